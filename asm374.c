@@ -10,10 +10,122 @@
  * - Modular and easy to extend.
  * - Comprehensive error checking.
  */
+#if !defined(__wasm__) && !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L // for clock_gettime
+#endif
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
 
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#endif
+
+// functions using AVX2 or AVX-512 are compiled with the target attribute, and
+// only used if the CPU supports it
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__wasm__) && !defined(NO_IMMINTRIN)
+#define HAVE_IMMINTRIN
+#include <immintrin.h>
+#endif
+
+/**
+ * Phases of assembly timed with STATS.
+ */
+typedef enum StatPhase {
+    StatPhase_Split,  // SplitProg
+    StatPhase_Layout, // LayoutProg
+    StatPhase_Check,  // the offset bounds/overlap check in AssembleProg
+    StatPhase_Encode, // the parsing and encoding in AssembleProg
+    StatPhase_Format, // writing the memory image
+    StatPhaseCount,
+} StatPhase;
+
+/**
+ * Gets the name of a StatPhase.
+ */
+static const char *GetStatPhase(StatPhase p) {
+    switch (p) {
+    case StatPhase_Split:  return "split";
+    case StatPhase_Layout: return "layout";
+    case StatPhase_Check:  return "check";
+    case StatPhase_Encode: return "encode";
+    case StatPhase_Format: return "format";
+    case StatPhaseCount:   break;
+    }
+    return "";
+}
+
+/**
+ * Totals collected when built with STATS. Phases which stop with an error
+ * aren't timed.
+ */
+typedef struct Stats {
+    uint64_t ns[StatPhaseCount]; // monotonic time spent in each phase
+    uint64_t tokens;             // tokens split
+    uint64_t labels;             // labels split
+    uint64_t lookups;            // symbols resolved
+    uint64_t bytes_in;           // source bytes split
+    uint64_t bytes_out;          // memory image bytes written
+} Stats;
+
+#if defined(STATS)
+static Stats stats_total;
+#if defined(__wasm__)
+__attribute__((import_module("env"), import_name("now"))) double now_ms(void);
+static uint64_t now_ns(void) {
+    return (uint64_t)(now_ms() * 1e6);
+}
+#else
+static uint64_t now_ns(void); // native section
+#endif
+#define STAT_ADD(f, n) (stats_total.f += (uint64_t)(n))
+#define STAT_BEGIN(p)  uint64_t stat_##p = now_ns()
+#define STAT_END(p)    (stats_total.ns[StatPhase_##p] += now_ns() - stat_##p)
+#else
+#define STAT_ADD(f, n) ((void)0)
+#define STAT_BEGIN(p)  ((void)0)
+#define STAT_END(p)    ((void)0)
+#endif
+
+/**
+ * Linux SDT (USDT) probes for attaching bpftrace, perf, or SystemTap to a
+ * running process (provider asm374, see trace_*.bt). Each one is a nop, plus a
+ * .note.stapsdt entry describing the location of the arguments (converted to
+ * int64_t), so they cost nothing until attached. This is the same format as
+ * the macros in <sys/sdt.h>, without the semaphores. Build with -DNO_PROBES to
+ * remove them.
+ */
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__)) && !defined(__wasm__) && !defined(NO_PROBES)
+#define PROBE_ASM(name, args)                                                   \
+    "990: nop\n"                                                                \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                                \
+    ".balign 4\n"                                                               \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                          \
+    "991: .asciz \"stapsdt\"\n"                                                 \
+    "992: .balign 4\n"                                                          \
+    "993: .8byte 990b, _.stapsdt.base, 0\n"                                     \
+    ".asciz \"asm374\"\n"                                                       \
+    ".asciz \"" #name "\"\n"                                                    \
+    ".asciz \"" args "\"\n"                                                     \
+    "994: .balign 4\n"                                                          \
+    ".popsection\n"                                                             \
+    ".ifndef _.stapsdt.base\n"                                                  \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"     \
+    ".weak _.stapsdt.base\n"                                                    \
+    ".hidden _.stapsdt.base\n"                                                  \
+    "_.stapsdt.base: .space 1\n"                                                \
+    ".size _.stapsdt.base, 1\n"                                                 \
+    ".popsection\n"                                                             \
+    ".endif\n"
+#define PROBE1(name, a)       __asm__ __volatile__ (PROBE_ASM(name, "-8@%0") :: "nor"((int64_t)(a)))
+#define PROBE2(name, a, b)    __asm__ __volatile__ (PROBE_ASM(name, "-8@%0 -8@%1") :: "nor"((int64_t)(a)), "nor"((int64_t)(b)))
+#define PROBE3(name, a, b, c) __asm__ __volatile__ (PROBE_ASM(name, "-8@%0 -8@%1 -8@%2") :: "nor"((int64_t)(a)), "nor"((int64_t)(b)), "nor"((int64_t)(c)))
+#else
+#define PROBE1(name, a)       ((void)0)
+#define PROBE2(name, a, b)    ((void)0)
+#define PROBE3(name, a, b, c) ((void)0)
+#endif
+
 /**
  * Convert the top 4 bits of x to a hex digit.
  */
@@ -53,6 +165,14 @@ static char *u32be_tobin(char *str, uint32_t n, int w) {
  */
 static char *u32be_tohex(char *str, uint32_t n) {
     if (!str) return NULL;
+#if defined(__wasm_simd128__)
+    // split the bytes (little-endian in the vector) into nibbles, most
+    // significant first, then look them up
+    v128_t v = wasm_u32x4_splat(n);
+    v128_t x = wasm_i8x16_shuffle(wasm_u8x16_shr(v, 4), wasm_v128_and(v, wasm_i8x16_splat(15)), 3, 19, 2, 18, 1, 17, 0, 16, 0, 0, 0, 0, 0, 0, 0, 0);
+    wasm_v128_store64_lane(str, wasm_i8x16_swizzle(wasm_v128_load("0123456789ABCDEF"), x), 0);
+    str += 8;
+#else
     *str++ = u4_tohex(n>>28);
     *str++ = u4_tohex(n>>24);
     *str++ = u4_tohex(n>>20);
@@ -61,10 +181,25 @@ static char *u32be_tohex(char *str, uint32_t n) {
     *str++ = u4_tohex(n>>8);
     *str++ = u4_tohex(n>>4);
     *str++ = u4_tohex(n>>0);
+#endif
     *str = '\0';
     return str;
 }
 
+/**
+ * Append n in decimal and a null terminator to str (min length 11).
+ */
+static char *u32_todec(char *str, uint32_t n) {
+    if (!str) return NULL;
+    size_t w = 1;
+    for (uint32_t t = n; t >= 10; t /= 10)
+        w++;
+    for (size_t i = w; i--; n /= 10)
+        str[i] = '0' + n%10;
+    str[w] = '\0';
+    return str + w;
+}
+
 /**
  * Convert 8 hex digits into a uint32, big-endian, returning false if the string
  * is too short/long, null, or contains invalid digits.
@@ -106,6 +241,19 @@ static bool chr_isspace(char c) {
  */
 static size_t str_len(const char *s) {
     const char *a = s;
+#if defined(__wasm_simd128__)
+    // aligned loads can't cross into an unmapped page
+    if (s) {
+        for (; (uintptr_t)(s) & 15; s++)
+            if (!*s)
+                return s-a;
+        for (;; s += 16) {
+            uint32_t m = wasm_i8x16_bitmask(wasm_i8x16_eq(wasm_v128_load(s), wasm_i8x16_splat(0)));
+            if (m)
+                return s-a + __builtin_ctz(m);
+        }
+    }
+#endif
     while (s && *s) s++;
 	return s-a;
 }
@@ -131,6 +279,33 @@ static char *str_trim(char *s) {
  * found.
  */
 static char *str_spl(char *s, char *x) {
+#if defined(__wasm_simd128__)
+    // aligned loads can't cross into an unmapped page
+    if (s && (uintptr_t)(s) & 15) {
+        char *a = (char*)((uintptr_t)(s) + 16 - ((uintptr_t)(s) & 15));
+        for (; s < a && *s; s++)
+            for (char *y = x; y && *y; y++)
+                if (*s == *y)
+                    return *s = '\0', s+1;
+        if (s < a)
+            return NULL;
+    }
+    for (; s; s += 16) {
+        v128_t v = wasm_v128_load(s);
+        v128_t m = wasm_i8x16_eq(v, wasm_i8x16_splat(0));
+        for (char *y = x; y && *y; y++)
+            m = wasm_v128_or(m, wasm_i8x16_eq(v, wasm_i8x16_splat(*y)));
+        uint32_t b = wasm_i8x16_bitmask(m);
+        if (b) {
+            char *c = s + __builtin_ctz(b);
+            if (!*c)
+                return NULL;
+            *c++ = '\0';
+            return c;
+        }
+    }
+    return NULL;
+#endif
     for (char *c = s; c && *c; c++) {
         for (char *y = x; y && *y; y++) {
             if (*c == *y) {
@@ -187,6 +362,30 @@ static char *str_ecpyn(char *a, const char *b, size_t n) {
     return n ? a : NULL;
 }
 
+/**
+ * Hash s using 32-bit FNV-1a.
+ */
+static uint32_t str_hash(const char *s) {
+    uint32_t h = 0x811C9DC5;
+    while (s && *s)
+        h = (h ^ (uint8_t)(*s++)) * 0x01000193;
+    return h;
+}
+
+/**
+ * Copy n bytes from b to a, which may overlap.
+ */
+static void mem_move(void *a, const void *b, size_t n) {
+    uint8_t *x = a;
+    const uint8_t *y = b;
+    if (x < y)
+        while (n--)
+            *x++ = *y++;
+    else
+        while (n--)
+            x[n] = y[n];
+}
+
 /**
  * Error codes.
  */
@@ -214,8 +413,21 @@ typedef enum Error {
     Error_Prog_DuplicateLabel,
     Error_Prog_OutOfRange,
     Error_Prog_Overlap,
+    Error_Prog_InvalidCount,
+    Error_Prog_InvalidFile,
+    Error_Prog_ReadFile,
+    Error_Prog_InvalidSection,
+    Error_Prog_NoSpace,
     Error_Adr_UndefinedLabel,
     Error_Adr_OutOfRange,
+    Error_Mem_Syntax,
+    Error_Mem_Address,
+    Error_Mem_Format,
+    Error_Gen_Empty,
+    Error_Exec_Fetch,
+    Error_Exec_Inst,
+    Error_Exec_Mem,
+    Error_Cache_Config,
 } Error;
 
 /**
@@ -269,20 +481,72 @@ static const char *GetError(Error err) {
         return "output buffer capacity exceeded (is ORG too large?)";
     case Error_Prog_Overlap:
         return "overlaps existing data";
+    case Error_Prog_InvalidCount:
+        return "count invalid or out of range";
+    case Error_Prog_InvalidFile:
+        return "invalid file name (must be enclosed in double quotes)";
+    case Error_Prog_ReadFile:
+        return "failed to read file";
+    case Error_Prog_InvalidSection:
+        return "invalid section (expected NAME[, ALIGN N][, AT ADDR], with attributes matching any previous definition)";
+    case Error_Prog_NoSpace:
+        return "section does not fit in the free memory";
     case Error_Adr_UndefinedLabel:
         return "undefined label";
     case Error_Adr_OutOfRange:
         return "label out of range";
+    case Error_Mem_Syntax:
+        return "invalid memory file";
+    case Error_Mem_Address:
+        return "memory file address out of range";
+    case Error_Mem_Format:
+        return "unknown memory file format";
+    case Error_Gen_Empty:
+        return "no instructions satisfy the generator constraints";
+    case Error_Exec_Fetch:
+        return "instruction fetch out of range";
+    case Error_Exec_Inst:
+        return "invalid instruction";
+    case Error_Exec_Mem:
+        return "memory access out of range";
+    case Error_Cache_Config:
+        return "invalid cache configuration";
     }
     return "unknown error";
 }
 
+/**
+ * Checks if sym is a valid symbol name (i.e., it starts with a letter or
+ * underscore followed by zero or more letters, numbers, or underscores).
+ */
+static bool SymValid(const char *sym) {
+    if (!sym || !*sym)
+        return false;
+    for (const char *x = sym; *x; x++) {
+        if (*x == '_')
+            continue;
+        if ('a' <= *x && *x <= 'z')
+            continue;
+        if ('A' <= *x && *x <= 'Z')
+            continue;
+        if (x != sym && '0' <= *x && *x <= '9')
+            continue;
+        return false;
+    }
+    return true;
+}
+
 /**
  * Contains information required to resolve symbols.
+ *
+ * If ref is not NULL, it is called for every valid symbol name resolved by
+ * AdrImm19s (with def set if lookup found it), and undefined symbols resolve to
+ * zero instead of failing. This is used to record relocations.
  */
 typedef struct SymCtx {
     const void *data;
     uint32_t (*lookup)(const char *sym, const void *data);
+    void (*ref)(const char *sym, bool def, const void *data);
 } SymCtx;
 
 /**
@@ -297,7 +561,18 @@ Error AdrImm19s(const SymCtx ctx, const char *sym, uint32_t off, Imm19s *imm) {
     if (!ctx.lookup || !sym)
         return Error_Adr_UndefinedLabel;
 
+    PROBE1(sym_lookup_entry, (intptr_t)(sym));
     uint32_t addr = ctx.lookup(sym, ctx.data);
+    PROBE2(sym_lookup_return, (intptr_t)(sym), ~addr ? (int64_t)(addr) : -1);
+    STAT_ADD(lookups, 1);
+    if (ctx.ref && SymValid(sym)) {
+        ctx.ref(sym, !!~addr, ctx.data);
+        if (!~addr) {
+            if (imm)
+                *imm = 0;
+            return NoError;
+        }
+    }
     if (!~addr)
         return Error_Adr_UndefinedLabel;
 
@@ -681,174 +956,27 @@ typedef struct InstSpec {
     InstArg Arg[3];
 } InstSpec;
 
-/**
- * Instruction table.
- *
- * This contains the mappings of opcodes to instruction specifications.
- */
-static const InstSpec InstData[1<<5] = {
-    [ 0] = {InstEnc_I, "ld",   false, {InstArg_Ra,  InstArg_RbC, InstArg__ }},
-    [ 1] = {InstEnc_I, "ldi",  false, {InstArg_Ra,  InstArg_RbC, InstArg__ }},
-    [ 2] = {InstEnc_I, "st",   false, {InstArg_RbC, InstArg_Ra,  InstArg__ }},
-    [ 3] = {InstEnc_R, "add",  false, {InstArg_Ra,  InstArg_Rb,  InstArg_Rc}},
-    [ 4] = {InstEnc_R, "sub",  false, {InstArg_Ra,  InstArg_Rb,  InstArg_Rc}},
-    [ 5] = {InstEnc_R, "and",  false, {InstArg_Ra,  InstArg_Rb,  InstArg_Rc}},
-    [ 6] = {InstEnc_R, "or",   false, {InstArg_Ra,  InstArg_Rb,  InstArg_Rc}},
-    [ 7] = {InstEnc_R, "shr",  false, {InstArg_Ra,  InstArg_Rb,  InstArg_Rc}},
-    [ 8] = {InstEnc_R, "shra", false, {InstArg_Ra,  InstArg_Rb,  InstArg_Rc}},
-    [ 9] = {InstEnc_R, "shl",  false, {InstArg_Ra,  InstArg_Rb,  InstArg_Rc}},
-    [10] = {InstEnc_R, "ror",  false, {InstArg_Ra,  InstArg_Rb,  InstArg_Rc}},
-    [11] = {InstEnc_R, "rol",  false, {InstArg_Ra,  InstArg_Rb,  InstArg_Rc}},
-    [12] = {InstEnc_I, "addi", false, {InstArg_Ra,  InstArg_Rb,  InstArg_C }},
-    [13] = {InstEnc_I, "andi", false, {InstArg_Ra,  InstArg_Rb,  InstArg_C }},
-    [14] = {InstEnc_I, "ori",  false, {InstArg_Ra,  InstArg_Rb,  InstArg_C }},
-    [15] = {InstEnc_I, "mul",  false, {InstArg_Ra,  InstArg_Rb,  InstArg__ }},
-    [16] = {InstEnc_I, "div",  false, {InstArg_Ra,  InstArg_Rb,  InstArg__ }},
-    [17] = {InstEnc_I, "neg",  false, {InstArg_Ra,  InstArg_Rb,  InstArg__ }},
-    [18] = {InstEnc_I, "not",  false, {InstArg_Ra,  InstArg_Rb,  InstArg__ }},
-    [19] = {InstEnc_B, "br",   true,  {InstArg_Ra,  InstArg_C,   InstArg__ }},
-    [20] = {InstEnc_J, "jr",   false, {InstArg_Ra,  InstArg__,   InstArg__ }},
-    [21] = {InstEnc_J, "jal",  false, {InstArg_Ra,  InstArg__,   InstArg__ }},
-    [22] = {InstEnc_J, "in",   false, {InstArg_Ra,  InstArg__,   InstArg__ }},
-    [23] = {InstEnc_J, "out",  false, {InstArg_Ra,  InstArg__,   InstArg__ }},
-    [24] = {InstEnc_J, "mfhi", false, {InstArg_Ra,  InstArg__,   InstArg__ }},
-    [25] = {InstEnc_J, "mflo", false, {InstArg_Ra,  InstArg__,   InstArg__ }},
-    [26] = {InstEnc_M, "nop",  false, {InstArg__,   InstArg__,   InstArg__ }},
-    [27] = {InstEnc_M, "halt", false, {InstArg__,   InstArg__,   InstArg__ }},
-};
-
-/**
- * Gets the instruction specification for op. Valid if Format is non-zero.
- */
-static InstSpec LookupOpcode(Opcode op) {
-    return InstData[op & ((1<<5)-1)];
-}
-
-/**
- * DecodeInst decodes inst.
- */
-static Inst DecodeInst(uint32_t b) {
-    Inst i = INST_ZERO;
-    switch (LookupOpcode((i.Opcode = (Opcode) ((b >> 27) & ((1<<5)-1)))).Format) {
-    case InstEnc_R:
-        i.Ra = (Reg)((b >> 23) & ((1<<4)-1));
-        i.Rb = (Reg)((b >> 19) & ((1<<4)-1));
-        i.Rc = (Reg)((b >> 15) & ((1<<4)-1));
-        break;
-    case InstEnc_I:
-        i.Ra = (Reg)   ((b >> 23) & ((1<<4)-1));
-        i.Rb = (Reg)   ((b >> 19) & ((1<<4)-1));
-        i.C  = (Imm19s)((b >> 00) & ((1<<19)-1));
-        break;
-    case InstEnc_B:
-        i.Ra = (Reg)   ((b >> 23) & ((1<<4)-1));
-        i.C2 = (Cond)  ((b >> 19) & ((1<<4)-1) & ((1<<2)-1)); // field is 4 bits, but we're supposed to ignore the top 2
-        i.C  = (Imm19s)((b >> 00) & ((1<<19)-1));
-        break;
-    case InstEnc_J:
-        i.Ra = (Reg)((b >> 23) & ((1<<4)-1));
-        break;
-    case InstEnc_M:
-        break;
-    }
-    return i;
-}
-
-/**
- * EncodeInst encodes inst.
- */
-static uint32_t EncodeInst(Inst i) {
-    uint32_t b = ((uint32_t)(i.Opcode) & ((1<<5)-1)) << 27;
-    switch (LookupOpcode(i.Opcode).Format) {
-    case InstEnc_R:
-        b |= ((uint32_t)(i.Ra) & ((1<<4)-1)) << 23;
-        b |= ((uint32_t)(i.Rb) & ((1<<4)-1)) << 19;
-        b |= ((uint32_t)(i.Rc) & ((1<<4)-1)) << 15;
-        break;
-    case InstEnc_I:
-        b |= ((uint32_t)(i.Ra) & ((1<<4)-1))  << 23;
-        b |= ((uint32_t)(i.Rb) & ((1<<4)-1))  << 19;
-        b |= ((uint32_t)(i.C)  & ((1<<19)-1)) << 0;
-        break;
-    case InstEnc_B:
-        b |= ((uint32_t)(i.Ra) & ((1<<4)-1))              << 23;
-        b |= ((uint32_t)(i.C2) & ((1<<4)-1) & ((1<<2)-1)) << 19; // field is 4 bits, but we're supposed to ignore the top 2
-        b |= ((uint32_t)(i.C)  & ((1<<19)-1))             << 0;
-        break;
-    case InstEnc_J:
-        b |= ((uint32_t)(i.Ra) & ((1<<4)-1)) << 23;
-        break;
-    case InstEnc_M:
-        break;
-    }
-    return b;
-}
+#include "asm374_isa.h" // InstData, LookupOpcode, DecodeInst, EncodeInst, CheckInst, FormatInst
 
 /**
- * CheckInst checks whether inst is valid.
+ * Sets span (if not NULL) to the columns of s (without trailing whitespace) in
+ * buf.
  */
-static Error CheckInst(Inst i) {
-    switch (LookupOpcode(i.Opcode).Format) {
-    case InstEnc_R:
-        if (!GetReg(i.Ra)) return Error_Inst_Reg;
-        if (!GetReg(i.Rb)) return Error_Inst_Reg;
-        if (!GetReg(i.Rc)) return Error_Inst_Reg;
-        return NoError;
-    case InstEnc_I:
-        if (!GetReg(i.Ra)) return Error_Inst_Reg;
-        if (!GetReg(i.Rb)) return Error_Inst_Reg;
-        return NoError;
-    case InstEnc_B:
-        if (!GetReg(i.Ra))   return Error_Inst_Reg;
-        if (!GetCond(i.C2)) return Error_Inst_Cond;
-        return NoError;
-    case InstEnc_J:
-        if (!GetReg(i.Ra)) return Error_Inst_Reg;
-        return NoError;
-    case InstEnc_M:
-        return NoError;
+static void ParseInst_span(uint32_t *span, const char *buf, const char *s) {
+    if (span) {
+        size_t n = str_len(s);
+        while (n && chr_isspace(s[n-1]))
+            n--;
+        span[0] = (uint32_t)(s - buf);
+        span[1] = span[0] + (uint32_t)(n);
     }
-    return Error_Inst_Op;
 }
 
-/**
- * Writes inst to str, returning a pointer to the end of the updated string.
- */
-static char *FormatInst(char *str, Inst inst) {
-    if (str) {
-        InstSpec spec = LookupOpcode(inst.Opcode);
-        if (spec.Format) {
-            str = str_ecpy(str, spec.Op);
-            if (spec.Cond)
-                str = FormatCond(str, inst.C2);
-            for (size_t i = 0; i < sizeof(spec.Arg)/sizeof(*spec.Arg) && spec.Arg[i]; i++) {
-                if (i)
-                    *str++ = ',';
-                *str++ = ' ';
-                switch (spec.Arg[i]) {
-                case InstArg__:   __builtin_unreachable();
-                case InstArg_Ra:  str = FormatReg(str, inst.Ra); break;
-                case InstArg_Rb:  str = FormatReg(str, inst.Rb); break;
-                case InstArg_Rc:  str = FormatReg(str, inst.Rc); break;
-                case InstArg_C:   str = FormatImm19s(str, inst.C); break;
-                case InstArg_RbC: str = FormatRegImm19s(str, inst.Rb, inst.C); break;
-                }
-            }
-        } else {
-            *str++ = '?';
-        }
-        *str = '\0';
+static Error ParseInst_parse(Inst *inst, const char *str, uint32_t off, SymCtx *sym, uint32_t *span) {
+    if (span) {
+        span[0] = 0;
+        span[1] = str ? (uint32_t)(str_len(str)) : 0;
     }
-    return str;
-}
-
-/**
- * ParseInst parses an instruction in assembly syntax.
- *
- * On success, the parsed instruction will always be valid (i.e, it will pass
- * CheckInst).
- */
-static Error ParseInst(Inst *inst, const char *str, uint32_t off, SymCtx *sym) {
     if (!str || !*str)
         return Error_Parse_EmptyArgument;
 
@@ -881,8 +1009,10 @@ static Error ParseInst(Inst *inst, const char *str, uint32_t off, SymCtx *sym) {
             }
             if (!m_op) {
                 *opcond_c = '\0';
-                if (str_eq(s_op, opcond, true))
+                if (str_eq(s_op, opcond, true)) {
+                    ParseInst_span(span, buf, s_op);
                     return Error_Parse_Op_MissingCond;
+                }
                 continue;
             }
         } else if (!str_eq(s_op, spec.Op, true)) {
@@ -907,20 +1037,47 @@ static Error ParseInst(Inst *inst, const char *str, uint32_t off, SymCtx *sym) {
             case InstArg_RbC: err = ParseRegImm19s(&tmp.Rb, &tmp.C, s_arg_cur, sym); break;
             }
             if (err) {
+                ParseInst_span(span, buf, s_arg_cur);
                 return err;
             }
         }
-        if (s_arg_next && *s_arg_next)
+        if (s_arg_next && *s_arg_next) {
+            ParseInst_span(span, buf, s_arg_next);
             return Error_Parse_OpArgs_TooMany;
+        }
 
         if (inst)
             *inst = tmp;
         return NoError;
     }
 
+    ParseInst_span(span, buf, s_op);
     return Error_Parse_Op_Unknown;
 }
 
+/**
+ * ParseInstSpan is like ParseInst, but on error, span (if not NULL) is set to
+ * the zero-based columns [span[0], span[1]) of str which caused it: the
+ * failing operand, the extra operands, the unknown opcode, or all of str if
+ * the error isn't specific to one.
+ */
+static Error ParseInstSpan(Inst *inst, const char *str, uint32_t off, SymCtx *sym, uint32_t span[2]) {
+    PROBE2(parse_inst_entry, (intptr_t)(str), off);
+    Error err = ParseInst_parse(inst, str, off, sym, span);
+    PROBE2(parse_inst_return, err, err || !inst ? -1 : (int64_t)(inst->Opcode));
+    return err;
+}
+
+/**
+ * ParseInst parses an instruction in assembly syntax.
+ *
+ * On success, the parsed instruction will always be valid (i.e, it will pass
+ * CheckInst).
+ */
+static Error ParseInst(Inst *inst, const char *str, uint32_t off, SymCtx *sym) {
+    return ParseInstSpan(inst, str, off, sym, NULL);
+}
+
 /**
  * Explains the binary encoding of an instruction in a human-readable manner.
  */
@@ -1045,7 +1202,7 @@ static Error Assemble(char *hex, const char *asmb) {
  * High-level wrapper to check and explain the encoding of an instruction.
  * Similar to Disassemble.
  *
- * The output buffer should be at least 64 bytes long to be safe.
+ * The output buffer should be at least 128 bytes long to be safe.
  */
 static Error Explain(char *exp, const char *hex) {
     uint32_t b;
@@ -1060,321 +1217,8070 @@ static Error Explain(char *exp, const char *hex) {
     return CheckInst(i);
 }
 
-typedef enum ProgTokKind {
-    ProgTokKind_Label,
-    ProgTokKind_Inst,
-    ProgTokKind_Data,
-} ProgTokKind;
-
 /**
- * A single part of a parsed assembly file.
+ * Parses the digits in [s, e) as an unsigned number in radix (up to 16),
+ * ignoring underscores, returning false if there are no digits, an invalid
+ * digit, or the value does not fit in 32 bits.
  */
-typedef struct ProgTok {
-    int         line;
-    uint32_t    offset;
-    ProgTokKind kind;
-    const char *value;
-} ProgTok;
+static bool ParseDigits(uint32_t *v, const char *s, const char *e, uint32_t radix) {
+    uint64_t r = 0;
+    bool any = false;
+    for (; s < e; s++) {
+        if (*s == '_')
+            continue;
+        uint8_t d = u4_fromhex(*s);
+        if (d >= radix || (r = r*radix + d) > UINT32_MAX)
+            return false;
+        any = true;
+    }
+    if (any && v)
+        *v = (uint32_t)(r);
+    return any;
+}
 
 /**
- * Parsed assembly file.
+ * Sets out[addr] to v if out is not NULL, zeroing any words skipped since the
+ * end of the image (*n), which is extended past addr.
  */
-typedef struct Prog {
-    size_t   len;
-    size_t   cap;
-    ProgTok *tok;
-} Prog;
+static Error ReadImageWord(uint32_t *out, size_t out_n, size_t *n, uint32_t addr, uint32_t v) {
+    if (addr >= out_n)
+        return Error_Mem_Address;
+    if (out) {
+        for (size_t i = *n; i < addr; i++)
+            out[i] = 0;
+        out[addr] = v;
+    }
+    if (addr >= *n)
+        *n = (size_t)(addr) + 1;
+    return NoError;
+}
 
 /**
- * SplitProg is a very simple parser which consumes buf into asm, writing the
- * current line number into curline if not NULL (which can be used for error
- * context).
- *
- * Each line contains:
- * - one or more "LABEL:"
- * - "ORG OFFSET", "DAT DATA", or an optional instruction
- * - a line comment starting with ";" spanning the rest of the line
+ * Reads a $readmemh memory file (whitespace-separated hex words, "//" and
+ * block comments, and @ADDR to move to a word address) into out[out_n]
+ * (which may be NULL to only find the size), setting n to one past the last
+ * word written. Skipped words are zeroed, but words past n are not touched.
  */
-static Error SplitProg(Prog *prog, char *buf, int *curline) {
-    ProgTok tok = {
-        .line   = 0,
-        .offset = 0,
-        .kind   = 0,
-        .value  = NULL,
-    };
-    while (1) {
-        if (!buf)
-            return NoError; // EOF
+static Error ReadMemh(const char *s, uint32_t *out, size_t out_n, size_t *n, int *curline) {
+    int line = 1;
+    uint32_t addr = 0;
+    Error err = NoError;
+    *n = 0;
+    while (*s && !err) {
+        if (*s == '\n') {
+            line++;
+            s++;
+        } else if (chr_isspace(*s)) {
+            s++;
+        } else if (s[0] == '/' && s[1] == '/') {
+            while (*s && *s != '\n')
+                s++;
+        } else if (s[0] == '/' && s[1] == '*') {
+            for (s += 2; *s && (s[0] != '*' || s[1] != '/'); s++)
+                line += *s == '\n';
+            if (!*s)
+                err = Error_Mem_Syntax;
+            else
+                s += 2;
+        } else {
+            bool at = *s == '@';
+            const char *e = s += at;
+            while (*e && !chr_isspace(*e) && *e != '/')
+                e++;
+            uint32_t v;
+            if (!ParseDigits(&v, s, e, 16))
+                err = Error_Mem_Syntax;
+            else if (at)
+                addr = v;
+            else if (!(err = ReadImageWord(out, out_n, n, addr, v)))
+                addr++;
+            s = e;
+        }
+    }
+    if (curline)
+        *curline = line;
+    return err;
+}
 
-        // get next line
-        char *line = buf;
-        buf = str_spl(line, "\n");
-        tok.line++;
+/**
+ * Checks if c can be part of a word in a MIF file.
+ */
+static bool ReadMif_word(char c) {
+    return c == '_' || ('0' <= c && c <= '9') || ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z');
+}
 
-        // store current line number
-        if (curline)
-            *curline = tok.line;
+/**
+ * Finds the next token of a MIF file (a word or number, "..", or a single
+ * punctuation character), skipping whitespace, "--" comments, and "% %"
+ * comments, and returning NULL at the end of the input.
+ */
+static const char *ReadMif_next(const char **s, const char **e, int *line) {
+    const char *c = *s;
+    for (;;) {
+        if (*c == '\n') {
+            (*line)++;
+            c++;
+        } else if (chr_isspace(*c)) {
+            c++;
+        } else if (c[0] == '-' && c[1] == '-') {
+            while (*c && *c != '\n')
+                c++;
+        } else if (*c == '%') {
+            for (c++; *c && *c != '%'; c++)
+                *line += *c == '\n';
+            if (*c)
+                c++;
+        } else {
+            break;
+        }
+    }
+    const char *t = c;
+    if (!*c)
+        t = NULL;
+    else if (c[0] == '.' && c[1] == '.')
+        c += 2;
+    else if (ReadMif_word(*c) || (*c == '-' && ReadMif_word(c[1])))
+        for (c++; ReadMif_word(*c); c++)
+            ;
+    else
+        c++;
+    *s = *e = c;
+    return t;
+}
 
-        // remove comments
-        str_spl(line, ";");
-        
-        // remove leading/triling whitespace
-        line = str_trim(line);
+/**
+ * Checks if the token [t, e) is kw, ignoring case.
+ */
+static bool ReadMif_is(const char *t, const char *e, const char *kw) {
+    if (!t)
+        return false;
+    for (; t < e && *kw; t++, kw++)
+        if (chr_tolower(*t) != chr_tolower(*kw))
+            return false;
+    return t == e && !*kw;
+}
 
-        // check for blank line
-        if (!*line)
-            continue;
+/**
+ * Parses the number [t, e) in radix, which may be negative if it is decimal.
+ */
+static bool ReadMif_num(uint32_t *v, const char *t, const char *e, uint32_t radix) {
+    if (!t)
+        return false;
+    if (*t == '-' && radix == 10) {
+        if (!ParseDigits(v, t + 1, e, radix) || *v > (uint32_t)(1) << 31)
+            return false;
+        *v = -*v;
+        return true;
+    }
+    return ParseDigits(v, t, e, radix);
+}
 
-        // labels
-        for (bool maybeLabel = true; maybeLabel; ) {
-            maybeLabel = false;
-            for (char *tmp = line; *tmp; tmp++) {
-                // if we have a space before a colon, no more labels
-                if (chr_isspace(*tmp))
-                    break;
+/**
+ * Parses a Quartus Memory Initialization File for ReadMif.
+ *
+ * The header sets DEPTH, WIDTH (at most 32, with words truncated to it),
+ * ADDRESS_RADIX and DATA_RADIX (HEX, DEC, UNS, OCT, or BIN). It is followed by
+ * CONTENT BEGIN, entries of ADDR : WORD...; (consecutive words from ADDR) or
+ * [FIRST..LAST] : WORD...; (repeated until LAST), and END;. If DEPTH is set,
+ * the image is that long.
+ */
+static Error ReadMif_parse(const char *s, uint32_t *out, size_t out_n, size_t *n, int *line) {
+    const char *t, *e;
+    uint32_t depth = 0, width = 32, arad = 16, drad = 16;
+    *n = 0;
+
+    #define NEXT() (t = ReadMif_next(&s, &e, line))
+    #define IS(kw) ReadMif_is(t, e, kw)
+    for (;;) {
+        if (!NEXT() || IS("CONTENT"))
+            break;
+        const char *k = t, *ke = e;
+        if (!NEXT() || !IS("=") || !NEXT())
+            return Error_Mem_Syntax;
+        if (ReadMif_is(k, ke, "DEPTH") || ReadMif_is(k, ke, "WIDTH")) {
+            uint32_t v;
+            if (!ReadMif_num(&v, t, e, 10) || !v)
+                return Error_Mem_Syntax;
+            *(ReadMif_is(k, ke, "DEPTH") ? &depth : &width) = v;
+        } else if (ReadMif_is(k, ke, "ADDRESS_RADIX") || ReadMif_is(k, ke, "DATA_RADIX")) {
+            uint32_t r = IS("HEX") ? 16 : IS("DEC") || IS("UNS") ? 10 : IS("OCT") ? 8 : IS("BIN") ? 2 : 0;
+            if (!r)
+                return Error_Mem_Syntax;
+            *(ReadMif_is(k, ke, "ADDRESS_RADIX") ? &arad : &drad) = r;
+        }
+        if (!NEXT() || !IS(";"))
+            return Error_Mem_Syntax;
+    }
+    if (!t || width > 32 || !NEXT() || !IS("BEGIN"))
+        return Error_Mem_Syntax;
+    for (;;) {
+        uint32_t a, b;
+        bool range = false;
+        if (!NEXT())
+            return Error_Mem_Syntax;
+        if (IS("END"))
+            break;
+        if (IS("[")) {
+            if (!NEXT() || !ReadMif_num(&a, t, e, arad) || !NEXT() || !IS("..") || !NEXT() || !ReadMif_num(&b, t, e, arad) || !NEXT() || !IS("]") || b < a || b == UINT32_MAX)
+                return Error_Mem_Syntax;
+            range = true;
+        } else if (ReadMif_num(&a, t, e, arad)) {
+            b = UINT32_MAX;
+        } else {
+            return Error_Mem_Syntax;
+        }
+        if (!NEXT() || !IS(":"))
+            return Error_Mem_Syntax;
+
+        uint32_t x = a, v;
+        while (NEXT() && !IS(";")) {
+            if (!ReadMif_num(&v, t, e, drad) || x > b)
+                return Error_Mem_Syntax;
+            if (width < 32)
+                v &= ((uint32_t)(1) << width) - 1;
+            if ((depth && x >= depth) || ReadImageWord(out, out_n, n, x++, v))
+                return Error_Mem_Address;
+        }
+        if (!t || x == a)
+            return Error_Mem_Syntax;
+        for (uint32_t y = x; range && y <= b; y++)
+            if ((depth && y >= depth) || ReadImageWord(out, out_n, n, y, out ? out[a + (y - a) % (x - a)] : 0))
+                return Error_Mem_Address;
+    }
+    if (NEXT() && !IS(";"))
+        return Error_Mem_Syntax;
+    if (depth > *n && ReadImageWord(out, out_n, n, depth - 1, 0))
+        return Error_Mem_Address;
+    #undef NEXT
+    #undef IS
+    return NoError;
+}
 
-                // if we have a colon, up to that might be a valid label, and
-                // after might be another
-                if (*tmp == ':') {
-                    *tmp++ = '\0';
-                    tok.kind = ProgTokKind_Label;
-                    tok.value = line;
-                    line = str_trim(tmp);
-
-                    // check if label is empty (if so, ignore it)
-                    if (str_len(tok.value)) {
-                        // check if label is valid
-                        for (const char *x = tok.value; *x; x++) {
-                            if (*x == '_')
-                                continue;
-                            if ('a' <= *x && *x <= 'z')
-                                continue;
-                            if ('A' <= *x && *x <= 'Z')
-                                continue;
-                            if (x != tok.value && '0' <= *x && *x <= '9')
-                                continue;
-                            return Error_Prog_InvalidLabel;
-                        }
+/**
+ * Reads a Quartus Memory Initialization File like ReadMemh (see ReadMif_parse).
+ */
+static Error ReadMif(const char *s, uint32_t *out, size_t out_n, size_t *n, int *curline) {
+    int line = 1;
+    Error err = ReadMif_parse(s, out, out_n, n, &line);
+    if (curline)
+        *curline = line;
+    return err;
+}
 
-                        // check for duplicate label
-                        for (size_t i = 0; i < prog->len; i++)
-                            if (prog->tok[i].kind == ProgTokKind_Label && str_eq(prog->tok[i].value, tok.value, false))
-                                return Error_Prog_DuplicateLabel;
+/**
+ * Reads a memory file into out like ReadMemh, detecting whether it is a MIF
+ * (which starts with a header keyword, none of which are valid hex).
+ */
+static Error ReadImage(const char *s, uint32_t *out, size_t out_n, size_t *n, int *curline) {
+    const char *c = s, *e;
+    int line = 1;
+    const char *t = ReadMif_next(&c, &e, &line);
+    if (ReadMif_is(t, e, "DEPTH") || ReadMif_is(t, e, "WIDTH") || ReadMif_is(t, e, "ADDRESS_RADIX") || ReadMif_is(t, e, "DATA_RADIX") || ReadMif_is(t, e, "CONTENT"))
+        return ReadMif(s, out, out_n, n, curline);
+    return ReadMemh(s, out, out_n, n, curline);
+}
 
-                        // add the label
-                        if (prog) {
-                            if (prog->len >= prog->cap)
-                                return Error_Prog_TooMany;
-                            prog->tok[prog->len++] = tok;
-                        }
-                    }
+/**
+ * Decodes w into i, returning false unless it is a valid instruction which
+ * assembles back into w (i.e., without any bits set outside the fields of its
+ * arguments).
+ */
+static bool ImageInst(uint32_t w, Inst *i) {
+    *i = DecodeInst(w);
+    if (CheckInst(*i))
+        return false;
+    InstSpec spec = LookupOpcode(i->Opcode);
+    Inst c = INST_ZERO;
+    c.Opcode = i->Opcode;
+    c.C2 = i->C2;
+    for (size_t x = 0; x < sizeof(spec.Arg)/sizeof(*spec.Arg); x++) {
+        switch (spec.Arg[x]) {
+        case InstArg__:   break;
+        case InstArg_Ra:  c.Ra = i->Ra; break;
+        case InstArg_Rb:  c.Rb = i->Rb; break;
+        case InstArg_Rc:  c.Rc = i->Rc; break;
+        case InstArg_C:   c.C = i->C; break;
+        case InstArg_RbC: c.Rb = i->Rb; c.C = i->C; break;
+        }
+    }
+    return EncodeInst(c) == w;
+}
 
-                    // we can try to parse another label
-                    maybeLabel = true;
-                    break;
+/**
+ * Gets the target of the branch i at addr, returning false if it is not a
+ * branch, or if the target couldn't be referenced by a label.
+ */
+static bool ImageBranch(Inst i, uint32_t addr, uint32_t *target) {
+    if (LookupOpcode(i.Opcode).Format != InstEnc_B)
+        return false;
+    int32_t d = (i.C & (1<<(19-1))) ? (int32_t)(i.C) - (1<<19) : (int32_t)(i.C);
+    if (d <= -(1<<(19-1)) || d >= (1<<(19-1)) - 1) // see AdrImm19s
+        return false;
+    *target = addr + 1 + (uint32_t)(d);
+    return true;
+}
+
+/**
+ * Writes n to str as at least w hex digits.
+ */
+static char *ImageHex(char *str, uint32_t n, int w) {
+    char h[9];
+    u32be_tohex(h, n);
+    while (w < 8 && n >> (w * 4))
+        w++;
+    return str_ecpy(str, h + 8 - w);
+}
+
+/**
+ * Disassembles img[n] into source which SplitProg and AssembleProg turn back
+ * into the same image, writing at most 64 bytes per word plus a null
+ * terminator to str, and returning the end of it. tgt must have room for n
+ * bytes.
+ *
+ * Valid instructions are disassembled, and the words they branch to are marked
+ * in tgt (so the set of targets is sorted without sorting) and labeled L
+ * followed by the address in hex. Other words are written as DAT, and runs of
+ * at least 4 of them (or of zeros) without a label as FILL (or SPACE). Each
+ * line has a comment with the address and word.
+ */
+static char *DisassembleImage(char *str, const uint32_t *img, size_t n, uint8_t *tgt) {
+    Inst inst;
+    uint32_t target;
+    int w = 4;
+    while (w < 8 && (n - 1) >> (w * 4))
+        w++;
+    int col = w + 3 > 8 ? w + 3 : 8;
+
+    for (size_t i = 0; i < n; i++)
+        tgt[i] = 0;
+    for (size_t i = 0; i < n; i++)
+        if (ImageInst(img[i], &inst) && ImageBranch(inst, (uint32_t)(i), &target) && target < n)
+            tgt[target] = 1;
+
+    for (size_t i = 0, r; i < n; i += r) {
+        char *line = str;
+        if (tgt[i])
+            str = str_ecpy(ImageHex(str_ecpy(str, "L"), (uint32_t)(i), w), ":");
+        while (str < line + col)
+            *str++ = ' ';
+        char *stmt = str;
+
+        bool valid = ImageInst(img[i], &inst);
+        r = 1;
+        if (!img[i] || !valid)
+            while (i + r < n && img[i + r] == img[i] && !tgt[i + r])
+                r++;
+        if (r < 4)
+            r = 1;
+
+        if (r != 1 && !img[i]) {
+            str = ImageHex(str_ecpy(str, "SPACE $"), (uint32_t)(r), 1);
+        } else if (r != 1) {
+            str = ImageHex(str_ecpy(ImageHex(str_ecpy(str, "FILL $"), (uint32_t)(r), 1), ", $"), img[i], 8);
+        } else if (valid && ImageBranch(inst, (uint32_t)(i), &target) && target < n) {
+            str = str_ecpy(str, LookupOpcode(inst.Opcode).Op);
+            str = FormatReg(str_ecpy(FormatCond(str, inst.C2), " "), inst.Ra);
+            str = ImageHex(str_ecpy(str, ", L"), target, w);
+        } else if (valid) {
+            str = FormatInst(str, inst);
+        } else {
+            str = ImageHex(str_ecpy(str, "DAT $"), img[i], 8);
+        }
+
+        do
+            *str++ = ' ';
+        while (str < stmt + 24);
+        str = ImageHex(str_ecpy(str, "; "), (uint32_t)(i), w);
+        if (r == 1)
+            str = ImageHex(str_ecpy(str, " "), img[i], 8);
+        else
+            str = ImageHex(str_ecpy(str, "-"), (uint32_t)(i + r - 1), w);
+        *str++ = '\n';
+    }
+    *str = '\0';
+    return str;
+}
+
+/**
+ * Memory image file formats.
+ */
+typedef enum ImageFormat {
+    ImageFormat_Hex,   // 8 hex words per line (like prog_assemble)
+    ImageFormat_Bin,   // raw big-endian words
+    ImageFormat_BinLE, // raw little-endian words
+    ImageFormat_IHex,  // Intel HEX with one word per record, addressed by word (like Quartus)
+    ImageFormat_Mif,   // Quartus MIF with runs of identical words as ranges
+    ImageFormat_Memh,  // $readmemh with @ADDR instead of runs of zeros
+    ImageFormatCount,
+} ImageFormat;
+
+/**
+ * Gets the name of fmt, or NULL if it does not exist.
+ */
+static const char *GetImageFormat(ImageFormat fmt) {
+    switch (fmt) {
+    case ImageFormat_Hex:   return "hex";
+    case ImageFormat_Bin:   return "bin";
+    case ImageFormat_BinLE: return "binle";
+    case ImageFormat_IHex:  return "ihex";
+    case ImageFormat_Mif:   return "mif";
+    case ImageFormat_Memh:  return "memh";
+    case ImageFormatCount:  break;
+    }
+    return NULL;
+}
+
+/**
+ * Output of WriteImage. write is called with each chunk of the output, and
+ * returns false on failure.
+ */
+typedef struct ImageSink {
+    void *data;
+    bool (*write)(const void *buf, size_t n, void *data);
+} ImageSink;
+
+/**
+ * An ImageSink data which appends to buf, or only counts the length if buf is
+ * NULL.
+ */
+typedef struct ImageBuf {
+    char   *buf;
+    size_t len;
+} ImageBuf;
+
+static bool ImageBuf_write(const void *buf, size_t n, void *data) {
+    ImageBuf *b = data;
+    if (b->buf)
+        mem_move(b->buf + b->len, buf, n);
+    b->len += n;
+    return true;
+}
+
+/**
+ * Writes an Intel HEX record to str.
+ */
+static char *WriteImage_ihex(char *str, uint8_t type, uint16_t addr, const uint8_t *data, uint8_t n) {
+    uint8_t sum = n + (addr >> 8) + addr + type;
+    *str++ = ':';
+    *str++ = u4_tohex(n >> 4);
+    *str++ = u4_tohex(n);
+    str = ImageHex(str, addr, 4);
+    *str++ = u4_tohex(type >> 4);
+    *str++ = u4_tohex(type);
+    for (uint8_t i = 0; i < n; i++) {
+        sum += data[i];
+        *str++ = u4_tohex(data[i] >> 4);
+        *str++ = u4_tohex(data[i]);
+    }
+    sum = -sum;
+    *str++ = u4_tohex(sum >> 4);
+    *str++ = u4_tohex(sum);
+    *str++ = '\n';
+    return str;
+}
+
+/**
+ * Writes img[n] to sink in fmt, streaming it a line (or 64 bytes of binary) at
+ * a time, and returning false if a write fails.
+ *
+ * For Intel HEX, addresses above 0xFFFF use extended linear address records.
+ * For $readmemh, runs of at least 16 zeros are skipped (so they must be
+ * initialized separately), but the last word is always written so the length
+ * is preserved.
+ */
+static bool WriteImage(ImageFormat fmt, const uint32_t *img, size_t n, ImageSink sink) {
+    char buf[80], *b;
+    #define FLUSH() do { if (!sink.write(buf, (size_t)(b - buf), sink.data)) return false; } while (0)
+    switch (fmt) {
+    case ImageFormat_Hex:
+        for (size_t i = 0; i < n; ) {
+            b = buf;
+            do {
+                b = u32be_tohex(b, img[i++]);
+                *b++ = i < n && i % 8 ? ' ' : '\n';
+            } while (i < n && i % 8);
+            FLUSH();
+        }
+        break;
+    case ImageFormat_Bin:
+    case ImageFormat_BinLE:
+        for (size_t i = 0; i < n; ) {
+            b = buf;
+            do {
+                uint32_t w = img[i++];
+                for (int s = 0; s < 4; s++)
+                    *b++ = (char)(w >> (fmt == ImageFormat_Bin ? 24 - s*8 : s*8));
+            } while (i < n && i % 16);
+            FLUSH();
+        }
+        break;
+    case ImageFormat_IHex:
+        for (size_t i = 0; i < n; i++) {
+            uint8_t d[4] = {img[i] >> 24, img[i] >> 16, img[i] >> 8, img[i]};
+            b = buf;
+            if (i && !(i & 0xFFFF)) {
+                uint8_t x[2] = {i >> 24, i >> 16};
+                b = WriteImage_ihex(b, 4, 0, x, 2);
+            }
+            b = WriteImage_ihex(b, 0, (uint16_t)(i), d, 4);
+            FLUSH();
+        }
+        b = WriteImage_ihex(buf, 1, 0, NULL, 0);
+        FLUSH();
+        break;
+    case ImageFormat_Mif:
+        b = str_ecpy(u32_todec(str_ecpy(buf, "DEPTH = "), n ? (uint32_t)(n) : 1), ";\nWIDTH = 32;\n");
+        FLUSH();
+        b = str_ecpy(buf, "ADDRESS_RADIX = HEX;\nDATA_RADIX = HEX;\nCONTENT BEGIN\n");
+        FLUSH();
+        for (size_t i = 0, r; i < n; i += r) {
+            for (r = 1; i + r < n && img[i + r] == img[i]; r++)
+                ;
+            b = str_ecpy(buf, "    ");
+            if (r == 1)
+                b = ImageHex(b, (uint32_t)(i), 1);
+            else
+                b = str_ecpy(ImageHex(str_ecpy(ImageHex(str_ecpy(b, "["), (uint32_t)(i), 1), ".."), (uint32_t)(i + r - 1), 1), "]");
+            b = str_ecpy(u32be_tohex(str_ecpy(b, " : "), img[i]), ";\n");
+            FLUSH();
+        }
+        b = str_ecpy(buf, "END;\n");
+        FLUSH();
+        break;
+    case ImageFormat_Memh:
+        b = buf;
+        for (size_t i = 0, col = 0; i < n; ) {
+            size_t z = i;
+            while (z + 1 < n && !img[z])
+                z++;
+            if (z - i >= 16) {
+                if (col) {
+                    b[-1] = '\n';
+                    FLUSH();
+                    col = 0;
+                }
+                b = str_ecpy(ImageHex(str_ecpy(buf, "@"), (uint32_t)(i = z), 1), "\n");
+                FLUSH();
+                b = buf;
+            }
+            b = u32be_tohex(b, img[i++]);
+            *b++ = ++col < 8 && i < n ? ' ' : '\n';
+            if (b[-1] == '\n') {
+                FLUSH();
+                b = buf;
+                col = 0;
+            }
+        }
+        break;
+    case ImageFormatCount:
+        return false;
+    }
+    #undef FLUSH
+    return true;
+}
+
+typedef enum ProgTokKind {
+    ProgTokKind_Label,
+    ProgTokKind_Inst,
+    ProgTokKind_Data,
+    ProgTokKind_Fill,
+    ProgTokKind_Bin,
+    ProgTokKind_Org,
+} ProgTokKind;
+
+/**
+ * A single part of a parsed assembly file.
+ *
+ * If section is non-zero, offset is relative to the start of the section with
+ * index section-1 until LayoutProg is called.
+ *
+ * Instructions occupy a single word. Data, fill, and binary tokens occupy count
+ * words starting at offset. For data, value contains count null-separated
+ * immediates. For fills, value is the immediate to fill with (or NULL for
+ * zero). For binaries, value is the file name, and data contains size bytes to
+ * be packed big-endian into the words. Origins occupy no words, and record the
+ * offset set by ORG for the following tokens.
+ *
+ * The zero-based columns [col, end) of line contain the label or statement the
+ * token came from, for diagnostics.
+ */
+typedef struct ProgTok {
+    int            line;
+    uint32_t       col;
+    uint32_t       end;
+    uint32_t       section;
+    uint32_t       offset;
+    uint32_t       count;
+    ProgTokKind    kind;
+    const char    *value;
+    const uint8_t *data;
+    size_t         size;
+} ProgTok;
+
+/**
+ * Contains information required to load binary files for INCBIN.
+ *
+ * The loaded data must remain valid until the program is assembled.
+ */
+typedef struct BinCtx {
+    const void *data;
+    Error (*load)(const char *path, const uint8_t **buf, size_t *len, const void *data);
+} BinCtx;
+
+/**
+ * Section of a parsed assembly file.
+ *
+ * If addr is ~0, the section is placed in the first free space which fits it
+ * best by LayoutProg, which also sets base and size.
+ */
+typedef struct ProgSec {
+    int         line;
+    const char *name;
+    uint32_t    align;
+    uint32_t    addr;
+    bool        attr;   // a definition had attributes (which other objects must match)
+    uint32_t    offset; // for SplitProg to switch between sections
+    uint32_t    base;
+    uint32_t    size;
+} ProgSec;
+
+/**
+ * Parsed assembly file.
+ */
+typedef struct Prog {
+    size_t   len;
+    size_t   cap;
+    ProgTok *tok;
+    size_t   sec_len;
+    size_t   sec_cap;
+    ProgSec *sec;
+    BinCtx   bin;
+} Prog;
+
+/**
+ * Appends tok to prog, if not NULL.
+ */
+static Error ProgAdd(Prog *prog, ProgTok tok) {
+    if (prog) {
+        if (prog->len >= prog->cap)
+            return Error_Prog_TooMany;
+        prog->tok[prog->len++] = tok;
+        STAT_ADD(tokens, 1);
+        STAT_ADD(labels, tok.kind == ProgTokKind_Label);
+    }
+    return NoError;
+}
+
+/**
+ * Error in an assembly file, spanning the zero-based columns [col, end) of line
+ * (both zero if unknown).
+ */
+typedef struct Diag {
+    int      line;
+    uint32_t col;
+    uint32_t end;
+    Error    err;
+} Diag;
+
+/**
+ * Errors collected while assembling a program, sorted by line. Only the first
+ * cap are stored, but len counts all of them.
+ */
+typedef struct Diags {
+    size_t len;
+    size_t cap;
+    Diag  *diag;
+} Diags;
+
+/**
+ * Adds an error to diag, after any others on the same line.
+ */
+static void DiagAdd(Diags *diag, int line, uint32_t col, uint32_t end, Error err) {
+    size_t i = diag->len < diag->cap ? diag->len : diag->cap;
+    for (; i && diag->diag[i-1].line > line; i--)
+        if (i < diag->cap)
+            diag->diag[i] = diag->diag[i-1];
+    if (i < diag->cap)
+        diag->diag[i] = (Diag){
+            .line = line,
+            .col  = col,
+            .end  = end,
+            .err  = err,
+        };
+    diag->len++;
+}
+
+/**
+ * If line starts with the directive dir followed by whitespace, returns a
+ * pointer to the trimmed arguments. Otherwise, returns NULL.
+ */
+static char *ProgDirective(char *line, const char *dir) {
+    for (; *dir; dir++, line++)
+        if (*line != *dir)
+            return NULL;
+    if (*line != ' ' && *line != '\t')
+        return NULL;
+    return str_trim(line);
+}
+
+/**
+ * Splits a comma-separated list in-place into consecutive null-terminated
+ * trimmed items, returning the number of items, or zero if any are empty.
+ */
+static uint32_t ProgList(char *s) {
+    uint32_t n = 0;
+    char *out = s;
+    while (s) {
+        char *next = str_spl(s, ",");
+        s = str_trim(s);
+        if (!*s)
+            return 0;
+        while ((*out++ = *s++))
+            ;
+        s = next;
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Parses a single line of an assembly file (see SplitProg) into prog, starting
+ * at tok, which is updated with the state for the next line. Unless dup is set,
+ * labels are not checked for duplicates.
+ */
+static Error SplitLine(Prog *prog, ProgTok *tok, char *line, bool dup) {
+    char *begin = line;
+
+    // remove comments
+    str_spl(line, ";");
+    
+    // remove leading/triling whitespace
+    line = str_trim(line);
+    tok->col = (uint32_t)(line - begin);
+    tok->end = tok->col + (uint32_t)(str_len(line));
+
+    // check for blank line
+    if (!*line)
+        return NoError;
+
+    // labels
+    for (bool maybeLabel = true; maybeLabel; ) {
+        maybeLabel = false;
+        for (char *tmp = line; *tmp; tmp++) {
+            // if we have a space before a colon, no more labels
+            if (chr_isspace(*tmp))
+                break;
+
+            // if we have a colon, up to that might be a valid label, and
+            // after might be another
+            if (*tmp == ':') {
+                *tmp++ = '\0';
+                tok->kind = ProgTokKind_Label;
+                tok->count = 0;
+                tok->value = line;
+                tok->col = (uint32_t)(line - begin);
+                tok->end = tok->col + (uint32_t)(str_len(line));
+                line = str_trim(tmp);
+
+                // check if label is empty (if so, ignore it)
+                if (str_len(tok->value)) {
+                    // check if label is valid
+                    if (!SymValid(tok->value))
+                        return Error_Prog_InvalidLabel;
+
+                    // check for duplicate label
+                    for (size_t i = 0; dup && i < prog->len; i++)
+                        if (prog->tok[i].kind == ProgTokKind_Label && str_eq(prog->tok[i].value, tok->value, false))
+                            return Error_Prog_DuplicateLabel;
+
+                    // add the label
+                    Error err;
+                    if ((err = ProgAdd(prog, *tok)))
+                        return err;
                 }
+
+                // we can try to parse another label
+                maybeLabel = true;
+                break;
+            }
+        }
+    }
+    tok->col = (uint32_t)(line - begin);
+    tok->end = tok->col + (uint32_t)(str_len(line));
+
+    char *args;
+    Error err;
+
+    // ORG
+    if ((args = ProgDirective(line, "ORG"))) {
+        if (ParseImm(32, false, &tok->offset, args))
+            return Error_Prog_InvalidOrg;
+        tok->kind = ProgTokKind_Org;
+        tok->count = 0;
+        tok->value = NULL;
+
+        // add the origin
+        return ProgAdd(prog, *tok);
+    }
+
+    // SECTION
+    if ((args = ProgDirective(line, "SECTION"))) {
+        ProgSec sec = {
+            .line   = tok->line,
+            .name   = args,
+            .align  = 0,
+            .addr   = ~(uint32_t)(0),
+            .attr   = false,
+            .offset = 0,
+            .base   = 0,
+            .size   = 0,
+        };
+        uint32_t n = ProgList(args);
+        bool attr = n > 1;
+        if (!n || !SymValid(args))
+            return Error_Prog_InvalidSection;
+        for (char *a = args + str_len(args) + 1; --n; a += str_len(a) + 1) {
+            char *v;
+            if ((v = ProgDirective(a, "ALIGN")) && !sec.align) {
+                if (ParseImm(32, false, &sec.align, v) || !sec.align)
+                    return Error_Prog_InvalidSection;
+            } else if ((v = ProgDirective(a, "AT")) && !~sec.addr) {
+                if (ParseImm(32, false, &sec.addr, v) || !~sec.addr)
+                    return Error_Prog_InvalidSection;
+            } else {
+                return Error_Prog_InvalidSection;
             }
         }
+        if (!sec.align)
+            sec.align = 1;
+
+        // save the offset of the current section
+        if (tok->section)
+            prog->sec[tok->section-1].offset = tok->offset;
+
+        // find or add the section
+        for (tok->section = 0; tok->section < prog->sec_len; tok->section++)
+            if (str_eq(prog->sec[tok->section].name, sec.name, false))
+                break;
+        if (tok->section == prog->sec_len) {
+            if (prog->sec_len >= prog->sec_cap)
+                return Error_Prog_TooMany;
+            prog->sec[prog->sec_len++] = sec;
+        } else if (attr && (prog->sec[tok->section].align != sec.align || prog->sec[tok->section].addr != sec.addr)) {
+            return Error_Prog_InvalidSection;
+        }
+        prog->sec[tok->section].attr |= attr;
+        tok->offset = prog->sec[tok->section++].offset;
+        return NoError;
+    }
+
+    // DAT
+    if ((args = ProgDirective(line, "DAT"))) {
+        tok->kind = ProgTokKind_Data;
+        tok->value = args;
+        if (!(tok->count = ProgList(args)))
+            return Error_Parse_EmptyArgument;
+
+        // add the data
+        if ((err = ProgAdd(prog, *tok)))
+            return err;
+
+        // next instruction
+        tok->offset += tok->count;
+        return NoError;
+    }
+
+    // FILL
+    if ((args = ProgDirective(line, "FILL"))) {
+        tok->kind = ProgTokKind_Fill;
+        uint32_t n = ProgList(args);
+        if (n < 2)
+            return Error_Parse_OpArgs_NotEnough;
+        if (n > 2)
+            return Error_Parse_OpArgs_TooMany;
+        if (ParseImm(32, false, &tok->count, args))
+            return Error_Prog_InvalidCount;
+        tok->value = args + str_len(args) + 1;
+
+        // add the data
+        if ((err = ProgAdd(prog, *tok)))
+            return err;
+
+        // next instruction
+        tok->offset += tok->count;
+        return NoError;
+    }
+
+    // SPACE
+    if ((args = ProgDirective(line, "SPACE"))) {
+        tok->kind = ProgTokKind_Fill;
+        tok->value = NULL;
+        if (ParseImm(32, false, &tok->count, args))
+            return Error_Prog_InvalidCount;
+
+        // add the data
+        if ((err = ProgAdd(prog, *tok)))
+            return err;
+
+        // next instruction
+        tok->offset += tok->count;
+        return NoError;
+    }
+
+    // INCBIN
+    if ((args = ProgDirective(line, "INCBIN"))) {
+        size_t n = str_len(args);
+        if (n < 3 || args[0] != '"' || args[n-1] != '"')
+            return Error_Prog_InvalidFile;
+        args[n-1] = '\0';
+
+        tok->kind = ProgTokKind_Bin;
+        tok->value = args + 1;
+        if (prog) {
+            if (!prog->bin.load || prog->bin.load(tok->value, &tok->data, &tok->size, prog->bin.data))
+                return Error_Prog_ReadFile;
+            if (tok->size > (size_t)(UINT32_MAX) - 3)
+                return Error_Prog_InvalidCount;
+            tok->count = (uint32_t)((tok->size + 3) / 4);
+        }
+
+        // add the data
+        if ((err = ProgAdd(prog, *tok)))
+            return err;
+
+        // next instruction
+        tok->offset += tok->count;
+        tok->data = NULL;
+        tok->size = 0;
+        return NoError;
+    }
+
+    // instruction
+    // note: line is already trimmed
+    if (*line) {
+        tok->kind = ProgTokKind_Inst;
+        tok->count = 1;
+        tok->value = line;
+
+        // add the instruction
+        if ((err = ProgAdd(prog, *tok)))
+            return err;
+
+        // next instruction
+        tok->offset++;
+    }
+    return NoError;
+}
+
+static Error SplitProgDiag(Prog *prog, char *buf, int *curline, Diags *diag);
+
+/**
+ * SplitProg is a very simple parser which consumes buf into asm, writing the
+ * current line number into curline if not NULL (which can be used for error
+ * context).
+ *
+ * Each line contains:
+ * - one or more "LABEL:"
+ * - one of:
+ *   - "ORG OFFSET" to set the offset of the following data
+ *   - "DAT DATA[, DATA...]" for one or more words of data
+ *   - "FILL COUNT, DATA" for COUNT copies of a word of data
+ *   - "SPACE COUNT" for COUNT words of zeros
+ *   - "INCBIN "FILE"" for the contents of FILE, big-endian, zero-padded
+ *   - "SECTION NAME[, ALIGN N][, AT ADDR]" to start or continue a section
+ *   - an optional instruction
+ * - a line comment starting with ";" spanning the rest of the line
+ */
+static Error SplitProg(Prog *prog, char *buf, int *curline) {
+    return SplitProgDiag(prog, buf, curline, NULL);
+}
+
+/**
+ * SplitProgDiag is like SplitProg, but if diag is not NULL, the error on each
+ * line is added to it, and parsing continues with the next line. The first
+ * error is returned, but Error_Prog_TooMany stops it.
+ */
+static Error SplitProgDiag(Prog *prog, char *buf, int *curline, Diags *diag) {
+    STAT_BEGIN(Split);
+    Error first = NoError;
+    ProgTok tok = {
+        .line    = 0,
+        .col     = 0,
+        .end     = 0,
+        .section = 0,
+        .offset  = 0,
+        .count   = 0,
+        .kind    = 0,
+        .value   = NULL,
+        .data    = NULL,
+        .size    = 0,
+    };
+    while (buf) {
+        // get next line
+        char *line = buf;
+        buf = str_spl(line, "\n");
+        tok.line++;
+        STAT_ADD(bytes_in, buf ? (size_t)(buf - line) : str_len(line));
+
+        // store current line number
+        if (curline)
+            *curline = tok.line;
+
+        Error err;
+        PROBE1(split_line_entry, tok.line);
+        err = SplitLine(prog, &tok, line, true);
+        PROBE3(split_line_return, tok.line, err, prog ? prog->len : 0);
+        if (err) {
+            if (!diag || err == Error_Prog_TooMany)
+                return err;
+            DiagAdd(diag, tok.line, tok.col, tok.end, err);
+            if (!first)
+                first = err;
+        }
+    }
+
+    // if (prog)
+    //     for (size_t i = 0; i < prog->len; i++)
+    //         printf("%04d: %d: %s%s\n", prog->tok[i].offset, prog->tok[i].line, prog->tok[i].label ? "LABEL " : "", prog->tok[i].value);
+
+    STAT_END(Split);
+    return first; // EOF
+}
+
+/**
+ * Computes the size of each section in prog.
+ */
+static Error SizeProgSec(Prog *prog, int *curline) {
+    for (size_t i = 0; i < prog->sec_len; i++)
+        prog->sec[i].size = 0;
+    for (size_t i = 0; i < prog->len; i++) {
+        ProgTok t = prog->tok[i];
+        if (!t.section || !t.count)
+            continue;
+        if (curline)
+            *curline = t.line;
+        if (t.count > UINT32_MAX - t.offset)
+            return Error_Prog_OutOfRange;
+        if (t.offset + t.count > prog->sec[t.section-1].size)
+            prog->sec[t.section-1].size = t.offset + t.count;
+    }
+    return NoError;
+}
+
+/**
+ * Places the sections of prog in out_n words of memory, then makes the offsets
+ * of all tokens absolute, writing the line number of the current section into
+ * curline if not NULL (which can be used for error context). This must only be
+ * called once. The contents of out are overwritten.
+ *
+ * Fixed sections and tokens outside a section are placed first. Then, the
+ * remaining sections are placed from largest to smallest into the smallest
+ * free block they fit in after alignment (i.e., best-fit decreasing). Free
+ * space between the tokens of fixed sections is used, but the other sections
+ * are placed as a single block.
+ */
+static Error LayoutProg(Prog *prog, uint32_t *out, size_t out_n, int *curline) {
+    if (!prog->sec_len)
+        return NoError;
+    STAT_BEGIN(Layout);
+
+    Error err;
+    if ((err = SizeProgSec(prog, curline)))
+        return err;
+
+    // mark the space used by fixed sections
+    for (size_t i = 0; i < out_n; i++)
+        out[i] = 0;
+    for (size_t i = 0; i < prog->sec_len; i++)
+        prog->sec[i].base = prog->sec[i].addr;
+    for (size_t i = 0; i < prog->len; i++) {
+        ProgTok t = prog->tok[i];
+        uint32_t base = t.section ? prog->sec[t.section-1].base : 0;
+        if (!~base || !t.count)
+            continue;
+        if (curline)
+            *curline = t.line;
+        if (t.offset > UINT32_MAX - base)
+            return Error_Prog_OutOfRange;
+        for (size_t x = base + t.offset, y = x + t.count; x < y && x < out_n; x++)
+            out[x] = 1;
+    }
+
+    // place the other sections
+    while (1) {
+        ProgSec *sec = NULL;
+        for (size_t i = 0; i < prog->sec_len; i++)
+            if (!~prog->sec[i].base && (!sec || prog->sec[i].size > sec->size))
+                sec = &prog->sec[i];
+        if (!sec)
+            break;
+        if (curline)
+            *curline = sec->line;
+
+        size_t best = SIZE_MAX, best_waste = SIZE_MAX;
+        for (size_t a = 0, b; a <= out_n; a = b + 1) {
+            if (a < out_n && out[a]) {
+                b = a;
+                continue;
+            }
+            for (b = a; b < out_n && !out[b]; b++)
+                ;
+            size_t x = (a + sec->align - 1) / sec->align * sec->align;
+            if (x <= b && b - x >= sec->size && (b - a) - sec->size < best_waste) {
+                best = x;
+                best_waste = (b - a) - sec->size;
+            }
+        }
+        if (best == SIZE_MAX || best > UINT32_MAX)
+            return Error_Prog_NoSpace;
+
+        for (size_t x = best; x < best + sec->size; x++)
+            out[x] = 1;
+        sec->base = (uint32_t)(best);
+    }
+
+    // make the offsets absolute
+    for (size_t i = 0; i < prog->len; i++) {
+        if (prog->tok[i].section) {
+            if (curline)
+                *curline = prog->tok[i].line;
+            if (prog->tok[i].offset > UINT32_MAX - prog->sec[prog->tok[i].section-1].base)
+                return Error_Prog_OutOfRange;
+            prog->tok[i].offset += prog->sec[prog->tok[i].section-1].base;
+        }
+    }
+    STAT_END(Layout);
+    return NoError;
+}
+
+/**
+ * Symbol in a relocatable object.
+ */
+typedef struct ObjSym {
+    const char *name;
+    uint32_t    value;   // word offset in the object, or ~0 if undefined
+    uint32_t    section; // index+1 of the section of the label, or 0
+} ObjSym;
+
+/**
+ * Relocation in a relocatable object. The C field of the instruction at offset
+ * is replaced with the address of sym, relative to offset+1 if rel is set (for
+ * branches), as resolved by AdrImm19s.
+ */
+typedef struct ObjReloc {
+    uint32_t offset;
+    uint32_t sym;
+    bool     rel;
+} ObjReloc;
+
+/**
+ * Section in a relocatable object, which is placed with the sections of the
+ * other objects when linking (see ProgSec).
+ */
+typedef struct ObjSec {
+    const char *name;
+    uint32_t    align;
+    uint32_t    addr;   // ~0 if not fixed
+    bool        attr;
+    uint32_t    offset; // word offset in the object
+    uint32_t    size;
+} ObjSec;
+
+/**
+ * Relocatable object.
+ *
+ * The words outside sections are first, followed by the words of each section
+ * in order. The defined symbols (i.e., all labels) are first, followed by the
+ * undefined ones. The names of undefined symbols are stored in str.
+ */
+typedef struct Obj {
+    uint32_t  size;
+    uint32_t *word;
+    size_t    sec_len;
+    ObjSec   *sec;
+    size_t    sym_len;
+    size_t    sym_cap;
+    ObjSym   *sym;
+    size_t    reloc_len;
+    size_t    reloc_cap;
+    ObjReloc *reloc;
+    size_t    str_len;
+    size_t    str_cap;
+    char     *str;
+} Obj;
+
+/**
+ * Gets the number of words spanned by prog, starting at zero.
+ */
+static uint32_t ProgExtent(const Prog prog) {
+    uint32_t n = 0;
+    for (size_t i = 0; i < prog.len; i++)
+        if (prog.tok[i].count && prog.tok[i].offset + prog.tok[i].count > n)
+            n = prog.tok[i].offset + prog.tok[i].count;
+    return n;
+}
+
+/**
+ * Writes the count words of a data, fill, or binary token to out, which must
+ * be zeroed.
+ */
+static Error AssembleData(const ProgTok tok, uint32_t *out) {
+    switch (tok.kind) {
+    case ProgTokKind_Data:
+        {
+            const char *v = tok.value;
+            for (uint32_t *x = out, *y = x + tok.count; x < y; x++, v += str_len(v) + 1) {
+                Error err = ParseImm(32, true, x, v);
+                if (err)
+                    return err;
+            }
+        }
+        break;
+    case ProgTokKind_Fill:
+        {
+            uint32_t v = 0;
+            if (tok.value) {
+                Error err = ParseImm(32, true, &v, tok.value);
+                if (err)
+                    return err;
+            }
+            if (v) // already zeroed
+                for (uint32_t *x = out, *y = x + tok.count; x < y; x++)
+                    *x = v;
+        }
+        break;
+    case ProgTokKind_Bin:
+        {
+            const uint8_t *b = tok.data;
+            uint32_t *x = out;
+            for (size_t n = tok.size; n >= 4; n -= 4, b += 4)
+                *x++ = (uint32_t)(b[0]) << 24 | (uint32_t)(b[1]) << 16 | (uint32_t)(b[2]) << 8 | (uint32_t)(b[3]);
+            for (size_t n = tok.size % 4, s = 24; n; n--, s -= 8)
+                *x |= (uint32_t)(*b++) << s;
+        }
+        break;
+    default:
+        break;
+    }
+    return NoError;
+}
+
+typedef struct AssembleProg_ctx {
+    const Prog *prog;
+    Obj        *obj;
+    size_t      ref; // index+1 of the last referenced symbol in obj
+    Error       err;
+} AssembleProg_ctx;
+
+static uint32_t AssembleProg_lookup(const char *sym, const void *data) {
+    const Prog *prog = ((AssembleProg_ctx*)(data))->prog;
+    for (size_t i = 0; i < prog->len; i++)
+        if (prog->tok[i].kind == ProgTokKind_Label && str_eq(prog->tok[i].value, sym, false))
+            return prog->tok[i].offset;
+    return ~(uint32_t)(0);
+}
+
+static void AssembleProg_ref(const char *sym, bool def, const void *data) {
+    AssembleProg_ctx *ctx = (AssembleProg_ctx*)(data);
+    Obj *obj = ctx->obj;
+
+    // find the symbol
+    for (size_t i = 0; i < obj->sym_len; i++) {
+        if (str_eq(obj->sym[i].name, sym, false)) {
+            ctx->ref = i + 1;
+            return;
+        }
+    }
+    if (def) {
+        ctx->err = Error_Adr_UndefinedLabel; // we added all labels already
+        return;
+    }
+
+    // add an undefined symbol
+    size_t n = str_len(sym) + 1;
+    if (obj->sym_len >= obj->sym_cap || n > obj->str_cap - obj->str_len) {
+        ctx->err = Error_Prog_TooMany;
+        return;
+    }
+    obj->sym[obj->sym_len].name = obj->str + obj->str_len;
+    obj->sym[obj->sym_len].value = ~(uint32_t)(0);
+    obj->sym[obj->sym_len].section = 0;
+    obj->str_len = str_ecpy(obj->str + obj->str_len, sym) - obj->str + 1;
+    ctx->ref = ++obj->sym_len;
+}
+
+/**
+ * Assembles prog into out[n], writing the current line number into curline if
+ * not NULL (which can be used for error context).
+ *
+ * If obj is not NULL, labels are added to it as symbols, references to
+ * undefined symbols, absolute references to labels, and branches to labels in
+ * other sections are recorded as relocations, and out must be at least
+ * ProgExtent words.
+ *
+ * If diag is not NULL, the error for each token is added to it, and assembly
+ * continues with the next one (tokens out of range are skipped). The first
+ * error is returned, but Error_Prog_TooMany stops it.
+ */
+static Error AssembleProgObj(const Prog prog, Obj *obj, uint32_t *out, size_t out_n, int *curline, Diags *diag) {
+    Error first = NoError;
+    #define DIAG(tok, e) do {                                  \
+        Error e_ = (e);                                        \
+        if (!diag || e_ == Error_Prog_TooMany)                 \
+            return e_;                                         \
+        DiagAdd(diag, (tok).line, (tok).col, (tok).end, e_);   \
+        if (!first)                                            \
+            first = e_;                                        \
+    } while (0)
+
+    // check for offset bounds/overlap
+    STAT_BEGIN(Check);
+    for (size_t i = 0; i < out_n; i++)
+        out[i] = 0;
+    for (size_t i = 0; i < prog.len; i++) {
+        if (curline)
+            *curline = prog.tok[i].line;
+        switch (prog.tok[i].kind) {
+        case ProgTokKind_Label:
+        case ProgTokKind_Org:
+            break;
+        case ProgTokKind_Inst:
+        case ProgTokKind_Data:
+        case ProgTokKind_Fill:
+        case ProgTokKind_Bin:
+            if (!prog.tok[i].count)
+                break;
+            if (prog.tok[i].offset >= out_n || prog.tok[i].count > out_n - prog.tok[i].offset) {
+                DIAG(prog.tok[i], Error_Prog_OutOfRange);
+                break;
+            }
+            for (uint32_t *x = &out[prog.tok[i].offset], *y = x + prog.tok[i].count; x < y; x++) {
+                if (*x) {
+                    DIAG(prog.tok[i], Error_Prog_Overlap);
+                    break;
+                }
+                *x = 1;
+            }
+            break;
+        }
+    }
+    STAT_END(Check);
+
+    // add the symbols
+    AssembleProg_ctx ctx = {
+        .prog = &prog,
+        .obj  = obj,
+        .ref  = 0,
+        .err  = NoError,
+    };
+    if (obj) {
+        obj->sym_len = obj->reloc_len = obj->str_len = 0;
+        for (size_t i = 0; i < prog.len; i++) {
+            if (prog.tok[i].kind == ProgTokKind_Label) {
+                if (obj->sym_len >= obj->sym_cap)
+                    return Error_Prog_TooMany;
+                obj->sym[obj->sym_len].name = prog.tok[i].value;
+                obj->sym[obj->sym_len].value = prog.tok[i].offset;
+                obj->sym[obj->sym_len].section = prog.tok[i].section;
+                obj->sym_len++;
+            }
+        }
+    }
+
+    // assemble the instructions
+    STAT_BEGIN(Encode);
+    for (size_t i = 0; i < out_n; i++)
+        out[i] = 0;
+    for (size_t i = 0; i < prog.len; i++) {
+        if (curline)
+            *curline = prog.tok[i].line;
+        if (prog.tok[i].count && (prog.tok[i].offset >= out_n || prog.tok[i].count > out_n - prog.tok[i].offset))
+            continue; // only with diag
+        switch (prog.tok[i].kind) {
+        case ProgTokKind_Label:
+        case ProgTokKind_Org:
+            break;
+        case ProgTokKind_Inst:
+            {
+                Inst inst;
+                uint32_t span[2];
+                ctx.ref = 0;
+                ctx.err = NoError;
+                Error err = ParseInstSpan(&inst, prog.tok[i].value, prog.tok[i].offset, &(SymCtx){
+                    .data = &ctx,
+                    .lookup = AssembleProg_lookup,
+                    .ref = obj ? AssembleProg_ref : NULL,
+                }, span);
+                if (err) {
+                    // the value starts at the column of the token
+                    ProgTok t = prog.tok[i];
+                    t.end = t.col + span[1];
+                    t.col = t.col + span[0];
+                    DIAG(t, err);
+                    break;
+                }
+                if ((err = ctx.err)) {
+                    DIAG(prog.tok[i], err);
+                    break;
+                }
+                out[prog.tok[i].offset] = EncodeInst(inst);
+
+                // branches to labels in the same section of the same object
+                // don't need to be relocated
+                if (ctx.ref) {
+                    ObjSym sym = obj->sym[ctx.ref-1];
+                    bool rel = LookupOpcode(inst.Opcode).Format == InstEnc_B;
+                    if (!rel || !~sym.value || sym.section != prog.tok[i].section) {
+                        if (obj->reloc_len >= obj->reloc_cap)
+                            return Error_Prog_TooMany;
+                        obj->reloc[obj->reloc_len].offset = prog.tok[i].offset;
+                        obj->reloc[obj->reloc_len].sym = (uint32_t)(ctx.ref-1);
+                        obj->reloc[obj->reloc_len].rel = rel;
+                        obj->reloc_len++;
+                    }
+                }
+            }
+            break;
+        case ProgTokKind_Data:
+        case ProgTokKind_Fill:
+        case ProgTokKind_Bin:
+            {
+                Error err = AssembleData(prog.tok[i], &out[prog.tok[i].offset]);
+                if (err)
+                    DIAG(prog.tok[i], err);
+            }
+            break;
+        }
+    }
+    STAT_END(Encode);
+    #undef DIAG
+    return first;
+}
+
+/**
+ * Assembles prog into out[n], writing the current line number into curline if
+ * not NULL (which can be used for error context).
+ */
+static Error AssembleProg(const Prog prog, uint32_t *out, size_t out_n, int *curline) {
+    PROBE1(assemble_entry, prog.len);
+    Error err = AssembleProgObj(prog, NULL, out, out_n, curline, NULL);
+    PROBE3(assemble_return, err, prog.len, curline ? *curline : 0);
+    return err;
+}
+
+/**
+ * Assembles buf into prog and out[n] like SplitProg, LayoutProg, and
+ * AssembleProg, but adds every error to diag instead of stopping at the first
+ * one. Lines with errors are skipped, as are the tokens which fail to assemble
+ * (leaving zeros). Errors which prevent it from continuing (i.e.,
+ * Error_Prog_TooMany or errors from LayoutProg) stop it. The first error found
+ * is returned.
+ */
+static Error DiagnoseProg(Prog *prog, char *buf, uint32_t *out, size_t out_n, Diags *diag) {
+    int line = 0;
+    Error err, first = SplitProgDiag(prog, buf, &line, diag);
+    if (first == Error_Prog_TooMany)
+        return first;
+    if ((err = LayoutProg(prog, out, out_n, &line))) {
+        DiagAdd(diag, line, 0, 0, err);
+        return first ? first : err;
+    }
+    if ((err = AssembleProgObj(*prog, NULL, out, out_n, &line, diag)) == Error_Prog_TooMany)
+        DiagAdd(diag, line, 0, 0, err);
+    return first ? first : err;
+}
+
+static bool SortIdx_less(const uint32_t *key, uint32_t a, uint32_t b) {
+    return key ? key[a] < key[b] || (key[a] == key[b] && a < b) : a < b;
+}
+
+static void SortIdx_sift(uint32_t *idx, size_t i, size_t n, const uint32_t *key) {
+    uint32_t x = idx[i];
+    for (size_t c; (c = 2*i + 1) < n; i = c) {
+        if (c + 1 < n && SortIdx_less(key, idx[c], idx[c+1]))
+            c++;
+        if (!SortIdx_less(key, x, idx[c]))
+            break;
+        idx[i] = idx[c];
+    }
+    idx[i] = x;
+}
+
+/**
+ * Sorts the indexes idx[n] by key[idx[i]] (if key is not NULL), then by index,
+ * in-place in O(n log n) (heapsort).
+ */
+static void SortIdx(uint32_t *idx, size_t n, const uint32_t *key) {
+    for (size_t i = n/2; i--; )
+        SortIdx_sift(idx, i, n, key);
+    while (n > 1) {
+        uint32_t x = idx[0];
+        idx[0] = idx[--n];
+        idx[n] = x;
+        SortIdx_sift(idx, 0, n, key);
+    }
+}
+
+/**
+ * Map between the words of an assembled program and the source lines they
+ * came from, using caller-provided storage.
+ *
+ * Each entry is a line which assembled to count words starting at addr. The
+ * entries are sorted by line, and order contains their indexes sorted by
+ * address.
+ */
+typedef struct SrcMap {
+    size_t    len;
+    size_t    cap;
+    int      *line;
+    uint32_t *addr;
+    uint32_t *count;
+    uint32_t *order;
+} SrcMap;
+
+/**
+ * Builds the source map of prog, which must have been assembled successfully
+ * (i.e., no words overlap). At most prog.len entries are needed.
+ */
+static Error SrcMapProg(SrcMap *map, const Prog prog) {
+    map->len = 0;
+    for (size_t i = 0; i < prog.len; i++) {
+        if (prog.tok[i].count) {
+            if (map->len >= map->cap)
+                return Error_Prog_TooMany;
+            map->line[map->len] = prog.tok[i].line; // tokens are in line order, one statement per line
+            map->addr[map->len] = prog.tok[i].offset;
+            map->count[map->len] = prog.tok[i].count;
+            map->order[map->len] = (uint32_t)(map->len);
+            map->len++;
+        }
+    }
+    SortIdx(map->order, map->len, map->addr);
+    return NoError;
+}
+
+/**
+ * Gets the source line of the word at addr, or zero if it isn't from one, in
+ * O(log n).
+ */
+static int SrcMapLine(const SrcMap *map, uint32_t addr) {
+    size_t lo = 0, hi = map->len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        if (map->addr[map->order[mid]] <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (!lo)
+        return 0;
+    uint32_t i = map->order[lo - 1];
+    return addr - map->addr[i] < map->count[i] ? map->line[i] : 0;
+}
+
+/**
+ * Gets the words assembled from line, returning false if there aren't any, in
+ * O(log n).
+ */
+static bool SrcMapAddr(const SrcMap *map, int line, uint32_t *addr, uint32_t *count) {
+    size_t lo = 0, hi = map->len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        if (map->line[mid] < line)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == map->len || map->line[lo] != line)
+        return false;
+    if (addr)
+        *addr = map->addr[lo];
+    if (count)
+        *count = map->count[lo];
+    return true;
+}
+
+typedef struct LinkObj_ctx {
+    const Obj  *obj;
+    size_t      n;
+    const Prog *lay;
+} LinkObj_ctx;
+
+/**
+ * Gets the address of the word at offset off of object i after it was laid out
+ * by LinkObj, where section is the index+1 of the section it's in (or 0 to find
+ * it, which is ambiguous for labels at the end of one).
+ */
+static uint32_t LinkObj_addr(const LinkObj_ctx *ctx, size_t i, uint32_t off, uint32_t section) {
+    const Obj *o = &ctx->obj[i];
+    size_t p = ctx->n;
+    for (size_t j = 0; j < i; j++)
+        p += ctx->obj[j].sec_len;
+    for (size_t k = 0; k < o->sec_len && !section; k++)
+        if (off >= o->sec[k].offset && off - o->sec[k].offset < o->sec[k].size)
+            section = (uint32_t)(k + 1);
+    if (section)
+        return ctx->lay->tok[p + section-1].offset + (off - o->sec[section-1].offset);
+    return ctx->lay->tok[i].offset + off;
+}
+
+static uint32_t LinkObj_lookup(const char *sym, const void *data) {
+    const LinkObj_ctx *ctx = (LinkObj_ctx*)(data);
+    for (size_t i = 0; i < ctx->n; i++)
+        for (size_t j = 0; j < ctx->obj[i].sym_len; j++)
+            if (~ctx->obj[i].sym[j].value && str_eq(ctx->obj[i].sym[j].name, sym, false))
+                return LinkObj_addr(ctx, i, ctx->obj[i].sym[j].value, ctx->obj[i].sym[j].section);
+    return ~(uint32_t)(0);
+}
+
+/**
+ * Links n objects into out[out_n], like assembling their sources one after
+ * another. The words outside sections of each object are placed directly after
+ * the previous object's, starting at zero. Then, sections with the same name
+ * are merged in object order, and placed like LayoutProg.
+ *
+ * The layout is written to lay, which must have room for one token per object
+ * plus one per section of each object, and one section per section of each
+ * object. Token i is the words of object i outside sections, followed by a
+ * token for the words of each section of each object (in order), and the line
+ * of each token is the index+1 of its object. It can be printed with
+ * print_map.
+ *
+ * The index of the current object and symbol name are written into curobj and
+ * cursym if not NULL (which can be used for error context).
+ */
+static Error LinkObj(const Obj *obj, size_t n, Prog *lay, uint32_t *out, size_t out_n, size_t *curobj, const char **cursym) {
+    LinkObj_ctx ctx = {
+        .obj = obj,
+        .n   = n,
+        .lay = lay,
+    };
+    Error err;
+    lay->len = 0;
+    lay->sec_len = 0;
+
+    // place the words outside sections
+    uint32_t off = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (curobj)
+            *curobj = i;
+        uint32_t size = obj[i].sec_len ? obj[i].sec[0].offset : obj[i].size;
+        if (size > out_n - off)
+            return Error_Prog_OutOfRange;
+        if ((err = ProgAdd(lay, (ProgTok){
+            .line    = (int)(i + 1),
+            .section = 0,
+            .offset  = off,
+            .count   = size,
+            .kind    = ProgTokKind_Data,
+        })))
+            return err;
+        off += size;
+    }
+
+    // merge the sections
+    for (size_t i = 0; i < n; i++) {
+        if (curobj)
+            *curobj = i;
+        for (size_t j = 0; j < obj[i].sec_len; j++) {
+            ObjSec sec = obj[i].sec[j];
+            if (cursym)
+                *cursym = sec.name;
+
+            size_t k;
+            for (k = 0; k < lay->sec_len; k++)
+                if (str_eq(lay->sec[k].name, sec.name, false))
+                    break;
+            if (k == lay->sec_len) {
+                if (lay->sec_len >= lay->sec_cap)
+                    return Error_Prog_TooMany;
+                lay->sec[lay->sec_len++] = (ProgSec){
+                    .line   = (int)(i + 1),
+                    .name   = sec.name,
+                    .align  = sec.align,
+                    .addr   = sec.addr,
+                    .attr   = sec.attr,
+                    .offset = 0,
+                    .base   = 0,
+                    .size   = 0,
+                };
+            } else if (sec.attr && (lay->sec[k].align != sec.align || lay->sec[k].addr != sec.addr)) {
+                return Error_Prog_InvalidSection;
+            }
+            if (sec.size > UINT32_MAX - lay->sec[k].offset)
+                return Error_Prog_OutOfRange;
+            if ((err = ProgAdd(lay, (ProgTok){
+                .line    = (int)(i + 1),
+                .section = (uint32_t)(k + 1),
+                .offset  = lay->sec[k].offset,
+                .count   = sec.size,
+                .kind    = ProgTokKind_Data,
+            })))
+                return err;
+            lay->sec[k].offset += sec.size;
+        }
+    }
+    if (cursym)
+        *cursym = NULL;
+
+    // place the sections
+    int line = 0;
+    if ((err = LayoutProg(lay, out, out_n, &line))) {
+        if (curobj && line)
+            *curobj = (size_t)(line - 1);
+        return err;
+    }
+
+    // check for offset bounds/overlap (words outside sections are placed as a
+    // single block for each object)
+    for (size_t i = 0; i < out_n; i++)
+        out[i] = 0;
+    for (size_t i = 0; i < lay->len; i++) {
+        ProgTok t = lay->tok[i];
+        if (curobj)
+            *curobj = (size_t)(t.line - 1);
+        if (!t.count)
+            continue;
+        if (t.offset >= out_n || t.count > out_n - t.offset)
+            return Error_Prog_OutOfRange;
+        for (uint32_t x = t.offset; x < t.offset + t.count; x++) {
+            if (out[x])
+                return Error_Prog_Overlap;
+            out[x] = 1;
+        }
+    }
+
+    // check for duplicate symbols
+    for (size_t i = 0; i < n; i++) {
+        if (curobj)
+            *curobj = i;
+        for (size_t j = 0; j < obj[i].sym_len; j++) {
+            if (!~obj[i].sym[j].value)
+                continue;
+            if (cursym)
+                *cursym = obj[i].sym[j].name;
+            for (size_t k = 0; k < i; k++)
+                for (size_t l = 0; l < obj[k].sym_len; l++)
+                    if (~obj[k].sym[l].value && str_eq(obj[k].sym[l].name, obj[i].sym[j].name, false))
+                        return Error_Prog_DuplicateLabel;
+        }
+    }
+
+    // copy the objects
+    for (size_t i = 0, p = n; i < n; i++) {
+        ProgTok t = lay->tok[i];
+        for (uint32_t j = 0; j < t.count; j++)
+            out[t.offset + j] = obj[i].word[j];
+        for (size_t k = 0; k < obj[i].sec_len; k++, p++) {
+            t = lay->tok[p];
+            for (uint32_t j = 0; j < t.count; j++)
+                out[t.offset + j] = obj[i].word[obj[i].sec[k].offset + j];
+        }
+    }
+
+    // apply the relocations
+    for (size_t i = 0; i < n; i++) {
+        if (curobj)
+            *curobj = i;
+        for (size_t j = 0; j < obj[i].reloc_len; j++) {
+            ObjReloc r = obj[i].reloc[j];
+            if (r.offset >= obj[i].size || r.sym >= obj[i].sym_len)
+                return Error_Prog_OutOfRange;
+            if (cursym)
+                *cursym = obj[i].sym[r.sym].name;
+
+            uint32_t addr = LinkObj_addr(&ctx, i, r.offset, 0);
+            Imm19s imm;
+            Error err = AdrImm19s((SymCtx){
+                .data = &ctx,
+                .lookup = LinkObj_lookup,
+            }, obj[i].sym[r.sym].name, r.rel ? addr + 1 : 0, &imm);
+            if (err)
+                return err;
+
+            uint32_t *w = &out[addr];
+            *w = (*w &~ ((1<<19)-1)) | imm;
+        }
+    }
+    return NoError;
+}
+
+/**
+ * State of a line of an IncProg.
+ */
+typedef struct IncLine {
+    size_t start; // offset in src
+    size_t len;   // including the null terminator
+    size_t ntok;
+    Error  err;   // from SplitLine, not including duplicate labels
+} IncLine;
+
+/**
+ * State of a token of an IncProg.
+ */
+typedef struct IncTok {
+    uint32_t hash; // of the label, or of the symbol resolved by the instruction
+    uint32_t prev; // offset before the current edit
+    uint32_t word; // encoded instruction
+    Error    err;  // from assembling the token
+    bool     sym;  // instruction resolved a symbol
+    bool     dup;  // label is a duplicate of a previous one
+    bool     add;  // token was added by the current edit
+} IncTok;
+
+/**
+ * Assembler state for a program which is edited a few lines at a time (e.g.,
+ * in a live editor), using caller-provided storage. INCBIN is not supported.
+ *
+ * Only the edited lines are parsed, and only new instructions and instructions
+ * resolving a symbol which may have moved are encoded again. The image is
+ * patched in place: only the words of the edited lines, of the tokens which
+ * moved, and of the instructions encoded again are written and compared, so
+ * editing a line without moving anything else doesn't depend on the size of
+ * the image. If the previous edit had an overlap or out-of-range error, or
+ * this one does, the image is rebuilt instead. A SECTION line changes the
+ * offsets of every line after it, so while the program has sections, every
+ * line is split again and the image is rebuilt. The resulting image and error
+ * (including the line) are the same as SplitProg, LayoutProg, and AssembleProg
+ * on the entire source.
+ */
+typedef struct IncProg {
+    Prog      prog;   // cap tokens
+    IncTok   *info;   // cap, parallel to prog.tok
+    size_t    line_len;
+    size_t    line_cap;
+    IncLine  *line;
+    size_t    src_len;
+    size_t    src_cap;
+    char     *src;
+    char     *raw;    // src_cap bytes: src before it was split
+    size_t    tab_n;  // power of two larger than cap
+    uint32_t *tab;    // index+1 of the first label token with each name
+    size_t    out_n;
+    uint32_t *out;    // image
+    uint32_t *tmp;    // out_n words to build the next image in
+    uint8_t  *occ;    // out_n bytes: 1 if the word is used, 2 if changed by the current edit
+    uint32_t *lin;    // out_n source lines of the words in the image, or 0
+    size_t    chg_len;
+    uint32_t *chg;    // out_n indexes of words changed by the last edit
+    uint32_t  mod[64]; // bloom filter of label hashes changed by the current edit
+    bool      stale;  // image can't be reused for the next edit
+    bool      broken; // ran out of space, must be reset
+} IncProg;
+
+typedef struct IncProg_ctx {
+    const IncProg *ip;
+    IncTok        *tok;
+} IncProg_ctx;
+
+static uint32_t *IncProgFind(const IncProg *ip, const char *sym, uint32_t hash) {
+    uint32_t *x = &ip->tab[hash & (ip->tab_n - 1)];
+    while (*x && (ip->info[*x-1].hash != hash || !str_eq(ip->prog.tok[*x-1].value, sym, false)))
+        if (++x == ip->tab + ip->tab_n)
+            x = ip->tab;
+    return x;
+}
+
+static uint32_t IncProg_lookup(const char *sym, const void *data) {
+    IncProg_ctx *ctx = (IncProg_ctx*)(data);
+    ctx->tok->sym = true;
+    ctx->tok->hash = str_hash(sym);
+
+    uint32_t *x = IncProgFind(ctx->ip, sym, ctx->tok->hash);
+    return *x ? ctx->ip->prog.tok[*x-1].offset : ~(uint32_t)(0);
+}
+
+static void IncProgMod(IncProg *ip, uint32_t hash) {
+    ip->mod[hash/32 % 64] |= (uint32_t)(1) << hash%32;
+}
+
+static bool IncProgModded(const IncProg *ip, uint32_t hash) {
+    return ip->mod[hash/32 % 64] & (uint32_t)(1) << hash%32;
+}
+
+/**
+ * Saves the previous value of word w of the image if it hasn't been changed by
+ * the current edit yet, and adds it to chg.
+ */
+static void IncProgTouch(IncProg *ip, uint32_t w) {
+    if (!(ip->occ[w] & 2)) {
+        ip->occ[w] |= 2;
+        ip->tmp[w] = ip->out[w];
+        ip->chg[ip->chg_len++] = w;
+    }
+}
+
+/**
+ * Removes the count words at offset from the image.
+ */
+static void IncProgClear(IncProg *ip, uint32_t offset, uint32_t count) {
+    for (uint32_t w = offset; w < offset + count; w++) {
+        IncProgTouch(ip, w);
+        ip->out[w] = ip->lin[w] = 0;
+        ip->occ[w] &= ~1;
+    }
+}
+
+/**
+ * Updates the image in place for IncProgEdit after the old tokens were removed
+ * (with IncProgClear) and the offsets and labels were updated, returning false
+ * if a token is out of range or overlaps another one. Line numbers changed
+ * starting at token tail.
+ */
+static bool IncProgPatch(IncProg *ip, size_t tail, bool shift) {
+    Prog *prog = &ip->prog;
+
+    // remove the moved tokens first, since they may move into each other
+    for (size_t i = 0; i < prog->len; i++) {
+        ProgTok *tok = &prog->tok[i];
+        IncTok *info = &ip->info[i];
+        if (tok->kind != ProgTokKind_Label && tok->kind != ProgTokKind_Org && !info->add && info->prev != tok->offset)
+            IncProgClear(ip, info->prev, tok->count);
+    }
+
+    for (size_t i = 0; i < prog->len; i++) {
+        ProgTok *tok = &prog->tok[i];
+        IncTok *info = &ip->info[i];
+        if (tok->kind == ProgTokKind_Label || tok->kind == ProgTokKind_Org)
+            continue;
+        bool moved = info->add || info->prev != tok->offset;
+        info->add = false;
+        if (moved && tok->count) {
+            if (tok->offset >= ip->out_n || tok->count > ip->out_n - tok->offset)
+                return false;
+            for (uint32_t w = tok->offset; w < tok->offset + tok->count; w++) {
+                if (ip->occ[w] & 1)
+                    return false;
+                ip->occ[w] |= 1;
+                ip->lin[w] = (uint32_t)(tok->line);
+            }
+        } else if (shift && i >= tail) {
+            for (uint32_t w = tok->offset; w < tok->offset + tok->count; w++)
+                ip->lin[w] = (uint32_t)(tok->line);
+        }
+        if (tok->kind == ProgTokKind_Inst) {
+            if (moved || (info->sym && IncProgModded(ip, info->hash))) {
+                Inst inst;
+                info->sym = false;
+                info->err = ParseInst(&inst, tok->value, tok->offset, &(SymCtx){
+                    .data = &(IncProg_ctx){
+                        .ip  = ip,
+                        .tok = info,
+                    },
+                    .lookup = IncProg_lookup,
+                    .ref = NULL,
+                });
+                info->word = info->err ? 0 : EncodeInst(inst);
+                IncProgTouch(ip, tok->offset);
+                ip->out[tok->offset] = info->word;
+            }
+        } else if (moved) {
+            for (uint32_t w = tok->offset; w < tok->offset + tok->count; w++)
+                IncProgTouch(ip, w);
+            info->err = AssembleData(*tok, &ip->out[tok->offset]);
+        }
+    }
+    return true;
+}
+
+/**
+ * Clears ip. Everything except the state flags and lengths must already be set.
+ */
+static void IncProgReset(IncProg *ip) {
+    ip->prog.len = 0;
+    ip->prog.sec_len = 0;
+    ip->line_len = 0;
+    ip->src_len = 0;
+    ip->chg_len = 0;
+    for (size_t i = 0; i < ip->out_n; i++) {
+        ip->out[i] = ip->lin[i] = 0;
+        ip->occ[i] = 0;
+    }
+    ip->stale = false;
+    ip->broken = false;
+}
+
+/**
+ * Rebuilds the image for IncProgEdit from scratch, checking offset
+ * bounds/overlap, and encoding every token again.
+ */
+static Error IncProgBuild(IncProg *ip, int *curline) {
+    Prog *prog = &ip->prog;
+    Error lerr = NoError;
+    ip->stale = false;
+    for (size_t i = 0; i < ip->out_n; i++) {
+        ip->tmp[i] = 0;
+        ip->occ[i] = 0;
+        ip->lin[i] = 0;
+    }
+    for (size_t i = 0; i < prog->len; i++) {
+        ProgTok *tok = &prog->tok[i];
+        IncTok *info = &ip->info[i];
+        info->add = false;
+        if (tok->kind == ProgTokKind_Label || tok->kind == ProgTokKind_Org)
+            continue;
+        if (tok->count) {
+            if (tok->offset >= ip->out_n || tok->count > ip->out_n - tok->offset) {
+                if (!lerr) {
+                    lerr = Error_Prog_OutOfRange;
+                    *curline = tok->line;
+                }
+                ip->stale = true;
+                continue;
+            }
+            for (uint8_t *x = &ip->occ[tok->offset], *y = x + tok->count; x < y; x++) {
+                if (*x) {
+                    if (!lerr) {
+                        lerr = Error_Prog_Overlap;
+                        *curline = tok->line;
+                    }
+                    ip->stale = true;
+                }
+                *x = 1;
+            }
+            for (size_t j = tok->offset; j < tok->offset + tok->count; j++)
+                ip->lin[j] = (uint32_t)(tok->line);
+        }
+        if (tok->kind == ProgTokKind_Inst) {
+            Inst inst;
+            info->sym = false;
+            info->err = ParseInst(&inst, tok->value, tok->offset, &(SymCtx){
+                .data = &(IncProg_ctx){
+                    .ip  = ip,
+                    .tok = info,
+                },
+                .lookup = IncProg_lookup,
+                .ref = NULL,
+            });
+            info->word = info->err ? 0 : EncodeInst(inst);
+            ip->tmp[tok->offset] = info->word;
+        } else {
+            info->err = AssembleData(*tok, &ip->tmp[tok->offset]);
+        }
+    }
+
+    // find changed words
+    ip->chg_len = 0;
+    for (size_t i = 0; i < ip->out_n; i++)
+        if (ip->tmp[i] != ip->out[i])
+            ip->chg[ip->chg_len++] = (uint32_t)(i);
+    uint32_t *x = ip->out;
+    ip->out = ip->tmp;
+    ip->tmp = x;
+    return lerr;
+}
+
+/**
+ * Splits every line of ip again from raw for IncProgEdit, carrying the state
+ * from one line to the next like SplitProg, then places the sections with
+ * LayoutProg (using tmp as scratch space), writing the line number of the error
+ * into curline. If Error_Prog_TooMany is returned, ip is broken.
+ */
+static Error IncProgSplit(IncProg *ip, int *curline) {
+    Prog *prog = &ip->prog;
+    ProgTok tok = {
+        .line    = 0,
+        .col     = 0,
+        .end     = 0,
+        .section = 0,
+        .offset  = 0,
+        .count   = 0,
+        .kind    = 0,
+        .value   = NULL,
+        .data    = NULL,
+        .size    = 0,
+    };
+    prog->len = 0;
+    prog->sec_len = 0;
+    for (size_t i = 0; i < ip->line_len; i++) {
+        IncLine *l = &ip->line[i];
+        mem_move(&ip->src[l->start], &ip->raw[l->start], l->len);
+        tok.line++;
+
+        size_t k = prog->len;
+        if ((l->err = SplitLine(prog, &tok, &ip->src[l->start], false)) == Error_Prog_TooMany) {
+            *curline = tok.line;
+            ip->broken = true;
+            return Error_Prog_TooMany;
+        }
+        for (l->ntok = prog->len - k; k < prog->len; k++) {
+            ip->info[k] = (IncTok){
+                .hash = prog->tok[k].kind == ProgTokKind_Label ? str_hash(prog->tok[k].value) : 0,
+                .prev = 0,
+                .word = 0,
+                .err  = NoError,
+                .sym  = false,
+                .dup  = false,
+                .add  = true,
+            };
+        }
+    }
+    return LayoutProg(prog, ip->tmp, ip->out_n, curline);
+}
+
+/**
+ * Replaces nold lines of ip starting at the zero-based line first with the nnew
+ * newline-separated lines of text (missing ones are empty), then assembles it,
+ * writing the line number of the error into curline if not NULL.
+ *
+ * The image is in out, the indexes of the words which changed are in chg (in
+ * ascending order), and the line each word came from is in lin. The image is
+ * updated even if an error is returned. If Error_Prog_TooMany is returned, ip
+ * is broken, and must be reset.
+ */
+static Error IncProgEdit(IncProg *ip, size_t first, size_t nold, const char *text, size_t nnew, int *curline) {
+    Prog *prog = &ip->prog;
+    if (curline)
+        *curline = (int)(first + 1);
+    if (ip->broken)
+        return Error_Prog_TooMany;
+    if (first > ip->line_len || nold > ip->line_len - first)
+        return Error_Prog_OutOfRange;
+
+    // find the old lines and tokens
+    size_t t0 = 0, t1, s0, s1;
+    for (size_t i = 0; i < first; i++)
+        t0 += ip->line[i].ntok;
+    t1 = t0;
+    for (size_t i = first; i < first + nold; i++)
+        t1 += ip->line[i].ntok;
+    s0 = first < ip->line_len ? ip->line[first].start : ip->src_len;
+    s1 = first + nold < ip->line_len ? ip->line[first + nold].start : ip->src_len;
+
+    // measure the new lines
+    size_t n = 0;
+    const char *t = text;
+    for (size_t i = 0; i < nnew; i++, n++) {
+        for (; t && *t && *t != '\n'; t++)
+            n++;
+        if (t && *t)
+            t++;
+    }
+    if (ip->line_len - nold + nnew > ip->line_cap || ip->src_len - (s1 - s0) + n > ip->src_cap) {
+        ip->broken = true;
+        return Error_Prog_TooMany;
+    }
+
+    // remove the words of the old lines, unless the image must be rebuilt
+    // anyway (then everything is in range and doesn't overlap)
+    bool sections = prog->sec_len != 0;
+    bool patch = !ip->stale && !sections;
+    ip->chg_len = 0;
+    for (size_t i = t0; patch && i < t1; i++)
+        if (prog->tok[i].kind != ProgTokKind_Label && prog->tok[i].kind != ProgTokKind_Org)
+            IncProgClear(ip, prog->tok[i].offset, prog->tok[i].count);
+
+    // the removed labels may have moved
+    for (size_t i = 0; i < sizeof(ip->mod)/sizeof(*ip->mod); i++)
+        ip->mod[i] = 0;
+    for (size_t i = t0; i < t1; i++)
+        if (prog->tok[i].kind == ProgTokKind_Label)
+            IncProgMod(ip, ip->info[i].hash);
+
+    // replace the source of the old lines
+    size_t tail = ip->src_len - s1;
+    mem_move(&ip->src[s0 + n], &ip->src[s1], tail);
+    mem_move(&ip->raw[s0 + n], &ip->raw[s1], tail);
+    ip->src_len = s0 + n + tail;
+    for (size_t i = t1; i < prog->len; i++)
+        if (prog->tok[i].value)
+            prog->tok[i].value = &ip->src[(size_t)(prog->tok[i].value - ip->src) - s1 + s0 + n];
+    mem_move(&ip->line[first + nnew], &ip->line[first + nold], (ip->line_len - first - nold) * sizeof(*ip->line));
+    for (size_t i = first + nnew; i < ip->line_len - nold + nnew; i++)
+        ip->line[i].start = ip->line[i].start - s1 + s0 + n;
+    ip->line_len = ip->line_len - nold + nnew;
+
+    // move the following tokens to the end to make room for the new ones
+    size_t cap = prog->cap, ntail = prog->len - t1;
+    mem_move(&prog->tok[cap - ntail], &prog->tok[t1], ntail * sizeof(*prog->tok));
+    mem_move(&ip->info[cap - ntail], &ip->info[t1], ntail * sizeof(*ip->info));
+    prog->len = t0;
+    prog->cap = cap - ntail;
+
+    // parse the new lines (only to find new sections, if there were already
+    // some, since they're all split again)
+    prog->sec_len = 0;
+    t = text;
+    for (size_t i = 0, s = s0; i < nnew; i++) {
+        IncLine *l = &ip->line[first + i];
+        l->start = s;
+        for (; t && *t && *t != '\n'; t++, s++)
+            ip->raw[s] = ip->src[s] = *t;
+        if (t && *t)
+            t++;
+        ip->raw[s] = ip->src[s] = '\0';
+        s++;
+        l->len = s - l->start;
+
+        ProgTok tok = {
+            .line    = (int)(first + i + 1),
+            .col     = 0,
+            .end     = 0,
+            .section = 0,
+            .offset  = 0,
+            .count   = 0,
+            .kind    = 0,
+            .value   = NULL,
+            .data    = NULL,
+            .size    = 0,
+        };
+        size_t k = prog->len;
+        if ((l->err = SplitLine(prog, &tok, &ip->src[l->start], false)) == Error_Prog_TooMany) {
+            if (curline)
+                *curline = tok.line;
+            ip->broken = true;
+            return Error_Prog_TooMany;
+        }
+        for (l->ntok = prog->len - k; k < prog->len; k++) {
+            ip->info[k] = (IncTok){
+                .hash = prog->tok[k].kind == ProgTokKind_Label ? str_hash(prog->tok[k].value) : 0,
+                .prev = 0,
+                .word = 0,
+                .err  = NoError,
+                .sym  = false,
+                .dup  = false,
+                .add  = true,
+            };
+        }
+    }
+
+    // move the following tokens back
+    mem_move(&prog->tok[prog->len], &prog->tok[cap - ntail], ntail * sizeof(*prog->tok));
+    mem_move(&ip->info[prog->len], &ip->info[cap - ntail], ntail * sizeof(*ip->info));
+    for (size_t i = prog->len; i < prog->len + ntail; i++)
+        prog->tok[i].line += (int)(nnew) - (int)(nold);
+    prog->len += ntail;
+    prog->cap = cap;
+
+    Error lerr = NoError;
+    int lerr_line = 0;
+    if (sections || prog->sec_len) {
+        // split everything again and lay out the sections
+        for (size_t i = 0; patch && i < ip->chg_len; i++)
+            ip->out[ip->chg[i]] = ip->tmp[ip->chg[i]];
+        patch = false;
+        ip->chg_len = 0;
+        if ((lerr = IncProgSplit(ip, &lerr_line)) == Error_Prog_TooMany) {
+            if (curline)
+                *curline = lerr_line;
+            return lerr;
+        }
+    } else {
+        // update offsets
+        for (size_t i = 0, off = 0; i < prog->len; i++) {
+            ProgTok *tok = &prog->tok[i];
+            ip->info[i].prev = tok->offset;
+            if (tok->kind == ProgTokKind_Org) {
+                off = tok->offset;
+                continue;
+            }
+            tok->offset = (uint32_t)(off);
+            off = (uint32_t)(off + tok->count);
+            if (tok->kind == ProgTokKind_Label && (ip->info[i].add || ip->info[i].prev != tok->offset))
+                IncProgMod(ip, ip->info[i].hash);
+        }
+    }
+
+    // find labels
+    for (size_t i = 0; i < ip->tab_n; i++)
+        ip->tab[i] = 0;
+    for (size_t i = 0; i < prog->len; i++) {
+        if (prog->tok[i].kind == ProgTokKind_Label) {
+            uint32_t *x = IncProgFind(ip, prog->tok[i].value, ip->info[i].hash);
+            if (!(ip->info[i].dup = !!*x))
+                *x = (uint32_t)(i + 1);
+        }
+    }
+
+    // update the image in place if possible
+    if (lerr) {
+        // the sections couldn't be placed, so the offsets are incomplete
+        ip->stale = true;
+    } else if (patch && IncProgPatch(ip, prog->len - ntail, nnew != nold)) {
+        size_t k = 0;
+        for (size_t i = 0; i < ip->chg_len; i++) {
+            uint32_t w = ip->chg[i];
+            ip->occ[w] &= ~2;
+            if (ip->out[w] != ip->tmp[w])
+                ip->chg[k++] = w;
+        }
+        SortIdx(ip->chg, ip->chg_len = k, NULL);
+    } else {
+        // undo the changes, then rebuild it from scratch
+        for (size_t i = 0; patch && i < ip->chg_len; i++)
+            ip->out[ip->chg[i]] = ip->tmp[ip->chg[i]];
+        lerr = IncProgBuild(ip, &lerr_line);
+    }
+
+    // errors from SplitProg come first
+    size_t eline = ip->line_len;
+    Error err = NoError;
+    for (size_t i = 0; i < ip->line_len; i++) {
+        if (ip->line[i].err) {
+            eline = i;
+            err = ip->line[i].err;
+            break;
+        }
+    }
+    for (size_t i = 0; i < prog->len; i++) {
+        if (prog->tok[i].kind == ProgTokKind_Label && ip->info[i].dup) {
+            if ((size_t)(prog->tok[i].line - 1) <= eline) {
+                eline = (size_t)(prog->tok[i].line - 1);
+                err = Error_Prog_DuplicateLabel;
+            }
+            break;
+        }
+    }
+    if (err) {
+        if (curline)
+            *curline = (int)(eline + 1);
+        return err;
+    }
+
+    // then the ones from AssembleProg
+    if (lerr) {
+        if (curline)
+            *curline = lerr_line;
+        return lerr;
+    }
+    for (size_t i = 0; i < prog->len; i++) {
+        if (ip->info[i].err) {
+            if (curline)
+                *curline = prog->tok[i].line;
+            return ip->info[i].err;
+        }
+    }
+    return NoError;
+}
+
+/**
+ * Options for GenProg.
+ */
+typedef struct GenProgOpt {
+    uint32_t n;      // number of lines (one word each)
+    uint32_t label;  // percentage of lines with a label (the first always has one)
+    uint32_t branch; // percentage of lines which branch to a label
+    uint32_t seed;
+} GenProgOpt;
+
+static bool GenProg_label(GenProgOpt opt, uint32_t i) {
+    uint32_t h = (i ^ opt.seed) * 0x9E3779B1u;
+    return !i || (h ^ (h >> 16)) % 100 < opt.label;
+}
+
+/**
+ * Writes a synthetic program of opt.n lines to str, returning a pointer to the
+ * end of the string. The output depends only on opt, and assembles into opt.n
+ * words (as long as opt.n is at most 2^18, so every branch is in range).
+ *
+ * Lines are labeled l<line> (zero-based). Branches go to a label at most 64
+ * lines before a random line, or to l0 if there isn't one. The other lines are
+ * random valid instructions (as written by FormatInst), with some DAT, and
+ * some comments.
+ *
+ * The output buffer should be at least 64*opt.n + 1 bytes long.
+ */
+static char *GenProg(char *str, GenProgOpt opt) {
+    if (!str)
+        return NULL;
+    uint32_t rng = opt.seed ? opt.seed : 1;
+    #define RAND(n) (rng ^= rng << 13, rng ^= rng >> 17, rng ^= rng << 5, rng % (n))
+    for (uint32_t i = 0; i < opt.n; i++) {
+        if (GenProg_label(opt, i))
+            str = str_ecpy(u32_todec(str_ecpy(str, "l"), i), ": ");
+        else
+            str = str_ecpy(str, "    ");
+        if (RAND(100) < opt.branch) {
+            uint32_t j = RAND(opt.n);
+            for (uint32_t k = 0; k < 64 && j && !GenProg_label(opt, j); k++)
+                j--;
+            if (!GenProg_label(opt, j))
+                j = 0;
+            str = str_ecpy(FormatCond(str_ecpy(str, "br"), (Cond)(RAND(CondCount))), " ");
+            str = u32_todec(str_ecpy(FormatReg(str, (Reg)(RAND(RegCount))), ", l"), j);
+        } else if (RAND(16) == 0) {
+            str = u32be_tohex(str_ecpy(str, "DAT $"), RAND(UINT32_MAX));
+        } else {
+            Inst inst;
+            do
+                inst = DecodeInst(RAND(UINT32_MAX));
+            while (CheckInst(inst) || LookupOpcode(inst.Opcode).Format == InstEnc_B);
+            str = FormatInst(str, inst);
+        }
+        if (RAND(8) == 0)
+            str = str_ecpy(str, " ; comment");
+        *str++ = '\n';
+    }
+    #undef RAND
+    *str = '\0';
+    return str;
+}
+
+/**
+ * Constraints for GenInst.
+ */
+typedef struct GenInstOpt {
+    uint16_t weight[1<<5]; // relative frequency of each opcode (0 to exclude)
+    uint16_t avoid;        // registers (1<<Reg) which are never used (e.g., a stack pointer)
+    bool     no_r0_base;   // whether to avoid R0 in RbC forms (i.e., absolute addresses)
+} GenInstOpt;
+
+/**
+ * Constrained-random instruction generator, set up by GenInstInit.
+ */
+typedef struct GenInst {
+    uint32_t cum[1<<5];     // cumulative weight of each opcode
+    Reg      reg[RegCount]; // usable registers
+    uint32_t nreg;
+    Reg      base[RegCount]; // usable RbC base registers
+    uint32_t nbase;
+} GenInst;
+
+/**
+ * Sets up g to generate instructions satisfying opt, returning Error_Gen_Empty
+ * if there aren't any. Opcodes which are invalid or need registers when all of
+ * them are avoided are excluded.
+ */
+static Error GenInstInit(GenInst *g, const GenInstOpt *opt) {
+    g->nreg = g->nbase = 0;
+    for (Reg r = 0; r < RegCount; r++) {
+        if (!(opt->avoid & (1u << r))) {
+            g->reg[g->nreg++] = r;
+            if (r || !opt->no_r0_base)
+                g->base[g->nbase++] = r;
+        }
+    }
+    uint32_t total = 0;
+    for (uint32_t op = 0; op < 1<<5; op++) {
+        InstSpec spec = LookupOpcode((Opcode)(op));
+        bool ok = spec.Format;
+        for (int a = 0; a < 3; a++) {
+            if (spec.Arg[a] == InstArg_Ra || spec.Arg[a] == InstArg_Rb || spec.Arg[a] == InstArg_Rc)
+                ok = ok && g->nreg;
+            if (spec.Arg[a] == InstArg_RbC)
+                ok = ok && g->nbase;
+        }
+        g->cum[op] = total += ok ? opt->weight[op] : 0;
+    }
+    return total ? NoError : Error_Gen_Empty;
+}
+
+/**
+ * Derives the initial state of the xorshift32 generator for stream k of seed,
+ * so each program can be generated independently (e.g., in parallel).
+ */
+static uint32_t GenSeed(uint32_t seed, uint64_t k) {
+    uint64_t z = (((uint64_t)(seed) << 32) ^ k) + 0x9E3779B97F4A7C15u;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9u;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBu;
+    z ^= z >> 31;
+    return (uint32_t)(z) ? (uint32_t)(z) : 1;
+}
+
+/**
+ * Generates a random immediate, favoring zero, one, minus one, and the largest
+ * positive and negative values.
+ */
+static Imm19s GenImm19s(uint32_t *rng) {
+    *rng ^= *rng << 13, *rng ^= *rng >> 17, *rng ^= *rng << 5;
+    switch (*rng >> 29) {
+    case 0:  return 0;
+    case 1:  return 1;
+    case 2:  return (1<<19) - 1;
+    case 3:  return (1<<(19-1)) - 1;
+    case 4:  return 1<<(19-1);
+    default: return *rng & ((1<<19) - 1);
+    }
+}
+
+/**
+ * Generates a random instruction at addr of a program of n words (n > addr)
+ * using g and the xorshift32 state rng. The instruction is valid and canonical
+ * (fields which aren't arguments are zero), and branches stay within the
+ * program and AdrImm19s range.
+ */
+static Inst GenInstNext(const GenInst *g, uint32_t *rng, uint32_t addr, uint32_t n) {
+    #define RAND(n) (*rng ^= *rng << 13, *rng ^= *rng >> 17, *rng ^= *rng << 5, (uint32_t)(((uint64_t)(*rng) * (n)) >> 32)) // [0, n) without dividing
+    Inst i = INST_ZERO;
+
+    uint32_t w = RAND(g->cum[(1<<5) - 1]), lo = 0, hi = (1<<5) - 1;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (g->cum[mid] > w)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    i.Opcode = (Opcode)(lo);
+
+    InstSpec spec = LookupOpcode(i.Opcode);
+    if (spec.Cond)
+        i.C2 = (Cond)(RAND(CondCount));
+    for (int a = 0; a < 3; a++) {
+        switch (spec.Arg[a]) {
+        case InstArg__:
+            break;
+        case InstArg_Ra:
+            i.Ra = g->reg[RAND(g->nreg)];
+            break;
+        case InstArg_Rb:
+            i.Rb = g->reg[RAND(g->nreg)];
+            break;
+        case InstArg_Rc:
+            i.Rc = g->reg[RAND(g->nreg)];
+            break;
+        case InstArg_RbC:
+            i.Rb = g->base[RAND(g->nbase)];
+            i.C = GenImm19s(rng);
+            break;
+        case InstArg_C:
+            if (spec.Format == InstEnc_B) {
+                int64_t t_lo = (int64_t)(addr) + 1 - ((1<<(19-1)) - 1);
+                int64_t t_hi = (int64_t)(addr) + 1 + ((1<<(19-1)) - 2);
+                if (t_lo < 0)
+                    t_lo = 0;
+                if (t_hi > (int64_t)(n) - 1)
+                    t_hi = (int64_t)(n) - 1;
+                int64_t t = t_lo + RAND((uint32_t)(t_hi - t_lo + 1));
+                i.C = (Imm19s)(t - addr - 1) & ((1<<19) - 1);
+            } else {
+                i.C = GenImm19s(rng);
+            }
+            break;
+        }
+    }
+    #undef RAND
+    return i;
+}
+
+/**
+ * Generates program k of seed (n words of encoded instructions) into out.
+ */
+static void GenInstProg(const GenInst *g, uint32_t seed, uint64_t k, uint32_t *out, uint32_t n) {
+    uint32_t rng = GenSeed(seed, k);
+    for (uint32_t addr = 0; addr < n; addr++)
+        out[addr] = EncodeInst(GenInstNext(g, &rng, addr, n));
+}
+
+/**
+ * Classes of Imm19s values for coverage.
+ */
+typedef enum ImmClass {
+    ImmClass_Zero,
+    ImmClass_Pos,    // other positive values
+    ImmClass_Neg,    // other negative values
+    ImmClass_MaxPos, // 2^18-1
+    ImmClass_MinNeg, // -2^18 (the sign boundary)
+    ImmClassCount,
+} ImmClass;
+
+/**
+ * Gets the name of an ImmClass.
+ */
+static const char *GetImmClass(ImmClass k) {
+    switch (k) {
+    case ImmClass_Zero:   return "zero";
+    case ImmClass_Pos:    return "positive";
+    case ImmClass_Neg:    return "negative";
+    case ImmClass_MaxPos: return "max-positive";
+    case ImmClass_MinNeg: return "min-negative";
+    case ImmClassCount:   break;
+    }
+    return "";
+}
+
+static ImmClass ClassifyImm19s(Imm19s c) {
+    c &= (1<<19) - 1;
+    return c == 0 ? ImmClass_Zero
+        : c == (1<<(19-1)) - 1 ? ImmClass_MaxPos
+        : c == 1<<(19-1) ? ImmClass_MinNeg
+        : c & (1<<(19-1)) ? ImmClass_Neg
+        : ImmClass_Pos;
+}
+
+/**
+ * Instruction coverage counters, indexed by opcode. Only valid instructions
+ * (per CheckInst) are counted by opcode. Every field is counted for every
+ * opcode (unused fields decode as zero), and only the ones which are arguments
+ * are reported. Coverage can be merged with CoverMerge.
+ */
+typedef struct Cover {
+    uint64_t words;
+    uint64_t invalid;
+    uint64_t op[1<<5];
+    uint64_t reg[1<<5][3][RegCount]; // Ra, Rb, Rc
+    uint64_t cond[1<<5][CondCount];
+    uint64_t imm[1<<5][ImmClassCount];
+    uint64_t combo[1<<5][(1<<12)/64]; // bitmap of Ra<<8 | Rb<<4 | Rc
+} Cover;
+
+/**
+ * Adds n instruction words to c.
+ */
+static void CoverAdd(Cover *c, const uint32_t *w, size_t n) {
+    c->words += n;
+    for (size_t x = 0; x < n; x++) {
+        Inst i = DecodeInst(w[x]);
+        if (CheckInst(i)) {
+            c->invalid++;
+            continue;
+        }
+        uint32_t combo = (uint32_t)(i.Ra) << 8 | (uint32_t)(i.Rb) << 4 | (uint32_t)(i.Rc);
+        c->op[i.Opcode]++;
+        c->reg[i.Opcode][0][i.Ra]++;
+        c->reg[i.Opcode][1][i.Rb]++;
+        c->reg[i.Opcode][2][i.Rc]++;
+        c->cond[i.Opcode][i.C2]++;
+        c->imm[i.Opcode][ClassifyImm19s(i.C)]++;
+        c->combo[i.Opcode][combo / 64] |= (uint64_t)(1) << (combo % 64);
+    }
+}
+
+/**
+ * Adds n bytes of instruction words (big-endian, or little-endian if le) to c,
+ * returning the number of bytes used (a multiple of 4).
+ */
+static size_t CoverAddBytes(Cover *c, const uint8_t *b, size_t n, bool le) {
+    uint32_t w[256];
+    size_t used = 0;
+    while (n - used >= 4) {
+        size_t k = 0;
+        for (; k < sizeof(w)/sizeof(*w) && n - used >= 4; k++, used += 4, b += 4)
+            w[k] = le
+                ? (uint32_t)(b[0]) | (uint32_t)(b[1]) << 8 | (uint32_t)(b[2]) << 16 | (uint32_t)(b[3]) << 24
+                : (uint32_t)(b[3]) | (uint32_t)(b[2]) << 8 | (uint32_t)(b[1]) << 16 | (uint32_t)(b[0]) << 24;
+        CoverAdd(c, w, k);
+    }
+    return used;
+}
+
+/**
+ * Adds the coverage in src to dst.
+ */
+static void CoverMerge(Cover *dst, const Cover *src) {
+    dst->words += src->words;
+    dst->invalid += src->invalid;
+    for (int op = 0; op < 1<<5; op++) {
+        dst->op[op] += src->op[op];
+        for (int f = 0; f < 3; f++)
+            for (int r = 0; r < RegCount; r++)
+                dst->reg[op][f][r] += src->reg[op][f][r];
+        for (int k = 0; k < CondCount; k++)
+            dst->cond[op][k] += src->cond[op][k];
+        for (int k = 0; k < ImmClassCount; k++)
+            dst->imm[op][k] += src->imm[op][k];
+        for (int k = 0; k < (1<<12)/64; k++)
+            dst->combo[op][k] |= src->combo[op][k];
+    }
+}
+
+/**
+ * Boundary values of C in decoder test vectors: the ImmClass boundaries and
+ * each bit on its own.
+ */
+static const Imm19s VecImm[] = {
+    0x00000, 0x00001, 0x3FFFE, 0x3FFFF, 0x40000, 0x40001, 0x7FFFE, 0x7FFFF,
+    1<<1, 1<<2, 1<<3, 1<<4, 1<<5, 1<<6, 1<<7, 1<<8, 1<<9, 1<<10, 1<<11,
+    1<<12, 1<<13, 1<<14, 1<<15, 1<<16, 1<<17,
+};
+
+/**
+ * Patterns for the bits of decoder test vectors which aren't part of any field
+ * of the opcode's format, which the decoder must ignore.
+ */
+static const uint32_t VecPad[] = {
+    0x00000000, 0xFFFFFFFF, 0x55555555, 0xAAAAAAAA,
+};
+
+/**
+ * The equivalence classes of the fields of an opcode for decoder test vectors:
+ * every value of each register and condition field in its format, crossed
+ * with VecImm if it has C, and with VecPad if it has bits outside the fields.
+ */
+typedef struct VecOp {
+    uint32_t count;  // number of vectors
+    uint32_t unused; // bits outside the opcode and fields
+    uint8_t  n[5];   // number of values of Ra, Rb, Rc, C2, C (1 if not a field)
+} VecOp;
+
+/**
+ * Gets the test vector classes for each opcode from the fields EncodeInst
+ * encodes for it, returning the total number of vectors.
+ */
+static uint32_t VecInit(VecOp v[1<<5]) {
+    uint32_t total = 0;
+    for (int op = 0; op < 1<<5; op++) {
+        Inst i = INST_ZERO;
+        i.Opcode = (Opcode)(op);
+        uint32_t base = EncodeInst(i), used = base;
+        uint8_t max[5] = {RegCount, RegCount, RegCount, CondCount, 0};
+        for (int f = 0; f < 5; f++) {
+            Inst x = i;
+            switch (f) {
+            case 0: x.Ra = (Reg)(RegCount-1); break;
+            case 1: x.Rb = (Reg)(RegCount-1); break;
+            case 2: x.Rc = (Reg)(RegCount-1); break;
+            case 3: x.C2 = (Cond)(CondCount-1); break;
+            case 4: x.C  = 0x7FFFF; break;
+            }
+            uint32_t m = EncodeInst(x);
+            v[op].n[f] = m == base ? 1 : f == 4 ? sizeof(VecImm)/sizeof(*VecImm) : max[f];
+            used |= m;
+        }
+        v[op].unused = ~(used | 0xF8000000);
+        v[op].count = v[op].unused ? sizeof(VecPad)/sizeof(*VecPad) : 1;
+        for (int f = 0; f < 5; f++)
+            v[op].count *= v[op].n[f];
+        total += v[op].count;
+    }
+    return total;
+}
+
+/**
+ * Gets the k-th (< v[op].count) test vector word for op.
+ */
+static uint32_t VecWord(const VecOp v[1<<5], Opcode op, uint32_t k) {
+    const VecOp *o = &v[op & 0x1F];
+    uint32_t x[5];
+    for (int f = 4; f >= 0; f--) {
+        x[f] = k % o->n[f];
+        k /= o->n[f];
+    }
+    Inst i = INST_ZERO;
+    i.Opcode = op;
+    i.Ra = (Reg)(x[0]);
+    i.Rb = (Reg)(x[1]);
+    i.Rc = (Reg)(x[2]);
+    i.C2 = (Cond)(x[3]);
+    i.C  = o->n[4] > 1 ? VecImm[x[4]] : 0;
+    return EncodeInst(i) | (VecPad[k] & o->unused);
+}
+
+/**
+ * Writes the expected decoding of w as 80 bits (20 hex digits, for $readmemh
+ * into a reg [79:0]) and a null terminator to str, returning a pointer to the
+ * end of the string. From the most significant nibble:
+ *
+ *     WWWWWWWW V OO A B C K CCCCC
+ *
+ * where W is the word, V is 1 if it is valid per CheckInst, O is the opcode,
+ * A/B/C are Ra/Rb/Rc, K is C2, and C is C. Fields which aren't part of the
+ * opcode's format are zero, as decoded by DecodeInst.
+ */
+static char *VecFormat(char *str, uint32_t w) {
+    Inst i = DecodeInst(w);
+    str = u32be_tohex(str, w);
+    *str++ = CheckInst(i) ? '0' : '1';
+    *str++ = u4_tohex((uint8_t)(i.Opcode >> 4));
+    *str++ = u4_tohex((uint8_t)(i.Opcode));
+    *str++ = u4_tohex((uint8_t)(i.Ra));
+    *str++ = u4_tohex((uint8_t)(i.Rb));
+    *str++ = u4_tohex((uint8_t)(i.Rc));
+    *str++ = u4_tohex((uint8_t)(i.C2));
+    for (int s = 16; s >= 0; s -= 4)
+        *str++ = u4_tohex((uint8_t)(i.C >> s));
+    *str = '\0';
+    return str;
+}
+
+/**
+ * The register jal stores the return address in.
+ */
+#define CPU_LINK Reg_R15
+
+/**
+ * State of an ISA-level model of the CPU, executing from caller-provided
+ * memory.
+ *
+ * Each step executes one instruction. R0 is an ordinary register, except as
+ * the base of ld, ldi, and st, where it reads as zero (see InstArg_RbC). mul
+ * stores the 64-bit signed product in HI:LO, and div stores the signed
+ * quotient in LO and the remainder in HI (division by zero gives a quotient
+ * of -1 and leaves the dividend as the remainder, and -2^31/-1 gives -2^31
+ * and 0). Shifts and rotates use the low 5 bits of Rc. jal stores the address
+ * of the next instruction in CPU_LINK. halt stops the CPU with PC at the next
+ * instruction.
+ */
+typedef struct Cpu {
+    uint32_t  R[RegCount];
+    uint32_t  HI;
+    uint32_t  LO;
+    uint32_t  PC;     // address of the next instruction
+    uint32_t  IR;     // last instruction executed
+    uint32_t  MA;     // address of the last ld or st
+    uint32_t  in;     // input port, read by in
+    uint32_t  out;    // output port, written by out
+    uint64_t  nout;   // number of writes to out
+    uint32_t  hash;   // FNV-1a of the values written to out
+    uint64_t  steps;  // number of instructions executed
+    bool      halted;
+    uint32_t *mem;
+    uint32_t  memsz;
+} Cpu;
+
+/**
+ * Resets c to start executing at address 0 of the memsz words in mem, with
+ * the registers cleared.
+ */
+static void CpuReset(Cpu *c, uint32_t *mem, uint32_t memsz) {
+    *c = (Cpu){
+        .hash  = 2166136261,
+        .mem   = mem,
+        .memsz = memsz,
+    };
+}
+
+/**
+ * Sign-extends c.
+ */
+static uint32_t CpuImm(Imm19s c) {
+    return (c & (1<<(19-1))) ? (uint32_t)(c) | ~(uint32_t)((1<<19) - 1) : (uint32_t)(c);
+}
+
+/**
+ * Executes the instruction at PC, doing nothing if halted. On error, nothing
+ * is changed other than IR.
+ */
+static Error CpuStep(Cpu *c) {
+    if (c->halted)
+        return NoError;
+    if (c->PC >= c->memsz)
+        return Error_Exec_Fetch;
+    Inst i = DecodeInst((c->IR = c->mem[c->PC]));
+    uint32_t *R = c->R, a, b;
+    int64_t p;
+    switch (i.Opcode) {
+    case 0: // ld Ra, C(Rb)
+    case 2: // st C(Rb), Ra
+        a = (i.Rb ? R[i.Rb] : 0) + CpuImm(i.C);
+        if (a >= c->memsz)
+            return Error_Exec_Mem;
+        c->MA = a;
+        if (i.Opcode)
+            c->mem[a] = R[i.Ra];
+        else
+            R[i.Ra] = c->mem[a];
+        break;
+    case 1:  R[i.Ra] = (i.Rb ? R[i.Rb] : 0) + CpuImm(i.C); break; // ldi Ra, C(Rb)
+    case 3:  R[i.Ra] = R[i.Rb] + R[i.Rc]; break; // add
+    case 4:  R[i.Ra] = R[i.Rb] - R[i.Rc]; break; // sub
+    case 5:  R[i.Ra] = R[i.Rb] & R[i.Rc]; break; // and
+    case 6:  R[i.Ra] = R[i.Rb] | R[i.Rc]; break; // or
+    case 7:  R[i.Ra] = R[i.Rb] >> (R[i.Rc] & 31); break; // shr
+    case 8:  R[i.Ra] = (uint32_t)((int32_t)(R[i.Rb]) >> (R[i.Rc] & 31)); break; // shra
+    case 9:  R[i.Ra] = R[i.Rb] << (R[i.Rc] & 31); break; // shl
+    case 10: R[i.Ra] = R[i.Rb] >> (R[i.Rc] & 31) | R[i.Rb] << ((32 - (R[i.Rc] & 31)) & 31); break; // ror
+    case 11: R[i.Ra] = R[i.Rb] << (R[i.Rc] & 31) | R[i.Rb] >> ((32 - (R[i.Rc] & 31)) & 31); break; // rol
+    case 12: R[i.Ra] = R[i.Rb] + CpuImm(i.C); break; // addi
+    case 13: R[i.Ra] = R[i.Rb] & CpuImm(i.C); break; // andi
+    case 14: R[i.Ra] = R[i.Rb] | CpuImm(i.C); break; // ori
+    case 15: // mul Ra, Rb
+        p = (int64_t)((int32_t)(R[i.Ra])) * (int32_t)(R[i.Rb]);
+        c->HI = (uint32_t)((uint64_t)(p) >> 32);
+        c->LO = (uint32_t)(p);
+        break;
+    case 16: // div Ra, Rb
+        a = R[i.Ra];
+        b = R[i.Rb];
+        if (!b)
+            c->LO = ~(uint32_t)(0), c->HI = a;
+        else if (a == 0x80000000 && b == ~(uint32_t)(0))
+            c->LO = a, c->HI = 0;
+        else
+            c->LO = (uint32_t)((int32_t)(a) / (int32_t)(b)), c->HI = (uint32_t)((int32_t)(a) % (int32_t)(b));
+        break;
+    case 17: R[i.Ra] = 0 - R[i.Rb]; break; // neg
+    case 18: R[i.Ra] = ~R[i.Rb]; break; // not
+    case 19: // brCOND Ra, C
+        a = R[i.Ra];
+        switch (i.C2) {
+        case Cond_ZR: b = a == 0; break;
+        case Cond_NZ: b = a != 0; break;
+        case Cond_PL: b = !(a >> 31); break;
+        case Cond_MI: b = a >> 31; break;
+        default:      b = 0; break;
+        }
+        if (b) {
+            c->PC += 1 + CpuImm(i.C);
+            c->steps++;
+            return NoError;
+        }
+        break;
+    case 20: // jr Ra
+        c->PC = R[i.Ra];
+        c->steps++;
+        return NoError;
+    case 21: // jal Ra
+        a = R[i.Ra];
+        R[CPU_LINK] = c->PC + 1;
+        c->PC = a;
+        c->steps++;
+        return NoError;
+    case 22: R[i.Ra] = c->in; break; // in
+    case 23: c->out = R[i.Ra], c->nout++, c->hash = (c->hash ^ R[i.Ra]) * 16777619; break; // out
+    case 24: R[i.Ra] = c->HI; break; // mfhi
+    case 25: R[i.Ra] = c->LO; break; // mflo
+    case 26: break; // nop
+    case 27: c->halted = true; break; // halt
+    default:
+        return Error_Exec_Inst;
+    }
+    c->PC++;
+    c->steps++;
+    return NoError;
+}
+
+/**
+ * Executes instructions until the CPU halts, limit instructions have been
+ * executed in total, or an error occurs.
+ */
+static Error CpuRun(Cpu *c, uint64_t limit) {
+    Error err = NoError;
+    while (!c->halted && c->steps < limit && !(err = CpuStep(c)))
+        ;
+    return err;
+}
+
+/**
+ * A calling context of the profiler: a function (the target of a jal) called
+ * from its parent context. Node 0 is the root, entered at reset.
+ */
+typedef struct ProfNode {
+    uint32_t func;   // entry address
+    uint32_t parent;
+    uint32_t child;  // first callee context, or 0
+    uint32_t next;   // next context with the same parent, or 0
+    uint64_t calls;
+    uint64_t self;   // instructions executed in this context, excluding callees
+} ProfNode;
+
+/**
+ * An active call: the return address, and the context to return to.
+ */
+typedef struct ProfFrame {
+    uint32_t ret;
+    uint32_t node;
+} ProfFrame;
+
+/**
+ * Execution profile, using caller-provided storage.
+ *
+ * hits and taken are indexed by address, so counting an instruction is a
+ * single increment. A jal enters the context of its target under the current
+ * one, and a jr to the return address of the innermost active call returns
+ * from it (other jr instructions are jumps). When node or frame is full,
+ * calls are attributed to the current context.
+ */
+typedef struct Prof {
+    uint64_t  *hits;  // [memsz] times each instruction was executed
+    uint64_t  *taken; // [memsz] times each branch was taken
+    ProfNode  *node;
+    uint32_t   node_len;
+    uint32_t   node_cap;
+    ProfFrame *frame;
+    uint32_t   depth;
+    uint32_t   depth_cap;
+    uint32_t   lost;  // calls which didn't fit in frame
+    uint32_t   cur;   // current context
+    uint64_t   mark;  // steps when cur was last entered
+} Prof;
+
+/**
+ * Resets p (with zeroed hits and taken) for a CPU starting at entry.
+ */
+static void ProfReset(Prof *p, uint32_t entry) {
+    p->node[0] = (ProfNode){.func = entry, .calls = 1};
+    p->node_len = 1;
+    p->depth = 0;
+    p->lost = 0;
+    p->cur = 0;
+    p->mark = 0;
+}
+
+/**
+ * Switches p to context n at steps.
+ */
+static void ProfSwitch(Prof *p, uint32_t n, uint64_t steps) {
+    p->node[p->cur].self += steps - p->mark;
+    p->mark = steps;
+    p->cur = n;
+}
+
+/**
+ * Records a call to func returning to ret.
+ */
+static void ProfCall(Prof *p, uint32_t func, uint32_t ret, uint64_t steps) {
+    if (p->depth == p->depth_cap) {
+        p->lost++;
+        return;
+    }
+    uint32_t n = p->node[p->cur].child;
+    while (n && p->node[n].func != func)
+        n = p->node[n].next;
+    if (!n && p->node_len < p->node_cap) {
+        n = p->node_len++;
+        p->node[n] = (ProfNode){
+            .func   = func,
+            .parent = p->cur,
+            .next   = p->node[p->cur].child,
+        };
+        p->node[p->cur].child = n;
+    }
+    p->frame[p->depth++] = (ProfFrame){.ret = ret, .node = p->cur};
+    if (n) {
+        p->node[n].calls++;
+        ProfSwitch(p, n, steps);
+    }
+}
+
+/**
+ * Records a jump to addr, which returns from the innermost call if it goes to
+ * its return address.
+ */
+static void ProfJump(Prof *p, uint32_t addr, uint64_t steps) {
+    if (p->lost) {
+        p->lost--; // assume calls past the limit return in order
+        return;
+    }
+    if (p->depth && p->frame[p->depth-1].ret == addr)
+        ProfSwitch(p, p->frame[--p->depth].node, steps);
+}
+
+/**
+ * Like CpuRun, but also records the profile of the execution in p. Any
+ * instructions executed before (e.g., by CpuRun) are attributed to the
+ * current context.
+ */
+static Error ProfRun(Prof *p, Cpu *c, uint64_t limit) {
+    Error err = NoError;
+    while (!c->halted && c->steps < limit) {
+        uint32_t pc = c->PC;
+        if ((err = CpuStep(c)))
+            break;
+        p->hits[pc]++;
+        switch (c->IR >> 27) {
+        case 19: // br
+            if (c->PC != pc + 1)
+                p->taken[pc]++;
+            break;
+        case 20: // jr
+            ProfJump(p, c->PC, c->steps);
+            break;
+        case 21: // jal
+            ProfCall(p, c->PC, pc + 1, c->steps);
+            break;
+        }
+    }
+    ProfSwitch(p, p->cur, c->steps);
+    return err;
+}
+
+/**
+ * Control signals of the 3-bus multi-cycle datapath (see Cyc), as bits of a
+ * control vector (CycCtl).
+ *
+ * Bus A is driven by one of the *out signals, bus B by RoutB or Cout, and the
+ * ALU drives bus C from them, which the *in signals load from (other than
+ * Read, which loads MDR from memory, and Zin, which loads the 64-bit ALU
+ * result into ZHI:ZLO).
+ */
+typedef enum CycSig {
+    CycSig_PCout,      // bus A
+    CycSig_Rout,
+    CycSig_BAout,      // with Rout, R0 reads as zero
+    CycSig_MDRout,
+    CycSig_HIout,
+    CycSig_LOout,
+    CycSig_InPortout,
+    CycSig_ZHIout,
+    CycSig_ZLOout,
+    CycSig_RoutB,      // bus B
+    CycSig_Cout,       // sign-extended C
+    CycSig_PCin,       // from bus C
+    CycSig_IRin,
+    CycSig_MARin,
+    CycSig_MDRin,
+    CycSig_HIin,
+    CycSig_LOin,
+    CycSig_Rin,
+    CycSig_OutPortin,
+    CycSig_Zin,        // from the ALU
+    CycSig_CONin,      // CON <- bus A meets the condition in IR
+    CycSig_Read,       // MDR <- M[MAR]
+    CycSig_Write,      // M[MAR] <- MDR
+    CycSig_Halt,
+    CycSig_End,        // last step of the instruction
+    CycSig_CON,        // state of CON after the step
+    CycSigCount,
+} CycSig;
+
+/**
+ * ALU operations, on bus A and bus B.
+ */
+typedef enum CycAlu {
+    CycAlu_None,
+    CycAlu_PassA,
+    CycAlu_Inc,   // A + 1
+    CycAlu_Add,
+    CycAlu_Sub,
+    CycAlu_And,
+    CycAlu_Or,
+    CycAlu_Shr,
+    CycAlu_Shra,
+    CycAlu_Shl,
+    CycAlu_Ror,
+    CycAlu_Rol,
+    CycAlu_Neg,   // -B
+    CycAlu_Not,   // ~B
+    CycAlu_Mul,   // 64-bit, low word on bus C
+    CycAlu_Div,   // remainder:quotient, quotient on bus C
+    CycAluCount,
+} CycAlu;
+
+/**
+ * Register file port selection (Gra, Grb, Grc).
+ */
+typedef enum CycSel {
+    CycSel_Link, // CPU_LINK, for jal
+    CycSel_Ra,
+    CycSel_Rb,
+    CycSel_Rc,
+} CycSel;
+
+/**
+ * Control vector: the CycSig bits, and fields for the step (0-7), ALU
+ * operation, and the register selected for bus A (Rout), bus B (RoutB), and
+ * bus C (Rin).
+ */
+typedef uint64_t CycCtl;
+
+#define CYC_SIG(s)    ((CycCtl)(1) << (s))
+#define CYC_T(t)      ((CycCtl)(t) << 32)
+#define CYC_ALU(a)    ((CycCtl)(a) << 36)
+#define CYC_SELA(r)   ((CycCtl)(r) << 42)
+#define CYC_SELB(r)   ((CycCtl)(r) << 44)
+#define CYC_SELC(r)   ((CycCtl)(r) << 46)
+#define CYC_GET_T(c)    ((uint32_t)((c) >> 32) & 7)
+#define CYC_GET_ALU(c)  ((CycAlu)((uint32_t)((c) >> 36) & 31))
+#define CYC_GET_SELA(c) ((CycSel)((uint32_t)((c) >> 42) & 3))
+#define CYC_GET_SELB(c) ((CycSel)((uint32_t)((c) >> 44) & 3))
+#define CYC_GET_SELC(c) ((CycSel)((uint32_t)((c) >> 46) & 3))
+
+/**
+ * Gets the name of a CycSig.
+ */
+static const char *GetCycSig(CycSig s) {
+    switch (s) {
+    case CycSig_PCout:     return "PCout";
+    case CycSig_Rout:      return "Rout";
+    case CycSig_BAout:     return "BAout";
+    case CycSig_MDRout:    return "MDRout";
+    case CycSig_HIout:     return "HIout";
+    case CycSig_LOout:     return "LOout";
+    case CycSig_InPortout: return "InPortout";
+    case CycSig_ZHIout:    return "ZHIout";
+    case CycSig_ZLOout:    return "ZLOout";
+    case CycSig_RoutB:     return "RoutB";
+    case CycSig_Cout:      return "Cout";
+    case CycSig_PCin:      return "PCin";
+    case CycSig_IRin:      return "IRin";
+    case CycSig_MARin:     return "MARin";
+    case CycSig_MDRin:     return "MDRin";
+    case CycSig_HIin:      return "HIin";
+    case CycSig_LOin:      return "LOin";
+    case CycSig_Rin:       return "Rin";
+    case CycSig_OutPortin: return "OutPortin";
+    case CycSig_Zin:       return "Zin";
+    case CycSig_CONin:     return "CONin";
+    case CycSig_Read:      return "Read";
+    case CycSig_Write:     return "Write";
+    case CycSig_Halt:      return "Halt";
+    case CycSig_End:       return "End";
+    case CycSig_CON:       return "CON";
+    case CycSigCount:      break;
+    }
+    return NULL;
+}
+
+/**
+ * Gets the control vector (without CycSig_CON) for step t of op, given the
+ * state of CON. Steps 0-2 fetch the instruction into IR and increment PC.
+ */
+static CycCtl CycControl(Opcode op, uint32_t t, bool con) {
+    static const CycAlu alu[1<<5] = {
+        [3]  = CycAlu_Add, [4]  = CycAlu_Sub, [5]  = CycAlu_And, [6]  = CycAlu_Or,
+        [7]  = CycAlu_Shr, [8]  = CycAlu_Shra, [9] = CycAlu_Shl, [10] = CycAlu_Ror,
+        [11] = CycAlu_Rol, [12] = CycAlu_Add, [13] = CycAlu_And, [14] = CycAlu_Or,
+        [15] = CycAlu_Mul, [16] = CycAlu_Div, [17] = CycAlu_Neg, [18] = CycAlu_Not,
+    };
+    const CycCtl R_A = CYC_SIG(CycSig_Rout) | CYC_SELA(CycSel_Ra);
+    const CycCtl R_B = CYC_SIG(CycSig_Rout) | CYC_SELA(CycSel_Rb);
+    const CycCtl RA_IN = CYC_SIG(CycSig_Rin) | CYC_SELC(CycSel_Ra);
+    const CycCtl END = CYC_SIG(CycSig_End);
+    CycCtl c = CYC_T(t);
+    switch (t) {
+    case 0: return c | CYC_SIG(CycSig_PCout) | CYC_ALU(CycAlu_PassA) | CYC_SIG(CycSig_MARin);
+    case 1: return c | CYC_SIG(CycSig_PCout) | CYC_ALU(CycAlu_Inc) | CYC_SIG(CycSig_PCin) | CYC_SIG(CycSig_Read);
+    case 2: return c | CYC_SIG(CycSig_MDRout) | CYC_ALU(CycAlu_PassA) | CYC_SIG(CycSig_IRin);
+    }
+    switch (LookupOpcode(op).Format ? op : 0xFF) {
+    case 0: // ld
+        switch (t) {
+        case 3: return c | R_B | CYC_SIG(CycSig_BAout) | CYC_SIG(CycSig_Cout) | CYC_ALU(CycAlu_Add) | CYC_SIG(CycSig_MARin);
+        case 4: return c | CYC_SIG(CycSig_Read);
+        case 5: return c | CYC_SIG(CycSig_MDRout) | CYC_ALU(CycAlu_PassA) | RA_IN | END;
+        }
+        break;
+    case 1: // ldi
+        return c | R_B | CYC_SIG(CycSig_BAout) | CYC_SIG(CycSig_Cout) | CYC_ALU(CycAlu_Add) | RA_IN | END;
+    case 2: // st
+        switch (t) {
+        case 3: return c | R_B | CYC_SIG(CycSig_BAout) | CYC_SIG(CycSig_Cout) | CYC_ALU(CycAlu_Add) | CYC_SIG(CycSig_MARin);
+        case 4: return c | R_A | CYC_ALU(CycAlu_PassA) | CYC_SIG(CycSig_MDRin);
+        case 5: return c | CYC_SIG(CycSig_Write) | END;
+        }
+        break;
+    case 3: case 4: case 5: case 6: case 7: case 8: case 9: case 10: case 11: // R
+        return c | R_B | CYC_SIG(CycSig_RoutB) | CYC_SELB(CycSel_Rc) | CYC_ALU(alu[op]) | RA_IN | END;
+    case 12: case 13: case 14: // addi, andi, ori
+        return c | R_B | CYC_SIG(CycSig_Cout) | CYC_ALU(alu[op]) | RA_IN | END;
+    case 15: case 16: // mul, div
+        switch (t) {
+        case 3: return c | R_A | CYC_SIG(CycSig_RoutB) | CYC_SELB(CycSel_Rb) | CYC_ALU(alu[op]) | CYC_SIG(CycSig_Zin);
+        case 4: return c | CYC_SIG(CycSig_ZLOout) | CYC_ALU(CycAlu_PassA) | CYC_SIG(CycSig_LOin);
+        case 5: return c | CYC_SIG(CycSig_ZHIout) | CYC_ALU(CycAlu_PassA) | CYC_SIG(CycSig_HIin) | END;
+        }
+        break;
+    case 17: case 18: // neg, not
+        return c | CYC_SIG(CycSig_RoutB) | CYC_SELB(CycSel_Rb) | CYC_ALU(alu[op]) | RA_IN | END;
+    case 19: // br
+        switch (t) {
+        case 3: return c | R_A | CYC_SIG(CycSig_CONin);
+        case 4: return c | CYC_SIG(CycSig_PCout) | CYC_SIG(CycSig_Cout) | CYC_ALU(CycAlu_Add) | (con ? CYC_SIG(CycSig_PCin) : 0) | END;
+        }
+        break;
+    case 20: // jr
+        return c | R_A | CYC_ALU(CycAlu_PassA) | CYC_SIG(CycSig_PCin) | END;
+    case 21: // jal
+        switch (t) {
+        case 3: return c | R_A | CYC_ALU(CycAlu_PassA) | CYC_SIG(CycSig_Zin);
+        case 4: return c | CYC_SIG(CycSig_PCout) | CYC_ALU(CycAlu_PassA) | CYC_SIG(CycSig_Rin) | CYC_SELC(CycSel_Link);
+        case 5: return c | CYC_SIG(CycSig_ZLOout) | CYC_ALU(CycAlu_PassA) | CYC_SIG(CycSig_PCin) | END;
+        }
+        break;
+    case 22: // in
+        return c | CYC_SIG(CycSig_InPortout) | CYC_ALU(CycAlu_PassA) | RA_IN | END;
+    case 23: // out
+        return c | R_A | CYC_ALU(CycAlu_PassA) | CYC_SIG(CycSig_OutPortin) | END;
+    case 24: // mfhi
+        return c | CYC_SIG(CycSig_HIout) | CYC_ALU(CycAlu_PassA) | RA_IN | END;
+    case 25: // mflo
+        return c | CYC_SIG(CycSig_LOout) | CYC_ALU(CycAlu_PassA) | RA_IN | END;
+    case 26: // nop
+        return c | END;
+    case 27: // halt
+        return c | CYC_SIG(CycSig_Halt) | END;
+    }
+    return c; // invalid
+}
+
+/**
+ * What happened in one step of the datapath: the control vector and the values
+ * on the buses (zero if not driven), the word read from memory (if Read), and
+ * the high word of the ALU result (if Zin).
+ */
+typedef struct CycRec {
+    CycCtl   ctl;
+    uint32_t A;
+    uint32_t B;
+    uint32_t C;
+    uint32_t M;
+    uint32_t ZHI;
+} CycRec;
+
+/**
+ * Cycle-accurate model of a 3-bus multi-cycle datapath executing the same
+ * instructions as Cpu (which holds the architectural state).
+ *
+ * Every instruction takes 3 steps to fetch (MAR <- PC, then PC <- PC+1 and
+ * MDR <- M[MAR], then IR <- MDR) and 1-3 steps to execute (see CycControl),
+ * one per cycle. Since both ALU operands are on a bus in the same cycle,
+ * there is no Y register. Z holds the 64-bit result of mul and div until it
+ * is moved to LO and HI, and the target address of jal while the return
+ * address is saved.
+ */
+typedef struct Cyc {
+    Cpu      cpu;
+    uint32_t MAR;
+    uint32_t MDR;
+    uint32_t ZHI;
+    uint32_t ZLO;
+    bool     CON;
+    uint32_t T;
+    uint64_t cycles;
+} Cyc;
+
+/**
+ * Resets y like CpuReset.
+ */
+static void CycReset(Cyc *y, uint32_t *mem, uint32_t memsz) {
+    *y = (Cyc){0};
+    CpuReset(&y->cpu, mem, memsz);
+}
+
+/**
+ * Gets the register selected by sel for the instruction in IR.
+ */
+static uint32_t CycReg(Inst i, CycSel sel) {
+    switch (sel) {
+    case CycSel_Link: return CPU_LINK;
+    case CycSel_Ra:   return i.Ra;
+    case CycSel_Rb:   return i.Rb;
+    case CycSel_Rc:   return i.Rc;
+    }
+    return 0;
+}
+
+/**
+ * Executes one step, doing nothing if halted, and describes it in r. On
+ * error, nothing is changed. cpu.steps is incremented after the last step of
+ * each instruction.
+ */
+static Error CycStep(Cyc *y, CycRec *r) {
+    Cpu *c = &y->cpu;
+    if (c->halted)
+        return NoError;
+    Inst i = DecodeInst(c->IR);
+    CycCtl ctl = CycControl(i.Opcode, y->T, y->CON);
+    if (y->T == 0 && c->PC >= c->memsz)
+        return Error_Exec_Fetch;
+    if (y->T > 2 && !(ctl & ~CYC_T(7)))
+        return Error_Exec_Inst;
+    if ((ctl & (CYC_SIG(CycSig_Read) | CYC_SIG(CycSig_Write))) && y->MAR >= c->memsz)
+        return Error_Exec_Mem;
+
+    // buses
+    *r = (CycRec){.ctl = ctl};
+    if (ctl & CYC_SIG(CycSig_PCout))     r->A = c->PC;
+    if (ctl & CYC_SIG(CycSig_MDRout))    r->A = y->MDR;
+    if (ctl & CYC_SIG(CycSig_HIout))     r->A = c->HI;
+    if (ctl & CYC_SIG(CycSig_LOout))     r->A = c->LO;
+    if (ctl & CYC_SIG(CycSig_InPortout)) r->A = c->in;
+    if (ctl & CYC_SIG(CycSig_ZHIout))    r->A = y->ZHI;
+    if (ctl & CYC_SIG(CycSig_ZLOout))    r->A = y->ZLO;
+    if (ctl & CYC_SIG(CycSig_Rout)) {
+        uint32_t x = CycReg(i, CYC_GET_SELA(ctl));
+        r->A = x || !(ctl & CYC_SIG(CycSig_BAout)) ? c->R[x] : 0;
+    }
+    if (ctl & CYC_SIG(CycSig_RoutB)) r->B = c->R[CycReg(i, CYC_GET_SELB(ctl))];
+    if (ctl & CYC_SIG(CycSig_Cout))  r->B = CpuImm(i.C);
+
+    // alu
+    uint32_t a = r->A, b = r->B, s = b & 31;
+    int64_t p;
+    switch (CYC_GET_ALU(ctl)) {
+    case CycAlu_None:  break;
+    case CycAlu_PassA: r->C = a; break;
+    case CycAlu_Inc:   r->C = a + 1; break;
+    case CycAlu_Add:   r->C = a + b; break;
+    case CycAlu_Sub:   r->C = a - b; break;
+    case CycAlu_And:   r->C = a & b; break;
+    case CycAlu_Or:    r->C = a | b; break;
+    case CycAlu_Shr:   r->C = a >> s; break;
+    case CycAlu_Shra:  r->C = (uint32_t)((int32_t)(a) >> s); break;
+    case CycAlu_Shl:   r->C = a << s; break;
+    case CycAlu_Ror:   r->C = a >> s | a << ((32 - s) & 31); break;
+    case CycAlu_Rol:   r->C = a << s | a >> ((32 - s) & 31); break;
+    case CycAlu_Neg:   r->C = 0 - b; break;
+    case CycAlu_Not:   r->C = ~b; break;
+    case CycAlu_Mul:
+        p = (int64_t)((int32_t)(a)) * (int32_t)(b);
+        r->C = (uint32_t)(p);
+        r->ZHI = (uint32_t)((uint64_t)(p) >> 32);
+        break;
+    case CycAlu_Div:
+        if (!b)
+            r->C = ~(uint32_t)(0), r->ZHI = a;
+        else if (a == 0x80000000 && b == ~(uint32_t)(0))
+            r->C = a, r->ZHI = 0;
+        else
+            r->C = (uint32_t)((int32_t)(a) / (int32_t)(b)), r->ZHI = (uint32_t)((int32_t)(a) % (int32_t)(b));
+        break;
+    case CycAluCount:  break;
+    }
+    if (!(ctl & CYC_SIG(CycSig_Zin)))
+        r->ZHI = 0;
+
+    // registers
+    if (ctl & CYC_SIG(CycSig_CONin)) {
+        switch (i.C2) {
+        case Cond_ZR: y->CON = a == 0; break;
+        case Cond_NZ: y->CON = a != 0; break;
+        case Cond_PL: y->CON = !(a >> 31); break;
+        case Cond_MI: y->CON = a >> 31; break;
+        default:      y->CON = false; break;
+        }
+    }
+    if (ctl & CYC_SIG(CycSig_Read))      y->MDR = r->M = c->mem[y->MAR];
+    if (ctl & CYC_SIG(CycSig_Write))     c->mem[y->MAR] = y->MDR;
+    if (ctl & CYC_SIG(CycSig_PCin))      c->PC = r->C;
+    if (ctl & CYC_SIG(CycSig_IRin))      c->IR = r->C;
+    if (ctl & CYC_SIG(CycSig_MARin))     y->MAR = r->C;
+    if (ctl & CYC_SIG(CycSig_MDRin))     y->MDR = r->C;
+    if (ctl & CYC_SIG(CycSig_HIin))      c->HI = r->C;
+    if (ctl & CYC_SIG(CycSig_LOin))      c->LO = r->C;
+    if (ctl & CYC_SIG(CycSig_Rin))       c->R[CycReg(i, CYC_GET_SELC(ctl))] = r->C;
+    if (ctl & CYC_SIG(CycSig_OutPortin)) c->out = r->C, c->nout++, c->hash = (c->hash ^ r->C) * 16777619;
+    if (ctl & CYC_SIG(CycSig_Zin))       y->ZLO = r->C, y->ZHI = r->ZHI;
+    if (ctl & CYC_SIG(CycSig_Halt))      c->halted = true;
+    if (y->CON)
+        r->ctl |= CYC_SIG(CycSig_CON);
+
+    y->cycles++;
+    if (ctl & CYC_SIG(CycSig_End)) {
+        y->T = 0;
+        c->steps++;
+    } else {
+        y->T++;
+    }
+    return NoError;
+}
+
+/**
+ * Implementations of BatchRun.
+ */
+typedef enum BatchImpl {
+    BatchImpl_Auto,   // avx512 if supported, scalar otherwise
+    BatchImpl_Scalar, // CpuRun on each lane
+    BatchImpl_Avx2,   // 8 lanes at a time (slower than scalar, only used if requested)
+    BatchImpl_Avx512, // 16 lanes at a time
+    BatchImplCount,
+} BatchImpl;
+
+/**
+ * Gets the name of a BatchImpl.
+ */
+static const char *GetBatchImpl(BatchImpl impl) {
+    switch (impl) {
+    case BatchImpl_Auto:   return "auto";
+    case BatchImpl_Scalar: return "scalar";
+    case BatchImpl_Avx2:   return "avx2";
+    case BatchImpl_Avx512: return "avx512";
+    default:               return NULL;
+    }
+}
+
+/**
+ * Many independent instances of Cpu, stored as structure-of-arrays in
+ * caller-provided storage, with n lanes.
+ *
+ * Lane l has memsz words of memory starting at mem[l*memsz], register r at
+ * R[r*n + l], and the rest of its state at index l of the other arrays. A lane
+ * stops when it halts, executes limit instructions, or sets err.
+ */
+typedef struct Batch {
+    uint32_t  n;
+    uint32_t  memsz;
+    uint32_t  limit;
+    BatchImpl impl;
+    uint32_t *mem;
+    uint32_t *R;
+    uint32_t *HI;
+    uint32_t *LO;
+    uint32_t *PC;
+    uint32_t *in;
+    uint32_t *out;
+    uint32_t *nout;
+    uint32_t *hash;
+    uint32_t *steps;
+    uint32_t *halted;
+    uint32_t *err;    // Error
+} Batch;
+
+/**
+ * Resets every lane of b like CpuReset (other than the memory and input
+ * port).
+ */
+static void BatchReset(Batch *b) {
+    for (uint32_t l = 0; l < b->n; l++) {
+        for (int r = 0; r < RegCount; r++)
+            b->R[r*b->n + l] = 0;
+        b->HI[l] = b->LO[l] = b->PC[l] = b->out[l] = b->nout[l] = b->steps[l] = b->halted[l] = b->err[l] = 0;
+        b->hash[l] = 2166136261;
+    }
+}
+
+/**
+ * Copies lane l of b into c.
+ */
+static void BatchLoad(const Batch *b, uint32_t l, Cpu *c) {
+    CpuReset(c, b->mem + (size_t)(l)*b->memsz, b->memsz);
+    for (int r = 0; r < RegCount; r++)
+        c->R[r] = b->R[r*b->n + l];
+    c->HI = b->HI[l];
+    c->LO = b->LO[l];
+    c->PC = b->PC[l];
+    c->in = b->in[l];
+    c->out = b->out[l];
+    c->nout = b->nout[l];
+    c->hash = b->hash[l];
+    c->steps = b->steps[l];
+    c->halted = b->halted[l];
+}
+
+/**
+ * Copies c into lane l of b.
+ */
+static void BatchStore(Batch *b, uint32_t l, const Cpu *c, Error err) {
+    for (int r = 0; r < RegCount; r++)
+        b->R[r*b->n + l] = c->R[r];
+    b->HI[l] = c->HI;
+    b->LO[l] = c->LO;
+    b->PC[l] = c->PC;
+    b->out[l] = c->out;
+    b->nout[l] = (uint32_t)(c->nout);
+    b->hash[l] = c->hash;
+    b->steps[l] = (uint32_t)(c->steps);
+    b->halted[l] = c->halted;
+    b->err[l] = err;
+}
+
+#if defined(HAVE_IMMINTRIN)
+/**
+ * The lanes being executed in lock-step, and the state of them which is kept
+ * in vectors (the rest is in Batch). Empty slots are halted.
+ */
+typedef struct BatchSlots {
+    uint32_t lane[16];
+    uint32_t PC[16];
+    uint32_t steps[16];
+    uint32_t halted[16];
+    uint32_t err[16];
+    uint32_t HI[16];
+    uint32_t LO[16];
+    uint32_t in[16];
+    uint32_t out[16];
+    uint32_t nout[16];
+    uint32_t hash[16];
+} BatchSlots;
+
+static void BatchSlotGet(const Batch *b, BatchSlots *s, int i, uint32_t l) {
+    s->lane[i] = l;
+    s->PC[i] = b->PC[l];
+    s->steps[i] = b->steps[l];
+    s->halted[i] = b->halted[l];
+    s->err[i] = b->err[l];
+    s->HI[i] = b->HI[l];
+    s->LO[i] = b->LO[l];
+    s->in[i] = b->in[l];
+    s->out[i] = b->out[l];
+    s->nout[i] = b->nout[l];
+    s->hash[i] = b->hash[l];
+}
+
+static void BatchSlotPut(Batch *b, const BatchSlots *s, int i) {
+    uint32_t l = s->lane[i];
+    b->PC[l] = s->PC[i];
+    b->steps[l] = s->steps[i];
+    b->halted[l] = s->halted[i];
+    b->HI[l] = s->HI[i];
+    b->LO[l] = s->LO[i];
+    b->out[l] = s->out[i];
+    b->nout[l] = s->nout[i];
+    b->hash[l] = s->hash[i];
+}
+
+/**
+ * Writes back the slots in active which aren't in run, and fills the empty
+ * slots of the w in s with the next lanes of b which haven't stopped,
+ * returning the slots which are now active.
+ */
+static unsigned BatchSlotFill(Batch *b, BatchSlots *s, int w, unsigned active, unsigned run, uint32_t *next) {
+    for (unsigned m = active & ~run; m; m &= m - 1)
+        BatchSlotPut(b, s, __builtin_ctz(m));
+    active = run;
+    for (unsigned m = ~active & ((1u << w) - 1); m && *next < b->n; (*next)++) {
+        uint32_t l = *next;
+        if (!b->err[l] && !b->halted[l] && b->steps[l] < b->limit) {
+            BatchSlotGet(b, s, __builtin_ctz(m), l);
+            active |= m & -m;
+            m &= m - 1;
+        }
+    }
+    for (unsigned m = ~active & ((1u << w) - 1); m; m &= m - 1)
+        s->halted[__builtin_ctz(m)] = 1;
+    return active;
+}
+
+/**
+ * Executes the next instruction of the slots in step with CpuStep.
+ */
+static void BatchSlotStep(Batch *b, BatchSlots *s, unsigned step) {
+    for (; step; step &= step - 1) {
+        int i = __builtin_ctz(step);
+        Cpu c;
+        BatchSlotPut(b, s, i);
+        BatchLoad(b, s->lane[i], &c);
+        BatchStore(b, s->lane[i], &c, CpuStep(&c));
+        BatchSlotGet(b, s, i, s->lane[i]);
+    }
+}
+
+/**
+ * Runs the lanes of b, 8 at a time in lock-step, until at most two of them
+ * are still running (which is faster to finish with CpuRun). When a lane
+ * stops, the next one takes its place, so the vectors stay full even though
+ * the lanes run for different numbers of steps.
+ *
+ * Each step gathers the instruction and the Ra, Rb, and Rc registers of every
+ * lane, computes the result of each instruction (see CpuStep) for all of them,
+ * and selects one by opcode. Registers and memory are written with scalar
+ * stores since AVX2 can't scatter. Lanes executing an invalid instruction or
+ * an out-of-range access (which stops them) are stepped with CpuStep.
+ */
+__attribute__((target("avx2,popcnt")))
+static void BatchRunAvx2(Batch *b) {
+    const __m256i memsz = _mm256_set1_epi32((int)(b->memsz)), memmax = _mm256_set1_epi32((int)(b->memsz - 1));
+    const __m256i limit = _mm256_set1_epi32((int)(b->limit));
+    const __m256i stride = _mm256_set1_epi32((int)(b->n));
+    const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi32(1), ones = _mm256_set1_epi32(-1);
+    const int *mem = (const int*)(b->mem), *R = (const int*)(b->R);
+    BatchSlots s = {.halted = {1, 1, 1, 1, 1, 1, 1, 1}};
+    uint32_t next = 0;
+    unsigned active = 0;
+
+    #define LOAD(x)  _mm256_loadu_si256((const __m256i*)(s.x))
+    #define STORE(x) _mm256_storeu_si256((__m256i*)(s.x), x)
+    #define NOT(x)   _mm256_xor_si256(x, ones)
+    #define OP(k)    _mm256_cmpeq_epi32(op, _mm256_set1_epi32(k))
+    __m256i lane, base, PC, steps, halted, err, HI, LO, in, out, nout, hash;
+    #define LOAD_SLOTS() (lane = LOAD(lane), base = _mm256_mullo_epi32(lane, memsz), PC = LOAD(PC), steps = LOAD(steps), \
+        halted = NOT(_mm256_cmpeq_epi32(LOAD(halted), zero)), err = NOT(_mm256_cmpeq_epi32(LOAD(err), zero)), \
+        HI = LOAD(HI), LO = LOAD(LO), in = LOAD(in), out = LOAD(out), nout = LOAD(nout), hash = LOAD(hash))
+    #define STORE_SLOTS() (STORE(PC), STORE(steps), (halted = _mm256_and_si256(halted, one), STORE(halted)), \
+        STORE(HI), STORE(LO), STORE(out), STORE(nout), STORE(hash))
+
+    LOAD_SLOTS();
+    for (;;) {
+        __m256i run = NOT(_mm256_or_si256(_mm256_cmpeq_epi32(_mm256_min_epu32(steps, limit), limit), _mm256_or_si256(halted, err)));
+        unsigned mrun = (unsigned)(_mm256_movemask_ps(_mm256_castsi256_ps(run)));
+        if (mrun != active || (next < b->n && mrun != 0xFF)) {
+            STORE_SLOTS();
+            active = BatchSlotFill(b, &s, 8, active, mrun, &next);
+            if (next == b->n && __builtin_popcount(active) <= 2) {
+                BatchSlotFill(b, &s, 8, active, 0, &next);
+                break;
+            }
+            LOAD_SLOTS();
+            run = NOT(_mm256_or_si256(_mm256_cmpeq_epi32(_mm256_min_epu32(steps, limit), limit), _mm256_or_si256(halted, err)));
+        }
+
+        // fetch and decode (see isa374.txt)
+        __m256i fetch = _mm256_and_si256(run, _mm256_cmpeq_epi32(_mm256_min_epu32(PC, memmax), PC));
+        __m256i w = _mm256_mask_i32gather_epi32(zero, mem, _mm256_add_epi32(base, PC), fetch, 4);
+        __m256i op = _mm256_srli_epi32(w, 27);
+        __m256i ra = _mm256_and_si256(_mm256_srli_epi32(w, 23), _mm256_set1_epi32(15));
+        __m256i rb = _mm256_and_si256(_mm256_srli_epi32(w, 19), _mm256_set1_epi32(15));
+        __m256i rc = _mm256_and_si256(_mm256_srli_epi32(w, 15), _mm256_set1_epi32(15));
+        __m256i c2 = _mm256_and_si256(_mm256_srli_epi32(w, 19), _mm256_set1_epi32(3));
+        __m256i c = _mm256_srai_epi32(_mm256_slli_epi32(w, 13), 13);
+
+        // operands
+        __m256i va = _mm256_mask_i32gather_epi32(zero, R, _mm256_add_epi32(_mm256_mullo_epi32(ra, stride), lane), fetch, 4);
+        __m256i vb = _mm256_mask_i32gather_epi32(zero, R, _mm256_add_epi32(_mm256_mullo_epi32(rb, stride), lane), fetch, 4);
+        __m256i vc = _mm256_mask_i32gather_epi32(zero, R, _mm256_add_epi32(_mm256_mullo_epi32(rc, stride), lane), fetch, 4);
+        __m256i ea = _mm256_add_epi32(_mm256_andnot_si256(_mm256_cmpeq_epi32(rb, zero), vb), c);
+        __m256i ea_ok = _mm256_cmpeq_epi32(_mm256_min_epu32(ea, memmax), ea);
+        __m256i sh = _mm256_and_si256(vc, _mm256_set1_epi32(31)), rsh = _mm256_sub_epi32(_mm256_set1_epi32(32), sh);
+
+        // lanes which need CpuStep
+        __m256i slow = _mm256_or_si256(_mm256_cmpgt_epi32(op, _mm256_set1_epi32(27)), _mm256_andnot_si256(ea_ok, _mm256_or_si256(OP(0), OP(2))));
+        slow = _mm256_or_si256(_mm256_and_si256(fetch, slow), _mm256_andnot_si256(fetch, run));
+        __m256i fast = _mm256_andnot_si256(slow, run);
+
+        // register results (selected in groups to shorten the dependency chains)
+        __m256i y = _mm256_blendv_epi8(vc, c, _mm256_cmpgt_epi32(op, _mm256_set1_epi32(11)));
+        __m256i alu = _mm256_add_epi32(vb, y);
+        alu = _mm256_blendv_epi8(alu, _mm256_sub_epi32(vb, vc),                             OP(4));
+        alu = _mm256_blendv_epi8(alu, _mm256_and_si256(vb, y),                              _mm256_or_si256(OP(5), OP(13)));
+        alu = _mm256_blendv_epi8(alu, _mm256_or_si256(vb, y),                               _mm256_or_si256(OP(6), OP(14)));
+        __m256i shift = _mm256_srlv_epi32(vb, sh);
+        shift = _mm256_blendv_epi8(shift, _mm256_srav_epi32(vb, sh),                        OP(8));
+        shift = _mm256_blendv_epi8(shift, _mm256_sllv_epi32(vb, sh),                        OP(9));
+        shift = _mm256_blendv_epi8(shift, _mm256_or_si256(_mm256_srlv_epi32(vb, sh), _mm256_sllv_epi32(vb, rsh)), OP(10));
+        shift = _mm256_blendv_epi8(shift, _mm256_or_si256(_mm256_sllv_epi32(vb, sh), _mm256_srlv_epi32(vb, rsh)), OP(11));
+        __m256i misc = _mm256_sub_epi32(zero, vb);
+        misc = _mm256_blendv_epi8(misc, NOT(vb),                                            OP(18));
+        misc = _mm256_blendv_epi8(misc, ea,                                                 OP(1));
+        misc = _mm256_blendv_epi8(misc, _mm256_mask_i32gather_epi32(zero, mem, _mm256_add_epi32(base, ea), _mm256_and_si256(fast, OP(0)), 4), OP(0));
+        __m256i misc2 = _mm256_add_epi32(PC, one);
+        misc2 = _mm256_blendv_epi8(misc2, in,                                               OP(22));
+        misc2 = _mm256_blendv_epi8(misc2, HI,                                               OP(24));
+        misc2 = _mm256_blendv_epi8(misc2, LO,                                               OP(25));
+        __m256i v = _mm256_blendv_epi8(misc, misc2, _mm256_cmpgt_epi32(op, _mm256_set1_epi32(20)));
+        v = _mm256_blendv_epi8(v, alu, _mm256_and_si256(_mm256_cmpgt_epi32(op, _mm256_set1_epi32(2)), _mm256_cmpgt_epi32(_mm256_set1_epi32(15), op)));
+        v = _mm256_blendv_epi8(v, shift, _mm256_and_si256(_mm256_cmpgt_epi32(op, _mm256_set1_epi32(6)), _mm256_cmpgt_epi32(_mm256_set1_epi32(12), op)));
+        __m256i dst = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_blendv_epi8(ra, _mm256_set1_epi32(CPU_LINK), OP(21)), stride), lane);
+        __m256i write = _mm256_and_si256(fast, _mm256_or_si256(
+            _mm256_andnot_si256(OP(2), _mm256_cmpgt_epi32(_mm256_set1_epi32(15), op)),
+            _mm256_or_si256(_mm256_or_si256(OP(17), OP(18)), _mm256_or_si256(_mm256_or_si256(OP(21), OP(22)), _mm256_or_si256(OP(24), OP(25))))));
+        __m256i store = _mm256_and_si256(fast, OP(2));
+
+        // mul (the products of the even and odd lanes)
+        __m256i mul = _mm256_and_si256(fast, OP(15));
+        __m256i pe = _mm256_mul_epi32(va, vb), po = _mm256_mul_epi32(_mm256_srli_epi64(va, 32), _mm256_srli_epi64(vb, 32));
+        LO = _mm256_blendv_epi8(LO, _mm256_blend_epi32(pe, _mm256_slli_epi64(po, 32), 0xAA), mul);
+        HI = _mm256_blendv_epi8(HI, _mm256_blend_epi32(_mm256_srli_epi64(pe, 32), po, 0xAA), mul);
+
+        // div (exact in double, and -2^31/-1 converts to -2^31 like CpuStep)
+        __m256i div = _mm256_and_si256(fast, OP(16));
+        if (!_mm256_testz_si256(div, div)) {
+            __m128i q0 = _mm256_cvttpd_epi32(_mm256_div_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(va)), _mm256_cvtepi32_pd(_mm256_castsi256_si128(vb))));
+            __m128i q1 = _mm256_cvttpd_epi32(_mm256_div_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(va, 1)), _mm256_cvtepi32_pd(_mm256_extracti128_si256(vb, 1))));
+            __m256i q = _mm256_set_m128i(q1, q0), r = _mm256_sub_epi32(va, _mm256_mullo_epi32(q, vb)), z = _mm256_cmpeq_epi32(vb, zero);
+            LO = _mm256_blendv_epi8(LO, _mm256_blendv_epi8(q, ones, z), div);
+            HI = _mm256_blendv_epi8(HI, _mm256_blendv_epi8(r, va, z), div);
+        }
+
+        // out
+        __m256i wout = _mm256_and_si256(fast, OP(23));
+        out = _mm256_blendv_epi8(out, va, wout);
+        nout = _mm256_sub_epi32(nout, wout);
+        hash = _mm256_blendv_epi8(hash, _mm256_mullo_epi32(_mm256_xor_si256(hash, va), _mm256_set1_epi32(16777619)), wout);
+
+        // next pc
+        __m256i zr = _mm256_cmpeq_epi32(va, zero), mi = _mm256_cmpgt_epi32(zero, va);
+        __m256i taken = _mm256_blendv_epi8(
+            _mm256_blendv_epi8(zr, NOT(zr), _mm256_cmpeq_epi32(c2, one)),
+            _mm256_blendv_epi8(NOT(mi), mi, _mm256_cmpeq_epi32(c2, _mm256_set1_epi32(3))),
+            _mm256_cmpgt_epi32(c2, one));
+        __m256i npc = _mm256_add_epi32(PC, one);
+        npc = _mm256_blendv_epi8(npc, _mm256_add_epi32(npc, c), _mm256_and_si256(OP(19), taken));
+        npc = _mm256_blendv_epi8(npc, va, _mm256_or_si256(OP(20), OP(21)));
+        PC = _mm256_blendv_epi8(PC, npc, fast);
+        steps = _mm256_sub_epi32(steps, fast);
+        halted = _mm256_or_si256(halted, _mm256_and_si256(fast, OP(27)));
+
+        uint32_t x_dst[8], x_v[8];
+        _mm256_storeu_si256((__m256i*)(x_dst), dst);
+        _mm256_storeu_si256((__m256i*)(x_v), v);
+        for (int m = _mm256_movemask_ps(_mm256_castsi256_ps(write)); m; m &= m - 1)
+            b->R[x_dst[__builtin_ctz(m)]] = x_v[__builtin_ctz(m)];
+        _mm256_storeu_si256((__m256i*)(x_dst), _mm256_add_epi32(base, ea));
+        _mm256_storeu_si256((__m256i*)(x_v), va);
+        for (int m = _mm256_movemask_ps(_mm256_castsi256_ps(store)); m; m &= m - 1)
+            b->mem[x_dst[__builtin_ctz(m)]] = x_v[__builtin_ctz(m)];
+        if (!_mm256_testz_si256(slow, slow)) {
+            STORE_SLOTS();
+            BatchSlotStep(b, &s, (unsigned)(_mm256_movemask_ps(_mm256_castsi256_ps(slow))));
+            LOAD_SLOTS();
+        }
+    }
+    #undef LOAD
+    #undef STORE
+    #undef NOT
+    #undef OP
+    #undef LOAD_SLOTS
+    #undef STORE_SLOTS
+}
+
+/**
+ * Like BatchRunAvx2, but 16 lanes at a time, with masks instead of blends,
+ * and scatters for the writes.
+ */
+__attribute__((target("avx512f,popcnt")))
+static void BatchRunAvx512(Batch *b) {
+    const __m512i memsz = _mm512_set1_epi32((int)(b->memsz)), memmax = _mm512_set1_epi32((int)(b->memsz - 1));
+    const __m512i limit = _mm512_set1_epi32((int)(b->limit));
+    const __m512i stride = _mm512_set1_epi32((int)(b->n));
+    const __m512i zero = _mm512_setzero_si512(), one = _mm512_set1_epi32(1), ones = _mm512_set1_epi32(-1);
+    const __m512i r15 = _mm512_set1_epi32(15), r3 = _mm512_set1_epi32(3);
+    BatchSlots s = {.halted = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1}};
+    uint32_t next = 0;
+    unsigned active = 0;
+
+    #define LOAD(x)  _mm512_loadu_si512(s.x)
+    #define STORE(x) _mm512_storeu_si512(s.x, x)
+    #define OP(k)    _mm512_cmpeq_epi32_mask(op, _mm512_set1_epi32(k))
+    __m512i lane, base, PC, steps, HI, LO, in, out, nout, hash;
+    __mmask16 halted, err;
+    #define LOAD_SLOTS() (lane = LOAD(lane), base = _mm512_mullo_epi32(lane, memsz), PC = LOAD(PC), steps = LOAD(steps), \
+        halted = _mm512_test_epi32_mask(LOAD(halted), ones), err = _mm512_test_epi32_mask(LOAD(err), ones), \
+        HI = LOAD(HI), LO = LOAD(LO), in = LOAD(in), out = LOAD(out), nout = LOAD(nout), hash = LOAD(hash))
+    #define STORE_SLOTS() (STORE(PC), STORE(steps), _mm512_storeu_si512(s.halted, _mm512_maskz_mov_epi32(halted, one)), \
+        STORE(HI), STORE(LO), STORE(out), STORE(nout), STORE(hash))
+
+    LOAD_SLOTS();
+    for (;;) {
+        __mmask16 run = (__mmask16)(_mm512_cmplt_epu32_mask(steps, limit) & ~halted & ~err);
+        if (run != active || (next < b->n && run != 0xFFFF)) {
+            STORE_SLOTS();
+            active = BatchSlotFill(b, &s, 16, active, run, &next);
+            if (next == b->n && __builtin_popcount(active) <= 2) {
+                BatchSlotFill(b, &s, 16, active, 0, &next);
+                break;
+            }
+            LOAD_SLOTS();
+            run = (__mmask16)(_mm512_cmplt_epu32_mask(steps, limit) & ~halted & ~err);
+        }
+
+        // fetch and decode (see isa374.txt)
+        __mmask16 fetch = _mm512_mask_cmple_epu32_mask(run, PC, memmax);
+        __m512i w = _mm512_mask_i32gather_epi32(zero, fetch, _mm512_add_epi32(base, PC), b->mem, 4);
+        __m512i op = _mm512_srli_epi32(w, 27);
+        __m512i ra = _mm512_and_si512(_mm512_srli_epi32(w, 23), r15);
+        __m512i rb = _mm512_and_si512(_mm512_srli_epi32(w, 19), r15);
+        __m512i rc = _mm512_and_si512(_mm512_srli_epi32(w, 15), r15);
+        __m512i c2 = _mm512_and_si512(_mm512_srli_epi32(w, 19), r3);
+        __m512i c = _mm512_srai_epi32(_mm512_slli_epi32(w, 13), 13);
+
+        // operands
+        __m512i va = _mm512_mask_i32gather_epi32(zero, fetch, _mm512_add_epi32(_mm512_mullo_epi32(ra, stride), lane), b->R, 4);
+        __m512i vb = _mm512_mask_i32gather_epi32(zero, fetch, _mm512_add_epi32(_mm512_mullo_epi32(rb, stride), lane), b->R, 4);
+        __m512i vc = _mm512_mask_i32gather_epi32(zero, fetch, _mm512_add_epi32(_mm512_mullo_epi32(rc, stride), lane), b->R, 4);
+        __m512i ea = _mm512_add_epi32(_mm512_maskz_mov_epi32(_mm512_test_epi32_mask(rb, rb), vb), c);
+        __mmask16 ea_ok = _mm512_cmple_epu32_mask(ea, memmax);
+        __m512i sh = _mm512_and_si512(vc, _mm512_set1_epi32(31));
+
+        // lanes which need CpuStep
+        __mmask16 slow = (__mmask16)((fetch & (_mm512_cmpgt_epi32_mask(op, _mm512_set1_epi32(27)) | ((OP(0) | OP(2)) & ~ea_ok))) | (run & ~fetch));
+        __mmask16 fast = (__mmask16)(run & ~slow);
+
+        // register results
+        __m512i v = _mm512_mask_i32gather_epi32(zero, (__mmask16)(fast & OP(0)), _mm512_add_epi32(base, ea), b->mem, 4);
+        v = _mm512_mask_mov_epi32(v, OP(1), ea);
+        v = _mm512_mask_add_epi32(v, OP(3), vb, vc);
+        v = _mm512_mask_sub_epi32(v, OP(4), vb, vc);
+        v = _mm512_mask_and_epi32(v, OP(5), vb, vc);
+        v = _mm512_mask_or_epi32(v, OP(6), vb, vc);
+        v = _mm512_mask_srlv_epi32(v, OP(7), vb, sh);
+        v = _mm512_mask_srav_epi32(v, OP(8), vb, sh);
+        v = _mm512_mask_sllv_epi32(v, OP(9), vb, sh);
+        v = _mm512_mask_rorv_epi32(v, OP(10), vb, sh);
+        v = _mm512_mask_rolv_epi32(v, OP(11), vb, sh);
+        v = _mm512_mask_add_epi32(v, OP(12), vb, c);
+        v = _mm512_mask_and_epi32(v, OP(13), vb, c);
+        v = _mm512_mask_or_epi32(v, OP(14), vb, c);
+        v = _mm512_mask_sub_epi32(v, OP(17), zero, vb);
+        v = _mm512_mask_xor_epi32(v, OP(18), vb, ones);
+        v = _mm512_mask_add_epi32(v, OP(21), PC, one);
+        v = _mm512_mask_mov_epi32(v, OP(22), in);
+        v = _mm512_mask_mov_epi32(v, OP(24), HI);
+        v = _mm512_mask_mov_epi32(v, OP(25), LO);
+        __m512i dst = _mm512_add_epi32(_mm512_mullo_epi32(_mm512_mask_mov_epi32(ra, OP(21), _mm512_set1_epi32(CPU_LINK)), stride), lane);
+        __mmask16 write = (__mmask16)(fast & ((_mm512_cmplt_epi32_mask(op, _mm512_set1_epi32(15)) & ~OP(2)) | OP(17) | OP(18) | OP(21) | OP(22) | OP(24) | OP(25)));
+        _mm512_mask_i32scatter_epi32(b->R, write, dst, v, 4);
+        _mm512_mask_i32scatter_epi32(b->mem, (__mmask16)(fast & OP(2)), _mm512_add_epi32(base, ea), va, 4);
+
+        // mul (the products of the even and odd lanes)
+        __mmask16 mul = (__mmask16)(fast & OP(15));
+        __m512i pe = _mm512_mul_epi32(va, vb), po = _mm512_mul_epi32(_mm512_srli_epi64(va, 32), _mm512_srli_epi64(vb, 32));
+        LO = _mm512_mask_mov_epi32(LO, mul, _mm512_mask_blend_epi32(0xAAAA, pe, _mm512_slli_epi64(po, 32)));
+        HI = _mm512_mask_mov_epi32(HI, mul, _mm512_mask_blend_epi32(0xAAAA, _mm512_srli_epi64(pe, 32), po));
+
+        // div (exact in double, and -2^31/-1 converts to -2^31 like CpuStep)
+        __mmask16 div = (__mmask16)(fast & OP(16));
+        if (div) {
+            __m256i q0 = _mm512_cvttpd_epi32(_mm512_div_pd(_mm512_cvtepi32_pd(_mm512_castsi512_si256(va)), _mm512_cvtepi32_pd(_mm512_castsi512_si256(vb))));
+            __m256i q1 = _mm512_cvttpd_epi32(_mm512_div_pd(_mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(va, 1)), _mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(vb, 1))));
+            __m512i q = _mm512_inserti64x4(_mm512_castsi256_si512(q0), q1, 1);
+            __mmask16 z = _mm512_cmpeq_epi32_mask(vb, zero);
+            LO = _mm512_mask_mov_epi32(LO, div, _mm512_mask_mov_epi32(q, z, ones));
+            HI = _mm512_mask_mov_epi32(HI, div, _mm512_mask_mov_epi32(_mm512_sub_epi32(va, _mm512_mullo_epi32(q, vb)), z, va));
+        }
+
+        // out
+        __mmask16 wout = (__mmask16)(fast & OP(23));
+        out = _mm512_mask_mov_epi32(out, wout, va);
+        nout = _mm512_mask_add_epi32(nout, wout, nout, one);
+        hash = _mm512_mask_mullo_epi32(hash, wout, _mm512_xor_si512(hash, va), _mm512_set1_epi32(16777619));
+
+        // next pc
+        __mmask16 zr = _mm512_cmpeq_epi32_mask(va, zero), mi = _mm512_cmplt_epi32_mask(va, zero);
+        __mmask16 taken = (__mmask16)((_mm512_cmpeq_epi32_mask(c2, zero) & zr) | (_mm512_cmpeq_epi32_mask(c2, one) & ~zr) |
+            (_mm512_cmpeq_epi32_mask(c2, _mm512_set1_epi32(2)) & ~mi) | (_mm512_cmpeq_epi32_mask(c2, r3) & mi));
+        __m512i npc = _mm512_add_epi32(PC, one);
+        npc = _mm512_mask_add_epi32(npc, (__mmask16)(OP(19) & taken), npc, c);
+        npc = _mm512_mask_mov_epi32(npc, (__mmask16)(OP(20) | OP(21)), va);
+        PC = _mm512_mask_mov_epi32(PC, fast, npc);
+        steps = _mm512_mask_add_epi32(steps, fast, steps, one);
+        halted = (__mmask16)(halted | (fast & OP(27)));
+
+        if (slow) {
+            STORE_SLOTS();
+            BatchSlotStep(b, &s, slow);
+            LOAD_SLOTS();
+        }
+    }
+    #undef LOAD
+    #undef STORE
+    #undef OP
+    #undef LOAD_SLOTS
+    #undef STORE_SLOTS
+}
+#endif
+
+/**
+ * Runs the lanes of b until they all stop, with impl if it's supported (and
+ * the memory of the lanes can be addressed with 32-bit gather offsets), or
+ * one after another with CpuRun otherwise. The AVX2 gathers are slower than
+ * CpuRun, so BatchImpl_Auto only uses AVX-512.
+ */
+static void BatchRun(Batch *b) {
+#if defined(HAVE_IMMINTRIN)
+    if (b->memsz && (uint64_t)(b->n)*b->memsz <= INT32_MAX) {
+        if ((b->impl == BatchImpl_Auto || b->impl == BatchImpl_Avx512) && __builtin_cpu_supports("avx512f"))
+            BatchRunAvx512(b);
+        else if (b->impl == BatchImpl_Avx2 && __builtin_cpu_supports("avx2"))
+            BatchRunAvx2(b);
+    }
+#endif
+    for (uint32_t l = 0; l < b->n; l++) {
+        if (!b->err[l] && !b->halted[l] && b->steps[l] < b->limit) {
+            Cpu c;
+            BatchLoad(b, l, &c);
+            Error err = CpuRun(&c, b->limit);
+            BatchStore(b, l, &c, err);
+        }
+    }
+}
+
+/**
+ * Cache replacement policies.
+ */
+typedef enum CachePolicy {
+    CachePolicy_LRU,    // least recently used
+    CachePolicy_FIFO,   // oldest fill
+    CachePolicy_Random,
+    CachePolicyCount,
+} CachePolicy;
+
+/**
+ * Gets the name of a CachePolicy.
+ */
+static const char *GetCachePolicy(CachePolicy p) {
+    switch (p) {
+    case CachePolicy_LRU:    return "lru";
+    case CachePolicy_FIFO:   return "fifo";
+    case CachePolicy_Random: return "random";
+    default:                 return NULL;
+    }
+}
+
+/**
+ * Geometry of a Cache in words (the CPU addresses words). Each value must be a
+ * power of two, and the size must be at least ways*line.
+ */
+typedef struct CacheConfig {
+    uint32_t    size;
+    uint32_t    ways;
+    uint32_t    line;
+    CachePolicy policy;
+} CacheConfig;
+
+#define CACHE_VALID 1
+#define CACHE_DIRTY 2
+
+/**
+ * Model of a write-back, write-allocate, set-associative cache, which only
+ * tracks tags. Block b of set s is at index s*ways + b of the caller-provided
+ * arrays, which have size/line elements.
+ */
+typedef struct Cache {
+    CacheConfig cfg;
+    uint32_t    line_bits;
+    uint32_t    set_mask;
+    uint32_t   *tag;        // line address
+    uint64_t   *used;       // time of the last access (LRU) or fill (FIFO)
+    uint8_t    *state;      // CACHE_VALID, CACHE_DIRTY
+    uint64_t    time;       // accesses
+    uint32_t    rng;        // for CachePolicy_Random
+    uint64_t    hits;
+    uint64_t    misses;
+    uint64_t    writebacks; // dirty lines evicted
+} Cache;
+
+/**
+ * Gets the number of blocks in a cache with cfg.
+ */
+static uint32_t CacheBlocks(CacheConfig cfg) {
+    return cfg.line ? cfg.size / cfg.line : 0;
+}
+
+/**
+ * Sets up an empty cache with cfg, returning Error_Cache_Config if it's
+ * invalid.
+ */
+static Error CacheInit(Cache *c, CacheConfig cfg, uint32_t *tag, uint64_t *used, uint8_t *state) {
+    #define POW2(x) ((x) && !((x) & ((x) - 1)))
+    if (!POW2(cfg.size) || !POW2(cfg.ways) || !POW2(cfg.line) || cfg.size / cfg.line < cfg.ways || (uint32_t)(cfg.policy) >= CachePolicyCount)
+        return Error_Cache_Config;
+    #undef POW2
+    *c = (Cache){
+        .cfg      = cfg,
+        .set_mask = cfg.size / cfg.line / cfg.ways - 1,
+        .tag      = tag,
+        .used     = used,
+        .state    = state,
+        .rng      = 1,
+    };
+    while (1u << c->line_bits < cfg.line)
+        c->line_bits++;
+    for (uint32_t i = 0; i < CacheBlocks(cfg); i++)
+        state[i] = 0;
+    return NoError;
+}
+
+/**
+ * Accesses the word at addr, returning true if it was a hit.
+ */
+static bool CacheAccess(Cache *c, uint32_t addr, bool write) {
+    uint32_t line = addr >> c->line_bits, ways = c->cfg.ways;
+    uint32_t *tag = c->tag + (line & c->set_mask) * ways;
+    uint64_t *used = c->used + (tag - c->tag);
+    uint8_t *state = c->state + (tag - c->tag);
+    c->time++;
+    for (uint32_t b = 0; b < ways; b++) {
+        if ((state[b] & CACHE_VALID) && tag[b] == line) {
+            if (c->cfg.policy == CachePolicy_LRU)
+                used[b] = c->time;
+            if (write)
+                state[b] |= CACHE_DIRTY;
+            c->hits++;
+            return true;
+        }
+    }
+
+    uint32_t v = 0;
+    while (v < ways && (state[v] & CACHE_VALID))
+        v++;
+    if (v == ways) {
+        if (c->cfg.policy == CachePolicy_Random) {
+            c->rng ^= c->rng << 13;
+            c->rng ^= c->rng >> 17;
+            c->rng ^= c->rng << 5;
+            v = c->rng & (ways - 1);
+        } else {
+            v = 0;
+            for (uint32_t b = 1; b < ways; b++)
+                if (used[b] < used[v])
+                    v = b;
+        }
+        if (state[v] & CACHE_DIRTY)
+            c->writebacks++;
+    }
+    tag[v] = line;
+    used[v] = c->time;
+    state[v] = CACHE_VALID | (write ? CACHE_DIRTY : 0);
+    c->misses++;
+    return false;
+}
+
+#if defined(__wasm__)
+#define export __attribute__((visibility("default")))
+
+// https://webassembly.org/roadmap/
+// https://clang.llvm.org/doxygen/Basic_2Targets_2WebAssembly_8cpp_source.html
+
+extern unsigned char __heap_base; // from wasm-ld
+
+static uintptr_t arena_top;  // end of the allocations
+static uintptr_t arena_mark; // end of the allocations which outlive a call
+
+/**
+ * Allocates n items of size bytes at the end of memory, growing it if needed,
+ * or returns NULL.
+ */
+static void *arena_alloc(size_t n, size_t size) {
+    if (!arena_top)
+        arena_top = arena_mark = (uintptr_t)(&__heap_base);
+    if (size && n > SIZE_MAX / size)
+        return NULL;
+    uintptr_t p = (arena_top + 15) & ~(uintptr_t)(15);
+    if (p < arena_top || n * size > SIZE_MAX - p)
+        return NULL;
+    uintptr_t end = p + n * size;
+    uintptr_t cur = __builtin_wasm_memory_size(0) * 65536;
+    if (end > cur && __builtin_wasm_memory_grow(0, (end - cur + 65535) / 65536) == SIZE_MAX)
+        return NULL;
+    arena_top = end;
+    return (void*)(p);
+}
+
+static const char *res;     // output of the last call
+static size_t      res_len;
+static int         line;
+static IncProg     inc;
+static SrcMap      map;     // of the last prog_assemble, until reset
+static uint32_t   *image;   // of the last prog_assemble, until reset
+static size_t      image_n;
+
+/**
+ * Frees everything allocated since the last call to prog_init. Memory is not
+ * returned to the host, but it is reused by the next allocations.
+ */
+export void reset(void) {
+    arena_top = arena_mark;
+    res = NULL;
+    res_len = 0;
+    map.len = 0;
+    image_n = 0;
+}
+
+/**
+ * Allocates n bytes for the input of the next call, returning NULL if there
+ * isn't enough memory. The input must be followed by room for a null
+ * terminator.
+ */
+export void *alloc(size_t n) {
+    return arena_alloc(n, 1);
+}
+
+export const char *result(void) {
+    return res;
+}
+
+export size_t result_len(void) {
+    return res_len;
+}
+
+export const char *error(Error err) {
+    return GetError(err);
+}
+
+export Error disassemble(char *str, size_t len) {
+    char *out = arena_alloc(512, 1);
+    if (!out)
+        return Error_Prog_TooMany;
+    str[len] = '\0';
+    Error err = Disassemble(out, str);
+    res_len = str_len(res = out);
+    return err;
+}
+
+export Error assemble(char *str, size_t len) {
+    char *out = arena_alloc(9, 1);
+    if (!out)
+        return Error_Prog_TooMany;
+    str[len] = '\0';
+    Error err = Assemble(out, str);
+    res_len = str_len(res = out);
+    return err;
+}
+
+export Error explain(char *str, size_t len) {
+    char *out = arena_alloc(512, 1);
+    if (!out)
+        return Error_Prog_TooMany;
+    str[len] = '\0';
+    Error err = Explain(out, str);
+    res_len = str_len(res = out);
+    return err;
+}
+
+export Error prog_assemble(char *str, size_t len, uint32_t memsz) {
+    str[len] = '\0';
+    Prog prog = {
+        .len     = 0,
+        .cap     = len / 2 + 1, // a token is at least 2 bytes ("a:", "nop\n")
+        .tok     = arena_alloc(len / 2 + 1, sizeof(ProgTok)),
+        .sec_len = 0,
+        .sec_cap = len / 10 + 1, // "SECTION a\n"
+        .sec     = arena_alloc(len / 10 + 1, sizeof(ProgSec)),
+    };
+    uint32_t *img = arena_alloc(memsz, sizeof(uint32_t));
+    char *out = arena_alloc(memsz, 9);
+    if (!prog.tok || !prog.sec || !img || !out)
+        return Error_Prog_TooMany;
+
+    Error err;
+    if ((err = SplitProg(&prog, str, &line)))
+        return err;
+    if ((err = LayoutProg(&prog, img, memsz, &line)))
+        return err;
+    if ((err = AssembleProg(prog, img, memsz, &line)))
+        return err;
+    STAT_BEGIN(Format);
+    for (uint32_t i = 0; i < memsz; i++)
+        *u32be_tohex(&out[i*9], img[i]) = i+1 == memsz ? '\0' : (i+1)%8 == 0 ? '\n' : ' ';
+    res = out;
+    res_len = memsz ? memsz*9 - 1 : 0;
+    STAT_END(Format);
+    STAT_ADD(bytes_out, res_len);
+    image = img;
+    image_n = memsz;
+
+    map = (SrcMap){
+        .len   = 0,
+        .cap   = prog.len,
+        .line  = arena_alloc(prog.len, sizeof(int)),
+        .addr  = arena_alloc(prog.len, sizeof(uint32_t)),
+        .count = arena_alloc(prog.len, sizeof(uint32_t)),
+        .order = arena_alloc(prog.len, sizeof(uint32_t)),
+    };
+    if (!map.line || !map.addr || !map.count || !map.order)
+        map.cap = 0;
+    return SrcMapProg(&map, prog);
+}
+
+/**
+ * Writes the image from the last prog_assemble in fmt.
+ */
+export Error image_write(ImageFormat fmt) {
+    STAT_BEGIN(Format);
+    ImageBuf buf = {NULL, 0};
+    if (!WriteImage(fmt, image, image_n, (ImageSink){.data = &buf, .write = ImageBuf_write}))
+        return Error_Mem_Format;
+    if (!(buf.buf = arena_alloc(buf.len + 1, 1)))
+        return Error_Prog_TooMany;
+    buf.len = 0;
+    WriteImage(fmt, image, image_n, (ImageSink){.data = &buf, .write = ImageBuf_write});
+    res = buf.buf;
+    res_len = buf.len;
+    STAT_END(Format);
+    STAT_ADD(bytes_out, buf.len);
+    return NoError;
+}
+
+export size_t map_len(void) {
+    return map.len;
+}
+
+export int *map_lines(void) {
+    return map.line;
+}
+
+export uint32_t *map_addrs(void) {
+    return map.addr;
+}
+
+export uint32_t *map_counts(void) {
+    return map.count;
+}
+
+export uint32_t *map_order(void) {
+    return map.order;
+}
+
+export int map_line(uint32_t addr) {
+    return SrcMapLine(&map, addr);
+}
+
+/**
+ * Gets the first address assembled from line, or ~0.
+ */
+export uint32_t map_addr(int line) {
+    uint32_t addr;
+    return SrcMapAddr(&map, line, &addr, NULL) ? addr : ~(uint32_t)(0);
+}
+
+export uint32_t map_count(int line) {
+    uint32_t count;
+    return SrcMapAddr(&map, line, NULL, &count) ? count : 0;
+}
+
+export uint32_t prog_curline(void) {
+    return line;
+}
+
+/**
+ * Assembles a program like prog_assemble, but finds every error. The result is
+ * the line, start column, end column, and error code of each, as four
+ * uint32_t, sorted by line. Returns the number of errors, or ~0 on failure.
+ */
+export uint32_t prog_diagnose(char *str, size_t len, uint32_t memsz) {
+    str[len] = '\0';
+    size_t nline = 1;
+    for (size_t i = 0; i < len; i++)
+        nline += str[i] == '\n';
+    Prog prog = {
+        .len     = 0,
+        .cap     = len / 2 + 1,
+        .tok     = arena_alloc(len / 2 + 1, sizeof(ProgTok)),
+        .sec_len = 0,
+        .sec_cap = len / 10 + 1,
+        .sec     = arena_alloc(len / 10 + 1, sizeof(ProgSec)),
+    };
+    Diags diag = {
+        .len  = 0,
+        .cap  = nline * 2 + 1, // split and assembly errors, or a fatal one
+        .diag = arena_alloc(nline * 2 + 1, sizeof(Diag)),
+    };
+    uint32_t *img = arena_alloc(memsz, sizeof(uint32_t));
+    uint32_t *out = arena_alloc(nline * 2 + 1, 4 * sizeof(uint32_t));
+    if (!prog.tok || !prog.sec || !diag.diag || !img || !out)
+        return ~(uint32_t)(0);
+
+    DiagnoseProg(&prog, str, img, memsz, &diag);
+    for (size_t i = 0; i < diag.len && i < diag.cap; i++) {
+        out[i*4+0] = (uint32_t)(diag.diag[i].line);
+        out[i*4+1] = diag.diag[i].col;
+        out[i*4+2] = diag.diag[i].end;
+        out[i*4+3] = diag.diag[i].err;
+    }
+    res = (const char*)(out);
+    res_len = (diag.len < diag.cap ? diag.len : diag.cap) * 4 * sizeof(uint32_t);
+    return (uint32_t)(diag.len);
+}
+
+/**
+ * Disassembles a memory image ($readmemh or MIF) into source which assembles
+ * back into it. On error, prog_curline is the line of the memory file.
+ */
+export Error image_disassemble(char *str, size_t len) {
+    str[len] = '\0';
+    size_t n;
+    Error err;
+    if ((err = ReadImage(str, NULL, UINT32_MAX, &n, &line)))
+        return err;
+    uint32_t *img = arena_alloc(n, sizeof(uint32_t));
+    uint8_t *tgt = arena_alloc(n, 1);
+    char *out = arena_alloc(n + 1, 64);
+    if (!img || !tgt || !out)
+        return Error_Prog_TooMany;
+    if ((err = ReadImage(str, img, n, &n, &line)))
+        return err;
+    res = out;
+    res_len = (size_t)(DisassembleImage(out, img, n, tgt) - out);
+    return NoError;
+}
+
+/**
+ * Frees all memory, then sets up an empty program for prog_edit with room for
+ * nsrc bytes of source in nline lines, and an image of memsz words.
+ */
+export Error prog_init(uint32_t memsz, uint32_t nline, uint32_t nsrc) {
+    size_t ntok = nsrc / 2 + 1;
+    size_t ntab = 1;
+    while (ntab <= ntok)
+        ntab *= 2;
+
+    arena_top = arena_mark = (uintptr_t)(&__heap_base);
+    inc = (IncProg){
+        .prog     = {
+            .len     = 0,
+            .cap     = ntok,
+            .tok     = arena_alloc(ntok, sizeof(ProgTok)),
+            .sec_len = 0,
+            .sec_cap = nsrc / 10 + 1, // "SECTION a\n"
+            .sec     = arena_alloc(nsrc / 10 + 1, sizeof(ProgSec)),
+        },
+        .info     = arena_alloc(ntok, sizeof(IncTok)),
+        .line_cap = nline,
+        .line     = arena_alloc(nline, sizeof(IncLine)),
+        .src_cap  = nsrc,
+        .src      = arena_alloc(nsrc, 1),
+        .raw      = arena_alloc(nsrc, 1),
+        .tab_n    = ntab,
+        .tab      = arena_alloc(ntab, sizeof(uint32_t)),
+        .out_n    = memsz,
+        .out      = arena_alloc(memsz, sizeof(uint32_t)),
+        .tmp      = arena_alloc(memsz, sizeof(uint32_t)),
+        .occ      = arena_alloc(memsz, 1),
+        .lin      = arena_alloc(memsz, sizeof(uint32_t)),
+        .chg      = arena_alloc(memsz, sizeof(uint32_t)),
+    };
+    if (!inc.prog.tok || !inc.prog.sec || !inc.info || !inc.line || !inc.src || !inc.raw || !inc.tab || !inc.out || !inc.tmp || !inc.occ || !inc.lin || !inc.chg) {
+        inc.out = NULL;
+        arena_top = arena_mark = (uintptr_t)(&__heap_base);
+        return Error_Prog_TooMany;
+    }
+    arena_mark = arena_top;
+    IncProgReset(&inc);
+    return NoError;
+}
+
+export Error prog_edit(uint32_t first, uint32_t nold, uint32_t nnew, char *text, size_t len) {
+    if (!inc.out)
+        return Error_Prog_OutOfRange;
+    text[len] = '\0';
+    return IncProgEdit(&inc, first, nold, text, nnew, &line);
+}
+
+export bool prog_broken(void) {
+    return inc.broken;
+}
+
+export uint32_t *prog_image(void) {
+    return inc.out;
+}
+
+export uint32_t *prog_lines(void) {
+    return inc.lin;
+}
+
+export uint32_t *prog_changed(void) {
+    return inc.chg;
+}
+
+export size_t prog_changed_len(void) {
+    return inc.chg_len;
+}
+
+#if defined(STATS)
+/**
+ * Gets the Stats collected since the last stats_reset.
+ */
+export Stats *stats(void) {
+    return &stats_total;
+}
+
+export void stats_reset(void) {
+    stats_total = (Stats){0};
+}
+#endif
+
+#else
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static bool is_interactive(void) {
+#ifdef _WIN32
+    return _isatty(_fileno(stdin));
+#else
+    return isatty(STDIN_FILENO);
+#endif
+}
+
+/**
+ * Returns the current monotonic time in nanoseconds.
+ */
+static uint64_t now_ns(void) {
+#ifdef _WIN32
+    LARGE_INTEGER c, f;
+    QueryPerformanceCounter(&c);
+    QueryPerformanceFrequency(&f);
+    return (uint64_t)(c.QuadPart / f.QuadPart) * 1000000000 + (uint64_t)(c.QuadPart % f.QuadPart) * 1000000000 / (uint64_t)(f.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec) * 1000000000 + (uint64_t)(ts.tv_nsec);
+#endif
+}
+
+/**
+ * Returns the number of online processors, or 1 if unknown.
+ */
+static uint32_t num_cpus(void) {
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors ? (uint32_t)(si.dwNumberOfProcessors) : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (uint32_t)(n) : 1;
+#endif
+}
+
+#define MAX_THREADS 64
+
+typedef struct run_threads_arg {
+    void (*fn)(void *data, uint32_t t);
+    void *data;
+    uint32_t t;
+} run_threads_arg;
+
+#ifdef _WIN32
+static DWORD WINAPI run_threads_start(LPVOID p) {
+    run_threads_arg *a = p;
+    a->fn(a->data, a->t);
+    return 0;
+}
+#else
+static void *run_threads_start(void *p) {
+    run_threads_arg *a = p;
+    a->fn(a->data, a->t);
+    return NULL;
+}
+#endif
+
+/**
+ * Calls fn(data, t) for each t < n (at most MAX_THREADS) on separate threads,
+ * returning when all of them are done. If a thread can't be started, fn is
+ * called on the current thread instead.
+ */
+static void run_threads(uint32_t n, void (*fn)(void *data, uint32_t t), void *data) {
+    run_threads_arg arg[MAX_THREADS];
+#ifdef _WIN32
+    HANDLE th[MAX_THREADS];
+#else
+    pthread_t th[MAX_THREADS];
+#endif
+    bool ok[MAX_THREADS];
+    if (n > MAX_THREADS)
+        n = MAX_THREADS;
+    for (uint32_t t = 1; t < n; t++) {
+        arg[t] = (run_threads_arg){fn, data, t};
+#ifdef _WIN32
+        ok[t] = (th[t] = CreateThread(NULL, 0, run_threads_start, &arg[t], 0, NULL)) != NULL;
+#else
+        ok[t] = !pthread_create(&th[t], NULL, run_threads_start, &arg[t]);
+#endif
+        if (!ok[t])
+            fn(data, t);
+    }
+    fn(data, 0);
+    for (uint32_t t = 1; t < n; t++) {
+        if (ok[t]) {
+#ifdef _WIN32
+            WaitForSingleObject(th[t], INFINITE);
+            CloseHandle(th[t]);
+#else
+            pthread_join(th[t], NULL);
+#endif
+        }
+    }
+}
+
+/**
+ * Reads the entire file at path into a null-terminated buffer allocated with
+ * malloc, returning NULL on error.
+ */
+static char *read_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+    size_t n = 0, cap = 4096;
+    char *buf = malloc(cap);
+    while (buf) {
+        n += fread(buf + n, 1, cap - n - 1, f);
+        if (n < cap - 1)
+            break;
+        char *tmp = realloc(buf, cap *= 2);
+        if (!tmp)
+            free(buf);
+        buf = tmp;
+    }
+    if (buf && ferror(f)) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    if (buf) {
+        buf[n] = '\0';
+        if (len)
+            *len = n;
+    }
+    return buf;
+}
+
+/**
+ * Maps the file at path read-only into memory, returning false on error. The
+ * mapping is valid until the process exits.
+ */
+static bool map_file(const char *path, const uint8_t **buf, size_t *len) {
+#ifdef _WIN32
+    HANDLE f = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (f == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER sz;
+    if (!GetFileSizeEx(f, &sz) || (uint64_t)(sz.QuadPart) > SIZE_MAX) {
+        CloseHandle(f);
+        return false;
+    }
+    *buf = NULL;
+    *len = (size_t)(sz.QuadPart);
+    if (*len) {
+        HANDLE m = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (m) {
+            *buf = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(m);
+        }
+    }
+    CloseHandle(f);
+    return !*len || *buf;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) || (uint64_t)(st.st_size) > SIZE_MAX) {
+        close(fd);
+        return false;
+    }
+    *buf = NULL;
+    *len = (size_t)(st.st_size);
+    if (*len) {
+        void *m = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED)
+            *buf = m;
+    }
+    close(fd);
+    return !*len || *buf;
+#endif
+}
+
+/**
+ * Loads INCBIN files relative to the directory containing the source file
+ * (data).
+ */
+static Error incbin_load(const char *path, const uint8_t **buf, size_t *len, const void *data) {
+    const char *src = data, *dir = src;
+    for (const char *c = src; src && *c; c++)
+        if (*c == '/' || *c == '\\')
+            dir = c + 1;
+    if (*path == '/' || *path == '\\' || (*path && path[1] == ':'))
+        dir = src;
+
+    char tmp[4096];
+    size_t n = (size_t)(dir - src);
+    if (n >= sizeof(tmp))
+        return Error_Prog_ReadFile;
+    for (size_t i = 0; i < n; i++)
+        tmp[i] = src[i];
+    if (!str_ecpyn(tmp + n, path, sizeof(tmp) - n))
+        return Error_Prog_ReadFile;
+    if (!map_file(tmp, buf, len))
+        return Error_Prog_ReadFile;
+    return NoError;
+}
+
+/**
+ * Computes the 64-bit FNV-1a hash of buf, continuing from h (which should
+ * initially be 0xCBF29CE484222325).
+ */
+static uint64_t fnv1a64(uint64_t h, const void *buf, size_t len) {
+    for (const uint8_t *b = buf, *e = b + len; b < e; b++)
+        h = (h ^ *b) * 0x100000001B3;
+    return h;
+}
+
+static uint8_t *put_uvarint(uint8_t *b, uint64_t v) {
+    for (; v >= 0x80; v >>= 7)
+        *b++ = (uint8_t)(v) | 0x80;
+    *b++ = (uint8_t)(v);
+    return b;
+}
+
+static const uint8_t *get_uvarint(const uint8_t *b, const uint8_t *e, uint64_t *v) {
+    *v = 0;
+    for (int s = 0; b && b < e && s < 64; s += 7) {
+        *v |= (uint64_t)(*b & 0x7F) << s;
+        if (!(*b++ & 0x80))
+            return b;
+    }
+    return NULL;
+}
+
+/**
+ * Encodes obj into a buffer allocated with malloc, returning NULL if out of
+ * memory.
+ *
+ * The format is:
+ * - magic "A374", version 2
+ * - uvarint size
+ * - uvarint number of chunks, then each chunk as:
+ *   - uvarint number of zero words since the previous chunk
+ *   - uvarint word count, then the big-endian words
+ * - uvarint number of symbols, then each symbol as:
+ *   - uvarint value+1 (zero if undefined)
+ *   - uvarint section
+ *   - null-terminated name
+ * - uvarint number of sections, then each section (following the words
+ *   outside sections, and each other) as:
+ *   - uvarint align
+ *   - uvarint addr+1 (zero if not fixed)
+ *   - uvarint size<<1 | attr
+ *   - null-terminated name
+ * - uvarint number of relocations, then each relocation as:
+ *   - zigzag uvarint offset delta from the previous relocation
+ *   - uvarint sym<<1 | rel
+ */
+static uint8_t *obj_encode(const Obj *obj, size_t *len) {
+    size_t cap = 5 + 10*4 + (size_t)(obj->size)*24 + obj->reloc_len*20;
+    for (size_t i = 0; i < obj->sym_len; i++)
+        cap += 20 + str_len(obj->sym[i].name) + 1;
+    for (size_t i = 0; i < obj->sec_len; i++)
+        cap += 30 + str_len(obj->sec[i].name) + 1;
+    cap += 10;
+
+    uint8_t *buf = malloc(cap), *b = buf;
+    if (!buf)
+        return NULL;
+
+    *b++ = 'A'; *b++ = '3'; *b++ = '7'; *b++ = '4'; *b++ = 2;
+    b = put_uvarint(b, obj->size);
+
+    // split the words into chunks wherever there's more than one zero
+    uint64_t nchunk = 0;
+    uint8_t *b_nchunk = b;
+    b += 5;
+    for (uint32_t i = 0, p = 0; i < obj->size; ) {
+        if (!obj->word[i]) {
+            i++;
+            continue;
+        }
+        uint32_t j = i;
+        while (j < obj->size && (obj->word[j] || (j+1 < obj->size && obj->word[j+1])))
+            j++;
+        b = put_uvarint(put_uvarint(b, i - p), j - i);
+        for (; i < j; i++) {
+            *b++ = (uint8_t)(obj->word[i] >> 24);
+            *b++ = (uint8_t)(obj->word[i] >> 16);
+            *b++ = (uint8_t)(obj->word[i] >> 8);
+            *b++ = (uint8_t)(obj->word[i]);
+        }
+        p = j;
+        nchunk++;
+    }
+    for (int i = 0; i < 5; i++, nchunk >>= 7) // fixed-width uvarint
+        b_nchunk[i] = (uint8_t)(nchunk & 0x7F) | (i < 4 ? 0x80 : 0);
+
+    b = put_uvarint(b, obj->sym_len);
+    for (size_t i = 0; i < obj->sym_len; i++) {
+        b = put_uvarint(b, ((uint64_t)(obj->sym[i].value) + 1) & 0xFFFFFFFF);
+        b = put_uvarint(b, obj->sym[i].section);
+        b = (uint8_t*)(str_ecpy((char*)(b), obj->sym[i].name)) + 1;
+    }
+
+    b = put_uvarint(b, obj->sec_len);
+    for (size_t i = 0; i < obj->sec_len; i++) {
+        b = put_uvarint(b, obj->sec[i].align);
+        b = put_uvarint(b, ((uint64_t)(obj->sec[i].addr) + 1) & 0xFFFFFFFF);
+        b = put_uvarint(b, (uint64_t)(obj->sec[i].size) << 1 | obj->sec[i].attr);
+        b = (uint8_t*)(str_ecpy((char*)(b), obj->sec[i].name)) + 1;
+    }
+
+    b = put_uvarint(b, obj->reloc_len);
+    for (size_t i = 0, p = 0; i < obj->reloc_len; p = obj->reloc[i++].offset) {
+        int64_t d = (int64_t)(obj->reloc[i].offset) - (int64_t)(p);
+        b = put_uvarint(b, (uint64_t)(d) << 1 ^ (d < 0 ? ~(uint64_t)(0) : 0));
+        b = put_uvarint(b, (uint64_t)(obj->reloc[i].sym) << 1 | obj->reloc[i].rel);
+    }
+
+    *len = (size_t)(b - buf);
+    return buf;
+}
+
+/**
+ * Decodes an object from buf, allocating the arrays with malloc. The symbol
+ * names point into buf. Returns false if the object is invalid or out of
+ * memory.
+ */
+static bool obj_decode(Obj *obj, const uint8_t *buf, size_t len) {
+    const uint8_t *b = buf, *e = buf + len;
+    uint64_t v, n;
+
+    *obj = (Obj){0};
+    if (len < 5 || b[0] != 'A' || b[1] != '3' || b[2] != '7' || b[3] != '4' || b[4] != 2)
+        return false;
+    b += 5;
+
+    if (!(b = get_uvarint(b, e, &v)) || v > UINT32_MAX || v > (uint64_t)(e - b) * 1024)
+        return false;
+    if (!(obj->word = calloc(v ? v : 1, sizeof(uint32_t))))
+        return false;
+    obj->size = (uint32_t)(v);
+
+    if (!(b = get_uvarint(b, e, &n)))
+        return false;
+    for (uint64_t i = 0, p = 0; i < n; i++) {
+        if (!(b = get_uvarint(b, e, &v)) || v > obj->size - p)
+            return false;
+        p += v;
+        if (!(b = get_uvarint(b, e, &v)) || v > obj->size - p || v > (uint64_t)(e - b) / 4)
+            return false;
+        for (; v; v--, b += 4)
+            obj->word[p++] = (uint32_t)(b[0]) << 24 | (uint32_t)(b[1]) << 16 | (uint32_t)(b[2]) << 8 | (uint32_t)(b[3]);
+    }
+
+    if (!(b = get_uvarint(b, e, &n)) || n > (uint64_t)(e - b))
+        return false;
+    if (!(obj->sym = malloc((n ? n : 1) * sizeof(ObjSym))))
+        return false;
+    obj->sym_len = obj->sym_cap = (size_t)(n);
+    for (size_t i = 0; i < obj->sym_len; i++) {
+        if (!(b = get_uvarint(b, e, &v)) || v > (uint64_t)(obj->size) + 1)
+            return false;
+        obj->sym[i].value = (uint32_t)(v - 1);
+        if (!(b = get_uvarint(b, e, &v)) || v > UINT32_MAX)
+            return false;
+        obj->sym[i].section = (uint32_t)(v);
+        obj->sym[i].name = (const char*)(b);
+        while (b < e && *b)
+            b++;
+        if (b++ == e || !SymValid(obj->sym[i].name))
+            return false;
+    }
+
+    if (!(b = get_uvarint(b, e, &n)) || n > (uint64_t)(e - b))
+        return false;
+    if (!(obj->sec = malloc((n ? n : 1) * sizeof(ObjSec))))
+        return false;
+    obj->sec_len = (size_t)(n);
+    uint64_t total = 0;
+    for (size_t i = 0; i < obj->sec_len; i++) {
+        if (!(b = get_uvarint(b, e, &v)) || !v || v > UINT32_MAX)
+            return false;
+        obj->sec[i].align = (uint32_t)(v);
+        if (!(b = get_uvarint(b, e, &v)) || v > UINT32_MAX)
+            return false;
+        obj->sec[i].addr = (uint32_t)(v - 1);
+        if (!(b = get_uvarint(b, e, &v)) || v >> 1 > obj->size)
+            return false;
+        obj->sec[i].size = (uint32_t)(v >> 1);
+        obj->sec[i].attr = v & 1;
+        total += obj->sec[i].size;
+        obj->sec[i].name = (const char*)(b);
+        while (b < e && *b)
+            b++;
+        if (b++ == e || !SymValid(obj->sec[i].name))
+            return false;
+    }
+    if (total > obj->size)
+        return false;
+    for (size_t i = 0, p = obj->size - (size_t)(total); i < obj->sec_len; p += obj->sec[i++].size)
+        obj->sec[i].offset = (uint32_t)(p);
+    for (size_t i = 0; i < obj->sym_len; i++)
+        if (obj->sym[i].section > obj->sec_len)
+            return false;
+
+    if (!(b = get_uvarint(b, e, &n)) || n > (uint64_t)(e - b))
+        return false;
+    if (!(obj->reloc = malloc((n ? n : 1) * sizeof(ObjReloc))))
+        return false;
+    obj->reloc_len = obj->reloc_cap = (size_t)(n);
+    for (size_t i = 0, p = 0; i < obj->reloc_len; i++) {
+        if (!(b = get_uvarint(b, e, &v)))
+            return false;
+        p += (size_t)(v >> 1 ^ (v & 1 ? ~(uint64_t)(0) : 0));
+        if (p >= obj->size)
+            return false;
+        obj->reloc[i].offset = (uint32_t)(p);
+        if (!(b = get_uvarint(b, e, &v)) || v >> 1 >= obj->sym_len)
+            return false;
+        obj->reloc[i].sym = (uint32_t)(v >> 1);
+        obj->reloc[i].rel = v & 1;
+    }
+    return b == e;
+}
+
+/**
+ * Sets up prog for splitting len bytes of source from path, allocating the
+ * tokens and sections with malloc.
+ */
+static Error alloc_prog(Prog *prog, const char *path, size_t len) {
+    // every token takes at least two bytes (including the line ending), other
+    // than the last, and every section takes at least ten
+    *prog = (Prog){
+        .len     = 0,
+        .cap     = len/2 + 1,
+        .tok     = malloc((len/2 + 1) * sizeof(ProgTok)),
+        .sec_len = 0,
+        .sec_cap = len/10 + 1,
+        .sec     = malloc((len/10 + 1) * sizeof(ProgSec)),
+        .bin     = {
+            .data = path,
+            .load = incbin_load,
+        },
+    };
+    if (!prog->tok || !prog->sec)
+        return Error_Prog_TooMany;
+    return NoError;
+}
+
+/**
+ * Splits src (from path) into prog, allocating the tokens and sections with
+ * malloc.
+ */
+static Error split_file(Prog *prog, const char *path, char *src, size_t len, int *line) {
+    Error err;
+    if ((err = alloc_prog(prog, path, len)))
+        return err;
+    return SplitProg(prog, src, line);
+}
+
+/**
+ * Assembles src (from path) into a relocatable object, allocating it with
+ * malloc. The object references src, which must not be freed. If cacheable is
+ * not NULL, it is set to whether the object depends only on src.
+ */
+static Error obj_assemble(Obj *obj, const char *path, char *src, size_t len, int *line, bool *cacheable) {
+    Prog prog;
+    Error err;
+    if ((err = split_file(&prog, path, src, len, line)))
+        return err;
+
+    // pack the sections after the words outside them (LinkObj places them)
+    uint32_t size = 0;
+    for (size_t i = 0; i < prog.len; i++)
+        if (!prog.tok[i].section && prog.tok[i].count && prog.tok[i].offset + prog.tok[i].count > size)
+            size = prog.tok[i].offset + prog.tok[i].count;
+    if (prog.sec_len) {
+        if ((err = SizeProgSec(&prog, line)))
+            return err;
+        for (size_t i = 0; i < prog.sec_len; i++) {
+            if (line)
+                *line = prog.sec[i].line;
+            if (prog.sec[i].size > UINT32_MAX - size)
+                return Error_Prog_OutOfRange;
+            prog.sec[i].base = size;
+            size += prog.sec[i].size;
+        }
+        for (size_t i = 0; i < prog.len; i++)
+            if (prog.tok[i].section)
+                prog.tok[i].offset += prog.sec[prog.tok[i].section-1].base;
+    }
+
+    *obj = (Obj){
+        .size      = size,
+        .sec_len   = prog.sec_len,
+        .sym_cap   = prog.len*2,
+        .reloc_cap = prog.len,
+        .str_cap   = len + 1,
+    };
+    obj->word  = malloc((obj->size ? obj->size : 1) * sizeof(uint32_t));
+    obj->sec   = malloc((prog.sec_len ? prog.sec_len : 1) * sizeof(ObjSec));
+    obj->sym   = malloc((prog.len ? prog.len*2 : 1) * sizeof(ObjSym));
+    obj->reloc = malloc((prog.len ? prog.len : 1) * sizeof(ObjReloc));
+    obj->str   = malloc(len + 1);
+    if (!obj->word || !obj->sec || !obj->sym || !obj->reloc || !obj->str)
+        return Error_Prog_TooMany;
+    for (size_t i = 0; i < prog.sec_len; i++)
+        obj->sec[i] = (ObjSec){
+            .name   = prog.sec[i].name,
+            .align  = prog.sec[i].align,
+            .addr   = prog.sec[i].addr,
+            .attr   = prog.sec[i].attr,
+            .offset = prog.sec[i].base,
+            .size   = prog.sec[i].size,
+        };
+
+    if ((err = AssembleProgObj(prog, obj, obj->word, obj->size, line, NULL)))
+        return err;
+
+    if (cacheable) {
+        *cacheable = true;
+        for (size_t i = 0; i < prog.len; i++)
+            if (prog.tok[i].kind == ProgTokKind_Bin)
+                *cacheable = false;
+    }
+    free(prog.tok);
+    free(prog.sec);
+    return NoError;
+}
+
+static const char cover_magic[] = "asm374 coverage\n";
+
+/**
+ * Writes cov as text which read_cover can merge.
+ */
+static bool write_cover(FILE *f, const Cover *cov) {
+    fputs(cover_magic, f);
+    fprintf(f, "words %llu\ninvalid %llu\n", (unsigned long long)(cov->words), (unsigned long long)(cov->invalid));
+    for (int op = 0; op < 1<<5; op++) {
+        if (!cov->op[op])
+            continue;
+        fprintf(f, "op %d %llu\n", op, (unsigned long long)(cov->op[op]));
+        for (int x = 0; x < 3; x++)
+            for (int r = 0; r < RegCount; r++)
+                if (cov->reg[op][x][r])
+                    fprintf(f, "reg %d %d %d %llu\n", op, x, r, (unsigned long long)(cov->reg[op][x][r]));
+        for (int k = 0; k < CondCount; k++)
+            if (cov->cond[op][k])
+                fprintf(f, "cond %d %d %llu\n", op, k, (unsigned long long)(cov->cond[op][k]));
+        for (int k = 0; k < ImmClassCount; k++)
+            if (cov->imm[op][k])
+                fprintf(f, "imm %d %d %llu\n", op, k, (unsigned long long)(cov->imm[op][k]));
+        fprintf(f, "combo %d ", op);
+        for (int k = 0; k < (1<<12)/64; k++)
+            fprintf(f, "%016llX", (unsigned long long)(cov->combo[op][k]));
+        fputc('\n', f);
+    }
+    return !fflush(f) && !ferror(f);
+}
+
+/**
+ * Checks whether s starts with the header written by write_cover.
+ */
+static bool is_cover(const char *s) {
+    for (const char *m = cover_magic; *m; m++)
+        if (*s++ != *m)
+            return false;
+    return true;
+}
+
+/**
+ * Adds the coverage written by write_cover in s to cov.
+ */
+static bool read_cover(Cover *cov, char *s) {
+    if (!is_cover(s))
+        return false;
+    s += sizeof(cover_magic) - 1;
+    for (char *line = s; line; line = s) {
+        s = str_spl(line, "\n");
+        unsigned long long v;
+        int a, b, c, n = 0;
+        if (!*str_trim(line))
+            continue;
+        if (sscanf(line, "words %llu%n", &v, &n) == 1 && !line[n])
+            cov->words += v;
+        else if (sscanf(line, "invalid %llu%n", &v, &n) == 1 && !line[n])
+            cov->invalid += v;
+        else if (sscanf(line, "op %d %llu%n", &a, &v, &n) == 2 && !line[n] && a >= 0 && a < 1<<5)
+            cov->op[a] += v;
+        else if (sscanf(line, "reg %d %d %d %llu%n", &a, &b, &c, &v, &n) == 4 && !line[n] && a >= 0 && a < 1<<5 && b >= 0 && b < 3 && c >= 0 && c < RegCount)
+            cov->reg[a][b][c] += v;
+        else if (sscanf(line, "cond %d %d %llu%n", &a, &b, &v, &n) == 3 && !line[n] && a >= 0 && a < 1<<5 && b >= 0 && b < CondCount)
+            cov->cond[a][b] += v;
+        else if (sscanf(line, "imm %d %d %llu%n", &a, &b, &v, &n) == 3 && !line[n] && a >= 0 && a < 1<<5 && b >= 0 && b < ImmClassCount)
+            cov->imm[a][b] += v;
+        else if (sscanf(line, "combo %d %n", &a, &n) == 1 && a >= 0 && a < 1<<5 && str_len(line + n) == (1<<12)/4) {
+            const char *h = line + n;
+            for (int k = 0; k < (1<<12)/64; k++) {
+                uint64_t m = 0;
+                for (int d = 0; d < 16; d++) {
+                    uint8_t x = u4_fromhex(*h++);
+                    if (x == 0xFF)
+                        return false;
+                    m = m << 4 | x;
+                }
+                cov->combo[a][k] |= m;
+            }
+        } else
+            return false;
+    }
+    return true;
+}
+
+#if defined(BENCH)
+
+static volatile uint32_t bench_sink; // keeps the benchmarked results alive
+
+#define BENCH_N 4096
+
+/**
+ * Inputs for the benchmarks.
+ */
+typedef struct BenchCtx {
+    uint32_t  word[BENCH_N];    // random valid instructions
+    Inst      inst[BENCH_N];    // decoded words
+    char      str[BENCH_N][32]; // formatted instructions
+    char     *src;              // synthetic program
+    size_t    len;
+    char     *buf;              // copy of src for SplitProg to modify
+    Prog      prog;
+    uint32_t *img;
+    uint32_t  img_n;
+    uint32_t  exec[64];         // loop calling a function with a loop
+    Prof      prof;
+    Batch     batch;            // random programs (see BENCH_BATCH)
+    uint32_t *batch_img;
+} BenchCtx;
+
+/**
+ * Number of random programs of 256 words run for up to 1000 instructions each
+ * by the batch execution benchmarks.
+ */
+#define BENCH_BATCH 256
+
+/**
+ * Program for the execution benchmarks, assembled to BenchCtx.exec.
+ */
+static const char *const bench_exec[] = {
+    "ldi r1, 10000",
+    "ldi r2, 6",
+    "jal r2",
+    "addi r1, r1, -1",
+    "brnz r1, -3",
+    "halt",
+    "ldi r5, 10",       // 6
+    "st 32(r5), r1",
+    "addi r5, r5, -1",
+    "brnz r5, -3",
+    "jr r15",
+};
+
+static uint32_t bench_ParseInst(BenchCtx *c) {
+    uint32_t x = 0;
+    for (size_t i = 0; i < BENCH_N; i++) {
+        Inst inst;
+        x += ParseInst(&inst, c->str[i], 0, NULL) ? 1 : (uint32_t)(inst.C);
+    }
+    bench_sink = x;
+    return BENCH_N;
+}
+
+static uint32_t bench_EncodeInst(BenchCtx *c) {
+    uint32_t x = 0;
+    for (size_t i = 0; i < BENCH_N; i++)
+        x += EncodeInst(c->inst[i]);
+    bench_sink = x;
+    return BENCH_N;
+}
+
+static uint32_t bench_DecodeInst(BenchCtx *c) {
+    uint32_t x = 0;
+    for (size_t i = 0; i < BENCH_N; i++) {
+        Inst inst = DecodeInst(c->word[i]);
+        x += (uint32_t)(inst.Ra ^ inst.Rb ^ inst.Rc ^ inst.C2 ^ inst.C);
+    }
+    bench_sink = x;
+    return BENCH_N;
+}
+
+static uint32_t bench_FormatInst(BenchCtx *c) {
+    uint32_t x = 0;
+    char buf[64];
+    for (size_t i = 0; i < BENCH_N; i++)
+        x += (uint32_t)(FormatInst(buf, c->inst[i]) - buf);
+    bench_sink = x;
+    return BENCH_N;
+}
+
+static uint32_t bench_ExplainInst(BenchCtx *c) {
+    uint32_t x = 0;
+    char buf[128];
+    for (size_t i = 0; i < BENCH_N; i++)
+        x += (uint32_t)(ExplainInst(buf, c->inst[i]) - buf);
+    bench_sink = x;
+    return BENCH_N;
+}
+
+static uint32_t bench_CpuRun(BenchCtx *c) {
+    Cpu cpu;
+    CpuReset(&cpu, c->exec, 64);
+    CpuRun(&cpu, UINT64_MAX);
+    bench_sink = cpu.R[1];
+    return (uint32_t)(cpu.steps);
+}
+
+static uint32_t bench_ProfRun(BenchCtx *c) {
+    Cpu cpu;
+    CpuReset(&cpu, c->exec, 64);
+    ProfReset(&c->prof, 0);
+    ProfRun(&c->prof, &cpu, UINT64_MAX);
+    bench_sink = cpu.R[1];
+    return (uint32_t)(cpu.steps);
+}
+
+static uint32_t bench_batch(BenchCtx *c, BatchImpl impl) {
+    Batch *b = &c->batch;
+    uint32_t n = 0;
+    mem_move(b->mem, c->batch_img, (size_t)(b->n)*b->memsz*sizeof(uint32_t));
+    BatchReset(b);
+    b->impl = impl;
+    BatchRun(b);
+    for (uint32_t l = 0; l < b->n; l++)
+        n += b->steps[l];
+    bench_sink = b->hash[0];
+    return n;
+}
+
+static uint32_t bench_BatchRunScalar(BenchCtx *c) {
+    return bench_batch(c, BatchImpl_Scalar);
+}
+
+static uint32_t bench_BatchRunAvx2(BenchCtx *c) {
+    return bench_batch(c, BatchImpl_Avx2);
+}
+
+static uint32_t bench_BatchRunAvx512(BenchCtx *c) {
+    return bench_batch(c, BatchImpl_Avx512);
+}
+
+static uint32_t bench_AssembleProg(BenchCtx *c) {
+    int line = 0;
+    mem_move(c->buf, c->src, c->len + 1);
+    c->prog.len = c->prog.sec_len = 0;
+    if (SplitProg(&c->prog, c->buf, &line) || LayoutProg(&c->prog, c->img, c->img_n, &line) || AssembleProg(c->prog, c->img, c->img_n, &line))
+        line = -1;
+    bench_sink = c->img[c->img_n - 1] + (uint32_t)(line);
+    return 1;
+}
+
+/**
+ * The benchmarks, each of which processes a batch of inputs and returns the
+ * number of items processed.
+ */
+static const struct {
+    const char *name;
+    const char *unit;
+    uint32_t  (*fn)(BenchCtx *c);
+} bench_fns[] = {
+    {"ParseInst",              "inst/s", bench_ParseInst},
+    {"EncodeInst",             "inst/s", bench_EncodeInst},
+    {"DecodeInst",             "inst/s", bench_DecodeInst},
+    {"FormatInst",             "inst/s", bench_FormatInst},
+    {"ExplainInst",            "inst/s", bench_ExplainInst},
+    {"SplitProg+AssembleProg", "prog/s", bench_AssembleProg}, // including LayoutProg and copying the source
+    {"CpuRun",                 "inst/s", bench_CpuRun},
+    {"ProfRun",                "inst/s", bench_ProfRun},
+    {"BatchRun (scalar)",      "inst/s", bench_BatchRunScalar},
+    {"BatchRun (avx2)",        "inst/s", bench_BatchRunAvx2},   // scalar if not supported
+    {"BatchRun (avx512)",      "inst/s", bench_BatchRunAvx512}, // scalar if not supported
+};
+
+/**
+ * Runs fn repeatedly for at least mintime seconds, runs times, returning the
+ * median rate in items per second.
+ */
+static double bench_run(uint32_t (*fn)(BenchCtx *c), BenchCtx *c, double mintime, uint32_t runs) {
+    double rate[9];
+    fn(c); // warm up
+    for (uint32_t r = 0; r < runs; r++) {
+        uint64_t n = 0;
+        uint64_t t0 = now_ns();
+        double t;
+        do
+            n += fn(c);
+        while ((t = (double)(now_ns() - t0) / 1e9) < mintime);
+        rate[r] = (double)n / t;
+        for (uint32_t i = r; i && rate[i] < rate[i-1]; i--) {
+            double tmp = rate[i];
+            rate[i] = rate[i-1];
+            rate[i-1] = tmp;
+        }
+    }
+    return rate[runs/2];
+}
+
+/**
+ * Finds the rate of name in the results file buf, returning false if it isn't
+ * there.
+ */
+static bool bench_baseline(const char *buf, const char *name, double *rate) {
+    for (const char *s = buf; *s; ) {
+        const char *p = s, *q = name;
+        while (*q && *p == *q)
+            p++, q++;
+        if (!*q && *p == '\t') {
+            *rate = strtod(p + 1, NULL);
+            return true;
+        }
+        while (*s && *s++ != '\n')
+            ;
+    }
+    return false;
+}
+
+static int usage(void) {
+    fprintf(stderr, "usage: asm374_bench [-n lines] [-L label%%] [-B branch%%] [-s seed] [-t ms] [-r runs] [-o results] [-c baseline] [-x threshold%%]\n");
+    fprintf(stderr, "       asm374_bench [-n lines] [-L label%%] [-B branch%%] [-s seed] -g\n");
+    return 2;
+}
+
+/**
+ * This command measures the throughput of the instruction functions (over
+ * random valid instructions) and of assembling a synthetic program (see
+ * GenProg) of -n lines, with -L percent of lines labeled and -B percent
+ * branches, generated from -s seed. Each benchmark is run -r times for -t
+ * milliseconds, and the median rate is used.
+ *
+ * With -o, the results are written as tab-separated name, rate, and unit lines
+ * (after a comment line with the options). With -c, they are compared against a
+ * saved results file, and the command fails if any benchmark is more than -x
+ * percent slower.
+ *
+ * With -g, the synthetic program is written to stdout instead.
+ */
+int main(int argc, char **argv) {
+    GenProgOpt opt = {.n = 2000, .label = 20, .branch = 10, .seed = 1};
+    uint32_t ms = 200, runs = 5, threshold = 5;
+    const char *output = NULL, *baseline = NULL;
+    bool gen = false;
+    for (int i = 1; i < argc; i++) {
+        uint32_t *v = NULL;
+        if (str_eq(argv[i], "-n", false)) {
+            v = &opt.n;
+        } else if (str_eq(argv[i], "-L", false)) {
+            v = &opt.label;
+        } else if (str_eq(argv[i], "-B", false)) {
+            v = &opt.branch;
+        } else if (str_eq(argv[i], "-s", false)) {
+            v = &opt.seed;
+        } else if (str_eq(argv[i], "-t", false)) {
+            v = &ms;
+        } else if (str_eq(argv[i], "-r", false)) {
+            v = &runs;
+        } else if (str_eq(argv[i], "-x", false)) {
+            v = &threshold;
+        } else if (str_eq(argv[i], "-o", false)) {
+            if (++i == argc)
+                return usage();
+            output = argv[i];
+        } else if (str_eq(argv[i], "-c", false)) {
+            if (++i == argc)
+                return usage();
+            baseline = argv[i];
+        } else if (str_eq(argv[i], "-g", false)) {
+            gen = true;
+        } else {
+            return usage();
+        }
+        if (v && (++i == argc || ParseImm(32, false, v, argv[i])))
+            return usage();
+    }
+    if (!opt.n || opt.n > 1<<18 || opt.label > 100 || opt.branch > 100 || !runs || runs > 9)
+        return usage();
+
+    BenchCtx *c = malloc(sizeof(BenchCtx));
+    if (!c || !(c->src = malloc((size_t)(opt.n)*64 + 1))) {
+        fprintf(stderr, "asm374_bench: out of memory\n");
+        return 1;
+    }
+    c->len = (size_t)(GenProg(c->src, opt) - c->src);
+    if (gen)
+        return fwrite(c->src, 1, c->len, stdout) == c->len ? 0 : 1;
+
+    uint32_t rng = opt.seed ? opt.seed : 1;
+    for (size_t i = 0; i < BENCH_N; i++) {
+        do {
+            rng ^= rng << 13, rng ^= rng >> 17, rng ^= rng << 5;
+            c->inst[i] = DecodeInst(rng);
+        } while (CheckInst(c->inst[i]));
+        c->word[i] = EncodeInst(c->inst[i]);
+        FormatInst(c->str[i], c->inst[i]);
+    }
+
+    c->img_n = opt.n;
+    c->buf = malloc(c->len + 1);
+    c->img = malloc(c->img_n * sizeof(uint32_t));
+    if (!c->buf || !c->img || alloc_prog(&c->prog, NULL, c->len)) {
+        fprintf(stderr, "asm374_bench: out of memory\n");
+        return 1;
+    }
+    int line = 0;
+    Error err;
+    mem_move(c->buf, c->src, c->len + 1);
+    if ((err = SplitProg(&c->prog, c->buf, &line)) || (err = LayoutProg(&c->prog, c->img, c->img_n, &line)) || (err = AssembleProg(c->prog, c->img, c->img_n, &line))) {
+        fprintf(stderr, "asm374_bench: synthetic program:%d: %s\n", line, GetError(err));
+        return 1;
+    }
+    for (size_t i = 0; i < 64; i++) {
+        Inst inst = INST_ZERO;
+        if (i < sizeof(bench_exec)/sizeof(*bench_exec) && ParseInst(&inst, bench_exec[i], (uint32_t)(i), NULL)) {
+            fprintf(stderr, "asm374_bench: invalid instruction %s\n", bench_exec[i]);
+            return 1;
+        }
+        c->exec[i] = EncodeInst(inst);
+    }
+    static uint64_t hits[64], taken[64];
+    static ProfNode node[16];
+    static ProfFrame frame[16];
+    c->prof = (Prof){
+        .hits      = hits,
+        .taken     = taken,
+        .node      = node,
+        .node_cap  = 16,
+        .frame     = frame,
+        .depth_cap = 16,
+    };
+
+    GenInst g;
+    GenInstOpt gopt = {.avoid = 0};
+    for (int op = 0; op < 1<<5; op++)
+        gopt.weight[op] = 1;
+    static uint32_t batch_img[BENCH_BATCH*256], batch_mem[BENCH_BATCH*256], batch_state[BENCH_BATCH*(RegCount + 11)];
+    GenInstInit(&g, &gopt);
+    for (uint32_t l = 0; l < BENCH_BATCH; l++)
+        GenInstProg(&g, opt.seed, l, batch_img + l*256, 256);
+    c->batch_img = batch_img;
+    c->batch = (Batch){
+        .n      = BENCH_BATCH,
+        .memsz  = 256,
+        .limit  = 1000,
+        .mem    = batch_mem,
+        .R      = batch_state,
+        .HI     = batch_state + BENCH_BATCH*RegCount,
+        .LO     = batch_state + BENCH_BATCH*(RegCount + 1),
+        .PC     = batch_state + BENCH_BATCH*(RegCount + 2),
+        .in     = batch_state + BENCH_BATCH*(RegCount + 3),
+        .out    = batch_state + BENCH_BATCH*(RegCount + 4),
+        .nout   = batch_state + BENCH_BATCH*(RegCount + 5),
+        .hash   = batch_state + BENCH_BATCH*(RegCount + 6),
+        .steps  = batch_state + BENCH_BATCH*(RegCount + 7),
+        .halted = batch_state + BENCH_BATCH*(RegCount + 8),
+        .err    = batch_state + BENCH_BATCH*(RegCount + 9),
+    };
+
+    char cfg[128];
+    snprintf(cfg, sizeof(cfg), "# asm374_bench -n %u -L %u -B %u -s %u", (unsigned)(opt.n), (unsigned)(opt.label), (unsigned)(opt.branch), (unsigned)(opt.seed));
+
+    char *base = NULL;
+    if (baseline) {
+        size_t len;
+        if (!(base = read_file(baseline, &len))) {
+            fprintf(stderr, "asm374_bench: failed to read %s\n", baseline);
+            return 1;
+        }
+        const char *p = base, *q = cfg;
+        while (*q && *p == *q)
+            p++, q++;
+        if (*q || (*p != '\n' && *p != '\r'))
+            fprintf(stderr, "asm374_bench: warning: %s was generated with different options\n", baseline);
+    }
+
+    FILE *f = NULL;
+    if (output && !(f = fopen(output, "w"))) {
+        fprintf(stderr, "asm374_bench: failed to write %s\n", output);
+        return 1;
+    }
+    if (f)
+        fprintf(f, "%s\n", cfg);
+
+    int ret = 0;
+    for (size_t i = 0; i < sizeof(bench_fns)/sizeof(*bench_fns); i++) {
+        double rate = bench_run(bench_fns[i].fn, c, ms / 1000.0, runs), old;
+        printf("%-24s %14.0f %s", bench_fns[i].name, rate, bench_fns[i].unit);
+        if (base && bench_baseline(base, bench_fns[i].name, &old) && old > 0) {
+            double change = (rate / old - 1) * 100;
+            printf(" %+7.1f%%", change);
+            if (change < -(double)(threshold)) {
+                printf(" REGRESSION");
+                ret = 1;
+            }
+        }
+        printf("\n");
+        fflush(stdout);
+        if (f)
+            fprintf(f, "%s\t%.0f\t%s\n", bench_fns[i].name, rate, bench_fns[i].unit);
+    }
+    if (f && fclose(f)) {
+        fprintf(stderr, "asm374_bench: failed to write %s\n", output);
+        return 1;
+    }
+    return ret;
+}
+
+#elif !defined(TESTS)
+
+static bool write_file(const void *buf, size_t n, void *data) {
+    STAT_ADD(bytes_out, n);
+    return fwrite(buf, 1, n, data) == n;
+}
+
+/**
+ * Writes img[memsz] in fmt (ImageFormat_Hex is the same as the web version).
+ */
+static bool write_image(FILE *f, const uint32_t *img, uint32_t memsz, ImageFormat fmt) {
+    STAT_BEGIN(Format);
+    bool ok = WriteImage(fmt, img, memsz, (ImageSink){.data = f, .write = write_file});
+    fflush(f);
+    STAT_END(Format);
+    return ok && !ferror(f);
+}
+
+/**
+ * Prints a summary of the used and free space in a memory image.
+ */
+static void print_usage(FILE *f, const uint8_t *used, uint32_t memsz) {
+    uint32_t n_used = 0, n_free = 0, n_block = 0, largest = 0;
+    for (uint32_t i = 0, run = 0; i < memsz; i++) {
+        if (used[i]) {
+            n_used++;
+            run = 0;
+        } else {
+            n_free++;
+            if (!run++)
+                n_block++;
+            if (run > largest)
+                largest = run;
+        }
+    }
+    fprintf(f, "used %u/%u words (%.1f%%), %u free in %u blocks (largest %u)\n",
+        (unsigned)(n_used), (unsigned)(memsz), memsz ? (double)(n_used)/(double)(memsz)*100 : 0.0,
+        (unsigned)(n_free), (unsigned)(n_block), (unsigned)(largest));
+}
+
+/**
+ * Prints the memory map of prog after it has been laid out.
+ */
+static void print_map(FILE *f, const Prog prog, uint32_t memsz) {
+    uint8_t *used = calloc(memsz ? memsz : 1, 1);
+    if (!used)
+        return;
+
+    // mark the used words, and find the bounds of the data outside sections
+    uint32_t abs_lo = UINT32_MAX, abs_hi = 0, abs_n = 0;
+    for (size_t i = 0; i < prog.len; i++) {
+        ProgTok t = prog.tok[i];
+        for (uint32_t x = t.offset; x < t.offset + t.count && x < memsz; x++)
+            used[x] = 1;
+        if (!t.section && t.count) {
+            abs_lo = t.offset < abs_lo ? t.offset : abs_lo;
+            abs_hi = t.offset + t.count > abs_hi ? t.offset + t.count : abs_hi;
+            abs_n += t.count;
+        }
+    }
+
+    fprintf(f, "%-8s %-8s %8s %6s  %s\n", "start", "end", "words", "align", "section");
+    if (abs_n)
+        fprintf(f, "%08X %08X %8u %6s  %s\n", (unsigned)(abs_lo), (unsigned)(abs_hi-1), (unsigned)(abs_n), "-", "(none)");
+    for (size_t i = 0; i < prog.sec_len; i++) {
+        ProgSec sec = prog.sec[i];
+        if (sec.size)
+            fprintf(f, "%08X %08X %8u %6u  %s%s\n", (unsigned)(sec.base), (unsigned)(sec.base + sec.size - 1), (unsigned)(sec.size), (unsigned)(sec.align), sec.name, ~sec.addr ? " (fixed)" : "");
+        else
+            fprintf(f, "%08X %8s %8u %6u  %s%s\n", (unsigned)(sec.base), "-", 0u, (unsigned)(sec.align), sec.name, ~sec.addr ? " (fixed)" : "");
+    }
+    print_usage(f, used, memsz);
+    free(used);
+}
+
+/**
+ * Writes a listing of the words of prog in img, in address order, with the
+ * source line number, labels, and text (from the original source orig[len])
+ * of each.
+ */
+static bool write_listing(FILE *f, const Prog prog, const uint32_t *img, char *orig, size_t len) {
+    SrcMap map = {
+        .len   = 0,
+        .cap   = prog.len,
+        .line  = malloc((prog.len ? prog.len : 1) * sizeof(int)),
+        .addr  = malloc((prog.len ? prog.len : 1) * sizeof(uint32_t)),
+        .count = malloc((prog.len ? prog.len : 1) * sizeof(uint32_t)),
+        .order = malloc((prog.len ? prog.len : 1) * sizeof(uint32_t)),
+    };
+    uint32_t *loff = malloc((prog.len ? prog.len : 1) * sizeof(uint32_t));
+    uint32_t *lidx = malloc((prog.len ? prog.len : 1) * sizeof(uint32_t));
+    size_t nline = 1;
+    for (size_t i = 0; i < len; i++)
+        nline += orig[i] == '\n';
+    char **text = malloc(nline * sizeof(char*));
+    if (!map.line || !map.addr || !map.count || !map.order || !loff || !lidx || !text || SrcMapProg(&map, prog))
+        return false;
+
+    // split the lines of the original source
+    text[0] = orig;
+    for (size_t i = 0, n = 1; i < len; i++) {
+        if (orig[i] == '\n')
+            text[n++] = &orig[i+1];
+        if (orig[i] == '\n' || orig[i] == '\r')
+            orig[i] = '\0';
+    }
+
+    // sort the labels by address
+    size_t nlabel = 0;
+    for (size_t i = 0; i < prog.len; i++) {
+        loff[i] = prog.tok[i].offset;
+        if (prog.tok[i].kind == ProgTokKind_Label)
+            lidx[nlabel++] = (uint32_t)(i);
+    }
+    SortIdx(lidx, nlabel, loff);
+
+    fprintf(f, "%-8s %-8s %6s  %-16s %s\n", "addr", "word", "line", "label", "source");
+    for (size_t i = 0, l = 0; i < map.len; i++) {
+        uint32_t e = map.order[i];
+        for (uint32_t a = map.addr[e]; a < map.addr[e] + map.count[e]; a++) {
+            char h[9], label[17] = "";
+            u32be_tohex(h, img[a]);
+            if (a != map.addr[e]) {
+                fprintf(f, "%08X %s\n", (unsigned)(a), h);
+                continue;
+            }
+            for (; l < nlabel && loff[lidx[l]] < a; l++)
+                ;
+            for (char *x = label; l < nlabel && loff[lidx[l]] == a; l++)
+                if (x + str_len(prog.tok[lidx[l]].value) + 3 < label + sizeof(label))
+                    x = str_ecpy(str_ecpy(str_ecpy(x, x == label ? "" : " "), prog.tok[lidx[l]].value), ":");
+            fprintf(f, "%08X %s %6d  %-16s %s\n", (unsigned)(a), h, map.line[e], label, text[map.line[e]-1]);
+        }
+    }
+    free(map.line);
+    free(map.addr);
+    free(map.count);
+    free(map.order);
+    free(loff);
+    free(lidx);
+    free(text);
+    fflush(f);
+    return !ferror(f);
+}
+
+/**
+ * Assembles the program at path into a memory image of memsz words. If all is
+ * set, every error is reported instead of just the first one. If listing is
+ * not NULL, a listing is written to it. The image is written to out in fmt.
+ */
+static int assemble_file(FILE *out, const char *path, uint32_t memsz, bool map, bool all, const char *listing, ImageFormat fmt) {
+    size_t len;
+    char *src = read_file(path, &len);
+    char *orig = src && listing ? malloc(len + 1) : NULL;
+    if (!src || (listing && !orig)) {
+        fprintf(stderr, "asm374: failed to read %s\n", path);
+        return 1;
+    }
+    if (orig)
+        mem_move(orig, src, len + 1);
+
+    uint32_t *img = malloc((memsz ? memsz : 1) * sizeof(uint32_t));
+    if (!img) {
+        fprintf(stderr, "asm374: out of memory\n");
+        return 1;
+    }
+
+    Prog prog;
+    int line = 0;
+    Error err;
+    if (all) {
+        // every line has at most one error from splitting and one from
+        // assembling
+        size_t nline = 1;
+        for (size_t i = 0; i < len; i++)
+            nline += src[i] == '\n';
+        Diags diag = {
+            .len  = 0,
+            .cap  = nline*2 + 1,
+            .diag = malloc((nline*2 + 1) * sizeof(Diag)),
+        };
+        if (!diag.diag) {
+            fprintf(stderr, "asm374: out of memory\n");
+            return 1;
+        }
+        if ((err = alloc_prog(&prog, path, len)) || (err = DiagnoseProg(&prog, src, img, memsz, &diag))) {
+            for (size_t i = 0; i < diag.len && i < diag.cap; i++) {
+                if (diag.diag[i].end)
+                    fprintf(stderr, "asm374: %s:%d:%u-%u: %s\n", path, diag.diag[i].line, (unsigned)(diag.diag[i].col + 1), (unsigned)(diag.diag[i].end), GetError(diag.diag[i].err));
+                else
+                    fprintf(stderr, "asm374: %s:%d: %s\n", path, diag.diag[i].line, GetError(diag.diag[i].err));
+            }
+            if (!diag.len)
+                fprintf(stderr, "asm374: %s: %s\n", path, GetError(err));
+            fprintf(stderr, "asm374: %s: %zu error%s\n", path, diag.len, diag.len == 1 ? "" : "s");
+            return 1;
+        }
+        free(diag.diag);
+    } else if ((err = split_file(&prog, path, src, len, &line)) || (err = LayoutProg(&prog, img, memsz, &line)) || (err = AssembleProg(prog, img, memsz, &line))) {
+        fprintf(stderr, "asm374: %s:%d: %s\n", path, line, GetError(err));
+        return 1;
+    }
+    if (map)
+        print_map(stderr, prog, memsz);
+    if (listing) {
+        FILE *f = fopen(listing, "w");
+        if (!f || !write_listing(f, prog, img, orig, len) || fclose(f)) {
+            fprintf(stderr, "asm374: failed to write %s\n", listing);
+            return 1;
+        }
+    }
+    return write_image(out, img, memsz, fmt) ? 0 : 1;
+}
+
+/**
+ * State for generating random programs on multiple threads. In each round,
+ * thread t generates programs [first + t*batch, first + (t+1)*batch) into
+ * out[t], which are then written in order.
+ */
+typedef struct gen_ctx {
+    GenInst   g;
+    uint32_t  seed;
+    uint32_t  memsz;
+    int       fmt; // ImageFormat, or -1 for source
+    uint32_t  count;
+    uint32_t  first;
+    uint32_t  batch;
+    uint32_t *img[MAX_THREADS];
+    ImageBuf  out[MAX_THREADS];
+    size_t    cap[MAX_THREADS];
+    bool      oom[MAX_THREADS];
+} gen_ctx;
+
+static void gen_thread(void *data, uint32_t t) {
+    gen_ctx *c = data;
+    ImageBuf *b = &c->out[t];
+    b->len = 0;
+    for (uint32_t k = c->first + t*c->batch, i = 0; i < c->batch && k < c->count; i++, k++) {
+        GenInstProg(&c->g, c->seed, k, c->img[t], c->memsz);
+
+        ImageBuf n = {NULL, 0};
+        if (c->fmt < 0)
+            n.len = 32 + (size_t)(c->memsz)*32; // "; program K", "ldi R15, -262144(R15)"
+        else
+            WriteImage((ImageFormat)(c->fmt), c->img[t], c->memsz, (ImageSink){.data = &n, .write = ImageBuf_write});
+        if (b->len + n.len > c->cap[t]) {
+            size_t cap = c->cap[t]*2 > b->len + n.len ? c->cap[t]*2 : b->len + n.len;
+            char *buf = realloc(b->buf, cap);
+            if (!buf) {
+                c->oom[t] = true;
+                return;
+            }
+            b->buf = buf;
+            c->cap[t] = cap;
+        }
+
+        if (c->fmt < 0) {
+            char *s = u32_todec(str_ecpy(b->buf + b->len, "; program "), k);
+            *s++ = '\n';
+            for (uint32_t addr = 0; addr < c->memsz; addr++) {
+                s = FormatInst(s, DecodeInst(c->img[t][addr]));
+                *s++ = '\n';
+            }
+            b->len = (size_t)(s - b->buf);
+        } else {
+            WriteImage((ImageFormat)(c->fmt), c->img[t], c->memsz, (ImageSink){.data = b, .write = ImageBuf_write});
+        }
+    }
+}
+
+/**
+ * Writes count random programs of memsz words satisfying opt, generated from
+ * seed, as source (fmt -1) or memory images. The output doesn't depend on the
+ * number of threads.
+ */
+static int generate_file(FILE *out, uint32_t count, uint32_t memsz, int fmt, const GenInstOpt *opt, uint32_t seed, uint32_t threads) {
+    gen_ctx *c = calloc(1, sizeof(gen_ctx));
+    if (!c) {
+        fprintf(stderr, "asm374: out of memory\n");
+        return 1;
+    }
+    Error err;
+    if ((err = GenInstInit(&c->g, opt))) {
+        fprintf(stderr, "asm374: %s\n", GetError(err));
+        return 1;
+    }
+    c->seed = seed;
+    c->memsz = memsz;
+    c->fmt = fmt;
+    c->count = count;
+    c->batch = memsz < 65536 ? 65536 / memsz : 1;
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+    if (threads > (count + c->batch - 1) / c->batch)
+        threads = (count + c->batch - 1) / c->batch;
+    for (uint32_t t = 0; t < threads; t++) {
+        if (!(c->img[t] = malloc((size_t)(memsz) * sizeof(uint32_t)))) {
+            fprintf(stderr, "asm374: out of memory\n");
+            return 1;
+        }
+    }
+    for (c->first = 0; c->first < count; c->first = count - c->first > c->batch*threads ? c->first + c->batch*threads : count) {
+        run_threads(threads, gen_thread, c);
+        for (uint32_t t = 0; t < threads; t++) {
+            if (c->oom[t]) {
+                fprintf(stderr, "asm374: out of memory\n");
+                return 1;
+            }
+            if (fwrite(c->out[t].buf, 1, c->out[t].len, out) != c->out[t].len) {
+                fprintf(stderr, "asm374: failed to write output\n");
+                return 1;
+            }
+        }
+    }
+    return fflush(out) || ferror(out);
+}
+
+/**
+ * Parses a comma-separated list of OP=WEIGHT (or *=WEIGHT for every opcode)
+ * into weight.
+ */
+static bool parse_weights(uint16_t *weight, char *s) {
+    while (s) {
+        char *x = s;
+        s = str_spl(x, ",");
+        char *v = str_spl(x, "=");
+        uint32_t w, op;
+        if (!v || ParseImm(16, false, &w, v))
+            return false;
+        if (str_eq(x, "*", false)) {
+            for (op = 0; op < 1<<5; op++)
+                weight[op] = (uint16_t)(w);
+            continue;
+        }
+        for (op = 0; op < 1<<5; op++)
+            if (LookupOpcode((Opcode)(op)).Format && str_eq(LookupOpcode((Opcode)(op)).Op, x, true))
+                break;
+        if (op == 1<<5)
+            return false;
+        weight[op] = (uint16_t)(w);
+    }
+    return true;
+}
+
+/**
+ * Parses a comma-separated list of registers into the mask avoid.
+ */
+static bool parse_regs(uint16_t *avoid, char *s) {
+    while (s) {
+        char *x = s;
+        s = str_spl(x, ",");
+        Reg r;
+        if (ParseReg(&r, x))
+            return false;
+        *avoid |= (uint16_t)(1u << r);
+    }
+    return true;
+}
+
+/**
+ * State for collecting coverage on multiple threads. Thread t adds its share
+ * of the words (or bytes if b is not NULL) to part[t].
+ */
+typedef struct cover_ctx {
+    const uint32_t *w;
+    const uint8_t  *b;
+    bool            le;
+    size_t          n;
+    uint32_t        threads;
+    Cover          *part;
+} cover_ctx;
+
+static void cover_thread(void *data, uint32_t t) {
+    cover_ctx *c = data;
+    size_t per = (c->n / 4 + c->threads - 1) / c->threads * 4, lo = per * t, hi = lo + per;
+    if (lo > c->n)
+        lo = c->n;
+    if (hi > c->n)
+        hi = c->n;
+    if (c->b)
+        CoverAddBytes(&c->part[t], c->b + lo, hi - lo, c->le);
+    else
+        CoverAdd(&c->part[t], c->w + lo/4, (hi - lo)/4);
+}
+
+/**
+ * Adds the n words (or bytes) in c to cov using up to threads threads.
+ */
+static bool cover_parallel(Cover *cov, cover_ctx c, uint32_t threads) {
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+    if (threads > c.n / (1<<20) + 1)
+        threads = (uint32_t)(c.n / (1<<20) + 1); // at least 256k words each
+    if (!(c.part = calloc(threads, sizeof(Cover))))
+        return false;
+    c.threads = threads;
+    run_threads(threads, cover_thread, &c);
+    for (uint32_t t = 0; t < threads; t++)
+        CoverMerge(cov, &c.part[t]);
+    free(c.part);
+    return true;
+}
+
+/**
+ * State for writing decoder test vectors on multiple threads. Thread t formats
+ * its share of the vectors into buf, at 21 bytes per vector.
+ */
+typedef struct vec_ctx {
+    VecOp    v[1<<5];
+    uint32_t first[1<<5]; // index of the first vector of each opcode
+    uint32_t total;
+    uint32_t threads;
+    char    *buf;
+} vec_ctx;
+
+static void vec_thread(void *data, uint32_t t) {
+    vec_ctx *c = data;
+    uint32_t per = (c->total + c->threads - 1) / c->threads, lo = per * t, hi = lo + per;
+    if (lo > c->total)
+        lo = c->total;
+    if (hi > c->total)
+        hi = c->total;
+    int op = 0;
+    while (op < (1<<5) - 1 && c->first[op+1] <= lo)
+        op++;
+    for (uint32_t k = lo; k < hi; k++) {
+        while (k - c->first[op] >= c->v[op].count)
+            op++;
+        char *s = VecFormat(c->buf + (size_t)(k)*21, VecWord(c->v, (Opcode)(op), k - c->first[op]));
+        *s = '\n';
+    }
+}
+
+/**
+ * Writes the decoder test vectors for every opcode (see VecWord and
+ * VecFormat) in $readmemh format, preceded by comments with the range of
+ * vectors for each opcode.
+ */
+static int vectors_file(FILE *out, uint32_t threads) {
+    vec_ctx *c = calloc(1, sizeof(vec_ctx));
+    if (!c) {
+        fprintf(stderr, "asm374: out of memory\n");
+        return 1;
+    }
+    c->total = VecInit(c->v);
+    for (int op = 0, k = 0; op < 1<<5; k += c->v[op++].count)
+        c->first[op] = k;
+    if (!(c->buf = malloc((size_t)(c->total)*21 + 1))) {
+        fprintf(stderr, "asm374: out of memory\n");
+        return 1;
+    }
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+    c->threads = threads ? threads : 1;
+    run_threads(c->threads, vec_thread, c);
+
+    fprintf(out, "// asm374 decoder test vectors: reg [79:0] vec [0:%u]\n", (unsigned)(c->total) - 1);
+    fprintf(out, "// {word[31:0], 3'b0, valid, 3'b0, opcode[4:0], ra[3:0], rb[3:0], rc[3:0], 2'b0, c2[1:0], 1'b0, c[18:0]}\n");
+    fprintf(out, "// fields outside the format of the opcode are zero\n");
+    for (int op = 0; op < 1<<5; op++) {
+        InstSpec spec = LookupOpcode((Opcode)(op));
+        fprintf(out, "// %2d %-4s %c %6u..%-6u Ra*%d Rb*%d Rc*%d C2*%d C*%d unused=%08X\n",
+            op, spec.Format ? spec.Op : "-", spec.Format ? (char)(spec.Format) : '-',
+            (unsigned)(c->first[op]), (unsigned)(c->first[op] + c->v[op].count - 1),
+            c->v[op].n[0], c->v[op].n[1], c->v[op].n[2], c->v[op].n[3], c->v[op].n[4], (unsigned)(c->v[op].unused));
+    }
+    if (fwrite(c->buf, 21, c->total, out) != c->total) {
+        fprintf(stderr, "asm374: failed to write output\n");
+        return 1;
+    }
+    free(c->buf);
+    free(c);
+    return fflush(out) || ferror(out);
+}
+
+/**
+ * Writes the coverage of each valid opcode and its arguments in cov, listing
+ * what wasn't covered.
+ */
+static void print_cover(FILE *f, const Cover *cov) {
+    fprintf(f, "%llu words, %llu invalid\n", (unsigned long long)(cov->words), (unsigned long long)(cov->invalid));
+    int nop = 0, nop_hit = 0;
+    for (int op = 0; op < 1<<5; op++) {
+        InstSpec spec = LookupOpcode((Opcode)(op));
+        if (!spec.Format)
+            continue;
+        nop++;
+        if (!cov->op[op]) {
+            fprintf(f, "%-5s missing\n", spec.Op);
+            continue;
+        }
+        nop_hit++;
+        fprintf(f, "%-5s %llu", spec.Op, (unsigned long long)(cov->op[op]));
+
+        // registers
+        const char *fields[3] = {"Ra", "Rb", "Rc"};
+        bool has[3] = {false, false, false}, imm = false;
+        int nreg = 0;
+        for (int a = 0; a < 3; a++) {
+            switch (spec.Arg[a]) {
+            case InstArg_Ra:  has[0] = true; nreg++; break;
+            case InstArg_Rb:  has[1] = true; nreg++; break;
+            case InstArg_Rc:  has[2] = true; nreg++; break;
+            case InstArg_RbC: has[1] = true; nreg++; imm = true; break;
+            case InstArg_C:   imm = true; break;
+            case InstArg__:   break;
+            }
+        }
+        for (int x = 0; x < 3; x++) {
+            if (!has[x])
+                continue;
+            int hit = 0;
+            for (int r = 0; r < RegCount; r++)
+                hit += !!cov->reg[op][x][r];
+            fprintf(f, ", %s %d/%d", fields[x], hit, RegCount);
+            if (hit != RegCount) {
+                fputs(" (missing", f);
+                for (int r = 0; r < RegCount; r++)
+                    if (!cov->reg[op][x][r])
+                        fprintf(f, " %s", GetReg((Reg)(r)));
+                fputc(')', f);
+            }
+        }
+
+        // conditions
+        if (spec.Cond) {
+            int hit = 0;
+            for (int k = 0; k < CondCount; k++)
+                hit += !!cov->cond[op][k];
+            fprintf(f, ", cond %d/%d", hit, CondCount);
+            if (hit != CondCount) {
+                fputs(" (missing", f);
+                for (int k = 0; k < CondCount; k++)
+                    if (!cov->cond[op][k])
+                        fprintf(f, " %s", GetCond((Cond)(k)));
+                fputc(')', f);
+            }
+        }
+
+        // immediates
+        if (imm) {
+            int hit = 0;
+            for (int k = 0; k < ImmClassCount; k++)
+                hit += !!cov->imm[op][k];
+            fprintf(f, ", C %d/%d", hit, ImmClassCount);
+            if (hit != ImmClassCount) {
+                fputs(" (missing", f);
+                for (int k = 0; k < ImmClassCount; k++)
+                    if (!cov->imm[op][k])
+                        fprintf(f, " %s", GetImmClass((ImmClass)(k)));
+                fputc(')', f);
+            }
+        }
+
+        // register combinations
+        if (nreg > 1) {
+            int hit = 0;
+            for (int k = 0; k < (1<<12)/64; k++)
+                for (uint64_t m = cov->combo[op][k]; m; m &= m - 1)
+                    hit++;
+            fprintf(f, ", combinations %d/%d", hit, 1 << (4*nreg));
+        }
+        fputc('\n', f);
+    }
+    fprintf(f, "%d/%d opcodes\n", nop_hit, nop);
+}
+
+/**
+ * Adds the instruction words in path to cov. Files written by write_cover are
+ * merged. Otherwise, the file is read as raw words if fmt is ImageFormat_Bin or
+ * ImageFormat_BinLE, or a memory image (see ReadImage). If path is "-", hex
+ * words are read from stdin, one per line.
+ */
+static bool cover_file(Cover *cov, const char *path, ImageFormat fmt, uint32_t threads) {
+    if (str_eq(path, "-", false)) {
+        char buf[256];
+        uint32_t w[4096];
+        size_t n = 0;
+        int line = 0;
+        while (fgets(buf, sizeof(buf), stdin)) {
+            char *s = str_trim(buf);
+            line++;
+            if (!*s)
+                continue;
+            if (!u32be_fromhex(&w[n++], s)) {
+                fprintf(stderr, "asm374: stdin:%d: %s\n", line, GetError(Error_Mem_Syntax));
+                return false;
+            }
+            if (n == sizeof(w)/sizeof(*w))
+                CoverAdd(cov, w, n), n = 0;
+        }
+        CoverAdd(cov, w, n);
+        return !ferror(stdin);
+    }
+
+    if (fmt == ImageFormat_Bin || fmt == ImageFormat_BinLE) {
+        const uint8_t *buf;
+        size_t len;
+        if (!map_file(path, &buf, &len)) {
+            fprintf(stderr, "asm374: failed to read %s\n", path);
+            return false;
+        }
+        if (len % 4) {
+            fprintf(stderr, "asm374: %s: not a whole number of words\n", path);
+            return false;
+        }
+        if (!cover_parallel(cov, (cover_ctx){.b = buf, .le = fmt == ImageFormat_BinLE, .n = len}, threads)) {
+            fprintf(stderr, "asm374: out of memory\n");
+            return false;
+        }
+        return true;
+    }
+
+    size_t len, n;
+    char *src = read_file(path, &len);
+    if (!src) {
+        fprintf(stderr, "asm374: failed to read %s\n", path);
+        return false;
+    }
+    if (is_cover(src)) {
+        if (!read_cover(cov, src)) {
+            fprintf(stderr, "asm374: %s: invalid coverage file\n", path);
+            return false;
+        }
+        free(src);
+        return true;
+    }
+    int line = 0;
+    Error err = ReadImage(src, NULL, UINT32_MAX, &n, &line);
+    uint32_t *img = malloc((n ? n : 1) * sizeof(uint32_t));
+    if (!img) {
+        fprintf(stderr, "asm374: out of memory\n");
+        return false;
+    }
+    if (err || (err = ReadImage(src, img, n, &n, &line))) {
+        fprintf(stderr, "asm374: %s:%d: %s\n", path, line, GetError(err));
+        return false;
+    }
+    if (!cover_parallel(cov, (cover_ctx){.w = img, .n = n * 4}, threads)) {
+        fprintf(stderr, "asm374: out of memory\n");
+        return false;
+    }
+    free(src);
+    free(img);
+    return true;
+}
+
+/**
+ * Program loaded for execution: a memory image, and if it was assembled from
+ * source, the labels sorted by address and the source map.
+ */
+typedef struct exec_prog {
+    uint32_t    *img;
+    uint32_t     memsz;
+    size_t       nlabel;
+    uint32_t    *label_addr;
+    const char **label_name;
+    SrcMap       map;
+    Prog         prog;
+    char        *src;
+} exec_prog;
+
+/**
+ * Loads the memory image ($readmemh or MIF) at path, or assembles it if it
+ * isn't one, into a memory of memsz words.
+ */
+static bool load_exec(exec_prog *e, const char *path, uint32_t memsz) {
+    size_t len, n;
+    *e = (exec_prog){.memsz = memsz};
+    if (!(e->src = read_file(path, &len))) {
+        fprintf(stderr, "asm374: failed to read %s\n", path);
+        return false;
+    }
+    if (!(e->img = calloc(memsz ? memsz : 1, sizeof(uint32_t)))) {
+        fprintf(stderr, "asm374: out of memory\n");
+        return false;
+    }
+
+    int line = 0;
+    Error err = ReadImage(e->src, NULL, UINT32_MAX, &n, &line);
+    if (!err) {
+        if (n > memsz) {
+            fprintf(stderr, "asm374: %s: image is larger than %u words\n", path, (unsigned)(memsz));
+            return false;
+        }
+        if ((err = ReadImage(e->src, e->img, n, &n, &line))) {
+            fprintf(stderr, "asm374: %s:%d: %s\n", path, line, GetError(err));
+            return false;
+        }
+        return true;
+    }
+
+    line = 0;
+    if ((err = split_file(&e->prog, path, e->src, len, &line)) || (err = LayoutProg(&e->prog, e->img, memsz, &line)) || (err = AssembleProg(e->prog, e->img, memsz, &line))) {
+        fprintf(stderr, "asm374: %s:%d: %s\n", path, line, GetError(err));
+        return false;
+    }
+    size_t cap = e->prog.len ? e->prog.len : 1;
+    uint32_t *off = malloc(cap * sizeof(uint32_t)), *idx = malloc(cap * sizeof(uint32_t));
+    e->label_addr = malloc(cap * sizeof(uint32_t));
+    e->label_name = malloc(cap * sizeof(char*));
+    e->map = (SrcMap){
+        .len   = 0,
+        .cap   = cap,
+        .line  = malloc(cap * sizeof(int)),
+        .addr  = malloc(cap * sizeof(uint32_t)),
+        .count = malloc(cap * sizeof(uint32_t)),
+        .order = malloc(cap * sizeof(uint32_t)),
+    };
+    if (!off || !idx || !e->label_addr || !e->label_name || !e->map.line || !e->map.addr || !e->map.count || !e->map.order || SrcMapProg(&e->map, e->prog)) {
+        fprintf(stderr, "asm374: out of memory\n");
+        return false;
+    }
+    for (size_t i = 0; i < e->prog.len; i++) {
+        off[i] = e->prog.tok[i].offset;
+        if (e->prog.tok[i].kind == ProgTokKind_Label)
+            idx[e->nlabel++] = (uint32_t)(i);
+    }
+    SortIdx(idx, e->nlabel, off);
+    for (size_t i = 0; i < e->nlabel; i++) {
+        e->label_addr[i] = off[idx[i]];
+        e->label_name[i] = e->prog.tok[idx[i]].value;
+    }
+    free(off);
+    free(idx);
+    return true;
+}
+
+/**
+ * Writes addr as the nearest label at or before it (label+N), or as hex if
+ * there isn't one, to str (min length 64).
+ */
+static char *exec_sym(char *str, const exec_prog *e, uint32_t addr) {
+    size_t lo = 0, hi = e->nlabel;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        if (e->label_addr[mid] <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (!lo)
+        return str + snprintf(str, 64, "0x%X", (unsigned)(addr));
+    if (e->label_addr[lo-1] == addr)
+        return str + snprintf(str, 64, "%s", e->label_name[lo-1]);
+    return str + snprintf(str, 64, "%s+%u", e->label_name[lo-1], (unsigned)(addr - e->label_addr[lo-1]));
+}
+
+/**
+ * Gets the number of instructions executed in context n and its callees.
+ */
+static uint64_t prof_total(const Prof *p, uint32_t n) {
+    uint64_t t = p->node[n].self;
+    for (uint32_t x = p->node[n].child; x; x = p->node[x].next)
+        t += prof_total(p, x);
+    return t;
+}
+
+/**
+ * Writes the calling context n and its callees, indented by depth.
+ */
+static void print_calls(FILE *f, const Prof *p, const exec_prog *e, uint32_t n, int depth) {
+    char sym[64];
+    exec_sym(sym, e, p->node[n].func);
+    fprintf(f, "%14llu %14llu %10llu  %*s%s\n", (unsigned long long)(prof_total(p, n)), (unsigned long long)(p->node[n].self), (unsigned long long)(p->node[n].calls), depth*2, "", sym);
+    for (uint32_t x = p->node[n].child; x; x = p->node[x].next)
+        print_calls(f, p, e, x, depth + 1);
+}
+
+/**
+ * Writes the profile as folded stacks (one line per context, with the
+ * function names from the root separated by semicolons, followed by the
+ * number of instructions executed in it), as used by flamegraph.pl and
+ * speedscope.
+ */
+static bool write_folded(FILE *f, const Prof *p, const exec_prog *e) {
+    uint32_t *path = malloc(p->node_len * sizeof(uint32_t));
+    if (!path)
+        return false;
+    for (uint32_t n = 0; n < p->node_len; n++) {
+        if (!p->node[n].self)
+            continue;
+        uint32_t d = 0;
+        for (uint32_t x = n; ; x = p->node[x].parent) {
+            path[d++] = x;
+            if (!x)
+                break;
+        }
+        while (d--) {
+            char sym[64];
+            exec_sym(sym, e, p->node[path[d]].func);
+            fprintf(f, "%s%c", sym, d ? ';' : ' ');
+        }
+        fprintf(f, "%llu\n", (unsigned long long)(p->node[n].self));
+    }
+    free(path);
+    fflush(f);
+    return !ferror(f);
+}
+
+/**
+ * Writes a report of the top hottest instructions, the loops (backward
+ * branches) by the number of instructions executed in them, and the calls
+ * between functions. Returns false if out of memory.
+ */
+static bool print_profile(FILE *f, const Cpu *c, const Prof *p, const exec_prog *e, uint32_t top, Error err) {
+    uint64_t total = c->steps ? c->steps : 1;
+    char sym[64], buf[64];
+    bool ok = false;
+    uint32_t *idx = malloc((c->memsz + 1) * sizeof(uint32_t));
+    uint32_t *rank = calloc(c->memsz + 1, sizeof(uint32_t));
+    uint64_t *sum = malloc((c->memsz + 1) * sizeof(uint64_t));
+    if (!idx || !rank || !sum) {
+        fprintf(stderr, "asm374: out of memory\n");
+        goto done;
+    }
+
+    fprintf(f, "%llu instructions, %s at %08X", (unsigned long long)(c->steps), err ? GetError(err) : c->halted ? "halted" : "stopped", (unsigned)(c->PC));
+    if (c->nout)
+        fprintf(f, ", out %08X (%llu writes)", (unsigned)(c->out), (unsigned long long)(c->nout));
+    fputc('\n', f);
+
+    // SortIdx sorts ascending by a uint32 key, so rank by the complement of
+    // the saturated count
+    uint32_t n = 0;
+    sum[0] = 0;
+    for (uint32_t a = 0; a < c->memsz; a++) {
+        if (p->hits[a])
+            idx[n++] = a;
+        rank[a] = ~(uint32_t)(p->hits[a] > UINT32_MAX ? UINT32_MAX : p->hits[a]);
+        sum[a+1] = sum[a] + p->hits[a];
+    }
+    SortIdx(idx, n, rank);
+    fprintf(f, "\nhot instructions:\n%14s %6s  %-8s %-24s %6s  %s\n", "count", "%", "addr", "symbol", "line", "instruction");
+    for (uint32_t i = 0; i < n && i < top; i++) {
+        uint32_t a = idx[i];
+        exec_sym(sym, e, a);
+        FormatInst(buf, DecodeInst(c->mem[a]));
+        fprintf(f, "%14llu %5.1f%%  %08X %-24s %6d  %s", (unsigned long long)(p->hits[a]), (double)(p->hits[a]) * 100 / (double)(total), (unsigned)(a), sym, SrcMapLine(&e->map, a), buf);
+        if (p->taken[a])
+            fprintf(f, " (taken %llu)", (unsigned long long)(p->taken[a]));
+        fputc('\n', f);
+    }
+
+    // loops (taken backward branches), by the instructions executed between
+    // the target and the branch
+    n = 0;
+    for (uint32_t a = 0; a < c->memsz; a++) {
+        uint32_t t;
+        if (p->taken[a] && ImageBranch(DecodeInst(c->mem[a]), a, &t) && t <= a) {
+            uint64_t body = sum[a+1] - sum[t];
+            rank[a] = ~(uint32_t)(body > UINT32_MAX ? UINT32_MAX : body);
+            idx[n++] = a;
+        }
+    }
+    SortIdx(idx, n, rank);
+    if (n)
+        fprintf(f, "\nhot loops:\n%14s %6s  %-8s %-24s %12s  %s\n", "count", "%", "head", "symbol", "iterations", "lines");
+    for (uint32_t i = 0; i < n && i < top; i++) {
+        uint32_t a = idx[i], t = a;
+        ImageBranch(DecodeInst(c->mem[a]), a, &t);
+        exec_sym(sym, e, t);
+        fprintf(f, "%14llu %5.1f%%  %08X %-24s %12llu  %d-%d\n", (unsigned long long)(sum[a+1] - sum[t]), (double)(sum[a+1] - sum[t]) * 100 / (double)(total), (unsigned)(t), sym, (unsigned long long)(p->taken[a]), SrcMapLine(&e->map, t), SrcMapLine(&e->map, a));
+    }
+
+    // calls
+    if (p->node_len > 1) {
+        fprintf(f, "\ncall graph:\n%14s %14s %10s  %s\n", "total", "self", "calls", "context");
+        print_calls(f, p, e, 0, 0);
+        if (p->node_len == p->node_cap || p->lost)
+            fprintf(f, "(call graph truncated)\n");
+    }
+    ok = true;
+done:
+    free(idx);
+    free(rank);
+    free(sum);
+    return ok;
+}
+
+/**
+ * Runs the program at path (see load_exec) for up to limit instructions with
+ * the input port set to in, writing a profile report with the top hottest
+ * instructions and loops to out, and folded stacks to folded if not NULL.
+ */
+static int profile_file(FILE *out, const char *path, uint32_t memsz, uint64_t limit, uint32_t in, uint32_t top, const char *folded) {
+    exec_prog e;
+    if (!load_exec(&e, path, memsz))
+        return 1;
+    Prof p = {
+        .hits      = calloc(memsz ? memsz : 1, sizeof(uint64_t)),
+        .taken     = calloc(memsz ? memsz : 1, sizeof(uint64_t)),
+        .node      = malloc(4096 * sizeof(ProfNode)),
+        .node_cap  = 4096,
+        .frame     = malloc(1024 * sizeof(ProfFrame)),
+        .depth_cap = 1024,
+    };
+    if (!p.hits || !p.taken || !p.node || !p.frame) {
+        fprintf(stderr, "asm374: out of memory\n");
+        return 1;
+    }
+    Cpu c;
+    CpuReset(&c, e.img, memsz);
+    c.in = in;
+    ProfReset(&p, c.PC);
+    Error err = ProfRun(&p, &c, limit);
+
+    if (!print_profile(out, &c, &p, &e, top, err))
+        return 1;
+    if (folded) {
+        FILE *f = fopen(folded, "w");
+        if (!f || !write_folded(f, &p, &e) || fclose(f)) {
+            fprintf(stderr, "asm374: failed to write %s\n", folded);
+            return 1;
+        }
+    }
+    fflush(out);
+    return ferror(out) || err;
+}
+
+/**
+ * Buffered output for binary traces.
+ */
+typedef struct trace_out {
+    FILE    *f;
+    uint8_t  buf[1<<16];
+    size_t   len;
+    bool     err;
+} trace_out;
+
+static void trace_flush(trace_out *t) {
+    if (t->len && fwrite(t->buf, 1, t->len, t->f) != t->len)
+        t->err = true;
+    t->len = 0;
+}
+
+/**
+ * Ensures there are at least n bytes free at the end of the buffer.
+ */
+static uint8_t *trace_reserve(trace_out *t, size_t n) {
+    if (t->len + n > sizeof(t->buf))
+        trace_flush(t);
+    return t->buf + t->len;
+}
+
+static uint8_t *put_u32be(uint8_t *b, uint32_t v) {
+    *b++ = (uint8_t)(v >> 24);
+    *b++ = (uint8_t)(v >> 16);
+    *b++ = (uint8_t)(v >> 8);
+    *b++ = (uint8_t)(v);
+    return b;
+}
+
+static const uint8_t *get_u32be(const uint8_t *b, const uint8_t *e, uint32_t *v) {
+    if (!b || e - b < 4)
+        return NULL;
+    *v = (uint32_t)(b[0]) << 24 | (uint32_t)(b[1]) << 16 | (uint32_t)(b[2]) << 8 | (uint32_t)(b[3]);
+    return b + 4;
+}
+
+#define CYC_BUS_A (CYC_SIG(CycSig_PCout) | CYC_SIG(CycSig_Rout) | CYC_SIG(CycSig_MDRout) | CYC_SIG(CycSig_HIout) | CYC_SIG(CycSig_LOout) | CYC_SIG(CycSig_InPortout) | CYC_SIG(CycSig_ZHIout) | CYC_SIG(CycSig_ZLOout))
+#define CYC_BUS_B (CYC_SIG(CycSig_RoutB) | CYC_SIG(CycSig_Cout))
+
+/**
+ * Writes the step in r to a cycle trace.
+ *
+ * The format is:
+ * - magic "C374", version 1 (written by the caller)
+ * - for each step:
+ *   - uvarint control vector
+ *   - big-endian bus A, if driven
+ *   - big-endian bus B, if driven
+ *   - big-endian bus C, if the ALU operation isn't CycAlu_None
+ *   - big-endian word read from memory, if Read
+ *   - big-endian high word of the ALU result, if Zin
+ */
+static void put_cycle(trace_out *t, const CycRec *r) {
+    uint8_t *b = trace_reserve(t, 10 + 5*4), *s = b;
+    b = put_uvarint(b, r->ctl);
+    if (r->ctl & CYC_BUS_A)
+        b = put_u32be(b, r->A);
+    if (r->ctl & CYC_BUS_B)
+        b = put_u32be(b, r->B);
+    if (CYC_GET_ALU(r->ctl) != CycAlu_None)
+        b = put_u32be(b, r->C);
+    if (r->ctl & CYC_SIG(CycSig_Read))
+        b = put_u32be(b, r->M);
+    if (r->ctl & CYC_SIG(CycSig_Zin))
+        b = put_u32be(b, r->ZHI);
+    t->len += (size_t)(b - s);
+}
+
+/**
+ * Reads a step written by put_cycle, returning NULL if it's invalid.
+ */
+static const uint8_t *get_cycle(const uint8_t *b, const uint8_t *e, CycRec *r) {
+    *r = (CycRec){0};
+    b = get_uvarint(b, e, &r->ctl);
+    if (b && (r->ctl & CYC_BUS_A))
+        b = get_u32be(b, e, &r->A);
+    if (b && (r->ctl & CYC_BUS_B))
+        b = get_u32be(b, e, &r->B);
+    if (b && CYC_GET_ALU(r->ctl) != CycAlu_None)
+        b = get_u32be(b, e, &r->C);
+    if (b && (r->ctl & CYC_SIG(CycSig_Read)))
+        b = get_u32be(b, e, &r->M);
+    if (b && (r->ctl & CYC_SIG(CycSig_Zin)))
+        b = get_u32be(b, e, &r->ZHI);
+    return b;
+}
+
+/**
+ * Runs the program at path (see load_exec) on the cycle-accurate model for up
+ * to limit instructions with the input port set to in, writing a cycle trace
+ * (see put_cycle) to out.
+ */
+static int cycles_file(FILE *out, const char *path, uint32_t memsz, uint64_t limit, uint32_t in) {
+    exec_prog e;
+    trace_out *t = malloc(sizeof(trace_out));
+    Cyc *y = malloc(sizeof(Cyc));
+    if (!t || !y) {
+        fprintf(stderr, "asm374: out of memory\n");
+        return 1;
+    }
+    if (!load_exec(&e, path, memsz))
+        return 1;
+    CycReset(y, e.img, memsz);
+    y->cpu.in = in;
+
+    *t = (trace_out){.f = out};
+    mem_move(t->buf, "C374\1", 5);
+    t->len = 5;
+
+    Error err = NoError;
+    CycRec r;
+    while (!y->cpu.halted && y->cpu.steps < limit && !(err = CycStep(y, &r)))
+        put_cycle(t, &r);
+    trace_flush(t);
+    if (t->err || fflush(out) || ferror(out)) {
+        fprintf(stderr, "asm374: failed to write output\n");
+        return 1;
+    }
+    fprintf(stderr, "asm374: %llu instructions, %llu cycles (CPI %.2f), %s at %08X\n",
+        (unsigned long long)(y->cpu.steps), (unsigned long long)(y->cycles),
+        y->cpu.steps ? (double)(y->cycles) / (double)(y->cpu.steps) : 0.0,
+        err ? GetError(err) : y->cpu.halted ? "halted" : "stopped", (unsigned)(y->cpu.PC));
+    free(t);
+    free(y);
+    return err != NoError;
+}
+
+/**
+ * Value Change Dump writer, which only writes variables which changed.
+ */
+typedef struct vcd_out {
+    FILE     *f;
+    uint64_t  time;
+    bool      stamped;
+    uint32_t  val[128];
+    bool      known[128]; // whether val has been written
+    uint8_t   width[128];
+    uint32_t  n;
+} vcd_out;
+
+/**
+ * Declares a variable of width bits, returning its index.
+ */
+static uint32_t vcd_var(vcd_out *v, const char *name, int width) {
+    uint32_t x = v->n++;
+    v->width[x] = (uint8_t)(width);
+    fprintf(v->f, "$var wire %d %c %s $end\n", width, '!' + (int)(x), name);
+    return x;
+}
+
+/**
+ * Sets variable x to val at the current time.
+ */
+static void vcd_set(vcd_out *v, uint32_t x, uint32_t val) {
+    if (v->known[x] && v->val[x] == val)
+        return;
+    if (!v->stamped) {
+        fprintf(v->f, "#%llu\n", (unsigned long long)(v->time));
+        v->stamped = true;
+    }
+    v->val[x] = val;
+    v->known[x] = true;
+    if (v->width[x] == 1) {
+        fprintf(v->f, "%c%c\n", val ? '1' : '0', '!' + (int)(x));
+        return;
+    }
+    char b[40], *s = b + sizeof(b) - 1;
+    *s = '\0';
+    do {
+        *--s = '0' + (val & 1);
+    } while (val >>= 1);
+    fprintf(v->f, "b%s %c\n", s, '!' + (int)(x));
+}
+
+/**
+ * Advances the current time.
+ */
+static void vcd_time(vcd_out *v, uint64_t time) {
+    v->time = time;
+    v->stamped = false;
+}
+
+/**
+ * Converts the cycles [from, to) of the cycle trace buf (see put_cycle) into a
+ * VCD with a 10ns clock (at the same times as if it were converted from the
+ * beginning), with the control signals and buses of each step, and the
+ * registers reconstructed from the transfers on bus C (updated on the next
+ * rising edge). The cycles before from are still decoded to reconstruct the
+ * registers.
+ */
+static bool cycles_vcd(FILE *f, const uint8_t *buf, size_t len, uint64_t from, uint64_t to) {
+    const uint8_t *b = buf + 5, *e = buf + len;
+    if (len < 5 || buf[0] != 'C' || buf[1] != '3' || buf[2] != '7' || buf[3] != '4' || buf[4] != 1)
+        return false;
+
+    vcd_out *v = calloc(1, sizeof(vcd_out));
+    if (!v)
+        return false;
+    v->f = f;
+    fprintf(f, "$version asm374 $end\n$timescale 1ns $end\n$scope module asm374 $end\n");
+    uint32_t clk = vcd_var(v, "clk", 1), T = vcd_var(v, "T", 3), alu = vcd_var(v, "ALU", 5);
+    uint32_t selA = vcd_var(v, "SelA", 2), selB = vcd_var(v, "SelB", 2), selC = vcd_var(v, "SelC", 2);
+    uint32_t sig = v->n;
+    for (int s = 0; s < CycSigCount; s++)
+        vcd_var(v, GetCycSig((CycSig)(s)), 1);
+    uint32_t busA = vcd_var(v, "BusA", 32), busB = vcd_var(v, "BusB", 32), busC = vcd_var(v, "BusC", 32);
+    uint32_t reg = v->n;
+    const char *names[] = {"PC", "IR", "MAR", "MDR", "HI", "LO", "ZHI", "ZLO", "OutPort"};
+    for (size_t x = 0; x < sizeof(names)/sizeof(*names); x++)
+        vcd_var(v, names[x], 32);
+    for (int x = 0; x < RegCount; x++)
+        vcd_var(v, GetReg((Reg)(x)), 32);
+    fprintf(f, "$upscope $end\n$enddefinitions $end\n");
+
+    // PC, IR, MAR, MDR, HI, LO, ZHI, ZLO, OutPort, R0-R15
+    uint32_t st[9 + RegCount] = {0};
+    uint64_t cyc = 0;
+    CycRec r;
+    for (; b < e && cyc < to; cyc++) {
+        if (!(b = get_cycle(b, e, &r)))
+            break;
+        if (cyc >= from) {
+            vcd_time(v, cyc*10);
+            vcd_set(v, clk, 1);
+            for (uint32_t x = 0; x < sizeof(st)/sizeof(*st); x++)
+                vcd_set(v, reg + x, st[x]);
+            vcd_set(v, T, CYC_GET_T(r.ctl));
+            vcd_set(v, alu, CYC_GET_ALU(r.ctl));
+            vcd_set(v, selA, CYC_GET_SELA(r.ctl));
+            vcd_set(v, selB, CYC_GET_SELB(r.ctl));
+            vcd_set(v, selC, CYC_GET_SELC(r.ctl));
+            for (int s = 0; s < CycSigCount; s++)
+                vcd_set(v, sig + (uint32_t)(s), (uint32_t)(r.ctl >> s) & 1);
+            vcd_set(v, busA, r.A);
+            vcd_set(v, busB, r.B);
+            vcd_set(v, busC, r.C);
+            vcd_time(v, cyc*10 + 5);
+            vcd_set(v, clk, 0);
+        }
+
+        if (r.ctl & CYC_SIG(CycSig_Read))      st[3] = r.M;
+        if (r.ctl & CYC_SIG(CycSig_PCin))      st[0] = r.C;
+        if (r.ctl & CYC_SIG(CycSig_IRin))      st[1] = r.C;
+        if (r.ctl & CYC_SIG(CycSig_MARin))     st[2] = r.C;
+        if (r.ctl & CYC_SIG(CycSig_MDRin))     st[3] = r.C;
+        if (r.ctl & CYC_SIG(CycSig_HIin))      st[4] = r.C;
+        if (r.ctl & CYC_SIG(CycSig_LOin))      st[5] = r.C;
+        if (r.ctl & CYC_SIG(CycSig_Zin))       st[6] = r.ZHI, st[7] = r.C;
+        if (r.ctl & CYC_SIG(CycSig_OutPortin)) st[8] = r.C;
+        if (r.ctl & CYC_SIG(CycSig_Rin))       st[9 + CycReg(DecodeInst(st[1]), CYC_GET_SELC(r.ctl))] = r.C;
+    }
+    if (cyc > from) {
+        vcd_time(v, cyc*10);
+        for (uint32_t x = 0; x < sizeof(st)/sizeof(*st); x++)
+            vcd_set(v, reg + x, st[x]);
+    }
+    free(v);
+    fflush(f);
+    return b && !ferror(f);
+}
+
+#define ETRACE_BLOCK     4096                // records per data block
+#define ETRACE_BLOCK_MAX (ETRACE_BLOCK * 11) // bytes per data block
+#define ETRACE_INDEX     256                 // data blocks per index block
+#define ETRACE_HDR       17                  // bytes per block header
+
+static uint8_t *put_u64be(uint8_t *b, uint64_t v) {
+    return put_u32be(put_u32be(b, (uint32_t)(v >> 32)), (uint32_t)(v));
+}
+
+static uint64_t get_u64be(const uint8_t *b) {
+    uint32_t hi, lo;
+    get_u32be(b, b + 4, &hi);
+    get_u32be(b + 4, b + 8, &lo);
+    return (uint64_t)(hi) << 32 | lo;
+}
+
+/**
+ * Streaming writer for execution traces, which contain the PC and IR of each
+ * retired instruction.
+ *
+ * The format is:
+ * - magic "T374", version 1
+ * - data blocks of up to ETRACE_BLOCK records, each one independent of the
+ *   others so it can be decoded on its own:
+ *   - 'D', big-endian u32 records, big-endian u32 bytes, big-endian u64 step
+ *     of the first record
+ *   - for each record:
+ *     - uvarint dictionary index of the IR, shifted left by 1, ORed with 1 if
+ *       the PC isn't the previous PC plus 1 (the previous PC starts at -1)
+ *     - uvarint zigzag PC minus the previous PC plus 1, if ORed with 1
+ *     - big-endian IR, if the index is the number of IRs seen in the block so
+ *       far (it's then added to the dictionary)
+ * - an index block after every ETRACE_INDEX data blocks, and before the end:
+ *   - 'I', big-endian u32 entries, big-endian u32 bytes (16 per entry),
+ *     big-endian u64 offset of the previous index block (0 if none)
+ *   - for each preceding data block since the last index block: big-endian
+ *     u64 step of its first record, big-endian u64 offset of the block
+ * - 'E', big-endian u64 offset of the last index block, big-endian u64 number
+ *   of records
+ *
+ * A trace without the end (e.g., if the program writing it was killed) can
+ * still be read up to the last complete block.
+ */
+typedef struct etrace_out {
+    trace_out t;
+    uint64_t  off;        // bytes written
+    uint64_t  step;       // records written
+    uint32_t  nrec;       // records in blk
+    uint32_t  pc;
+    size_t    len;
+    uint32_t  ndict;
+    uint32_t  dict[ETRACE_BLOCK];
+    uint16_t  slot[ETRACE_BLOCK*2]; // dictionary index + 1 of each IR by hash
+    uint8_t   blk[ETRACE_BLOCK_MAX];
+    uint32_t  nindex;
+    uint64_t  index_step[ETRACE_INDEX];
+    uint64_t  index_off[ETRACE_INDEX];
+    uint64_t  last_index;
+} etrace_out;
+
+static void etrace_write(etrace_out *w, const void *b, size_t n) {
+    mem_move(trace_reserve(&w->t, n), b, n);
+    w->t.len += n;
+    w->off += n;
+}
+
+static void etrace_begin(etrace_out *w, FILE *f) {
+    *w = (etrace_out){.t = {.f = f}, .pc = UINT32_MAX};
+    etrace_write(w, "T374\1", 5);
+}
+
+static void etrace_put_index(etrace_out *w) {
+    uint8_t h[ETRACE_HDR], *b = h;
+    *b++ = 'I';
+    b = put_u32be(b, w->nindex);
+    b = put_u32be(b, w->nindex*16);
+    put_u64be(b, w->last_index);
+    w->last_index = w->off;
+    etrace_write(w, h, sizeof(h));
+    for (uint32_t i = 0; i < w->nindex; i++)
+        etrace_write(w, put_u64be(put_u64be(h, w->index_step[i]), w->index_off[i]) - 16, 16);
+    w->nindex = 0;
+}
+
+static void etrace_put_block(etrace_out *w) {
+    if (!w->nrec)
+        return;
+    if (w->nindex == ETRACE_INDEX)
+        etrace_put_index(w);
+    w->index_step[w->nindex] = w->step - w->nrec;
+    w->index_off[w->nindex++] = w->off;
+
+    uint8_t h[ETRACE_HDR], *b = h;
+    *b++ = 'D';
+    b = put_u32be(b, w->nrec);
+    b = put_u32be(b, (uint32_t)(w->len));
+    put_u64be(b, w->step - w->nrec);
+    etrace_write(w, h, sizeof(h));
+    etrace_write(w, w->blk, w->len);
+
+    w->nrec = 0;
+    w->pc = UINT32_MAX;
+    w->len = 0;
+    w->ndict = 0;
+    for (size_t i = 0; i < sizeof(w->slot)/sizeof(*w->slot); i++)
+        w->slot[i] = 0;
+}
+
+/**
+ * Appends a retired instruction to the trace.
+ */
+static void etrace_put(etrace_out *w, uint32_t pc, uint32_t ir) {
+    uint32_t h = (ir * 0x9E3779B1u) >> 19, d = pc - w->pc - 1;
+    while (w->slot[h] && w->dict[w->slot[h] - 1] != ir)
+        h = (h + 1) & (ETRACE_BLOCK*2 - 1);
+    uint32_t x = w->slot[h] ? w->slot[h] - 1u : w->ndict;
+
+    uint8_t *b = w->blk + w->len;
+    b = put_uvarint(b, (uint64_t)(x) << 1 | !!d);
+    if (d)
+        b = put_uvarint(b, d << 1 ^ (0 - (d >> 31)));
+    if (x == w->ndict) {
+        b = put_u32be(b, ir);
+        w->dict[w->ndict++] = ir;
+        w->slot[h] = (uint16_t)(w->ndict);
+    }
+    w->len = (size_t)(b - w->blk);
+    w->pc = pc;
+    w->step++;
+    if (++w->nrec == ETRACE_BLOCK)
+        etrace_put_block(w);
+}
+
+/**
+ * Finishes the trace, returning false if writing it failed.
+ */
+static bool etrace_end(etrace_out *w) {
+    etrace_put_block(w);
+    etrace_put_index(w);
+    uint8_t h[ETRACE_HDR], *b = h;
+    *b++ = 'E';
+    put_u64be(put_u64be(b, w->last_index), w->step);
+    etrace_write(w, h, sizeof(h));
+    trace_flush(&w->t);
+    return !w->t.err && !fflush(w->t.f) && !ferror(w->t.f);
+}
+
+/**
+ * Streaming reader for execution traces (see etrace_out), from a mapped file
+ * (which can be seeked using the index) or a stream.
+ */
+typedef struct etrace_in {
+    FILE          *f;
+    const uint8_t *map;
+    size_t         len;
+    size_t         off;   // of the next block in map
+    const uint8_t *b, *e; // remaining data of the current block
+    uint32_t       left;  // records left in the current block
+    uint64_t       step;  // of the next record
+    uint32_t       pc;
+    uint32_t       ndict;
+    bool           err;
+    uint32_t       dict[ETRACE_BLOCK];
+    uint8_t        buf[ETRACE_BLOCK_MAX]; // if reading from f
+} etrace_in;
+
+/**
+ * Reads the next n bytes, returning NULL at the end.
+ */
+static const uint8_t *etrace_read(etrace_in *r, size_t n) {
+    if (r->f)
+        return n <= sizeof(r->buf) && fread(r->buf, 1, n, r->f) == n ? r->buf : NULL;
+    if (r->len - r->off < n)
+        return NULL;
+    r->off += n;
+    return r->map + r->off - n;
+}
+
+/**
+ * Checks the magic, returning false if buf (or the start of f if buf is NULL)
+ * isn't an execution trace.
+ */
+static bool etrace_open(etrace_in *r, FILE *f, const uint8_t *buf, size_t len) {
+    *r = (etrace_in){.f = buf ? NULL : f, .map = buf, .len = len};
+    const uint8_t *b = etrace_read(r, 5);
+    return b && b[0] == 'T' && b[1] == '3' && b[2] == '7' && b[3] == '4' && b[4] == 1;
+}
+
+/**
+ * Reads the next data block, returning false at the end or on error.
+ */
+static bool etrace_block(etrace_in *r) {
+    for (;;) {
+        if (!r->f && r->off == r->len)
+            return false; // no end marker, but the last block is complete
+        const uint8_t *h = etrace_read(r, ETRACE_HDR), *d;
+        if (!h) {
+            r->err = r->f ? ferror(r->f) || !feof(r->f) : true;
+            return false;
+        }
+        uint32_t n, len;
+        get_u32be(h + 1, h + 5, &n);
+        get_u32be(h + 5, h + 9, &len);
+        switch (h[0]) {
+        case 'D':
+            r->step = get_u64be(h + 9);
+            if (!n || n > ETRACE_BLOCK || len > ETRACE_BLOCK_MAX || !(d = etrace_read(r, len)))
+                return !(r->err = true);
+            r->b = d;
+            r->e = d + len;
+            r->left = n;
+            r->pc = UINT32_MAX;
+            r->ndict = 0;
+            return true;
+        case 'I':
+            if (n > ETRACE_INDEX || len != n*16 || !etrace_read(r, len))
+                return !(r->err = true);
+            break;
+        case 'E':
+            return false;
+        default:
+            return !(r->err = true);
+        }
+    }
+}
+
+/**
+ * Reads the next record, returning false at the end or on error.
+ */
+static bool etrace_next(etrace_in *r, uint32_t *pc, uint32_t *ir) {
+    while (!r->left)
+        if (!etrace_block(r))
+            return false;
+    uint64_t v, d = 0;
+    const uint8_t *b = get_uvarint(r->b, r->e, &v);
+    if (b && (v & 1))
+        b = get_uvarint(b, r->e, &d);
+    if (!b || (v >> 1) > r->ndict || d > UINT32_MAX)
+        return !(r->err = true);
+    if ((v >> 1) == r->ndict) {
+        if (!(b = get_u32be(b, r->e, &r->dict[r->ndict++])))
+            return !(r->err = true);
+    }
+    *ir = r->dict[v >> 1];
+    *pc = r->pc += 1 + ((uint32_t)(d) >> 1 ^ (0 - ((uint32_t)(d) & 1)));
+    r->b = b;
+    r->left--;
+    r->step++;
+    return true;
+}
 
-        // ORG
-        if (line[0] == 'O' && line[1] == 'R' && line[2] == 'G' && (line[3] == ' ' || line[3] == '\t')) {
-            if (ParseImm(32, false, &tok.offset, str_trim(&line[3])))
-                return Error_Prog_InvalidOrg;
-            continue;
+/**
+ * Skips to the record at step, using the index to find the data block
+ * containing it if the trace is mapped and complete, and skipping whole
+ * blocks without decoding them otherwise. Returns false if there is no such
+ * record or on error.
+ */
+static bool etrace_seek(etrace_in *r, uint64_t step) {
+    if (!r->f && r->len >= 5 + ETRACE_HDR && r->map[r->len - ETRACE_HDR] == 'E') {
+        uint64_t x = get_u64be(r->map + r->len - ETRACE_HDR + 1);
+        while (x) {
+            uint32_t n;
+            if (x > r->len - ETRACE_HDR || r->map[x] != 'I' || !get_u32be(r->map + x + 1, r->map + x + 5, &n) || (r->len - x - ETRACE_HDR) / 16 < n)
+                return !(r->err = true);
+            const uint8_t *e = r->map + x + ETRACE_HDR;
+            if (n && get_u64be(e) <= step) {
+                while (n > 1 && get_u64be(e + 16) <= step)
+                    e += 16, n--;
+                if ((r->off = (size_t)(get_u64be(e + 8))) > r->len)
+                    return !(r->err = true);
+                r->left = 0;
+                break;
+            }
+            uint64_t p = get_u64be(r->map + x + 9);
+            if (p >= x)
+                return !(r->err = true);
+            x = p;
         }
+    }
+    while (!r->left || r->step + r->left <= step) {
+        r->left = 0;
+        if (!etrace_block(r))
+            return false;
+    }
+    uint32_t pc, ir;
+    while (r->step < step)
+        if (!etrace_next(r, &pc, &ir))
+            return false;
+    return true;
+}
 
-        // DAT
-        if (line[0] == 'D' && line[1] == 'A' && line[2] == 'T' && (line[3] == ' ' || line[3] == '\t')) {
-            tok.kind = ProgTokKind_Data;
-            tok.value = str_trim(&line[3]);
-
-            // add the data
-            if (prog) {
-                if (prog->len >= prog->cap)
-                    return Error_Prog_TooMany;
-                prog->tok[prog->len++] = tok;
+/**
+ * Runs the program at path (see load_exec) for up to limit instructions with
+ * the input port set to in, writing the PC and IR of each retired instruction
+ * as an execution trace (see etrace_out) to out. If path is -, lines with the
+ * hex PC and IR are read from stdin instead (e.g., to convert a text trace
+ * from an RTL simulation).
+ */
+static int etrace_file(FILE *out, const char *path, uint32_t memsz, uint64_t limit, uint32_t in) {
+    etrace_out *w = malloc(sizeof(etrace_out));
+    if (!w) {
+        fprintf(stderr, "asm374: out of memory\n");
+        return 1;
+    }
+    etrace_begin(w, out);
+
+    Error err = NoError;
+    const char *res;
+    uint32_t pc;
+    if (str_eq(path, "-", false)) {
+        char buf[256];
+        int line = 0;
+        while (fgets(buf, sizeof(buf), stdin)) {
+            char *s = str_trim(buf), *x;
+            line++;
+            if (!*s)
+                continue;
+            uint32_t ir;
+            x = str_trim(str_spl(s, " \t"));
+            if (!x || !u32be_fromhex(&pc, s) || !u32be_fromhex(&ir, x)) {
+                fprintf(stderr, "asm374: stdin:%d: %s\n", line, GetError(Error_Mem_Syntax));
+                return 1;
             }
-
-            // next instruction
-            tok.offset++;
-            continue;
+            etrace_put(w, pc, ir);
+        }
+        if (ferror(stdin)) {
+            fprintf(stderr, "asm374: failed to read stdin\n");
+            return 1;
         }
+        res = "read";
+    } else {
+        exec_prog e;
+        if (!load_exec(&e, path, memsz))
+            return 1;
+        Cpu c;
+        CpuReset(&c, e.img, memsz);
+        c.in = in;
+        while (!c.halted && c.steps < limit && (pc = c.PC, !(err = CpuStep(&c))))
+            etrace_put(w, pc, c.IR);
+        res = err ? GetError(err) : c.halted ? "halted" : "stopped";
+    }
+    if (!etrace_end(w)) {
+        fprintf(stderr, "asm374: failed to write output\n");
+        return 1;
+    }
+    fprintf(stderr, "asm374: %llu instructions (%s), %llu bytes (%.2f per instruction)\n",
+        (unsigned long long)(w->step), res, (unsigned long long)(w->off), w->step ? (double)(w->off) / (double)(w->step) : 0.0);
+    free(w);
+    return err != NoError;
+}
 
-        // instruction
-        // note: line is already trimmed
-        if (*line) {
-            tok.kind = ProgTokKind_Inst;
-            tok.value = line;
+/**
+ * Converts the records [from, to) of the execution trace r (see etrace_out)
+ * into a VCD with a 10ns clock per instruction (at the same times as if it
+ * were converted from the beginning), or into lines with the step, PC, IR,
+ * and disassembled instruction if vcd is false.
+ */
+static bool etrace_dump(FILE *f, etrace_in *r, uint64_t from, uint64_t to, bool vcd) {
+    vcd_out *v = NULL;
+    uint32_t clk = 0, pcv = 0, irv = 0, opv = 0;
+    if (vcd) {
+        if (!(v = calloc(1, sizeof(vcd_out))))
+            return false;
+        v->f = f;
+        fprintf(f, "$version asm374 $end\n$timescale 1ns $end\n$scope module asm374 $end\n");
+        clk = vcd_var(v, "clk", 1);
+        pcv = vcd_var(v, "PC", 32);
+        irv = vcd_var(v, "IR", 32);
+        opv = vcd_var(v, "Opcode", 5);
+        fprintf(f, "$upscope $end\n$enddefinitions $end\n");
+    }
 
-            // add the instruction
-            if (prog) {
-                if (prog->len >= prog->cap)
-                    return Error_Prog_TooMany;
-                prog->tok[prog->len++] = tok;
+    uint32_t pc, ir;
+    if (from < to && etrace_seek(r, from)) {
+        while (r->step < to && etrace_next(r, &pc, &ir)) {
+            uint64_t step = r->step - 1;
+            if (v) {
+                vcd_time(v, step*10);
+                vcd_set(v, clk, 1);
+                vcd_set(v, pcv, pc);
+                vcd_set(v, irv, ir);
+                vcd_set(v, opv, ir >> 27);
+                vcd_time(v, step*10 + 5);
+                vcd_set(v, clk, 0);
+                continue;
             }
-
-            // next instruction
-            tok.offset++;
+            char line[128], dec[21], *s = dec + sizeof(dec);
+            do {
+                *--s = (char)('0' + step % 10);
+            } while (step /= 10);
+            char *e = line;
+            while (s < dec + sizeof(dec))
+                *e++ = *s++;
+            *e++ = ' ';
+            e = u32be_tohex(e, pc);
+            *e++ = ' ';
+            e = u32be_tohex(e, ir);
+            *e++ = ' ';
+            e = FormatInst(e, DecodeInst(ir));
+            *e++ = '\n';
+            fwrite(line, 1, (size_t)(e - line), f);
         }
     }
+    free(v);
+    fflush(f);
+    return !r->err && !ferror(f);
+}
 
-    // if (prog)
-    //     for (size_t i = 0; i < prog->len; i++)
-    //         printf("%04d: %d: %s%s\n", prog->tok[i].offset, prog->tok[i].line, prog->tok[i].label ? "LABEL " : "", prog->tok[i].value);
+/**
+ * Converts the records (instructions or cycles) [from, to) of the trace at
+ * path (or stdin for -, if it's an execution trace) to a VCD, or to text if
+ * vcd is false (only for execution traces).
+ */
+static int vcd_file(FILE *out, const char *path, uint64_t from, uint64_t to, bool vcd) {
+    const uint8_t *buf = NULL;
+    size_t len = 0;
+    bool std = str_eq(path, "-", false);
+    if (!std && !map_file(path, &buf, &len)) {
+        fprintf(stderr, "asm374: failed to read %s\n", path);
+        return 1;
+    }
+    etrace_in *r = malloc(sizeof(etrace_in));
+    if (!r) {
+        fprintf(stderr, "asm374: out of memory\n");
+        return 1;
+    }
+    bool ok;
+    if (etrace_open(r, stdin, buf, len)) {
+        ok = etrace_dump(out, r, from, to, vcd);
+    } else if (std || !vcd) {
+        fprintf(stderr, "asm374: %s: not an execution trace\n", path);
+        free(r);
+        return 1;
+    } else {
+        ok = cycles_vcd(out, buf, len, from, to);
+    }
+    free(r);
+    if (!ok) {
+        fprintf(stderr, "asm374: %s: invalid trace or failed to write output\n", path);
+        return 1;
+    }
+    return 0;
+}
 
-    return NoError;
+/**
+ * State for running random programs on multiple threads. In each round,
+ * thread t generates programs [first + t*n, first + (t+1)*n) into the lanes
+ * of b[t] (n lanes each), runs them, and writes their results to out[t].
+ */
+typedef struct batch_ctx {
+    GenInst   g;
+    uint32_t  seed;
+    uint32_t  count;
+    uint32_t  first;
+    Batch     b[MAX_THREADS];
+    char     *out[MAX_THREADS];
+    size_t    len[MAX_THREADS];
+    uint64_t  steps[MAX_THREADS];
+    uint32_t  halted[MAX_THREADS];
+    uint32_t  failed[MAX_THREADS];
+} batch_ctx;
+
+/**
+ * Gets the result of lane l of b for batch_file.
+ */
+static const char *batch_status(const Batch *b, uint32_t l) {
+    switch ((Error)(b->err[l])) {
+    case NoError:          return b->halted[l] ? "halt" : "limit";
+    case Error_Exec_Fetch: return "fetch";
+    case Error_Exec_Mem:   return "mem";
+    default:               return "inst";
+    }
 }
 
-static uint32_t AssembleProg_lookup(const char *sym, const void *data) {
-    const Prog *prog = (Prog*)(data);
-    for (size_t i = 0; i < prog->len; i++)
-        if (prog->tok[i].kind == ProgTokKind_Label && str_eq(prog->tok[i].value, sym, false))
-            return prog->tok[i].offset;
-    return ~(uint32_t)(0);
+static void batch_thread(void *data, uint32_t t) {
+    batch_ctx *c = data;
+    Batch *b = &c->b[t];
+    char *s = c->out[t];
+    uint32_t k = c->first + t*b->n, n = k < c->count ? (c->count - k < b->n ? c->count - k : b->n) : 0;
+    BatchReset(b);
+    for (uint32_t l = 0; l < b->n; l++) {
+        if (l < n)
+            GenInstProg(&c->g, c->seed, k + l, b->mem + (size_t)(l)*b->memsz, b->memsz);
+        else
+            b->err[l] = Error_Exec_Inst; // unused
+    }
+    BatchRun(b);
+    for (uint32_t l = 0; l < n; l++) {
+        c->steps[t] += b->steps[l];
+        c->halted[t] += b->halted[l];
+        c->failed[t] += !!b->err[l];
+        s = u32_todec(s, k + l);
+        *s++ = ' ';
+        s = str_ecpy(s, batch_status(b, l));
+        *s++ = ' ';
+        s = u32be_tohex(s, b->PC[l]);
+        *s++ = ' ';
+        s = u32_todec(s, b->steps[l]);
+        *s++ = ' ';
+        s = u32_todec(s, b->nout[l]);
+        *s++ = ' ';
+        s = u32be_tohex(s, b->hash[l]);
+        *s++ = '\n';
+    }
+    c->len[t] = (size_t)(s - c->out[t]);
 }
 
 /**
- * Assembles prog into out[n], writing the current line number into curline if
- * not NULL (which can be used for error context).
+ * Runs count random programs of memsz words satisfying opt, generated from
+ * seed, for up to limit instructions each (see Batch), and writes a line with
+ * the index, result (halt, limit, or the error: fetch, mem, or inst), PC,
+ * number of instructions executed, number of writes to the output port, and
+ * hash of the output of each one. If expect is not NULL, the lines are also
+ * compared against it, and the command fails if any of them differ. The
+ * output doesn't depend on the number of threads or on impl.
  */
-static Error AssembleProg(const Prog prog, uint32_t *out, size_t out_n, int *curline) {
-    // check for offset bounds/overlap
-    for (size_t i = 0; i < out_n; i++)
-        out[i] = 0;
-    for (size_t i = 0; i < prog.len; i++) {
-        if (curline)
-            *curline = prog.tok[i].line;
-        switch (prog.tok[i].kind) {
-        case ProgTokKind_Label:
-            break;
-        case ProgTokKind_Inst:
-        case ProgTokKind_Data:
-            if (prog.tok[i].offset >= out_n)
-                return Error_Prog_OutOfRange;
-            if (out[prog.tok[i].offset])
-                return Error_Prog_Overlap;
-            out[prog.tok[i].offset] = 1;
-            break;
+static int batch_file(FILE *out, uint32_t count, uint32_t memsz, const GenInstOpt *opt, uint32_t seed, uint32_t threads, uint32_t limit, BatchImpl impl, const char *expect) {
+    batch_ctx *c = calloc(1, sizeof(batch_ctx));
+    if (!c) {
+        fprintf(stderr, "asm374: out of memory\n");
+        return 1;
+    }
+    Error err;
+    if ((err = GenInstInit(&c->g, opt))) {
+        fprintf(stderr, "asm374: %s\n", GetError(err));
+        return 1;
+    }
+    size_t elen = 0;
+    const char *exp = NULL;
+    char *ebuf = NULL;
+    if (expect && !(exp = ebuf = read_file(expect, &elen))) {
+        fprintf(stderr, "asm374: failed to read %s\n", expect);
+        return 1;
+    }
+    c->seed = seed;
+    c->count = count;
+
+    // enough lanes to keep the threads busy, but not too much memory
+    uint32_t n = 256;
+    while (n > 1 && (uint64_t)(n)*memsz > 1<<22)
+        n /= 2;
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+    if (threads > (count + n - 1) / n)
+        threads = (count + n - 1) / n;
+    if (!threads)
+        threads = 1;
+    for (uint32_t t = 0; t < threads; t++) {
+        uint32_t *buf = malloc((size_t)(n) * (memsz + RegCount + 11) * sizeof(uint32_t));
+        if (!buf || !(c->out[t] = malloc((size_t)(n) * 64))) {
+            fprintf(stderr, "asm374: out of memory\n");
+            return 1;
         }
+        Batch *b = &c->b[t];
+        b->n = n;
+        b->memsz = memsz;
+        b->limit = limit;
+        b->impl = impl;
+        b->mem = buf;
+        b->R = (buf += (size_t)(n)*memsz);
+        b->HI = (buf += (size_t)(n)*RegCount);
+        b->LO = (buf += n);
+        b->PC = (buf += n);
+        b->in = (buf += n);
+        b->out = (buf += n);
+        b->nout = (buf += n);
+        b->hash = (buf += n);
+        b->steps = (buf += n);
+        b->halted = (buf += n);
+        b->err = (buf += n);
+        for (uint32_t l = 0; l < n; l++)
+            b->in[l] = 0;
     }
 
-    // assemble the instructions
-    for (size_t i = 0; i < out_n; i++)
-        out[i] = 0;
-    for (size_t i = 0; i < prog.len; i++) {
-        if (curline)
-            *curline = prog.tok[i].line;
-        switch (prog.tok[i].kind) {
-        case ProgTokKind_Label:
-            break;
-        case ProgTokKind_Inst:
-            {
-                Inst inst;
-                Error err = ParseInst(&inst, prog.tok[i].value, prog.tok[i].offset, &(SymCtx){
-                    .data = &prog,
-                    .lookup = AssembleProg_lookup,
-                });
-                if (err)
-                    return err;
-                out[prog.tok[i].offset] = EncodeInst(inst);
+    uint32_t bad = 0;
+    uint64_t t0 = now_ns();
+    for (c->first = 0; c->first < count; c->first = count - c->first > n*threads ? c->first + n*threads : count) {
+        run_threads(threads, batch_thread, c);
+        for (uint32_t t = 0; t < threads; t++) {
+            if (fwrite(c->out[t], 1, c->len[t], out) != c->len[t]) {
+                fprintf(stderr, "asm374: failed to write output\n");
+                return 1;
             }
-            break;
-        case ProgTokKind_Data:
-            {
-                Error err = ParseImm(32, true, &out[prog.tok[i].offset], prog.tok[i].value);
-                if (err)
-                    return err;
+            for (const char *s = c->out[t], *e = s + c->len[t]; exp && s < e; ) {
+                size_t xn = 0, yn = 0;
+                while (s[xn] != '\n')
+                    xn++;
+                while (exp[yn] && exp[yn] != '\n' && exp[yn] != '\r')
+                    yn++;
+                bool ok = xn == yn;
+                for (size_t i = 0; ok && i < xn; i++)
+                    ok = s[i] == exp[i];
+                if (!ok && bad++ < 10)
+                    fprintf(stderr, "asm374: %s: got %.*s, expected %.*s\n", expect, (int)(xn), s, (int)(yn), exp);
+                s += xn + 1;
+                exp += yn;
+                while (*exp == '\r' || *exp == '\n')
+                    exp++;
             }
-            break;
         }
     }
-    return NoError;
+    double sec = (double)(now_ns() - t0) / 1e9;
+
+    uint64_t steps = 0;
+    uint32_t halted = 0, failed = 0;
+    for (uint32_t t = 0; t < threads; t++)
+        steps += c->steps[t], halted += c->halted[t], failed += c->failed[t];
+    fprintf(stderr, "asm374: %u programs (%u halted, %u failed, %u hit the limit), %llu instructions in %.3f s (%.0f inst/s)\n",
+        (unsigned)(count), (unsigned)(halted), (unsigned)(failed), (unsigned)(count - halted - failed),
+        (unsigned long long)(steps), sec, sec > 0 ? (double)(steps) / sec : 0.0);
+    if (exp && *exp)
+        bad++, fprintf(stderr, "asm374: %s: more results than programs\n", expect);
+    if (bad)
+        fprintf(stderr, "asm374: %s: %u results differ\n", expect, (unsigned)(bad));
+
+    for (uint32_t t = 0; t < threads; t++)
+        free(c->b[t].mem), free(c->out[t]);
+    free(ebuf);
+    free(c);
+    return fflush(out) || ferror(out) || bad;
 }
 
-#if defined(__wasm__)
-#define export __attribute__((visibility("default")))
-
-// https://webassembly.org/roadmap/
-// https://clang.llvm.org/doxygen/Basic_2Targets_2WebAssembly_8cpp_source.html
+#define MEMTRACE_FETCH 0
+#define MEMTRACE_LD    1
+#define MEMTRACE_ST    2
 
-export char buf[16384]; // at least 512 for enough room to asm/dis/exp, but larger so we have room for entire programs
-static uint32_t ibuf[sizeof(buf) / 9]; // at most as many encoded instructions as we have room to encode in hex
-static ProgTok tok[4096]; // an arbitrary number
-static int line;
+/**
+ * Writes an access of kind to addr to a memory trace, where prev contains the
+ * last fetch and data addresses.
+ *
+ * The format is:
+ * - magic "M374", version 1 (written by the caller)
+ * - for each access: uvarint zigzag delta from the previous address of the
+ *   same stream (fetches or ld/st, starting at 0), shifted left by 2, ORed
+ *   with the kind (MEMTRACE_FETCH, MEMTRACE_LD, or MEMTRACE_ST)
+ */
+static void put_access(trace_out *t, uint32_t *prev, uint32_t kind, uint32_t addr) {
+    uint32_t *p = &prev[kind != MEMTRACE_FETCH], d = addr - *p;
+    *p = addr;
+    uint8_t *b = trace_reserve(t, 5), *s = b;
+    b = put_uvarint(b, (uint64_t)(d << 1 ^ (0 - (d >> 31))) << 2 | kind);
+    t->len += (size_t)(b - s);
+}
 
-export size_t bufsz(void) {
-    return sizeof(buf);
+/**
+ * Reads an access written by put_access, returning NULL if it's invalid.
+ */
+static const uint8_t *get_access(const uint8_t *b, const uint8_t *e, uint32_t *prev, uint32_t *kind, uint32_t *addr) {
+    uint64_t v;
+    if (!(b = get_uvarint(b, e, &v)) || v >> 34 || (v & 3) > MEMTRACE_ST)
+        return NULL;
+    uint32_t z = (uint32_t)(v >> 2), *p = &prev[(*kind = v & 3) != MEMTRACE_FETCH];
+    *addr = *p += z >> 1 ^ (0 - (z & 1));
+    return b;
 }
 
-export size_t buflen(void) {
-    return str_len(buf);
+/**
+ * Runs the program at path (see load_exec) for up to limit instructions with
+ * the input port set to in, writing the address of each instruction fetch, ld,
+ * and st as a memory trace (see put_access) to out.
+ */
+static int memtrace_file(FILE *out, const char *path, uint32_t memsz, uint64_t limit, uint32_t in) {
+    exec_prog e;
+    trace_out *t = malloc(sizeof(trace_out));
+    if (!t) {
+        fprintf(stderr, "asm374: out of memory\n");
+        return 1;
+    }
+    if (!load_exec(&e, path, memsz))
+        return 1;
+    Cpu c;
+    CpuReset(&c, e.img, memsz);
+    c.in = in;
+
+    *t = (trace_out){.f = out};
+    mem_move(t->buf, "M374\1", 5);
+    t->len = 5;
+
+    Error err = NoError;
+    uint32_t prev[2] = {0, 0};
+    uint64_t n[3] = {0};
+    while (!c.halted && c.steps < limit) {
+        uint32_t pc = c.PC;
+        if ((err = CpuStep(&c)))
+            break;
+        put_access(t, prev, MEMTRACE_FETCH, pc);
+        n[MEMTRACE_FETCH]++;
+        switch (c.IR >> 27) {
+        case 0: put_access(t, prev, MEMTRACE_LD, c.MA); n[MEMTRACE_LD]++; break;
+        case 2: put_access(t, prev, MEMTRACE_ST, c.MA); n[MEMTRACE_ST]++; break;
+        }
+    }
+    trace_flush(t);
+    if (t->err || fflush(out) || ferror(out)) {
+        fprintf(stderr, "asm374: failed to write output\n");
+        return 1;
+    }
+    fprintf(stderr, "asm374: %llu fetches, %llu loads, %llu stores, %s at %08X\n",
+        (unsigned long long)(n[MEMTRACE_FETCH]), (unsigned long long)(n[MEMTRACE_LD]), (unsigned long long)(n[MEMTRACE_ST]),
+        err ? GetError(err) : c.halted ? "halted" : "stopped", (unsigned)(c.PC));
+    free(t);
+    return err != NoError;
 }
 
-export void error(Error err) {
-    str_ecpy(buf, GetError(err));
+/**
+ * Parses a comma-separated list of up to max powers of two.
+ */
+static bool parse_pow2s(uint32_t *v, uint32_t *n, uint32_t max, char *s) {
+    for (*n = 0; s; (*n)++) {
+        char *x = s;
+        s = str_spl(x, ",");
+        if (*n == max || ParseImm(32, false, &v[*n], x) || !v[*n] || (v[*n] & (v[*n] - 1)))
+            return false;
+    }
+    return true;
 }
 
-export Error disassemble(void) {
-    return Disassemble(buf, buf);
+/**
+ * Parses a comma-separated list of CachePolicy names into a bitmask.
+ */
+static bool parse_policies(uint32_t *policies, char *s) {
+    for (*policies = 0; s; ) {
+        char *x = s;
+        s = str_spl(x, ",");
+        CachePolicy p;
+        for (p = 0; p < CachePolicyCount && !str_eq(x, GetCachePolicy(p), true); p++)
+            ;
+        if (p == CachePolicyCount)
+            return false;
+        *policies |= 1u << p;
+    }
+    return true;
 }
 
-export Error assemble(void) {
-    return Assemble(buf, buf);
+#define CACHE_CHUNK (1<<20)
+
+/**
+ * State for simulating caches on multiple threads. In each round, the main
+ * thread decodes up to CACHE_CHUNK accesses into addr and kind, then thread t
+ * replays them on the instruction and data caches of every threads-th
+ * configuration starting at t.
+ */
+typedef struct cache_ctx {
+    uint32_t  threads;
+    uint32_t  nconf;
+    Cache    *I;
+    Cache    *D;
+    size_t    n;
+    uint32_t *addr;
+    uint8_t  *kind;
+} cache_ctx;
+
+static void cache_thread(void *data, uint32_t t) {
+    cache_ctx *c = data;
+    for (uint32_t x = t; x < c->nconf; x += c->threads) {
+        Cache *I = &c->I[x], *D = &c->D[x];
+        for (size_t i = 0; i < c->n; i++) {
+            if (c->kind[i] == MEMTRACE_FETCH)
+                CacheAccess(I, c->addr[i], false);
+            else
+                CacheAccess(D, c->addr[i], c->kind[i] == MEMTRACE_ST);
+        }
+    }
 }
 
-export Error explain(void) {
-    return Explain(buf, buf);
+/**
+ * Replays the memory trace at path (see put_access, or stdin for -) on split
+ * instruction and data caches for each combination of the sizes, ways, lines
+ * (all in words), and policies (a bitmask of CachePolicy), and writes a table
+ * with the hit rates, writebacks, and the estimated number of memory cycles
+ * if a hit takes hit cycles, and a miss or writeback takes miss cycles, along
+ * with the speedup over no cache (every access taking miss cycles). The trace
+ * is read in chunks, so it can be arbitrarily large.
+ */
+static int cache_file(FILE *out, const char *path, const uint32_t *sizes, uint32_t nsizes, const uint32_t *ways, uint32_t nways, const uint32_t *lines, uint32_t nlines, uint32_t policies, uint32_t hit, uint32_t miss, uint32_t threads) {
+    cache_ctx c = {.nconf = 0};
+    uint32_t cap = nsizes * nways * nlines * CachePolicyCount;
+    uint8_t *buf = malloc(CACHE_CHUNK + 5);
+    c.I = malloc(cap * sizeof(Cache));
+    c.D = malloc(cap * sizeof(Cache));
+    c.addr = malloc(CACHE_CHUNK * sizeof(uint32_t));
+    c.kind = malloc(CACHE_CHUNK);
+    if (!buf || !c.I || !c.D || !c.addr || !c.kind) {
+        fprintf(stderr, "asm374: out of memory\n");
+        return 1;
+    }
+    for (uint32_t s = 0; s < nsizes; s++) {
+        for (uint32_t w = 0; w < nways; w++) {
+            for (uint32_t l = 0; l < nlines; l++) {
+                for (CachePolicy p = 0; p < CachePolicyCount; p++) {
+                    CacheConfig cfg = {sizes[s], ways[w], lines[l], p};
+                    uint32_t nb = CacheBlocks(cfg);
+                    if (!(policies & (1u << p)) || cfg.size / cfg.line < cfg.ways || (p != CachePolicy_LRU && cfg.ways == 1))
+                        continue; // invalid, or the same as LRU
+                    for (int d = 0; d < 2; d++) {
+                        uint32_t *tag = malloc(nb * sizeof(uint32_t));
+                        uint64_t *used = malloc(nb * sizeof(uint64_t));
+                        uint8_t *state = malloc(nb);
+                        if (!tag || !used || !state) {
+                            fprintf(stderr, "asm374: out of memory\n");
+                            return 1;
+                        }
+                        CacheInit(d ? &c.D[c.nconf] : &c.I[c.nconf], cfg, tag, used, state);
+                    }
+                    c.nconf++;
+                }
+            }
+        }
+    }
+    if (!c.nconf) {
+        fprintf(stderr, "asm374: %s\n", GetError(Error_Cache_Config));
+        return 1;
+    }
+    c.threads = threads > MAX_THREADS ? MAX_THREADS : threads < c.nconf ? threads : c.nconf;
+
+    bool std = str_eq(path, "-", false);
+    FILE *f = std ? stdin : fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "asm374: failed to read %s\n", path);
+        return 1;
+    }
+    size_t len = fread(buf, 1, 5, f);
+    if (len != 5 || buf[0] != 'M' || buf[1] != '3' || buf[2] != '7' || buf[3] != '4' || buf[4] != 1) {
+        fprintf(stderr, "asm374: %s: not a memory trace\n", path);
+        return 1;
+    }
+
+    uint64_t total = 0, t0 = now_ns();
+    uint32_t prev[2] = {0, 0};
+    bool eof = false;
+    len = 0;
+    while (!eof || len) {
+        size_t r = eof ? 0 : fread(buf + len, 1, CACHE_CHUNK - len, f);
+        if (r < CACHE_CHUNK - len)
+            eof = true;
+        len += r;
+
+        // the last access in the buffer may be incomplete if it isn't the end
+        const uint8_t *b = buf, *e = buf + len;
+        for (c.n = 0; b < e && c.n < CACHE_CHUNK && (eof || e - b >= 5); c.n++) {
+            uint32_t k;
+            if (!(b = get_access(b, e, prev, &k, &c.addr[c.n]))) {
+                fprintf(stderr, "asm374: %s: invalid trace\n", path);
+                return 1;
+            }
+            c.kind[c.n] = (uint8_t)(k);
+        }
+        len = (size_t)(e - b);
+        mem_move(buf, b, len);
+        total += c.n;
+        run_threads(c.threads, cache_thread, &c);
+    }
+    if (ferror(f)) {
+        fprintf(stderr, "asm374: failed to read %s\n", path);
+        return 1;
+    }
+    if (!std)
+        fclose(f);
+    double sec = (double)(now_ns() - t0) / 1e9;
+
+    fprintf(out, "%10s %5s %5s %-7s %8s %8s %12s %16s %8s\n", "size", "ways", "line", "policy", "I-hit%", "D-hit%", "writebacks", "cycles", "speedup");
+    for (uint32_t x = 0; x < c.nconf; x++) {
+        Cache *I = &c.I[x], *D = &c.D[x];
+        uint64_t ia = I->hits + I->misses, da = D->hits + D->misses;
+        double cyc = (double)(I->hits + D->hits) * hit + (double)(I->misses + D->misses + D->writebacks) * miss;
+        fprintf(out, "%10u %5u %5u %-7s %8.3f %8.3f %12llu %16.0f %8.3f\n",
+            (unsigned)(I->cfg.size), (unsigned)(I->cfg.ways), (unsigned)(I->cfg.line), GetCachePolicy(I->cfg.policy),
+            ia ? (double)(I->hits) * 100 / (double)(ia) : 0.0, da ? (double)(D->hits) * 100 / (double)(da) : 0.0,
+            (unsigned long long)(D->writebacks), cyc, cyc > 0 ? (double)(ia + da) * miss / cyc : 0.0);
+        free(I->tag), free(I->used), free(I->state);
+        free(D->tag), free(D->used), free(D->state);
+    }
+    fprintf(stderr, "asm374: %llu accesses, %u configurations in %.3f s (%.0f accesses/s per configuration)\n",
+        (unsigned long long)(total), (unsigned)(c.nconf), sec, sec > 0 ? (double)(total) * c.nconf / sec : 0.0);
+    free(buf), free(c.I), free(c.D), free(c.addr), free(c.kind);
+    return fflush(out) || ferror(out);
 }
 
-export Error prog_assemble(uint32_t memsz) {
-    if (memsz > sizeof(ibuf)/sizeof(*ibuf))
-        return Error_Prog_OutOfRange;
+/**
+ * Disassembles the memory image at path (in $readmemh or MIF format) into
+ * source which assembles back into it.
+ */
+static int disassemble_file(FILE *out, const char *path) {
+    size_t len, n;
+    char *src = read_file(path, &len);
+    if (!src) {
+        fprintf(stderr, "asm374: failed to read %s\n", path);
+        return 1;
+    }
 
-    Prog prog = {
-        .len = 0,
-        .cap = sizeof(tok) / sizeof(*tok),
-        .tok = tok,
-    };
+    int line = 0;
+    Error err = ReadImage(src, NULL, UINT32_MAX, &n, &line);
+    uint32_t *img = malloc((n ? n : 1) * sizeof(uint32_t));
+    uint8_t *tgt = malloc(n ? n : 1);
+    char *asmb = malloc(n * 64 + 1);
+    if (!img || !tgt || !asmb) {
+        fprintf(stderr, "asm374: out of memory\n");
+        return 1;
+    }
+    if (err || (err = ReadImage(src, img, n, &n, &line))) {
+        fprintf(stderr, "asm374: %s:%d: %s\n", path, line, GetError(err));
+        return 1;
+    }
 
-    Error err;
-    if ((err = SplitProg(&prog, buf, &line)))
-        return err;
-    if ((err = AssembleProg(prog, ibuf, memsz, &line)))
-        return err;
-    for (uint32_t i = 0; i < memsz; i++)
-        *u32be_tohex(&buf[i*9], ibuf[i]) = i+1 == memsz ? '\0' : (i+1)%8 == 0 ? '\n' : ' ';
-    return NoError;
+    char *end = DisassembleImage(asmb, img, n, tgt);
+    bool ok = fwrite(asmb, 1, end - asmb, out) == (size_t)(end - asmb) && !fflush(out);
+    free(src);
+    free(img);
+    free(tgt);
+    free(asmb);
+    return !ok;
 }
 
-export uint32_t prog_curline(void) {
-    return line;
+/**
+ * Loads an object from path if it ends with ".o", or assembles it otherwise.
+ *
+ * If cache is not NULL, it is a directory containing objects named after the
+ * hash of the source they were assembled from, which will be used instead of
+ * re-assembling the source if possible.
+ */
+static bool load_obj(Obj *obj, const char *path, const char *cache) {
+    size_t len = str_len(path);
+    if (len > 2 && path[len-2] == '.' && path[len-1] == 'o') {
+        uint8_t *buf = (uint8_t*)(read_file(path, &len));
+        if (!buf) {
+            fprintf(stderr, "asm374: failed to read %s\n", path);
+            return false;
+        }
+        if (!obj_decode(obj, buf, len)) {
+            fprintf(stderr, "asm374: %s: invalid object\n", path);
+            return false;
+        }
+        return true;
+    }
+
+    char *src = read_file(path, &len);
+    if (!src) {
+        fprintf(stderr, "asm374: failed to read %s\n", path);
+        return false;
+    }
+
+    char cpath[4096], ctmp[4096+8];
+    if (cache) {
+        uint64_t h = fnv1a64(0xCBF29CE484222325, "A374\2", 5);
+        h = fnv1a64(h, src, len);
+
+        char hex[17];
+        u32be_tohex(u32be_tohex(hex, (uint32_t)(h >> 32)), (uint32_t)(h));
+        if (str_len(cache) + 1 + 16 + 2 >= sizeof(cpath)) {
+            fprintf(stderr, "asm374: cache path too long\n");
+            return false;
+        }
+        str_ecpy(str_ecpy(str_ecpy(str_ecpy(cpath, cache), "/"), hex), ".o");
+        str_ecpy(str_ecpy(ctmp, cpath), ".tmp");
+
+        uint8_t *buf = (uint8_t*)(read_file(cpath, &len));
+        if (buf && obj_decode(obj, buf, len)) {
+            free(src);
+            return true;
+        }
+        free(buf);
+    }
+
+    int line = 0;
+    bool cacheable;
+    Error err = obj_assemble(obj, path, src, len, &line, &cacheable);
+    if (err) {
+        fprintf(stderr, "asm374: %s:%d: %s\n", path, line, GetError(err));
+        return false;
+    }
+
+    if (cache && cacheable) {
+        uint8_t *buf = obj_encode(obj, &len);
+        FILE *f = buf ? fopen(ctmp, "wb") : NULL;
+        if (f) {
+            bool ok = fwrite(buf, 1, len, f) == len;
+            ok = !fclose(f) && ok;
+            remove(cpath);
+            if (!ok || rename(ctmp, cpath))
+                remove(ctmp);
+        }
+        free(buf);
+    }
+    return true;
 }
 
-#elif !defined(TESTS)
-#include <stdio.h>
-#include <stdlib.h>
-#ifdef _WIN32
-#include <io.h>
+/**
+ * Writes the Stats collected while running to stderr.
+ */
+static void print_stats(void) {
+#if defined(STATS)
+    uint64_t total = 0;
+    for (StatPhase p = 0; p < StatPhaseCount; p++)
+        total += stats_total.ns[p];
+    for (StatPhase p = 0; p < StatPhaseCount; p++)
+        fprintf(stderr, "asm374: stats: %-8s %10.3f ms %5.1f%%\n", GetStatPhase(p), (double)(stats_total.ns[p]) / 1e6, total ? (double)(stats_total.ns[p]) * 100 / (double)(total) : 0.0);
+    fprintf(stderr, "asm374: stats: %llu tokens, %llu labels, %llu lookups, %llu bytes in, %llu bytes out\n",
+        (unsigned long long)(stats_total.tokens), (unsigned long long)(stats_total.labels), (unsigned long long)(stats_total.lookups),
+        (unsigned long long)(stats_total.bytes_in), (unsigned long long)(stats_total.bytes_out));
 #else
-#include <unistd.h>
+    fprintf(stderr, "asm374: stats: not available (built without -DSTATS)\n");
 #endif
+}
+
+static int usage(void) {
+    fprintf(stderr, "usage: asm374 [-m words] [-o output] [-f format] [-C cachedir] [-c] [-M] [-k] [-l listing] [--stats] [file...]\n");
+    fprintf(stderr, "       asm374 [-o output] -d image\n");
+    fprintf(stderr, "       asm374 [-m words] [-o output] [-f format|asm] [--seed n] [--threads n] [--weights op=n,...] [--avoid reg,...] [--no-r0-base] --gen count\n");
+    fprintf(stderr, "       asm374 [-o database] [-f hex|bin|binle] [--threads n] --cover file...\n");
+    fprintf(stderr, "       asm374 [-m words] [-o results] [--steps n] [--seed n] [--threads n] [--weights op=n,...] [--avoid reg,...] [--no-r0-base] [--simd impl] [--expect results] --batch count\n");
+    fprintf(stderr, "       asm374 [-o output] [--threads n] --vectors\n");
+    fprintf(stderr, "       asm374 [-m words] [-o report] [--steps n] [--in n] [--top n] [--folded output] --profile file\n");
+    fprintf(stderr, "       asm374 [-m words] [-o trace] [--steps n] [--in n] --cycles file\n");
+    fprintf(stderr, "       asm374 [-m words] [-o trace] [--steps n] [--in n] --trace file|-\n");
+    fprintf(stderr, "       asm374 [-o output.vcd] [--from n] [--to n] --vcd trace\n");
+    fprintf(stderr, "       asm374 [-o output] [--from n] [--to n] --dump trace\n");
+    fprintf(stderr, "       asm374 [-m words] [-o trace] [--steps n] [--in n] --memtrace file\n");
+    fprintf(stderr, "       asm374 [-o report] [--threads n] [--sizes n,...] [--ways n,...] [--lines n,...] [--policies lru,fifo,random] [--hit n] [--miss n] --cache trace\n");
+    return 2;
+}
+
+/**
+ * This command reads lines of either 8-digit hex instructions to disassemble,
+ * or assembly code to assemble.
+ *
+ * If not running interactively, the original input will be echoed back if an
+ * error occurs during assembly/disassembly.
+ *
+ * If files are specified, they are assembled as programs instead. With -c, each
+ * one is assembled into a relocatable object (named after the source file
+ * unless -o is specified). Otherwise, the files (or objects ending in .o) are
+ * linked one after another into a memory image of -m words. With -M, the memory
+ * map is written to stderr. With -k, every error in a single source file being
+ * assembled into a memory image is reported, rather than only the first one.
+ * With -l, a listing of a single source file is written. With -f, the memory
+ * image is written as hex (the default), bin, binle, ihex, mif, or memh.
+ *
+ * With -d, a memory image ($readmemh or MIF) is disassembled into source.
+ *
+ * With --gen, count random programs of -m words are generated (see GenInst) as
+ * memory images, or as source with -f asm. Each program only depends on
+ * --seed and its index, so the output is the same for any number of
+ * --threads (default: one per CPU). --weights sets the relative frequency of
+ * opcodes (all 1 by default, * for all of them), --avoid excludes registers,
+ * and --no-r0-base avoids absolute addresses in ld, ldi, and st. Multiple
+ * programs can only be written as asm, hex, bin, or binle.
+ *
+ * With --batch, count random programs (generated like --gen) are executed for
+ * up to --steps instructions each, many at a time in lock-step (see Batch) on
+ * each thread, and the result of each program is written (see batch_file).
+ * With --expect, the results are compared against a previous run (e.g., one
+ * with --simd scalar, which runs the programs one after another with CpuRun,
+ * rather than avx512 if the CPU supports it).
+ *
+ * With --cover, the instructions in each file (memory images, raw words with -f
+ * bin or binle, or hex words from stdin for -) are counted by opcode, register,
+ * condition, and immediate class, and the combinations and values which never
+ * occurred are written to stdout. The counts are written to -o, which can be
+ * passed to --cover again to merge it with more files.
+ *
+ * With --vectors, golden test vectors for an RTL instruction decoder (see
+ * VecInit and VecFormat) are written in $readmemh format.
+ *
+ * With --profile, a memory image or source file is executed (see Cpu) for up
+ * to --steps instructions (default 10^9) with --in on the input port, and the
+ * --top (default 20) hottest instructions and loops and the call graph are
+ * written, with folded stacks for flamegraphs to --folded.
+ *
+ * With --cycles, the program is executed like --profile on the cycle-accurate
+ * datapath model (see Cyc), and the control vector and buses of each step
+ * are written as a binary trace (see put_cycle), which --vcd converts to a
+ * VCD.
+ *
+ * With --trace, the program is executed like --profile, and the PC and IR of
+ * each retired instruction are written as a compact execution trace (see
+ * etrace_out), or a text trace with a hex PC and IR on each line is read from
+ * stdin for -. --vcd converts the instructions from --from to --to (default:
+ * all of them) to a VCD, and --dump to disassembled text, seeking to the
+ * first one using the index rather than decoding the whole trace. For cycle
+ * traces, --from and --to are cycles, and the trace is decoded from the start.
+ *
+ * With --memtrace, the program is executed like --profile, and the address of
+ * each instruction fetch, ld, and st is written as a binary trace (see
+ * put_access). With --cache, a trace (or stdin for -) is replayed on split
+ * instruction and data caches (see Cache) for every combination of --sizes,
+ * --ways, and --lines (in words) and --policies, in parallel on --threads, and
+ * the hit rates and estimated memory cycles (with --hit and --miss cycles per
+ * access) are written.
+ *
+ * With --stats, the time spent in each phase of assembly and the number of
+ * tokens, labels, symbol lookups, and bytes processed are written to stderr on
+ * exit (if built with -DSTATS).
+ */
+int main(int argc, char **argv) {
+    uint32_t memsz = 512;
+    const char *output = NULL, *cache = NULL, *listing = NULL;
+    bool compile = false, map = false, all = false, disasm = false;
+    ImageFormat fmt = ImageFormat_Hex;
+    bool source = false, gen = false, batch = false, cover = false, vectors = false, profile = false, cycles = false, vcd = false, memtrace = false, cachesim = false, etrace = false, dump = false;
+    uint32_t sizes[16] = {64, 256, 1024, 4096}, ways[16] = {1, 2, 4}, lines[16] = {1, 4};
+    uint32_t nsizes = 4, nways = 3, nlines = 2, policies = 1u << CachePolicy_LRU | 1u << CachePolicy_FIFO, hit = 1, miss = 20;
+    uint64_t steps = 1000000000, from = 0, to = UINT64_MAX;
+    uint32_t in = 0, top = 20;
+    const char *folded = NULL, *expect = NULL;
+    BatchImpl impl = BatchImpl_Auto;
+    uint32_t count = 0, seed = 1, threads = 0;
+    GenInstOpt gopt = {.avoid = 0, .no_r0_base = false};
+    for (int op = 0; op < 1<<5; op++)
+        gopt.weight[op] = 1;
+    int nfile = 0;
+    for (int i = 1; i < argc; i++) {
+        if (str_eq(argv[i], "-m", false)) {
+            if (++i == argc || ParseImm(32, false, &memsz, argv[i]))
+                return usage();
+        } else if (str_eq(argv[i], "-o", false)) {
+            if (++i == argc)
+                return usage();
+            output = argv[i];
+        } else if (str_eq(argv[i], "-f", false)) {
+            if (++i == argc)
+                return usage();
+            for (fmt = 0; fmt < ImageFormatCount && !str_eq(argv[i], GetImageFormat(fmt), true); fmt++)
+                ;
+            if ((source = str_eq(argv[i], "asm", true)))
+                fmt = ImageFormat_Hex;
+            else if (fmt == ImageFormatCount)
+                return usage();
+        } else if (str_eq(argv[i], "-l", false)) {
+            if (++i == argc)
+                return usage();
+            listing = argv[i];
+        } else if (str_eq(argv[i], "-C", false)) {
+            if (++i == argc)
+                return usage();
+            cache = argv[i];
+        } else if (str_eq(argv[i], "-c", false)) {
+            compile = true;
+        } else if (str_eq(argv[i], "-M", false)) {
+            map = true;
+        } else if (str_eq(argv[i], "-k", false)) {
+            all = true;
+        } else if (str_eq(argv[i], "-d", false)) {
+            disasm = true;
+        } else if (str_eq(argv[i], "--stats", false)) {
+            atexit(print_stats);
+        } else if (str_eq(argv[i], "--gen", false)) {
+            if (++i == argc || ParseImm(32, false, &count, argv[i]))
+                return usage();
+            gen = true;
+        } else if (str_eq(argv[i], "--batch", false)) {
+            if (++i == argc || ParseImm(32, false, &count, argv[i]))
+                return usage();
+            batch = true;
+        } else if (str_eq(argv[i], "--expect", false)) {
+            if (++i == argc)
+                return usage();
+            expect = argv[i];
+        } else if (str_eq(argv[i], "--simd", false)) {
+            if (++i == argc)
+                return usage();
+            for (impl = 0; impl < BatchImplCount && !str_eq(argv[i], GetBatchImpl(impl), true); impl++)
+                ;
+            if (impl == BatchImplCount)
+                return usage();
+        } else if (str_eq(argv[i], "--cycles", false)) {
+            cycles = true;
+        } else if (str_eq(argv[i], "--vcd", false)) {
+            vcd = true;
+        } else if (str_eq(argv[i], "--trace", false)) {
+            etrace = true;
+        } else if (str_eq(argv[i], "--dump", false)) {
+            dump = true;
+        } else if (str_eq(argv[i], "--from", false)) {
+            char *end;
+            if (++i == argc || (from = strtoull(argv[i], &end, 0), *end))
+                return usage();
+        } else if (str_eq(argv[i], "--to", false)) {
+            char *end;
+            if (++i == argc || (to = strtoull(argv[i], &end, 0), *end))
+                return usage();
+        } else if (str_eq(argv[i], "--memtrace", false)) {
+            memtrace = true;
+        } else if (str_eq(argv[i], "--cache", false)) {
+            cachesim = true;
+        } else if (str_eq(argv[i], "--sizes", false)) {
+            if (++i == argc || !parse_pow2s(sizes, &nsizes, 16, argv[i]))
+                return usage();
+        } else if (str_eq(argv[i], "--ways", false)) {
+            if (++i == argc || !parse_pow2s(ways, &nways, 16, argv[i]))
+                return usage();
+        } else if (str_eq(argv[i], "--lines", false)) {
+            if (++i == argc || !parse_pow2s(lines, &nlines, 16, argv[i]))
+                return usage();
+        } else if (str_eq(argv[i], "--policies", false)) {
+            if (++i == argc || !parse_policies(&policies, argv[i]))
+                return usage();
+        } else if (str_eq(argv[i], "--hit", false)) {
+            if (++i == argc || ParseImm(32, false, &hit, argv[i]))
+                return usage();
+        } else if (str_eq(argv[i], "--miss", false)) {
+            if (++i == argc || ParseImm(32, false, &miss, argv[i]))
+                return usage();
+        } else if (str_eq(argv[i], "--profile", false)) {
+            profile = true;
+        } else if (str_eq(argv[i], "--steps", false)) {
+            char *end;
+            if (++i == argc || !(steps = strtoull(argv[i], &end, 0)) || *end)
+                return usage();
+        } else if (str_eq(argv[i], "--in", false)) {
+            if (++i == argc || ParseImm(32, true, &in, argv[i]))
+                return usage();
+        } else if (str_eq(argv[i], "--top", false)) {
+            if (++i == argc || ParseImm(32, false, &top, argv[i]))
+                return usage();
+        } else if (str_eq(argv[i], "--folded", false)) {
+            if (++i == argc)
+                return usage();
+            folded = argv[i];
+        } else if (str_eq(argv[i], "--vectors", false)) {
+            vectors = true;
+        } else if (str_eq(argv[i], "--cover", false)) {
+            cover = true;
+        } else if (str_eq(argv[i], "--seed", false)) {
+            if (++i == argc || ParseImm(32, false, &seed, argv[i]))
+                return usage();
+        } else if (str_eq(argv[i], "--threads", false)) {
+            if (++i == argc || ParseImm(32, false, &threads, argv[i]))
+                return usage();
+        } else if (str_eq(argv[i], "--weights", false)) {
+            if (++i == argc || !parse_weights(gopt.weight, argv[i]))
+                return usage();
+        } else if (str_eq(argv[i], "--avoid", false)) {
+            if (++i == argc || !parse_regs(&gopt.avoid, argv[i]))
+                return usage();
+        } else if (str_eq(argv[i], "--no-r0-base", false)) {
+            gopt.no_r0_base = true;
+        } else if (argv[i][0] == '-' && ((!cover && !cachesim && !etrace && !vcd && !dump) || argv[i][1])) {
+            return usage();
+        } else {
+            argv[++nfile] = argv[i];
+        }
+    }
+
+    if (gen) {
+        if (nfile || batch || expect || impl || disasm || compile || map || all || listing || cache || !memsz)
+            return usage();
+        if (count > 1 && !source && fmt != ImageFormat_Hex && fmt != ImageFormat_Bin && fmt != ImageFormat_BinLE)
+            return usage();
+        FILE *out = output ? fopen(output, "wb") : stdout;
+        if (!out) {
+            fprintf(stderr, "asm374: failed to open %s\n", output);
+            return 1;
+        }
+        return generate_file(out, count, memsz, source ? -1 : (int)(fmt), &gopt, seed, threads ? threads : num_cpus()) || (output && fclose(out));
+    }
+
+    if (source)
+        return usage();
+
+    if (batch) {
+        if (nfile || cycles || vcd || dump || etrace || memtrace || cachesim || profile || vectors || cover || disasm || compile || map || all || listing || cache || !memsz || steps > UINT32_MAX)
+            return usage();
+        FILE *out = output ? fopen(output, "w") : stdout;
+        if (!out) {
+            fprintf(stderr, "asm374: failed to open %s\n", output);
+            return 1;
+        }
+        return batch_file(out, count, memsz, &gopt, seed, threads ? threads : num_cpus(), (uint32_t)(steps), impl, expect) || (output && fclose(out));
+    }
+    if (expect || impl || ((from || to != UINT64_MAX) && !vcd && !dump))
+        return usage();
+
+    if (cachesim) {
+        if (nfile != 1 || cycles || vcd || dump || etrace || memtrace || profile || vectors || cover || disasm || compile || map || all || listing || cache)
+            return usage();
+        FILE *out = output ? fopen(output, "w") : stdout;
+        if (!out) {
+            fprintf(stderr, "asm374: failed to open %s\n", output);
+            return 1;
+        }
+        return cache_file(out, argv[1], sizes, nsizes, ways, nways, lines, nlines, policies, hit, miss, threads ? threads : num_cpus()) || (output && fclose(out));
+    }
+
+    if (cycles || vcd || dump || etrace || memtrace) {
+        if (nfile != 1 || cycles + vcd + dump + etrace + memtrace != 1 || profile || vectors || cover || disasm || compile || map || all || listing || cache || !memsz)
+            return usage();
+        FILE *out = output ? fopen(output, vcd || dump ? "w" : "wb") : stdout;
+        if (!out) {
+            fprintf(stderr, "asm374: failed to open %s\n", output);
+            return 1;
+        }
+        if (memtrace)
+            return memtrace_file(out, argv[1], memsz, steps, in) || (output && fclose(out));
+        if (etrace)
+            return etrace_file(out, argv[1], memsz, steps, in) || (output && fclose(out));
+        return (cycles ? cycles_file(out, argv[1], memsz, steps, in) : vcd_file(out, argv[1], from, to, vcd)) || (output && fclose(out));
+    }
+
+    if (profile) {
+        if (nfile != 1 || vectors || cover || disasm || compile || map || all || listing || cache || !memsz)
+            return usage();
+        FILE *out = output ? fopen(output, "w") : stdout;
+        if (!out) {
+            fprintf(stderr, "asm374: failed to open %s\n", output);
+            return 1;
+        }
+        return profile_file(out, argv[1], memsz, steps, in, top, folded) || (output && fclose(out));
+    }
+
+    if (vectors) {
+        if (nfile || cover || disasm || compile || map || all || listing || cache)
+            return usage();
+        FILE *out = output ? fopen(output, "wb") : stdout;
+        if (!out) {
+            fprintf(stderr, "asm374: failed to open %s\n", output);
+            return 1;
+        }
+        return vectors_file(out, threads ? threads : num_cpus()) || (output && fclose(out));
+    }
+
+    if (cover) {
+        if (!nfile || disasm || compile || map || all || listing || cache)
+            return usage();
+        if (fmt != ImageFormat_Hex && fmt != ImageFormat_Bin && fmt != ImageFormat_BinLE)
+            return usage();
+        Cover *cov = calloc(1, sizeof(Cover));
+        if (!cov) {
+            fprintf(stderr, "asm374: out of memory\n");
+            return 1;
+        }
+        for (int i = 1; i <= nfile; i++)
+            if (!cover_file(cov, argv[i], fmt, threads ? threads : num_cpus()))
+                return 1;
+        if (output) {
+            FILE *out = fopen(output, "w");
+            if (!out || !write_cover(out, cov) || fclose(out)) {
+                fprintf(stderr, "asm374: failed to write %s\n", output);
+                return 1;
+            }
+        }
+        print_cover(stdout, cov);
+        free(cov);
+        return fflush(stdout) != 0;
+    }
+
+    if (disasm) {
+        if (nfile != 1 || compile || map || all || listing || cache)
+            return usage();
+        FILE *out = output ? fopen(output, "w") : stdout;
+        if (!out) {
+            fprintf(stderr, "asm374: failed to open %s\n", output);
+            return 1;
+        }
+        return disassemble_file(out, argv[1]) || (output && fclose(out));
+    }
+
+    if (compile) {
+        if (!nfile || (output && nfile != 1))
+            return usage();
+        for (int i = 1; i <= nfile; i++) {
+            char opath[4096];
+            if (!output) {
+                char *ext = NULL;
+                if (!str_ecpyn(opath, argv[i], sizeof(opath) - 2))
+                    return usage();
+                for (char *c = opath; *c; c++)
+                    ext = *c == '.' ? c : *c == '/' || *c == '\\' ? NULL : ext;
+                str_ecpy(ext ? ext : opath + str_len(opath), ".o");
+            }
+
+            Obj obj;
+            if (!load_obj(&obj, argv[i], cache))
+                return 1;
+
+            size_t len;
+            uint8_t *buf = obj_encode(&obj, &len);
+            FILE *f = buf ? fopen(output ? output : opath, "wb") : NULL;
+            if (!f || fwrite(buf, 1, len, f) != len || fclose(f)) {
+                fprintf(stderr, "asm374: failed to write %s\n", output ? output : opath);
+                return 1;
+            }
+            free(buf);
+        }
+        return 0;
+    }
+
+    if (nfile) {
+        FILE *out = output ? fopen(output, "wb") : stdout;
+        if (!out) {
+            fprintf(stderr, "asm374: failed to open %s\n", output);
+            return 1;
+        }
+        if (nfile == 1 && !cache) {
+            size_t len = str_len(argv[1]);
+            if (len < 2 || argv[1][len-2] != '.' || argv[1][len-1] != 'o')
+                return assemble_file(out, argv[1], memsz, map, all, listing, fmt) || (output && fclose(out));
+        }
+        if (listing)
+            return usage();
+
+        Obj *obj = malloc(nfile * sizeof(Obj));
+        uint32_t *img = malloc((memsz ? memsz : 1) * sizeof(uint32_t));
+        if (!obj || !img) {
+            fprintf(stderr, "asm374: out of memory\n");
+            return 1;
+        }
+        size_t nsec = 0;
+        for (int i = 0; i < nfile; i++) {
+            if (!load_obj(&obj[i], argv[i+1], cache))
+                return 1;
+            nsec += obj[i].sec_len;
+        }
 
-static bool is_interactive(void) {
-#ifdef _WIN32
-    return _isatty(_fileno(stdin));
-#else
-    return isatty(STDIN_FILENO);
-#endif
-}
+        Prog lay = {
+            .len     = 0,
+            .cap     = nfile + nsec,
+            .tok     = malloc((nfile + nsec) * sizeof(ProgTok)),
+            .sec_len = 0,
+            .sec_cap = nsec,
+            .sec     = malloc((nsec ? nsec : 1) * sizeof(ProgSec)),
+            .bin     = {0},
+        };
+        if (!lay.tok || !lay.sec) {
+            fprintf(stderr, "asm374: out of memory\n");
+            return 1;
+        }
+
+        size_t curobj = 0;
+        const char *cursym = NULL;
+        Error err = LinkObj(obj, nfile, &lay, img, memsz, &curobj, &cursym);
+        if (err) {
+            if (cursym)
+                fprintf(stderr, "asm374: %s: %s: %s\n", argv[curobj+1], cursym, GetError(err));
+            else
+                fprintf(stderr, "asm374: %s: %s\n", argv[curobj+1], GetError(err));
+            return 1;
+        }
+        if (map)
+            print_map(stderr, lay, memsz);
+        return !write_image(out, img, memsz, fmt) || (output && fclose(out));
+    }
 
-/**
- * This command reads lines of either 8-digit hex instructions to disassemble,
- * or assembly code to assemble.
- *
- * If not running interactively, the original input will be echoed back if an
- * error occurs during assembly/disassembly.
- */
-int main(void) {
     char buf[4096];
     bool interactive = is_interactive();
     if (interactive)
@@ -1411,8 +9317,132 @@ int main(void) {
 }
 
 #else
-#include <stdio.h>
-#include <time.h>
+
+static Error test_load(const char *path, const uint8_t **buf, size_t *len, const void *data) {
+    if (!str_eq(path, "test.bin", false))
+        return Error_Prog_ReadFile;
+    *buf = data;
+    *len = str_len(data);
+    return NoError;
+}
+
+/**
+ * Table-driven DecodeInst, to check the generated one.
+ */
+static Inst TableDecodeInst(uint32_t b) {
+    Inst i = INST_ZERO;
+    switch (LookupOpcode((i.Opcode = (Opcode) ((b >> 27) & ((1<<5)-1)))).Format) {
+    case InstEnc_R:
+        i.Ra = (Reg)((b >> 23) & ((1<<4)-1));
+        i.Rb = (Reg)((b >> 19) & ((1<<4)-1));
+        i.Rc = (Reg)((b >> 15) & ((1<<4)-1));
+        break;
+    case InstEnc_I:
+        i.Ra = (Reg)   ((b >> 23) & ((1<<4)-1));
+        i.Rb = (Reg)   ((b >> 19) & ((1<<4)-1));
+        i.C  = (Imm19s)((b >> 00) & ((1<<19)-1));
+        break;
+    case InstEnc_B:
+        i.Ra = (Reg)   ((b >> 23) & ((1<<4)-1));
+        i.C2 = (Cond)  ((b >> 19) & ((1<<4)-1) & ((1<<2)-1)); // field is 4 bits, but we're supposed to ignore the top 2
+        i.C  = (Imm19s)((b >> 00) & ((1<<19)-1));
+        break;
+    case InstEnc_J:
+        i.Ra = (Reg)((b >> 23) & ((1<<4)-1));
+        break;
+    case InstEnc_M:
+        break;
+    }
+    return i;
+}
+
+/**
+ * Table-driven EncodeInst, to check the generated one.
+ */
+static uint32_t TableEncodeInst(Inst i) {
+    uint32_t b = ((uint32_t)(i.Opcode) & ((1<<5)-1)) << 27;
+    switch (LookupOpcode(i.Opcode).Format) {
+    case InstEnc_R:
+        b |= ((uint32_t)(i.Ra) & ((1<<4)-1)) << 23;
+        b |= ((uint32_t)(i.Rb) & ((1<<4)-1)) << 19;
+        b |= ((uint32_t)(i.Rc) & ((1<<4)-1)) << 15;
+        break;
+    case InstEnc_I:
+        b |= ((uint32_t)(i.Ra) & ((1<<4)-1))  << 23;
+        b |= ((uint32_t)(i.Rb) & ((1<<4)-1))  << 19;
+        b |= ((uint32_t)(i.C)  & ((1<<19)-1)) << 0;
+        break;
+    case InstEnc_B:
+        b |= ((uint32_t)(i.Ra) & ((1<<4)-1))              << 23;
+        b |= ((uint32_t)(i.C2) & ((1<<4)-1) & ((1<<2)-1)) << 19; // field is 4 bits, but we're supposed to ignore the top 2
+        b |= ((uint32_t)(i.C)  & ((1<<19)-1))             << 0;
+        break;
+    case InstEnc_J:
+        b |= ((uint32_t)(i.Ra) & ((1<<4)-1)) << 23;
+        break;
+    case InstEnc_M:
+        break;
+    }
+    return b;
+}
+
+/**
+ * Table-driven CheckInst, to check the generated one.
+ */
+static Error TableCheckInst(Inst i) {
+    switch (LookupOpcode(i.Opcode).Format) {
+    case InstEnc_R:
+        if (!GetReg(i.Ra)) return Error_Inst_Reg;
+        if (!GetReg(i.Rb)) return Error_Inst_Reg;
+        if (!GetReg(i.Rc)) return Error_Inst_Reg;
+        return NoError;
+    case InstEnc_I:
+        if (!GetReg(i.Ra)) return Error_Inst_Reg;
+        if (!GetReg(i.Rb)) return Error_Inst_Reg;
+        return NoError;
+    case InstEnc_B:
+        if (!GetReg(i.Ra))   return Error_Inst_Reg;
+        if (!GetCond(i.C2)) return Error_Inst_Cond;
+        return NoError;
+    case InstEnc_J:
+        if (!GetReg(i.Ra)) return Error_Inst_Reg;
+        return NoError;
+    case InstEnc_M:
+        return NoError;
+    }
+    return Error_Inst_Op;
+}
+
+/**
+ * Table-driven FormatInst, to check the generated one.
+ */
+static char *TableFormatInst(char *str, Inst inst) {
+    if (str) {
+        InstSpec spec = LookupOpcode(inst.Opcode);
+        if (spec.Format) {
+            str = str_ecpy(str, spec.Op);
+            if (spec.Cond)
+                str = FormatCond(str, inst.C2);
+            for (size_t i = 0; i < sizeof(spec.Arg)/sizeof(*spec.Arg) && spec.Arg[i]; i++) {
+                if (i)
+                    *str++ = ',';
+                *str++ = ' ';
+                switch (spec.Arg[i]) {
+                case InstArg__:   __builtin_unreachable();
+                case InstArg_Ra:  str = FormatReg(str, inst.Ra); break;
+                case InstArg_Rb:  str = FormatReg(str, inst.Rb); break;
+                case InstArg_Rc:  str = FormatReg(str, inst.Rc); break;
+                case InstArg_C:   str = FormatImm19s(str, inst.C); break;
+                case InstArg_RbC: str = FormatRegImm19s(str, inst.Rb, inst.C); break;
+                }
+            }
+        } else {
+            *str++ = '?';
+        }
+        *str = '\0';
+    }
+    return str;
+}
 
 int main(void) {
     fprintf(stderr, "> testing assembly\n");
@@ -1493,6 +9523,1184 @@ int main(void) {
         }
     }
 
+    fprintf(stderr, "> testing generated instruction functions\n");
+    {
+        uint32_t rng = 1;
+        for (int x = 0; x < 1000000; x++) {
+            #define RAND() (rng ^= rng << 13, rng ^= rng >> 17, rng ^= rng << 5, rng)
+            uint32_t b = RAND();
+            Inst i1 = DecodeInst(b), i2 = TableDecodeInst(b);
+            if (i1.Opcode != i2.Opcode || i1.C2 != i2.C2 || i1.Ra != i2.Ra || i1.Rb != i2.Rb || i1.Rc != i2.Rc || i1.C != i2.C)
+                return printf("[%08X] decoded differently\n", (unsigned)(b)), 1;
+
+            // including out-of-range fields
+            // initializers are evaluated in an unspecified order, so fill the fields one at a time
+            Inst i;
+            i.Opcode = (Opcode)(RAND());
+            i.C2 = (Cond)(RAND() & 7);
+            i.Ra = (Reg)(RAND() & 31);
+            i.Rb = (Reg)(RAND() & 31);
+            i.Rc = (Reg)(RAND() & 31);
+            i.C = RAND();
+            if (EncodeInst(i) != TableEncodeInst(i))
+                return printf("[%08X] encoded differently\n", (unsigned)(b)), 1;
+            if (CheckInst(i) != TableCheckInst(i))
+                return printf("[%08X] checked differently\n", (unsigned)(b)), 1;
+
+            char s1[256], s2[256];
+            FormatInst(s1, x & 1 ? i : i1);
+            TableFormatInst(s2, x & 1 ? i : i1);
+            if (!str_eq(s1, s2, false))
+                return printf("[%08X] formatted as %s, expected %s\n", (unsigned)(b), s1, s2), 1;
+            #undef RAND
+        }
+    }
+
+    fprintf(stderr, "> testing program assembly\n");
+    const char *progtests[][2] = {
+        {"00000001 00000002 00000003", "DAT 1\nDAT 2\nDAT 3"},
+        {"00000001 00000002 FFFFFFFF", "DAT 1, 2 ,-1"},
+        {"00000000 00000005 00000005", "ORG 1\nFILL 2, 5"},
+        {"00000007 00000000 00000000 00000008", "DAT 7\nSPACE 2\nDAT 8"},
+        {"D0000000 98800000 00000001", "br: ORG 0\nnop\nbrzr r1, x\nx: DAT 1"},
+        {"01020304 05060000", "INCBIN \"test.bin\""},
+        {"00000000 08000003 0000000A", "SPACE 1\nldi r0, x\nFILL 1, 10\nx:"},
+        {NULL, "DAT 1,\nDAT 2"},
+        {NULL, "DAT 1, 2\nORG 1\nDAT 3"},
+        {NULL, "FILL 1"},
+        {NULL, "FILL 1, 2, 3"},
+        {NULL, "FILL -1, 2"},
+        {NULL, "SPACE 17"},
+        {NULL, "ORG 15\nFILL 2, 0"},
+        {NULL, "FILL 2, 1\nORG 1\nSPACE 1"},
+        {NULL, "INCBIN test.bin"},
+        {NULL, "INCBIN \"missing.bin\""},
+        {"08800004 00000000 00000000 00000000 00000005", "ldi r1, b\nSECTION b, ALIGN 4\nb: DAT 5"},
+        {"00000001 00000005 00000006 00000002 00000004 00000000 00000003", "DAT 1\nORG 3\nDAT 2\nORG 6\nDAT 3\nSECTION a\nDAT 4\nSECTION b\nDAT 5, 6"},
+        {"98000003 00000007 00000000 00000001 00000002", "brzr r0, x\nSECTION s, AT 3\nDAT 1\nSECTION t\nDAT 7\nSECTION s\nx: DAT 2"},
+        {NULL, "SECTION a, AT 16\nDAT 1"},
+        {NULL, "SECTION a, FOO 3"},
+        {NULL, "SECTION a, ALIGN 2\nSECTION a, ALIGN 4"},
+        {NULL, "SECTION 1a"},
+        {NULL, "SECTION a\nSPACE 17"},
+    };
+    for (size_t x = 0; x < sizeof(progtests)/sizeof(*progtests); x++) {
+        fprintf(stderr, ". %s\n", progtests[x][1]);
+
+        char src[256];
+        ProgTok tok[16];
+        ProgSec sec[4];
+        uint32_t out[16];
+        Prog prog = {
+            .len     = 0,
+            .cap     = sizeof(tok)/sizeof(*tok),
+            .tok     = tok,
+            .sec_len = 0,
+            .sec_cap = sizeof(sec)/sizeof(*sec),
+            .sec     = sec,
+            .bin     = {
+                .data = "\x01\x02\x03\x04\x05\x06",
+                .load = test_load,
+            },
+        };
+        str_ecpyn(src, progtests[x][1], sizeof(src));
+
+        Error e = SplitProg(&prog, src, NULL);
+        if (!e)
+            e = LayoutProg(&prog, out, sizeof(out)/sizeof(*out), NULL);
+        if (!e)
+            e = AssembleProg(prog, out, sizeof(out)/sizeof(*out), NULL);
+        if (!progtests[x][0]) {
+            if (!e)
+                return printf("[%s] expected assembly error, got none\n", progtests[x][1]), 1;
+            continue;
+        } else if (e) {
+            return printf("[%s] unexpected assembly error %s\n", progtests[x][1], GetError(e)), 1;
+        }
+
+        char h[sizeof(out)/sizeof(*out)*9];
+        for (size_t i = 0; i < sizeof(out)/sizeof(*out); i++)
+            *u32be_tohex(&h[i*9], out[i]) = ' ';
+        if (!str_ecpyn(src, h, str_len(progtests[x][0])+1) || !str_eq(src, progtests[x][0], false))
+            return printf("[%s] incorrect program image %s (expected %s)\n", progtests[x][1], src, progtests[x][0]), 1;
+    }
+
+    fprintf(stderr, "> testing diagnostics\n");
+    struct {
+        const char *src;
+        size_t      cap;
+        size_t      len;
+        Diag        diag[4];
+    } diagtests[] = {
+        {"nop", 4, 0, {{0}}},
+        {"nop\n  foo r1 ; bar\n9x: DAT 1\nld r1, x\nDAT 1,,2", 4, 4, {
+            {2, 2, 5, Error_Parse_Op_Unknown},
+            {3, 0, 2, Error_Prog_InvalidLabel},
+            {4, 7, 8, Error_Parse_Imm_InvalidDigit},
+            {5, 0, 8, Error_Parse_EmptyArgument},
+        }},
+        {"a: nop\na: DAT 1\nORG 14\nDAT 1, 2, 3\nORG 0\nb: DAT 5", 4, 3, {
+            {2, 0, 1, Error_Prog_DuplicateLabel},
+            {4, 0, 11, Error_Prog_OutOfRange},
+            {6, 3, 8, Error_Prog_Overlap},
+        }},
+        {"ldi r1, 999999999\n1x:\nFILL 1", 4, 3, {
+            {1, 8, 17, Error_Parse_Imm_OutOfRange},
+            {2, 0, 2, Error_Prog_InvalidLabel},
+            {3, 0, 6, Error_Parse_OpArgs_NotEnough},
+        }},
+        {"brzr r2, nowhere\nx: add r1, r2, r3, r4, r5\n  br r1, 0\nld r1, 2(r99)", 4, 4, {
+            {1, 9, 16, Error_Parse_Imm_InvalidDigit},
+            {2, 19, 25, Error_Parse_OpArgs_TooMany},
+            {3, 2, 4, Error_Parse_Op_MissingCond},
+            {4, 7, 13, Error_Parse_Reg_Unknown},
+        }},
+        {"ldi r1, 999999999\n1x:\nFILL 1", 2, 3, {
+            {1, 8, 17, Error_Parse_Imm_OutOfRange},
+            {2, 0, 2, Error_Prog_InvalidLabel},
+        }},
+    };
+    for (size_t x = 0; x < sizeof(diagtests)/sizeof(*diagtests); x++) {
+        fprintf(stderr, ". %s\n", diagtests[x].src);
+
+        char src[256];
+        ProgTok tok[16];
+        ProgSec sec[4];
+        uint32_t out[16];
+        Diag d[4];
+        Prog prog = {
+            .len     = 0,
+            .cap     = sizeof(tok)/sizeof(*tok),
+            .tok     = tok,
+            .sec_len = 0,
+            .sec_cap = sizeof(sec)/sizeof(*sec),
+            .sec     = sec,
+        };
+        Diags diag = {
+            .len  = 0,
+            .cap  = diagtests[x].cap,
+            .diag = d,
+        };
+        str_ecpyn(src, diagtests[x].src, sizeof(src));
+
+        Error e = DiagnoseProg(&prog, src, out, sizeof(out)/sizeof(*out), &diag);
+        if (!e != !diagtests[x].len || diag.len != diagtests[x].len)
+            return printf("[%s] got %d errors (returned %s), expected %d\n", diagtests[x].src, (int)(diag.len), GetError(e), (int)(diagtests[x].len)), 1;
+        for (size_t i = 0; i < diag.len && i < diag.cap; i++) {
+            Diag a = diag.diag[i], b = diagtests[x].diag[i];
+            if (a.line != b.line || a.col != b.col || a.end != b.end || a.err != b.err)
+                return printf("[%s] error %d is %d:%d-%d %s, expected %d:%d-%d %s\n", diagtests[x].src, (int)(i), a.line, (int)(a.col), (int)(a.end), GetError(a.err), b.line, (int)(b.col), (int)(b.end), GetError(b.err)), 1;
+        }
+    }
+
+    fprintf(stderr, "> testing source maps\n");
+    {
+        char src[] = "a: ORG 6\nnop\nDAT 1, 2\n\nSECTION s\nFILL 3, 1\nb: halt\nSECTION t, AT 2\nDAT 3\n; x\nbrzr r1, a\nSECTION u\nSPACE 1";
+        ProgTok tok[32];
+        ProgSec sec[4];
+        uint32_t out[16], idx[64], key[64];
+        int mline[32];
+        uint32_t maddr[32], mcount[32], morder[32];
+        Prog prog = {
+            .len     = 0,
+            .cap     = sizeof(tok)/sizeof(*tok),
+            .tok     = tok,
+            .sec_len = 0,
+            .sec_cap = sizeof(sec)/sizeof(*sec),
+            .sec     = sec,
+        };
+        SrcMap map = {
+            .len   = 0,
+            .cap   = sizeof(mline)/sizeof(*mline),
+            .line  = mline,
+            .addr  = maddr,
+            .count = mcount,
+            .order = morder,
+        };
+        Error e = SplitProg(&prog, src, NULL);
+        if (!e)
+            e = LayoutProg(&prog, out, sizeof(out)/sizeof(*out), NULL);
+        if (!e)
+            e = AssembleProg(prog, out, sizeof(out)/sizeof(*out), NULL);
+        if (!e)
+            e = SrcMapProg(&map, prog);
+        if (e)
+            return printf("[source map] unexpected error %s\n", GetError(e)), 1;
+
+        for (uint32_t a = 0; a < 20; a++) {
+            int exp = 0;
+            for (size_t i = 0; i < prog.len; i++)
+                if (a >= tok[i].offset && a - tok[i].offset < tok[i].count)
+                    exp = tok[i].line;
+            if (SrcMapLine(&map, a) != exp)
+                return printf("[source map] address %d is line %d, expected %d\n", (int)(a), SrcMapLine(&map, a), exp), 1;
+        }
+        for (int l = 0; l < 16; l++) {
+            uint32_t addr = 0, count = 0, eaddr = 0, ecount = 0;
+            for (size_t i = 0; i < prog.len; i++)
+                if (tok[i].line == l && tok[i].count)
+                    eaddr = tok[i].offset, ecount = tok[i].count;
+            if (SrcMapAddr(&map, l, &addr, &count) != !!ecount || addr != eaddr || count != ecount)
+                return printf("[source map] line %d is %d+%d, expected %d+%d\n", l, (int)(addr), (int)(count), (int)(eaddr), (int)(ecount)), 1;
+        }
+
+        uint32_t rng = 1;
+        for (int x = 0; x < 1000; x++) {
+            #define RAND(n) (rng ^= rng << 13, rng ^= rng >> 17, rng ^= rng << 5, rng % (n))
+            size_t n = RAND(64);
+            for (size_t i = 0; i < n; i++) {
+                idx[i] = (uint32_t)(n - 1 - i);
+                key[i] = RAND(8);
+            }
+            #undef RAND
+            SortIdx(idx, n, key);
+            for (size_t i = 1; i < n; i++)
+                if (key[idx[i-1]] > key[idx[i]] || (key[idx[i-1]] == key[idx[i]] && idx[i-1] >= idx[i]))
+                    return printf("[sort %d] not sorted at %d\n", x, (int)(i)), 1;
+        }
+    }
+
+    fprintf(stderr, "> testing object linking\n");
+    const char *linktests[][3] = {
+        {"ok", "a: ldi r1, b\nbrzr r1, c\nld r2, a\nORG 8\nc: halt", "b: DAT 1\nbrnz r0, a\njal r1"},
+        {"ok", "x: brmi r1, y", "SPACE 4\nldi r2, 5(r1)\ny: ld r3, x(r2)"},
+        {NULL, "a: DAT 1", "a: DAT 2"},
+        {NULL, "brzr r1, b", "c: nop"},
+        {"ok", "a: ldi r1, 5\nnop\nnop\nnop\nnop", "SECTION text, ALIGN 4\nfn: brzr r1, a"},
+        {"ok", "fn: nop", "SECTION vec, AT 16\nbrzr r0, fn"},
+        {"ok", "SECTION text, ALIGN 2\na: brnz r1, b\nSECTION data\nd: DAT 1, 2, 3", "SECTION text\nb: ld r1, d\nbrzr r1, a\nSECTION data\nldi r2, b"},
+        {"ok", "x: ld r1, y\nSECTION big\nSPACE 3\nSECTION vec, AT 2\nDAT 7", "SECTION big\ny: brzr r1, x"},
+        {NULL, "SECTION s, ALIGN 2\nnop", "SECTION s, ALIGN 4\nnop"},
+        {NULL, "SECTION s, AT 1\nnop", "SECTION t, AT 1\nnop"},
+    };
+    for (size_t x = 0; x < sizeof(linktests)/sizeof(*linktests); x++) {
+        fprintf(stderr, ". %s | %s\n", linktests[x][1], linktests[x][2]);
+
+        Obj obj[2];
+        ProgTok tok[16];
+        ProgSec sec[8];
+        uint32_t out[2][64];
+        char src[3][256];
+        str_ecpy(str_ecpy(str_ecpy(src[2], linktests[x][1]), "\n"), linktests[x][2]);
+        for (size_t i = 0; i < 2; i++) {
+            str_ecpy(src[i], linktests[x][i+1]);
+
+            Error e = obj_assemble(&obj[i], "", src[i], str_len(src[i]), NULL, NULL);
+            if (e)
+                return printf("[%s] unexpected assembly error %s\n", linktests[x][i+1], GetError(e)), 1;
+
+            size_t len;
+            uint8_t *buf = obj_encode(&obj[i], &len);
+            if (!buf || !obj_decode(&obj[i], buf, len))
+                return printf("[%s] object encode/decode failed\n", linktests[x][i+1]), 1;
+        }
+
+        Prog lay = {
+            .len     = 0,
+            .cap     = sizeof(tok)/sizeof(*tok),
+            .tok     = tok,
+            .sec_len = 0,
+            .sec_cap = sizeof(sec)/sizeof(*sec),
+            .sec     = sec,
+        };
+        Error e = LinkObj(obj, 2, &lay, out[0], sizeof(out[0])/sizeof(*out[0]), NULL, NULL);
+        if (!linktests[x][0]) {
+            if (!e)
+                return printf("[%s | %s] expected link error, got none\n", linktests[x][1], linktests[x][2]), 1;
+            continue;
+        } else if (e) {
+            return printf("[%s | %s] unexpected link error %s\n", linktests[x][1], linktests[x][2], GetError(e)), 1;
+        }
+
+        // linking objects one after another should be the same as assembling them together
+        Prog prog = {
+            .len     = 0,
+            .cap     = sizeof(tok)/sizeof(*tok),
+            .tok     = tok,
+            .sec_len = 0,
+            .sec_cap = sizeof(sec)/sizeof(*sec),
+            .sec     = sec,
+        };
+        if ((e = SplitProg(&prog, src[2], NULL)) || (e = LayoutProg(&prog, out[1], sizeof(out[1])/sizeof(*out[1]), NULL)) || (e = AssembleProg(prog, out[1], sizeof(out[1])/sizeof(*out[1]), NULL)))
+            return printf("[%s | %s] unexpected assembly error %s\n", linktests[x][1], linktests[x][2], GetError(e)), 1;
+        for (size_t i = 0; i < sizeof(out[0])/sizeof(*out[0]); i++)
+            if (out[0][i] != out[1][i])
+                return printf("[%s | %s] linked image differs from assembled one at %d\n", linktests[x][1], linktests[x][2], (int)(i)), 1;
+    }
+
+    fprintf(stderr, "> testing incremental assembly\n");
+    {
+        const char *lines[][8] = {
+            {"", "; comment", "brzr r1, a", "brnz r2, b", "brpl r3, e", "ld r1, c", "ldi r2, a(r1)", "jr r15"},
+            {"ORG 4", "ORG 20", "ORG 0", "FILL 3, 7", "SPACE 2", "DAT 5", "not r1, r2", "mflo r4"},
+            {"a:", "b: nop", "c: DAT 1, -2", "d: e: add r1, r2, r3", "f: ORG 8", "a: halt", "b: DAT 2", "e:"},
+            {"9x:", "xx yy", "ld r3, g", "ORG 40", "FILL 1, zz", "DAT 1,,2", "ld r1 r2", "ORG 1"},
+            {"SECTION s", "SECTION t, ALIGN 4", "SECTION u, AT 24", "SECTION s, ALIGN 2", "SECTION t", "SECTION u, AT 40", "SECTION 9", "SECTION v, ALIGN 8"},
+        };
+        const char *cur[16];
+        size_t cur_n = 0;
+
+        ProgTok tok[64];
+        ProgSec sec[16];
+        IncTok info[64];
+        IncLine line[16];
+        char src[1024], raw[1024];
+        uint32_t tab[128], img[2][32], lin[32], chg[32], old[32];
+        uint8_t occ[32];
+        IncProg ip = {
+            .prog     = {
+                .cap     = sizeof(tok)/sizeof(*tok),
+                .tok     = tok,
+                .sec_cap = sizeof(sec)/sizeof(*sec),
+                .sec     = sec,
+            },
+            .info     = info,
+            .line_cap = sizeof(line)/sizeof(*line),
+            .line     = line,
+            .src_cap  = sizeof(src),
+            .src      = src,
+            .raw      = raw,
+            .tab_n    = sizeof(tab)/sizeof(*tab),
+            .tab      = tab,
+            .out_n    = sizeof(img[0])/sizeof(*img[0]),
+            .out      = img[0],
+            .tmp      = img[1],
+            .occ      = occ,
+            .lin      = lin,
+            .chg      = chg,
+        };
+        IncProgReset(&ip);
+
+        uint32_t rng = 1;
+        for (int x = 0; x < 50000; x++) {
+            #define RAND(n) (rng ^= rng << 13, rng ^= rng >> 17, rng ^= rng << 5, rng % (n))
+            size_t first = RAND(cur_n + 1);
+            size_t nold = RAND(cur_n - first + 1) % 3;
+            size_t nnew = RAND(3);
+            if (cur_n - nold + nnew > sizeof(cur)/sizeof(*cur))
+                nnew = 0;
+
+            char text[256], *t = text;
+            *t = '\0';
+            const char *ins[3];
+            for (size_t i = 0; i < nnew; i++) {
+                uint32_t w = RAND(32);
+                ins[i] = lines[w < 12 ? 0 : w < 24 ? 1 : w < 30 ? 2 : w < 31 ? 3 : 4][RAND(8)];
+                t = str_ecpy(str_ecpy(t, i ? "\n" : ""), ins[i]);
+            }
+            #undef RAND
+            for (size_t i = 0; i < ip.out_n; i++)
+                old[i] = ip.out[i];
+
+            int l1;
+            Error e1 = IncProgEdit(&ip, first, nold, text, nnew, &l1);
+
+            for (size_t i = first + nold; i < cur_n; i++)
+                cur[i - nold] = cur[i];
+            cur_n -= nold;
+            for (size_t i = cur_n; i > first; i--)
+                cur[i - 1 + nnew] = cur[i - 1];
+            for (size_t i = 0; i < nnew; i++)
+                cur[first + i] = ins[i];
+            cur_n += nnew;
+
+            // the result should be the same as assembling everything
+            char full[1024];
+            t = full;
+            *t = '\0';
+            for (size_t i = 0; i < cur_n; i++)
+                t = str_ecpy(str_ecpy(t, i ? "\n" : ""), cur[i]);
+
+            ProgTok ftok[64];
+            ProgSec fsec[16];
+            uint32_t fimg[32];
+            Prog prog = {
+                .len     = 0,
+                .cap     = sizeof(ftok)/sizeof(*ftok),
+                .tok     = ftok,
+                .sec_len = 0,
+                .sec_cap = sizeof(fsec)/sizeof(*fsec),
+                .sec     = fsec,
+            };
+            int l2;
+            Error e2 = SplitProg(&prog, full, &l2);
+            if (!e2)
+                e2 = LayoutProg(&prog, fimg, sizeof(fimg)/sizeof(*fimg), &l2);
+            if (!e2)
+                e2 = AssembleProg(prog, fimg, sizeof(fimg)/sizeof(*fimg), &l2);
+
+            for (size_t i = 0, j = 0; i < ip.out_n; i++) {
+                if (j < ip.chg_len && ip.chg[j] == i)
+                    j++;
+                else if (old[i] != ip.out[i])
+                    return printf("[edit %d] word %d changed, but not in list\n", x, (int)(i)), 1;
+            }
+            if (e1 != e2 || (e1 && l1 != l2))
+                return printf("[edit %d] incremental error %s at line %d, expected %s at line %d\n", x, GetError(e1), l1, GetError(e2), l2), 1;
+            if (!e1) {
+                for (size_t i = 0; i < ip.out_n; i++)
+                    if (ip.out[i] != fimg[i])
+                        return printf("[edit %d] incremental image differs at %d\n", x, (int)(i)), 1;
+                uint32_t flin[32] = {0};
+                for (size_t i = 0; i < prog.len; i++)
+                    for (size_t j = ftok[i].offset; j < ftok[i].offset + ftok[i].count; j++)
+                        flin[j] = (uint32_t)(ftok[i].line);
+                for (size_t i = 0; i < ip.out_n; i++)
+                    if (ip.lin[i] != flin[i])
+                        return printf("[edit %d] incremental line of word %d is %d, expected %d\n", x, (int)(i), (int)(ip.lin[i]), (int)(flin[i])), 1;
+            }
+        }
+    }
+
+    fprintf(stderr, "> testing memory files\n");
+    {
+        struct {
+            const char *src;
+            Error err;
+            size_t n;
+            uint32_t img[8];
+        } memtests[] = {
+            {"", NoError, 0, {0}},
+            {"DEADBEEF 1\n// 2\n3 /* 4\n5 */ 6_7", NoError, 4, {0xDEADBEEF, 1, 3, 0x67}},
+            {"@2 5 @0 1\n", NoError, 3, {1, 0, 5}},
+            {"0000000A 0000000b\n0000000C\n", NoError, 3, {10, 11, 12}},
+            {"12345678 123456789", Error_Mem_Syntax, 0, {0}},
+            {"1 /* 2", Error_Mem_Syntax, 0, {0}},
+            {"1 / 2", Error_Mem_Syntax, 0, {0}},
+            {"@", Error_Mem_Syntax, 0, {0}},
+            {"@7 1 2", Error_Mem_Address, 0, {0}},
+            {"xyz", Error_Mem_Syntax, 0, {0}},
+            {"DEPTH = 4;\nWIDTH = 32;\nADDRESS_RADIX = HEX;\nDATA_RADIX = HEX;\nCONTENT BEGIN\n    0 : DEADBEEF;\n    2 : 1 2;\nEND;\n", NoError, 4, {0xDEADBEEF, 0, 1, 2}},
+            {"-- comment\nwidth = 32; data_radix = dec; % multi-line\ncomment % content begin [0..5] : 1 -1; 6 : 7; end;", NoError, 7, {1, -1, 1, -1, 1, -1, 7}},
+            {"WIDTH = 8; DATA_RADIX = BIN; ADDRESS_RADIX = OCT; CONTENT BEGIN 7 : 111111111; END;", NoError, 8, {0, 0, 0, 0, 0, 0, 0, 0xFF}},
+            {"CONTENT BEGIN 0 : 1; END", NoError, 1, {1}},
+            {"DEPTH = 2; CONTENT BEGIN 2 : 1; END;", Error_Mem_Address, 0, {0}},
+            {"DEPTH = 9; CONTENT BEGIN END;", Error_Mem_Address, 0, {0}},
+            {"DEPTH = 8; CONTENT BEGIN [0..1] : 1 2 3; END;", Error_Mem_Syntax, 0, {0}},
+            {"DEPTH = 8; CONTENT BEGIN [1..0] : 1; END;", Error_Mem_Syntax, 0, {0}},
+            {"DEPTH = 8; CONTENT BEGIN 0 : ; END;", Error_Mem_Syntax, 0, {0}},
+            {"DEPTH = 1; ADDRESS_RADIX = FOO; CONTENT BEGIN END;", Error_Mem_Syntax, 0, {0}},
+            {"WIDTH = 33; CONTENT BEGIN END;", Error_Mem_Syntax, 0, {0}},
+            {"CONTENT BEGIN 0 : 1;", Error_Mem_Syntax, 0, {0}},
+        };
+        for (size_t x = 0; x < sizeof(memtests)/sizeof(*memtests); x++) {
+            uint32_t img[8];
+            size_t n[2];
+            for (size_t i = 0; i < 8; i++)
+                img[i] = 0xAAAAAAAA;
+            Error e[2] = {
+                ReadImage(memtests[x].src, NULL, 8, &n[0], NULL),
+                ReadImage(memtests[x].src, img, 8, &n[1], NULL),
+            };
+            if (e[0] != memtests[x].err || e[1] != memtests[x].err)
+                return printf("[%s] expected error %s, got %s/%s\n", memtests[x].src, GetError(memtests[x].err), GetError(e[0]), GetError(e[1])), 1;
+            if (e[0])
+                continue;
+            if (n[0] != memtests[x].n || n[1] != memtests[x].n)
+                return printf("[%s] expected %d words, got %d/%d\n", memtests[x].src, (int)(memtests[x].n), (int)(n[0]), (int)(n[1])), 1;
+            for (size_t i = 0; i < 8; i++)
+                if (img[i] != (i < n[1] ? memtests[x].img[i] : 0xAAAAAAAA))
+                    return printf("[%s] word %d is %08X\n", memtests[x].src, (int)(i), (unsigned)(img[i])), 1;
+        }
+    }
+
+    fprintf(stderr, "> testing memory image formats\n");
+    {
+        static uint32_t img[2][0x10000 + 40];
+        static char buf[(0x10000 + 40) * 24];
+        const size_t n = sizeof(img[0])/sizeof(*img[0]);
+        for (size_t i = 0; i < n; i++)
+            img[0][i] = i < 20 ? (uint32_t)(i * 0x9E3779B9) : i < 40 ? 7 : i % 1000 == 3 || i > 0x10000 + 30 ? (uint32_t)(i) : 0;
+
+        for (ImageFormat fmt = 0; fmt < ImageFormatCount; fmt++) {
+            ImageBuf b = {NULL, 0};
+            if (!WriteImage(fmt, img[0], n, (ImageSink){.data = &b, .write = ImageBuf_write}) || b.len >= sizeof(buf))
+                return printf("[%s] failed to write image\n", GetImageFormat(fmt)), 1;
+            size_t len = b.len;
+            b = (ImageBuf){buf, 0};
+            WriteImage(fmt, img[0], n, (ImageSink){.data = &b, .write = ImageBuf_write});
+            if (b.len != len)
+                return printf("[%s] wrote %d bytes, then %d\n", GetImageFormat(fmt), (int)(len), (int)(b.len)), 1;
+            buf[b.len] = '\0';
+
+            size_t m = 0;
+            switch (fmt) {
+            case ImageFormat_Bin:
+            case ImageFormat_BinLE:
+                for (m = 0; m < b.len / 4; m++) {
+                    img[1][m] = 0;
+                    for (int s = 0; s < 4; s++)
+                        img[1][m] |= (uint32_t)(uint8_t)(buf[m*4 + s]) << (fmt == ImageFormat_Bin ? 24 - s*8 : s*8);
+                }
+                break;
+            case ImageFormat_IHex:
+                {
+                    size_t base = 0;
+                    for (size_t i = 0; i < n; i++)
+                        img[1][i] = 0;
+                    for (const char *l = buf; *l; ) {
+                        uint8_t d[5+255], sum = 0;
+                        size_t dn = 5 + u4_fromhex(l[1])*16 + u4_fromhex(l[2]);
+                        for (size_t i = 0; i < dn; i++)
+                            sum += d[i] = (uint8_t)(u4_fromhex(l[1+i*2])*16 + u4_fromhex(l[2+i*2]));
+                        if (l[0] != ':' || sum || l[1+dn*2] != '\n')
+                            return printf("[%s] invalid record %.20s\n", GetImageFormat(fmt), l), 1;
+                        if (d[3] == 4)
+                            base = (size_t)(d[4]) << 24 | (size_t)(d[5]) << 16;
+                        if (d[3] == 0) {
+                            size_t x = base | (size_t)(d[1]) << 8 | d[2];
+                            img[1][x] = (uint32_t)(d[4]) << 24 | (uint32_t)(d[5]) << 16 | (uint32_t)(d[6]) << 8 | d[7];
+                            m = x + 1 > m ? x + 1 : m;
+                        }
+                        l += 1 + dn*2 + 1;
+                    }
+                }
+                break;
+            default:
+                {
+                    Error e = ReadImage(buf, img[1], n, &m, NULL);
+                    if (e)
+                        return printf("[%s] failed to read image: %s\n", GetImageFormat(fmt), GetError(e)), 1;
+                }
+                break;
+            }
+            if (m != n)
+                return printf("[%s] read %d words, expected %d\n", GetImageFormat(fmt), (int)(m), (int)(n)), 1;
+            for (size_t i = 0; i < n; i++)
+                if (img[0][i] != img[1][i])
+                    return printf("[%s] word %d is %08X, expected %08X\n", GetImageFormat(fmt), (int)(i), (unsigned)(img[1][i]), (unsigned)(img[0][i])), 1;
+        }
+
+        const uint32_t small[] = {0xDEADBEEF, 1};
+        ImageBuf b = {buf, 0};
+        WriteImage(ImageFormat_IHex, small, 2, (ImageSink){.data = &b, .write = ImageBuf_write});
+        buf[b.len] = '\0';
+        if (!str_eq(buf, ":04000000DEADBEEFC4\n:0400010000000001FA\n:00000001FF\n", false))
+            return printf("unexpected Intel HEX:\n%s", buf), 1;
+    }
+
+    fprintf(stderr, "> testing image disassembly\n");
+    {
+        static uint32_t img[2][300];
+        static uint8_t tgt[300];
+        static char src[300*64 + 1];
+        static ProgTok tok[300*2];
+
+        uint32_t rng = 1;
+        for (int x = 0; x < 2000; x++) {
+            #define RAND(n) (rng ^= rng << 13, rng ^= rng >> 17, rng ^= rng << 5, rng % (n))
+            size_t n = RAND(300) + 1;
+            for (size_t i = 0; i < n; ) {
+                uint32_t k = RAND(8), r = RAND(8) + 1, w = rng;
+                uint32_t ra = RAND(16), cond = RAND(4), off = RAND(n + 4), edge = RAND(4); // each RAND changes rng, so only one per expression
+                Inst inst;
+                switch (k) {
+                case 0: // zeros
+                    w = 0;
+                    break;
+                case 1: // branches
+                    w = (19u << 27) | (ra << 23) | (cond << 19) | ((off - 2 - (uint32_t)(i) - 1) & ((1<<19)-1));
+                    r = 1;
+                    break;
+                case 2: // edge of the branch range
+                    w = (19u << 27) | (edge & 2 ? (1<<(19-1)) - (edge & 1) - 1 : (1<<(19-1)) + (edge & 1));
+                    r = 1;
+                    break;
+                case 3: case 4: // instructions
+                    do
+                        w = RAND(UINT32_MAX);
+                    while (!ImageInst(w, &inst));
+                    break;
+                default: // data
+                    break;
+                }
+                for (; r && i < n; r--)
+                    img[0][i++] = w;
+            }
+            #undef RAND
+
+            char *end = DisassembleImage(src, img[0], n, tgt);
+            if ((size_t)(end - src) > n*64 || str_len(src) != (size_t)(end - src))
+                return printf("[image %d] disassembly too long\n", x), 1;
+
+            Prog prog = {
+                .len = 0,
+                .cap = sizeof(tok)/sizeof(*tok),
+                .tok = tok,
+            };
+            int line;
+            Error e;
+            if ((e = SplitProg(&prog, src, &line)) || (e = AssembleProg(prog, img[1], n, &line)))
+                return printf("[image %d] line %d: %s\n%s", x, line, GetError(e), src), 1;
+            for (size_t i = 0; i < n; i++)
+                if (img[0][i] != img[1][i])
+                    return printf("[image %d] word %d is %08X, expected %08X\n", x, (int)(i), (unsigned)(img[1][i]), (unsigned)(img[0][i])), 1;
+        }
+
+        // labels can't reach the ends of the branch range
+        static uint32_t big[2][(1<<(19-1)) + 1];
+        static uint8_t big_tgt[(1<<(19-1)) + 1];
+        const size_t big_n = sizeof(big[0])/sizeof(*big[0]);
+        big[0][0] = 0x9803FFFF;
+        big[0][big_n - 1] = 0x98040000;
+        DisassembleImage(src, big[0], big_n, big_tgt);
+        Prog big_prog = {
+            .len = 0,
+            .cap = sizeof(tok)/sizeof(*tok),
+            .tok = tok,
+        };
+        Error e;
+        if ((e = SplitProg(&big_prog, src, NULL)) || (e = AssembleProg(big_prog, big[1], big_n, NULL)))
+            return printf("[big image] %s\n%s", GetError(e), src), 1;
+        for (size_t i = 0; i < big_n; i++)
+            if (big[0][i] != big[1][i])
+                return printf("[big image] word %d is %08X, expected %08X\n", (int)(i), (unsigned)(big[1][i]), (unsigned)(big[0][i])), 1;
+
+        const uint32_t prog[] = {0x99800005, 0, 0, 0, 0, 0x9A7FFFFC, 0xD8000000, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0x988FFFFA};
+        const char *exp =
+            "        brzr R3, L0006          ; 0000 99800005\n"
+            "        SPACE $4                ; 0001-0004\n"
+            "        DAT $9A7FFFFC           ; 0005 9A7FFFFC\n"
+            "L0006:  halt                    ; 0006 D8000000\n"
+            "        FILL $4, $FFFFFFFF      ; 0007-000A\n"
+            "        brnz R1, L0006          ; 000B 988FFFFA\n";
+        DisassembleImage(src, prog, sizeof(prog)/sizeof(*prog), tgt);
+        if (!str_eq(src, exp, false))
+            return printf("unexpected image disassembly:\n%s", src), 1;
+    }
+
+    fprintf(stderr, "> testing constrained-random generation\n");
+    {
+        static uint32_t img[2][3000];
+        GenInstOpt opts[4] = {
+            {.avoid = 0,                     .no_r0_base = false},
+            {.avoid = 1u<<14 | 1u<<15,       .no_r0_base = true},
+            {.avoid = 0x7FFF,                .no_r0_base = true},
+            {.avoid = 0xFFFF,                .no_r0_base = false},
+        };
+        for (int op = 0; op < 1<<5; op++) {
+            opts[0].weight[op] = 1;
+            opts[1].weight[op] = op == 19 ? 50 : op == 0 || op == 2 ? 10 : op == 27 ? 0 : 1;
+            opts[2].weight[op] = op < 3 || op == 19 ? 1 : 0;
+            opts[3].weight[op] = 1;
+        }
+        for (int x = 0; x < 4; x++) {
+            GenInst g;
+            if (GenInstInit(&g, &opts[x]))
+                return printf("[gen %d] no instructions\n", x), 1;
+            uint32_t seen = 0;
+            for (uint32_t k = 0; k < 30; k++) {
+                uint32_t n = k < 5 ? k + 1 : 3000 - k;
+                GenInstProg(&g, 42, k, img[0], n);
+                GenInstProg(&g, 42, k, img[1], n);
+                for (uint32_t addr = 0; addr < n; addr++) {
+                    uint32_t w = img[0][addr], target;
+                    Inst i = DecodeInst(w), p;
+                    InstSpec spec = LookupOpcode(i.Opcode);
+                    char buf[64];
+                    if (w != img[1][addr])
+                        return printf("[gen %d] program %u not deterministic\n", x, (unsigned)(k)), 1;
+                    if (CheckInst(i) || !ImageInst(w, &i))
+                        return printf("[gen %d] invalid instruction %08X\n", x, (unsigned)(w)), 1;
+                    if (!opts[x].weight[i.Opcode])
+                        return printf("[gen %d] excluded opcode in %08X\n", x, (unsigned)(w)), 1;
+                    for (int a = 0; a < 3; a++) {
+                        if (((spec.Arg[a] == InstArg_Ra) && (opts[x].avoid >> i.Ra & 1)) ||
+                            ((spec.Arg[a] == InstArg_Rb || spec.Arg[a] == InstArg_RbC) && (opts[x].avoid >> i.Rb & 1)) ||
+                            ((spec.Arg[a] == InstArg_Rc) && (opts[x].avoid >> i.Rc & 1)))
+                            return printf("[gen %d] avoided register in %08X\n", x, (unsigned)(w)), 1;
+                        if (spec.Arg[a] == InstArg_RbC && opts[x].no_r0_base && !i.Rb)
+                            return printf("[gen %d] R0 base in %08X\n", x, (unsigned)(w)), 1;
+                    }
+                    if (spec.Format == InstEnc_B && (!ImageBranch(i, addr, &target) || target >= n))
+                        return printf("[gen %d] branch %08X at %u out of bounds\n", x, (unsigned)(w), (unsigned)(addr)), 1;
+                    FormatInst(buf, i);
+                    if (ParseInst(&p, buf, addr, NULL) || EncodeInst(p) != w)
+                        return printf("[gen %d] %08X does not round-trip through %s\n", x, (unsigned)(w), buf), 1;
+                    seen |= 1u << i.Opcode;
+                }
+            }
+            for (int op = 0; op < 1<<5; op++)
+                if (LookupOpcode((Opcode)(op)).Format && opts[x].weight[op] && !(seen >> op & 1) && x != 3)
+                    return printf("[gen %d] opcode %d never generated\n", x, op), 1;
+        }
+        GenInstOpt none = {.avoid = 0xFFFF};
+        none.weight[3] = 1;
+        GenInst g;
+        if (GenInstInit(&g, &none) != Error_Gen_Empty)
+            return printf("[gen] expected no instructions without registers\n"), 1;
+    }
+
+    fprintf(stderr, "> testing instruction coverage\n");
+    {
+        static uint32_t img[5000];
+        static uint8_t be[sizeof(img)], le[sizeof(img)];
+        static Cover cov[4];
+        static char db[1<<20];
+        struct {
+            Imm19s   c;
+            ImmClass k;
+        } imm[] = {
+            {0x00000, ImmClass_Zero},
+            {0x00001, ImmClass_Pos},
+            {0x3FFFE, ImmClass_Pos},
+            {0x3FFFF, ImmClass_MaxPos},
+            {0x40000, ImmClass_MinNeg},
+            {0x40001, ImmClass_Neg},
+            {0x7FFFF, ImmClass_Neg},
+        };
+        for (size_t x = 0; x < sizeof(imm)/sizeof(*imm); x++)
+            if (ClassifyImm19s(imm[x].c) != imm[x].k)
+                return printf("[cover] %05X is %s, expected %s\n", (unsigned)(imm[x].c), GetImmClass(ClassifyImm19s(imm[x].c)), GetImmClass(imm[x].k)), 1;
+
+        GenInstOpt opt = {.avoid = 0};
+        for (int op = 0; op < 1<<5; op++)
+            opt.weight[op] = 1;
+        GenInst g;
+        GenInstInit(&g, &opt);
+        GenInstProg(&g, 7, 0, img, 5000);
+        img[10] = 0xFFFFFFFF; // invalid opcode
+        img[20] = 0x18000000 | 15u << 23 | 1u << 21; // br with unused C2 bits
+        for (size_t x = 0; x < 5000; x++) {
+            for (int b = 0; b < 4; b++) {
+                be[x*4+b] = (uint8_t)(img[x] >> (24 - 8*b));
+                le[x*4+b] = (uint8_t)(img[x] >> (8*b));
+            }
+        }
+        static const Cover zero;
+        mem_move(&cov[0], &zero, sizeof(Cover));
+        CoverAdd(&cov[0], img, 5000);
+        mem_move(&cov[1], &zero, sizeof(Cover));
+        for (size_t x = 0; x < 5000; x += 999) {
+            mem_move(&cov[3], &zero, sizeof(Cover));
+            CoverAdd(&cov[3], img + x, x + 999 > 5000 ? 5000 - x : 999);
+            CoverMerge(&cov[1], &cov[3]);
+        }
+        mem_move(&cov[2], &zero, sizeof(Cover));
+        if (CoverAddBytes(&cov[2], be, sizeof(be) - 1, false) != sizeof(be) - 4 || CoverAddBytes(&cov[2], be + sizeof(be) - 4, 4, false) != 4)
+            return printf("[cover] wrong number of bytes used\n"), 1;
+        mem_move(&cov[3], &zero, sizeof(Cover));
+        CoverAddBytes(&cov[3], le, sizeof(le), true);
+        if (cov[0].words != 5000 || cov[0].invalid != 1)
+            return printf("[cover] counted %llu words, %llu invalid\n", (unsigned long long)(cov[0].words), (unsigned long long)(cov[0].invalid)), 1;
+        for (int op = 0; op < 1<<5; op++)
+            if (!LookupOpcode((Opcode)(op)).Format != !cov[0].op[op])
+                return printf("[cover] opcode %d count %llu\n", op, (unsigned long long)(cov[0].op[op])), 1;
+        for (int x = 1; x < 4; x++) {
+            const uint8_t *a = (const uint8_t*)(&cov[0]), *b = (const uint8_t*)(&cov[x]);
+            for (size_t y = 0; y < sizeof(Cover); y++)
+                if (a[y] != b[y])
+                    return printf("[cover] coverage %d differs at byte %zu\n", x, y), 1;
+        }
+
+        FILE *f = tmpfile();
+        if (!f || !write_cover(f, &cov[0]))
+            return printf("[cover] failed to write database\n"), 1;
+        rewind(f);
+        size_t n = fread(db, 1, sizeof(db) - 1, f);
+        db[n] = '\0';
+        fclose(f);
+        mem_move(&cov[1], &cov[0], sizeof(Cover));
+        if (!read_cover(&cov[1], db))
+            return printf("[cover] failed to read database\n"), 1;
+        for (int op = 0; op < 1<<5; op++) {
+            if (cov[1].op[op] != 2*cov[0].op[op] || cov[1].reg[op][1][5] != 2*cov[0].reg[op][1][5] || cov[1].imm[op][ImmClass_Neg] != 2*cov[0].imm[op][ImmClass_Neg])
+                return printf("[cover] opcode %d not merged from database\n", op), 1;
+            for (int k = 0; k < (1<<12)/64; k++)
+                if (cov[1].combo[op][k] != cov[0].combo[op][k])
+                    return printf("[cover] opcode %d combinations not merged from database\n", op), 1;
+        }
+        if (cov[1].words != 10000 || cov[1].invalid != 2)
+            return printf("[cover] words not merged from database\n"), 1;
+        char bad[] = "asm374 coverage\nop 32 1\n";
+        if (read_cover(&cov[1], bad))
+            return printf("[cover] expected invalid database to fail\n"), 1;
+    }
+
+    fprintf(stderr, "> testing decoder test vectors\n");
+    {
+        static VecOp v[1<<5];
+        static uint32_t w[1<<16];
+        uint32_t total = VecInit(v), sum = 0;
+        for (int op = 0; op < 1<<5; op++) {
+            InstSpec spec = LookupOpcode((Opcode)(op));
+            uint32_t n = v[op].count, imm = 0;
+            sum += n;
+            if (n > sizeof(w)/sizeof(*w))
+                return printf("[vec %d] too many vectors\n", op), 1;
+            if (spec.Format == InstEnc_R && (n != 16*16*16*4 || v[op].unused != 0x7FFF))
+                return printf("[vec %d] wrong R classes\n", op), 1;
+            if (spec.Format == InstEnc_B && v[op].n[3] != CondCount)
+                return printf("[vec %d] wrong B classes\n", op), 1;
+            for (uint32_t k = 0; k < n; k++) {
+                Inst i = DecodeInst((w[k] = VecWord(v, (Opcode)(op), k)));
+                char buf[32], *p = buf;
+                if (i.Opcode != (Opcode)(op) || (EncodeInst(i) | (w[k] & v[op].unused)) != w[k])
+                    return printf("[vec %d] vector %u is %08X\n", op, (unsigned)(k), (unsigned)(w[k])), 1;
+                if (VecFormat(buf, w[k]) != buf + 20)
+                    return printf("[vec %d] wrong length\n", op), 1;
+                uint64_t x = 0;
+                for (p = buf + 8; *p; p++)
+                    x = x << 4 | u4_fromhex(*p);
+                uint32_t hi;
+                buf[8] = '\0';
+                if (!u32be_fromhex(&hi, buf) || hi != w[k] ||
+                    (x >> 44 & 15) != !CheckInst(i) || (x >> 36 & 0xFF) != (uint64_t)(op) ||
+                    (x >> 32 & 15) != i.Ra || (x >> 28 & 15) != i.Rb || (x >> 24 & 15) != i.Rc ||
+                    (x >> 20 & 15) != i.C2 || (x & 0xFFFFF) != (uint64_t)(i.C))
+                    return printf("[vec %d] wrong expected fields for %08X\n", op, (unsigned)(w[k])), 1;
+                imm |= 1u << ClassifyImm19s(i.C);
+            }
+            if (v[op].n[4] > 1 && imm != (1u << ImmClassCount) - 1)
+                return printf("[vec %d] not every immediate class\n", op), 1;
+            for (uint32_t k = 0; k < n; k++) {
+                // each vector must map back to its own index
+                Inst i = DecodeInst(w[k]);
+                uint32_t p = 0, c = 0;
+                while (p < sizeof(VecPad)/sizeof(*VecPad) - 1 && (VecPad[p] & v[op].unused) != (w[k] & v[op].unused))
+                    p++;
+                while (v[op].n[4] > 1 && VecImm[c] != i.C)
+                    c++;
+                uint32_t x = ((((p*v[op].n[0] + i.Ra)*v[op].n[1] + i.Rb)*v[op].n[2] + i.Rc)*v[op].n[3] + i.C2)*v[op].n[4] + c;
+                if (x != k)
+                    return printf("[vec %d] vector %u (%08X) is a duplicate of %u\n", op, (unsigned)(k), (unsigned)(w[k]), (unsigned)(x)), 1;
+            }
+        }
+        if (sum != total)
+            return printf("[vec] total %u, expected %u\n", (unsigned)(total), (unsigned)(sum)), 1;
+    }
+
+    fprintf(stderr, "> testing execution\n");
+    {
+        struct {
+            const char *src;  // instructions or hex words separated by ';'
+            Reg         reg;
+            uint32_t    val;  // of reg, or of HI:LO for mul/div (HI in reg+1)
+            uint64_t    steps;
+            Error       err;
+        } tests[] = {
+            {"ldi r1, 5; halt",                                  Reg_R1,  5,          2, NoError},
+            {"ldi r1, -1; halt",                                 Reg_R1,  0xFFFFFFFF, 2, NoError},
+            {"ldi r0, 3; ldi r1, 4; halt",                       Reg_R1,  4,          3, NoError}, // r0 base is zero
+            {"ldi r2, 3; ldi r1, 4(r2); halt",                   Reg_R1,  7,          3, NoError},
+            {"ldi r1, 9; st 20, r1; ld r2, 20; halt",            Reg_R2,  9,          4, NoError},
+            {"ldi r3, 10; ld r2, 2(r3); halt",                   Reg_R2,  0,          3, NoError},
+            {"ldi r1, 7; ldi r2, 5; sub r3, r1, r2; halt",       Reg_R3,  2,          4, NoError},
+            {"ldi r1, 7; ldi r2, 5; sub r3, r2, r1; halt",       Reg_R3,  0xFFFFFFFE, 4, NoError},
+            {"ldi r1, 12; ldi r2, 10; and r3, r1, r2; halt",     Reg_R3,  8,          4, NoError},
+            {"ldi r1, 12; ldi r2, 10; or r3, r1, r2; halt",      Reg_R3,  14,         4, NoError},
+            {"ldi r1, -8; ldi r2, 1; shr r3, r1, r2; halt",      Reg_R3,  0x7FFFFFFC, 4, NoError},
+            {"ldi r1, -8; ldi r2, 1; shra r3, r1, r2; halt",     Reg_R3,  0xFFFFFFFC, 4, NoError},
+            {"ldi r1, 3; ldi r2, 33; shl r3, r1, r2; halt",      Reg_R3,  6,          4, NoError}, // low 5 bits
+            {"ldi r1, 3; ldi r2, 1; ror r3, r1, r2; halt",       Reg_R3,  0x80000001, 4, NoError},
+            {"ldi r1, -1; ldi r2, 0; rol r3, r1, r2; halt",      Reg_R3,  0xFFFFFFFF, 4, NoError},
+            {"ldi r1, 1; ldi r2, 4; rol r3, r1, r2; halt",       Reg_R3,  16,         4, NoError},
+            {"ldi r1, 5; addi r2, r1, -6; halt",                 Reg_R2,  0xFFFFFFFF, 3, NoError},
+            {"ldi r1, -1; andi r2, r1, 0x3FFFF; halt",           Reg_R2,  0x3FFFF,    3, NoError},
+            {"ldi r1, 1; ori r2, r1, -2; halt",                  Reg_R2,  0xFFFFFFFF, 3, NoError},
+            {"ldi r1, -3; ldi r2, 7; mul r1, r2; mfhi r3; mflo r4; halt", Reg_R3, 0xFFFFFFFF, 6, NoError},
+            {"ldi r1, -3; ldi r2, 7; mul r1, r2; mflo r4; halt", Reg_R4,  (uint32_t)(-21), 5, NoError},
+            {"ldi r1, -7; ldi r2, 2; div r1, r2; mflo r3; halt", Reg_R3,  (uint32_t)(-3), 5, NoError},
+            {"ldi r1, -7; ldi r2, 2; div r1, r2; mfhi r3; halt", Reg_R3,  (uint32_t)(-1), 5, NoError},
+            {"ldi r1, 7; div r1, r0; mflo r3; halt",             Reg_R3,  0xFFFFFFFF, 4, NoError},
+            {"ldi r1, 7; div r1, r0; mfhi r3; halt",             Reg_R3,  7,          4, NoError},
+            {"ldi r1, 1; shl r1, r1, r1; ldi r2, 30; shl r1, r1, r2; ldi r2, -1; div r1, r2; mflo r3; halt", Reg_R3, 0x80000000, 8, NoError},
+            {"ldi r1, 5; neg r2, r1; halt",                      Reg_R2,  0xFFFFFFFB, 3, NoError},
+            {"ldi r1, 5; not r2, r1; halt",                      Reg_R2,  0xFFFFFFFA, 3, NoError},
+            {"ldi r1, 3; addi r2, r2, 1; addi r1, r1, -1; brnz r1, -3; halt", Reg_R2, 3, 11, NoError},
+            {"brzr r0, 1; ldi r1, 1; halt",                      Reg_R1,  0,          2, NoError},
+            {"ldi r1, -1; brpl r1, 1; ldi r2, 1; halt",          Reg_R2,  1,          4, NoError},
+            {"ldi r1, -1; brmi r1, 1; ldi r2, 1; halt",          Reg_R2,  0,          3, NoError},
+            {"ldi r1, 3; jal r1; halt; ldi r2, 8; jr r15",       Reg_R2,  8,          5, NoError},
+            {"ldi r1, 3; jal r1; halt; halt",                    Reg_R15, 2,          3, NoError},
+            {"ldi r1, 3; jr r1; ldi r2, 1; halt",                Reg_R2,  0,          3, NoError},
+            {"in r1; halt",                                      Reg_R1,  0x1234,     2, NoError},
+            {"nop; nop; halt; ldi r1, 1",                        Reg_R1,  0,          3, NoError},
+            {"ldi r1, 64; ld r2, 0(r1); halt",                   Reg_R2,  0,          1, Error_Exec_Mem},
+            {"ldi r1, -1; st 0(r1), r1; halt",                   Reg_R1,  0xFFFFFFFF, 1, Error_Exec_Mem},
+            {"ldi r1, 100; jr r1",                               Reg_R1,  100,        2, Error_Exec_Fetch},
+            {"nop; FFFFFFFF",                                    Reg_R1,  0,          1, Error_Exec_Inst},
+        };
+        for (size_t x = 0; x < sizeof(tests)/sizeof(*tests); x++) {
+            uint32_t mem[64] = {0};
+            char src[256], *p = src, *n;
+            str_ecpyn(src, tests[x].src, sizeof(src));
+            for (uint32_t a = 0; p; a++, p = n) {
+                Inst i;
+                n = str_spl(p, ";");
+                p = str_trim(p);
+                if (u32be_fromhex(&mem[a], p))
+                    continue;
+                if (ParseInst(&i, p, a, NULL))
+                    return printf("[exec %zu] invalid instruction %s\n", x, p), 1;
+                mem[a] = EncodeInst(i);
+            }
+            Cpu c;
+            CpuReset(&c, mem, 64);
+            c.in = 0x1234;
+            Error err = CpuRun(&c, 100);
+            if (err != tests[x].err || c.steps != tests[x].steps || c.R[tests[x].reg] != tests[x].val || (!err && !c.halted))
+                return printf("[exec %zu] %s: got %s, %llu steps, R%d=%08X, expected %s, %llu steps, %08X\n", x, tests[x].src,
+                    err ? GetError(err) : "ok", (unsigned long long)(c.steps), (int)(tests[x].reg), (unsigned)(c.R[tests[x].reg]),
+                    tests[x].err ? GetError(tests[x].err) : "ok", (unsigned long long)(tests[x].steps), (unsigned)(tests[x].val)), 1;
+        }
+
+        // profile of a loop calling a function with a loop, which calls
+        // another function
+        const char *prog[] = {
+            "ldi r1, 4", "ldi r2, 6", "jal r2", "addi r1, r1, -1", "brnz r1, -3", "halt",
+            "ldi r5, 3", "ldi r6, 13", "addi r5, r5, -1", "brnz r5, -2", "ldi r7, 0(r15)", "jal r6", "jr r7",
+            "jr r15",
+        };
+        uint32_t mem[64] = {0};
+        for (uint32_t a = 0; a < sizeof(prog)/sizeof(*prog); a++) {
+            Inst i;
+            if (ParseInst(&i, prog[a], a, NULL))
+                return printf("[exec] invalid instruction %s\n", prog[a]), 1;
+            mem[a] = EncodeInst(i);
+        }
+        static uint64_t hits[64], taken[64];
+        ProfNode node[4];
+        ProfFrame frame[2];
+        Prof p = {.hits = hits, .taken = taken, .node = node, .node_cap = 4, .frame = frame, .depth_cap = 2};
+        Cpu c;
+        CpuReset(&c, mem, 64);
+        ProfReset(&p, 0);
+        if (ProfRun(&p, &c, 1000) || !c.halted)
+            return printf("[prof] failed to run\n"), 1;
+        uint64_t sum = 0;
+        for (int a = 0; a < 64; a++)
+            sum += hits[a];
+        if (sum != c.steps || hits[8] != 12 || taken[9] != 8 || taken[4] != 3 || hits[13] != 4)
+            return printf("[prof] wrong counts\n"), 1;
+        if (p.node_len != 3 || p.depth || node[1].func != 6 || node[1].calls != 4 || node[2].func != 13 || node[2].parent != 1 || node[2].calls != 4)
+            return printf("[prof] wrong call graph\n"), 1;
+        if (node[0].self != 2+4*3+1 || node[1].self != 4*(2+3*2+3) || node[2].self != 4 || node[0].self + node[1].self + node[2].self != c.steps)
+            return printf("[prof] wrong attribution %llu %llu %llu\n", (unsigned long long)(node[0].self), (unsigned long long)(node[1].self), (unsigned long long)(node[2].self)), 1;
+    }
+
+    fprintf(stderr, "> testing cycle-accurate datapath\n");
+    {
+        // every instruction must have the same effect as on Cpu
+        static uint32_t mem[2][4096];
+        GenInstOpt opt = {.avoid = 0};
+        for (int op = 0; op < 1<<5; op++)
+            opt.weight[op] = op == 27 ? 0 : 1;
+        GenInst g;
+        GenInstInit(&g, &opt);
+        uint64_t insts = 0;
+        for (uint32_t k = 0; k < 64; k++) {
+            GenInstProg(&g, 99, k, mem[0], 4096);
+            mem_move(mem[1], mem[0], sizeof(mem[0]));
+            Cpu c;
+            Cyc y;
+            CpuReset(&c, mem[0], 4096);
+            CycReset(&y, mem[1], 4096);
+            c.in = y.cpu.in = 0xC0FFEE + k;
+            for (uint32_t n = 0; n < 2000; n++) {
+                Error e1 = CpuStep(&c), e2 = NoError;
+                CycRec r;
+                uint64_t steps = y.cpu.steps, cycles = y.cycles;
+                while (y.cpu.steps == steps && !(e2 = CycStep(&y, &r)))
+                    if (CYC_GET_T(r.ctl) != y.cycles - cycles - 1)
+                        return printf("[cyc] wrong step %u\n", CYC_GET_T(r.ctl)), 1;
+                if (e1 != e2)
+                    return printf("[cyc] program %u instruction %u: %s vs %s\n", (unsigned)(k), (unsigned)(n), GetError(e1), GetError(e2)), 1;
+                if (e1)
+                    break;
+                insts++;
+                bool same = c.PC == y.cpu.PC && c.HI == y.cpu.HI && c.LO == y.cpu.LO && c.out == y.cpu.out && c.nout == y.cpu.nout;
+                for (int x = 0; x < RegCount; x++)
+                    same = same && c.R[x] == y.cpu.R[x];
+                if (c.IR >> 27 == 2) // st
+                    same = same && mem[0][c.MA] == mem[1][c.MA];
+                uint32_t want = 4;
+                switch (c.IR >> 27) {
+                case 0: case 2: case 15: case 16: case 21: want = 6; break;
+                case 19: want = 5; break;
+                }
+                if (!same || y.cycles - cycles != want)
+                    return printf("[cyc] program %u instruction %u (%08X, %u cycles): state differs\n", (unsigned)(k), (unsigned)(n), (unsigned)(c.IR), (unsigned)(y.cycles - cycles)), 1;
+            }
+        }
+        if (insts < 10000)
+            return printf("[cyc] only %llu instructions executed\n", (unsigned long long)(insts)), 1;
+    }
+
+    fprintf(stderr, "> testing batch execution\n");
+    {
+        // every lane must end up like running it on Cpu, with each implementation
+        enum { N = 203, M = 64 };
+        static uint32_t img[N*M], mem[N*M], ref[M], state[N*(RegCount + 10)];
+        static const char *const edge[] = {
+            "ldi r1, 1", "ldi r2, 31", "shl r1, r1, r2", "ldi r3, -1", "div r1, r3", "mflo r4", "mfhi r5", "out r4", "out r5",
+            "div r3, r0", "mflo r4", "mfhi r5", "out r4", "out r5", "mul r1, r3", "mfhi r4", "out r4", "ror r6, r3, r2",
+            "rol r7, r1, r3", "out r6", "out r7", "in r8", "out r8", "halt",
+        };
+        static const uint32_t edge_out[] = {0x80000000, 0, 0xFFFFFFFF, 0xFFFFFFFF, 0, 0xFFFFFFFF, 0x40000000, 0};
+        GenInstOpt opt = {.avoid = 0};
+        for (int op = 0; op < 1<<5; op++)
+            opt.weight[op] = op == 15 || op == 16 ? 4 : 1;
+        GenInst g;
+        GenInstInit(&g, &opt);
+        for (uint32_t l = 0; l < N; l++) {
+            GenInstProg(&g, 5, l, img + l*M, M);
+            if (l % 7 == 3)
+                img[l*M + l % M] = 0xF0000000; // invalid
+        }
+        for (uint32_t i = 0; i < sizeof(edge)/sizeof(*edge); i++) {
+            Inst inst = INST_ZERO;
+            if (ParseInst(&inst, edge[i], i, NULL))
+                return printf("[batch] invalid instruction %s\n", edge[i]), 1;
+            img[i] = EncodeInst(inst);
+        }
+        Batch b = {
+            .n      = N,
+            .memsz  = M,
+            .limit  = 700,
+            .mem    = mem,
+            .R      = state,
+            .HI     = state + N*RegCount,
+            .LO     = state + N*(RegCount + 1),
+            .PC     = state + N*(RegCount + 2),
+            .in     = state + N*(RegCount + 3),
+            .out    = state + N*(RegCount + 4),
+            .nout   = state + N*(RegCount + 5),
+            .hash   = state + N*(RegCount + 6),
+            .steps  = state + N*(RegCount + 7),
+            .halted = state + N*(RegCount + 8),
+            .err    = state + N*(RegCount + 9),
+        };
+        for (BatchImpl impl = 0; impl < BatchImplCount; impl++) {
+            mem_move(mem, img, sizeof(img));
+            b.impl = impl;
+            BatchReset(&b);
+            for (uint32_t l = 0; l < N; l++)
+                b.in[l] = l * 0x9E3779B9;
+            BatchRun(&b);
+            for (uint32_t l = 0; l < N; l++) {
+                Cpu c;
+                mem_move(ref, img + l*M, sizeof(ref));
+                CpuReset(&c, ref, M);
+                c.in = b.in[l];
+                Error err = CpuRun(&c, b.limit);
+                bool same = b.err[l] == err && b.halted[l] == c.halted && b.steps[l] == c.steps && b.PC[l] == c.PC && b.HI[l] == c.HI && b.LO[l] == c.LO &&
+                    b.out[l] == c.out && b.nout[l] == c.nout && b.hash[l] == c.hash;
+                for (int r = 0; r < RegCount; r++)
+                    same = same && b.R[r*N + l] == c.R[r];
+                for (uint32_t a = 0; a < M; a++)
+                    same = same && mem[l*M + a] == ref[a];
+                if (!same)
+                    return printf("[batch] %s: lane %u (%s after %u steps) differs\n", GetBatchImpl(impl), (unsigned)(l), GetError(err), (unsigned)(c.steps)), 1;
+            }
+        }
+        uint32_t hash = 2166136261;
+        for (uint32_t i = 0; i < sizeof(edge_out)/sizeof(*edge_out); i++)
+            hash = (hash ^ edge_out[i]) * 16777619;
+        if (!b.halted[0] || b.nout[0] != sizeof(edge_out)/sizeof(*edge_out) || b.hash[0] != hash)
+            return printf("[batch] unexpected edge case results\n"), 1;
+    }
+
+    fprintf(stderr, "> testing cache simulation\n");
+    {
+        Cache c;
+        uint32_t tag[8];
+        uint64_t used[8];
+        uint8_t state[8];
+        if (CacheInit(&c, (CacheConfig){16, 4, 8, CachePolicy_LRU}, tag, used, state) != Error_Cache_Config || CacheInit(&c, (CacheConfig){16, 3, 1, CachePolicy_LRU}, tag, used, state) != Error_Cache_Config)
+            return printf("[cache] invalid config accepted\n"), 1;
+
+        // one set of two 2-word lines: 4 evicts 2..3 with LRU, but 0..1 with FIFO
+        static const uint32_t seq[] = {0, 3, 1, 4, 0, 5, 2};
+        static const char lru[] = "MMHMHHM", fifo[] = "MMHMMHM";
+        for (CachePolicy p = CachePolicy_LRU; p <= CachePolicy_FIFO; p++) {
+            const char *exp = p == CachePolicy_LRU ? lru : fifo;
+            if (CacheInit(&c, (CacheConfig){4, 2, 2, p}, tag, used, state))
+                return printf("[cache] valid config rejected\n"), 1;
+            for (uint32_t i = 0; i < sizeof(seq)/sizeof(*seq); i++)
+                if (CacheAccess(&c, seq[i], seq[i] == 3) != (exp[i] == 'H'))
+                    return printf("[cache] %s: access %u to %u: expected %s\n", GetCachePolicy(p), (unsigned)(i), (unsigned)(seq[i]), exp[i] == 'H' ? "hit" : "miss"), 1;
+            if (c.hits + c.misses != sizeof(seq)/sizeof(*seq) || c.writebacks != 1)
+                return printf("[cache] %s: wrong counts\n", GetCachePolicy(p)), 1;
+        }
+
+        // random replacement still fills invalid ways first
+        if (CacheInit(&c, (CacheConfig){8, 8, 1, CachePolicy_Random}, tag, used, state))
+            return printf("[cache] valid config rejected\n"), 1;
+        for (uint32_t i = 0; i < 16; i++)
+            if (CacheAccess(&c, i & 7, false) != (i >= 8))
+                return printf("[cache] random: access %u: wrong result\n", (unsigned)(i)), 1;
+    }
+
+#if defined(STATS)
+    fprintf(stderr, "> testing statistics\n");
+    {
+        char src[] = "a: ld r1, b\nb: brnz r1, a ; x\nc:\nd: DAT 1\n nop";
+        ProgTok tok[16];
+        uint32_t img[8];
+        Prog prog = {
+            .len = 0,
+            .cap = sizeof(tok)/sizeof(*tok),
+            .tok = tok,
+        };
+        stats_total = (Stats){0};
+        if (SplitProg(&prog, src, NULL) || AssembleProg(prog, img, 8, NULL))
+            return printf("failed to assemble statistics test\n"), 1;
+        Stats exp = {.tokens = 8, .labels = 4, .lookups = 2, .bytes_in = sizeof(src) - 1};
+        if (stats_total.tokens != exp.tokens || stats_total.labels != exp.labels || stats_total.lookups != exp.lookups || stats_total.bytes_in != exp.bytes_in || stats_total.bytes_out)
+            return printf("unexpected statistics: %d tokens, %d labels, %d lookups, %d bytes in, %d bytes out\n",
+                (int)(stats_total.tokens), (int)(stats_total.labels), (int)(stats_total.lookups), (int)(stats_total.bytes_in), (int)(stats_total.bytes_out)), 1;
+    }
+#endif
+
+    fprintf(stderr, "> testing synthetic programs\n");
+    {
+        static char src[2][500*64 + 1];
+        static ProgTok tok[500*3];
+        static uint32_t img[500];
+        const GenProgOpt opts[] = {
+            {.n = 1,   .label = 0,   .branch = 0,   .seed = 0},
+            {.n = 1,   .label = 0,   .branch = 100, .seed = 1},
+            {.n = 500, .label = 0,   .branch = 100, .seed = 2},
+            {.n = 500, .label = 20,  .branch = 10,  .seed = 3},
+            {.n = 500, .label = 100, .branch = 100, .seed = 4},
+            {.n = 500, .label = 50,  .branch = 0,   .seed = 5},
+        };
+        for (size_t x = 0; x < sizeof(opts)/sizeof(*opts); x++) {
+            GenProgOpt opt = opts[x];
+            char *end = GenProg(src[0], opt);
+            GenProg(src[1], opt);
+            if ((size_t)(end - src[0]) > opt.n*64 || str_len(src[0]) != (size_t)(end - src[0]))
+                return printf("[synthetic %d] program too long\n", (int)(x)), 1;
+            if (!str_eq(src[0], src[1], false))
+                return printf("[synthetic %d] program not deterministic\n", (int)(x)), 1;
+
+            Prog prog = {
+                .len = 0,
+                .cap = sizeof(tok)/sizeof(*tok),
+                .tok = tok,
+            };
+            int line;
+            Error e;
+            if ((e = SplitProg(&prog, src[0], &line)) || (e = AssembleProg(prog, img, opt.n, &line)))
+                return printf("[synthetic %d] line %d: %s\n%s", (int)(x), line, GetError(e), src[1]), 1;
+
+            uint32_t nlabel = 0, nword = 0, nbranch = 0;
+            for (size_t i = 0; i < prog.len; i++) {
+                nlabel += prog.tok[i].kind == ProgTokKind_Label;
+                nword += prog.tok[i].count;
+            }
+            for (size_t i = 0; i < opt.n; i++)
+                nbranch += DecodeInst(img[i]).Opcode == 19;
+            if (nword != opt.n)
+                return printf("[synthetic %d] assembled into %u words, expected %u\n", (int)(x), (unsigned)(nword), (unsigned)(opt.n)), 1;
+            if (nlabel < 1 || (opt.label == 0 && nlabel != 1) || (opt.label == 100 && nlabel != opt.n) || (opt.label == 50 && (nlabel < opt.n*4/10 || nlabel > opt.n*6/10)))
+                return printf("[synthetic %d] unexpected label count %u\n", (int)(x), (unsigned)(nlabel)), 1;
+            if (opt.branch == 100 && nbranch != opt.n)
+                return printf("[synthetic %d] unexpected branch count %u\n", (int)(x), (unsigned)(nbranch)), 1;
+        }
+    }
+
     fprintf(stderr, "> testing instruction encode/decode/parse/format consistency\n");
     time_t ts = time(NULL);
     time_t tx = ts;
@@ -1505,7 +10713,7 @@ int main(void) {
             if (tc - tx > 5) {
                 fprintf(stderr, ". %s %.0f%% (%d/sec)\n", h,
                     (double)(n1+1)/(double)(UINT32_MAX)*100,
-                    (int)((tcn-n1)/(tc - tx)));
+                    (int)((n1-tcn)/(tc - tx)));
                 tcn = n1;
                 tx = tc;
             }
@@ -1601,3 +10809,4 @@ int main(void) {
 }
 
 #endif
+#endif
@@ -12,76 +12,508 @@ class AssemblyError extends Error {
 }
 
 export function assemble(s) {
-    native.str = s
-    const res = native.assemble()
-    if (res) {
-        native.error(res)
-        throw new AssemblyError(native.str)
-    }
-    return native.str
+    return call("assemble", s)
 }
 
 export function disassemble(s) {
-    native.str = s
-    const res = native.disassemble()
-    const asm = native.str
-    if (res) {
-        native.error(res)
-        if (!asm.length) {
-            throw new AssemblyError(native.str)
-        }
-    }
-    return {asm, err: res ? native.str : null}
+    return call("disassemble", s)
 }
 
 export function explain(s) {
-    native.str = s
-    const res = native.explain()
-    const exp = native.str
-    if (res) {
-        native.error(res)
-        if (!exp.length) {
-            throw new AssemblyError(native.str)
+    return call("explain", s)
+}
+
+export function assembleProg(s, n = 512) {
+    return call("assembleProg", s, n)
+}
+
+// assembleImage assembles s like assembleProg, returning the image as a
+// Uint8Array in format: "hex" (like assembleProg), "bin" or "binle" (raw
+// big/little-endian words), "ihex" (Intel HEX addressed by word, like
+// Quartus), "mif" (Quartus MIF), or "memh" (Verilog $readmemh, skipping long
+// runs of zeros with @addr).
+export function assembleImage(s, n = 512, format = "bin") {
+    return call("assembleImage", s, n, format)
+}
+
+// disassembleImage disassembles a memory image ($readmemh hex words like the
+// output of assembleProg, or a Quartus MIF) into source which assembles back
+// into the same image, with labels for branch targets.
+export function disassembleImage(s) {
+    return call("disassembleImage", s)
+}
+
+// sourceMap assembles s like assembleProg, returning a SourceMap between the
+// words of the image and the lines of s.
+export function sourceMap(s, n = 512) {
+    return call("sourceMap", s, n)
+}
+
+// SourceMap maps between the words of an assembled program and the source lines
+// they came from. Each entry is a line which assembled to count[i] words
+// starting at addr[i]. The entries are sorted by line, and order contains
+// their indexes sorted by address.
+export class SourceMap {
+    constructor(line, addr, count, order) {
+        Object.assign(this, {line, addr, count, order})
+    }
+
+    // lineOf returns the source line of the word at addr, or 0.
+    lineOf(addr) {
+        let lo = 0, hi = this.order.length
+        while (lo < hi) {
+            const mid = (lo + hi) >>> 1
+            if (this.addr[this.order[mid]] <= addr) {
+                lo = mid + 1
+            } else {
+                hi = mid
+            }
+        }
+        const i = this.order[lo - 1]
+        return lo && addr - this.addr[i] < this.count[i] ? this.line[i] : 0
+    }
+
+    // rangeOf returns the words assembled from line as {addr, count}, or null.
+    rangeOf(line) {
+        let lo = 0, hi = this.line.length
+        while (lo < hi) {
+            const mid = (lo + hi) >>> 1
+            if (this.line[mid] < line) {
+                lo = mid + 1
+            } else {
+                hi = mid
+            }
         }
+        return this.line[lo] === line ? {addr: this.addr[lo], count: this.count[lo]} : null
     }
-    return {exp, err: res ? native.str : null}
 }
 
-export function assembleProg(s, n = 512) {
-    native.str = s
-    const res = native.prog_assemble(n)
-    if (res) {
-        native.error(res)
-        throw new AssemblyError(`line ${native.prog_curline()}: ${native.str}`)
-    }
-    return native.str
-}
-
-const wasm = await WebAssembly.instantiateStreaming(fetch(/**/"asm374.wasm"/**/))
-const native = {...wasm.instance.exports}
-
-Object.defineProperty(native, "str", {
-    get() {
-        const buf = new Uint8Array(this.memory.buffer, this.buf, this.buflen())
-        return new TextDecoder().decode(buf)
-    },
-    set(s) {
-        const buf = new Uint8Array(this.memory.buffer, this.buf, this.bufsz())
-        const res = new TextEncoder().encodeInto(s, buf)
-        if (res.written < buf.length) {
-            buf[res.written] = 0
+// diagnoseProg assembles s like assembleProg, but returns every error (as
+// objects with the line, the zero-based columns [col, end), and the message)
+// instead of throwing the first one.
+export function diagnoseProg(s, n = 512) {
+    return call("diagnoseProg", s, n)
+}
+
+// assembleProgLive assembles s like assembleProg, but only reassembles the lines
+// which changed since the last call. It returns the image, the indexes of the
+// words which changed since the last successful call (or null if all of them
+// may have), and the source line of each word (0 if unused, or null if
+// unknown).
+export function assembleProgLive(s, n = 512) {
+    return call("assembleProgLive", s, n)
+}
+
+// stats returns the time (in milliseconds) spent in each phase of assembly
+// ({split, layout, check, encode, format}) and the number of tokens, labels,
+// symbol lookups, and source and image bytes processed ({tokens, labels,
+// lookups, bytesIn, bytesOut}) by the functions above since the last reset, or
+// null if the module wasn't built with -DSTATS (see asm374.stats.wasm). It
+// doesn't include requests to pools.
+export function stats(reset = false) {
+    const native = wasm.instance.exports
+    if (!native.stats) {
+        return null
+    }
+    const [split, layout, check, encode, format, tokens, labels, lookups, bytesIn, bytesOut] =
+        Array.from(new BigUint64Array(native.memory.buffer, native.stats(), 10), Number)
+    if (reset) {
+        native.stats_reset()
+    }
+    return {split: split/1e6, layout: layout/1e6, check: check/1e6, encode: encode/1e6, format: format/1e6, tokens, labels, lookups, bytesIn, bytesOut}
+}
+
+// createPool creates a pool of workers, each with their own instance of the
+// module, with Promise-returning versions of the functions above which take an
+// additional options argument.
+//
+// Inputs can be strings or UTF-8 ArrayBuffers (or views of them), which are
+// transferred to the worker (so they can't be used afterwards). Requests with
+// the same key run in order on the same worker, and each new one cancels the
+// earlier ones which haven't finished yet, rejecting them with an AbortError.
+// Requests can also be cancelled with an AbortSignal. By default,
+// assembleProgLive uses the same key for every request.
+export function createPool(size = Math.min(navigator.hardwareConcurrency || 1, 4)) {
+    selfTest()
+    const url = URL.createObjectURL(new Blob([workerSource], {type: "text/javascript"}))
+    const keys = new Map()
+    const workers = Array.from({length: Math.max(size, 1)}, () => {
+        const w = {worker: new Worker(url), queue: [], running: null, live: undefined}
+        w.worker.onmessage = ({data}) => done(w, data)
+        w.worker.onerror = ev => {
+            ev.preventDefault()
+            for (const req of [w.running, ...w.queue]) {
+                if (req && !req.cancelled) {
+                    req.reject(new Error(`ASM374 worker failed: ${ev.message}`))
+                }
+            }
+            w.running = null
+            w.queue = []
+        }
+        w.worker.postMessage({module: wasm.module})
+        return w
+    })
+
+    // release stops listening for the abort signal of a settled request, so
+    // a long-lived signal doesn't keep every request alive
+    const release = req => {
+        req.signal?.removeEventListener("abort", req.abort)
+        req.signal = null
+    }
+
+    const cancel = req => {
+        release(req)
+        if (!req.cancelled) {
+            req.cancelled = true
+            req.reject(new DOMException("Request cancelled", "AbortError"))
+        }
+    }
+
+    const idlest = () => workers.reduce((a, b) => a.queue.length + !!a.running <= b.queue.length + !!b.running ? a : b)
+
+    const next = w => {
+        if (!w.running && w.queue.length) {
+            const {op, buf, n, format} = w.running = w.queue.shift()
+            w.worker.postMessage({op, buf, n, format}, [buf])
+        }
+    }
+
+    const done = (w, data) => {
+        const req = w.running
+        if (!req) {
+            return
+        }
+        w.running = null
+        release(req)
+        if (req.op == "assembleProgLive") {
+            // the changes are relative to the last result from this worker
+            if (req.cancelled || data.ex) {
+                w.live = undefined
+            } else {
+                if (w.live !== req.key) {
+                    data.changed = null
+                }
+                w.live = req.key
+            }
+        }
+        if (!req.cancelled) {
+            try {
+                if (data.ex) {
+                    throw Object.assign(new Error(data.ex.message), {name: data.ex.name})
+                }
+                req.resolve(finish(req.op, data))
+            } catch (ex) {
+                req.reject(ex)
+            }
+        }
+        next(w)
+    }
+
+    const request = (op, s, n, {key, signal, format} = {}) => new Promise((resolve, reject) => {
+        if (signal?.aborted) {
+            throw new DOMException("Request cancelled", "AbortError")
+        }
+        if (!workers.length) {
+            throw new Error("Pool has been terminated")
+        }
+        const req = {op, buf: toBuffer(s), n, format, key, signal, resolve, reject, cancelled: false}
+
+        let w
+        if (key !== undefined) {
+            if (!(w = keys.get(key))) {
+                keys.set(key, w = idlest())
+            }
+            w.queue = w.queue.filter(r => r.key !== key || cancel(r))
+            if (w.running?.key === key) {
+                cancel(w.running)
+            }
         } else {
-            buf[0] = 0
-            throw new TypeError(`String exceeds maximum length ${buf.length - 1}`)
+            w = idlest()
         }
-    },
-    enumerable: true,
-})
+        req.abort = () => {
+            w.queue = w.queue.filter(r => r !== req)
+            cancel(req)
+        }
+        signal?.addEventListener("abort", req.abort, {once: true})
+
+        w.queue.push(req)
+        next(w)
+    })
+
+    return {
+        assemble: (s, opt) => request("assemble", s, 0, opt),
+        disassemble: (s, opt) => request("disassemble", s, 0, opt),
+        explain: (s, opt) => request("explain", s, 0, opt),
+        assembleProg: (s, n = 512, opt) => request("assembleProg", s, n, opt),
+        diagnoseProg: (s, n = 512, opt) => request("diagnoseProg", s, n, opt),
+        sourceMap: (s, n = 512, opt) => request("sourceMap", s, n, opt),
+        assembleImage: (s, n = 512, format = "bin", opt) => request("assembleImage", s, n, {...opt, format}),
+        disassembleImage: (s, opt) => request("disassembleImage", s, 0, opt),
+        assembleProgLive: (s, n = 512, opt) => request("assembleProgLive", s, n, {key: "assembleProgLive", ...opt}),
+        terminate() {
+            for (const w of workers.splice(0)) {
+                w.worker.terminate()
+                if (w.running) {
+                    cancel(w.running)
+                }
+                w.queue.forEach(cancel)
+            }
+            URL.revokeObjectURL(url)
+        },
+    }
+}
+
+// runner returns a function which runs a request using the exports of an
+// instance of the module. It must be self-contained since it is also used as
+// the source of the workers.
+function runner(native) {
+    const mem = () => new Uint8Array(native.memory.buffer)
+    const load = () => mem().slice(native.result(), native.result() + native.result_len()).buffer
+    const store = b => {
+        native.reset()
+        const p = native.alloc(b.length + 1)
+        if (!p) {
+            throw new RangeError("Out of memory")
+        }
+        mem().set(b, p)
+        return p
+    }
+    const error = res => {
+        const m = mem(), p = native.error(res)
+        return m.slice(p, m.indexOf(0, p)).buffer
+    }
+
+    // the program currently loaded by assembleProgLive
+    let live = null
+
+    const assembleProgLive = (b, n) => {
+        const lines = new TextDecoder().decode(b).split("\n")
+        if (live?.n !== n || native.prog_broken()) {
+            // leave room for the program to grow
+            live = null
+            const res = native.prog_init(n, (lines.length + 256) * 2, (b.length + 4096) * 2)
+            if (res) {
+                return {res, err: error(res), line: 0}
+            }
+            live = {n, lines: [], fresh: true}
+        }
+
+        // find the changed lines
+        const a = live.lines
+        let p = 0, q = 0
+        while (p < a.length && p < lines.length && a[p] === lines[p]) p++
+        while (q < a.length - p && q < lines.length - p && a[a.length-1-q] === lines[lines.length-1-q]) q++
+
+        // replace them
+        const t = new TextEncoder().encode(lines.slice(p, lines.length - q).join("\n"))
+        let res = native.prog_edit(p, a.length - p - q, lines.length - p - q, store(t), t.length)
+        if (native.prog_broken()) {
+            // fall back to assembling everything
+            live = null
+            if ((res = native.prog_assemble(store(b), b.length, n))) {
+                return {res, err: error(res), line: native.prog_curline()}
+            }
+            const image = Uint32Array.from(new TextDecoder().decode(load()).split(/\s+/), x => parseInt(x, 16))
+            return {res, image: image.buffer, changed: null, lines: null}
+        }
+        live.lines = lines
+        if (res) {
+            live.fresh = true
+            return {res, err: error(res), line: native.prog_curline()}
+        }
+
+        const image = new Uint32Array(native.memory.buffer, native.prog_image(), n).slice()
+        const wordLines = new Uint32Array(native.memory.buffer, native.prog_lines(), n).slice()
+        const changed = live.fresh ? null : new Uint32Array(native.memory.buffer, native.prog_changed(), native.prog_changed_len()).slice()
+        live.fresh = false
+        return {res, image: image.buffer, changed: changed ? changed.buffer : null, lines: wordLines.buffer}
+    }
+
+    return ({op, buf, n, format}) => {
+        const b = new Uint8Array(buf)
+        let res
+        switch (op) {
+        case "assemble":
+            res = native.assemble(store(b), b.length)
+            break
+        case "disassemble":
+            res = native.disassemble(store(b), b.length)
+            break
+        case "explain":
+            res = native.explain(store(b), b.length)
+            break
+        case "assembleProg":
+            res = native.prog_assemble(store(b), b.length, n)
+            break
+        case "assembleImage":
+            res = native.prog_assemble(store(b), b.length, n)
+            if (!res) {
+                const fmt = ["hex", "bin", "binle", "ihex", "mif", "memh"].indexOf(format)
+                if (fmt < 0) {
+                    throw new TypeError(`Unknown image format ${format}`)
+                }
+                res = native.image_write(fmt)
+            }
+            break
+        case "disassembleImage":
+            res = native.image_disassemble(store(b), b.length)
+            break
+        case "sourceMap": {
+            res = native.prog_assemble(store(b), b.length, n)
+            if (res) {
+                return {res, err: error(res), line: native.prog_curline()}
+            }
+            const copy = (T, p) => new T(native.memory.buffer, p, native.map_len()).slice().buffer
+            return {res, map: [
+                copy(Int32Array, native.map_lines()),
+                copy(Uint32Array, native.map_addrs()),
+                copy(Uint32Array, native.map_counts()),
+                copy(Uint32Array, native.map_order()),
+            ]}
+        }
+        case "diagnoseProg": {
+            const count = native.prog_diagnose(store(b), b.length, n) >>> 0
+            if (count == 0xFFFFFFFF) {
+                throw new RangeError("Out of memory")
+            }
+            const d = new Uint32Array(native.memory.buffer, native.result(), native.result_len() / 4)
+            const diags = []
+            for (let i = 0; i < d.length; i += 4) {
+                diags.push({line: d[i], col: d[i+1], end: d[i+2], message: new TextDecoder().decode(error(d[i+3]))})
+            }
+            return {res: 0, diags}
+        }
+        case "assembleProgLive":
+            return assembleProgLive(b, n)
+        default:
+            throw new TypeError(`Unknown request ${op}`)
+        }
+        const out = load()
+        return {res, out, err: res ? error(res) : null, line: res ? native.prog_curline() : 0}
+    }
+}
+
+// finish converts the result of a request into the return value, throwing
+// the error if there was one.
+function finish(op, r) {
+    const decode = b => new TextDecoder().decode(b)
+    const err = r.res ? decode(r.err) : null
+    switch (op) {
+    case "assemble":
+        if (err) {
+            throw new AssemblyError(err)
+        }
+        return decode(r.out)
+    case "disassemble":
+    case "explain": {
+        const out = decode(r.out)
+        if (err && !out.length) {
+            throw new AssemblyError(err)
+        }
+        return op == "explain" ? {exp: out, err} : {asm: out, err}
+    }
+    case "diagnoseProg":
+        return r.diags
+    case "sourceMap":
+        if (err) {
+            throw new AssemblyError(r.line ? `line ${r.line}: ${err}` : err)
+        }
+        return new SourceMap(new Int32Array(r.map[0]), new Uint32Array(r.map[1]), new Uint32Array(r.map[2]), new Uint32Array(r.map[3]))
+    case "assembleProg":
+    case "assembleProgLive":
+    case "assembleImage":
+    case "disassembleImage":
+        if (err) {
+            throw new AssemblyError(r.line ? `line ${r.line}: ${err}` : err)
+        }
+        if (op == "assembleImage") {
+            return new Uint8Array(r.out)
+        }
+        return op != "assembleProgLive" ? decode(r.out) : {
+            image: new Uint32Array(r.image),
+            changed: r.changed ? new Uint32Array(r.changed) : null,
+            lines: r.lines ? new Uint32Array(r.lines) : null,
+        }
+    }
+}
+
+function toBuffer(s) {
+    if (typeof s == "string") {
+        return new TextEncoder().encode(s).buffer
+    }
+    if (ArrayBuffer.isView(s)) {
+        return s.byteOffset == 0 && s.byteLength == s.buffer.byteLength ? s.buffer : s.buffer.slice(s.byteOffset, s.byteOffset + s.byteLength)
+    }
+    return s
+}
+
+function call(op, s, n, format) {
+    selfTest()
+    return finish(op, run({op, buf: toBuffer(s), n, format}))
+}
+
+const workerSource = `"use strict"
+const runner = ${runner}
+let run
+onmessage = ({data}) => {
+    if (data.module) {
+        run = runner(new WebAssembly.Instance(data.module, {env: {now: () => performance.now()}}).exports)
+        return
+    }
+    let r
+    try {
+        r = run(data)
+    } catch (ex) {
+        r = {ex: {name: ex.name, message: ex.message}}
+    }
+    postMessage(r, [r.out, r.err, r.image, r.changed, r.lines, ...(r.map || [])].filter(x => x))
+}
+`
+
+// loadModule compiles the wasm module at url while it is downloaded. The
+// content-hashed files from make dist can be served as immutable, so the
+// browser can reuse both the download and its own compiled code cache.
+function loadModule(url) {
+    return WebAssembly.compileStreaming(fetch(url))
+}
+
+// selfTest checks the module the first time it is used, so it doesn't delay
+// loading.
+let broken
+function selfTest() {
+    if (broken === undefined) {
+        broken = null
+        try {
+            if (disassemble(assemble("nop"))?.asm !== "nop") {
+                throw new Error("Incorrect assembly/disassembly")
+            }
+        } catch (ex) {
+            broken = new Error(`ASM374 is broken: ${ex}`)
+        }
+    }
+    if (broken) {
+        throw broken
+    }
+}
+
+// fast is whether the browser supports the features used by the fast build
+// (SIMD128, bulk memory, and sign extension).
+const fast = [
+    [0, 97, 115, 109, 1, 0, 0, 0, 1, 5, 1, 96, 0, 1, 123, 3, 2, 1, 0, 10, 10, 1, 8, 0, 65, 0, 253, 15, 253, 98, 11],
+    [0, 97, 115, 109, 1, 0, 0, 0, 1, 4, 1, 96, 0, 0, 3, 2, 1, 0, 5, 3, 1, 0, 1, 10, 14, 1, 12, 0, 65, 0, 65, 0, 65, 0, 252, 10, 0, 0, 11],
+    [0, 97, 115, 109, 1, 0, 0, 0, 1, 4, 1, 96, 0, 0, 3, 2, 1, 0, 10, 8, 1, 6, 0, 65, 0, 192, 26, 11],
+].every(b => WebAssembly.validate(new Uint8Array(b)))
 
-try {
-    if (disassemble(assemble("nop"))?.asm !== "nop") {
-        throw new Error(`Incorrect assembly/disassembly ${JSON.stringify(res)}`)
+// the fast build isn't embedded in asm374.dist.js, so fall back to the mvp
+// build if it can't be loaded (or resolved, e.g., from a data URL)
+let module = null
+if (fast) {
+    try {
+        module = await loadModule(new URL(/*simd*/"asm374.simd.wasm"/*simd*/, import.meta.url))
+    } catch {
+        // not available
     }
-} catch (ex) {
-    throw new Error(`ASM374 is broken: ${ex}`)
 }
+module ??= await loadModule(new URL(/**/"asm374.wasm"/**/, import.meta.url))
+const wasm = {module, instance: await WebAssembly.instantiate(module, {env: {now: () => performance.now()}})}
+const run = runner(wasm.instance.exports)
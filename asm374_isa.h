@@ -0,0 +1,289 @@
+/* Generated by gen_isa.py from isa374.txt. Do not edit. */
+
+/**
+ * Instruction table.
+ *
+ * This contains the mappings of opcodes to instruction specifications.
+ */
+static const InstSpec InstData[1<<5] = {
+    [ 0] = {InstEnc_I, "ld",   false, {InstArg_Ra,  InstArg_RbC, InstArg__ }},
+    [ 1] = {InstEnc_I, "ldi",  false, {InstArg_Ra,  InstArg_RbC, InstArg__ }},
+    [ 2] = {InstEnc_I, "st",   false, {InstArg_RbC, InstArg_Ra,  InstArg__ }},
+    [ 3] = {InstEnc_R, "add",  false, {InstArg_Ra,  InstArg_Rb,  InstArg_Rc}},
+    [ 4] = {InstEnc_R, "sub",  false, {InstArg_Ra,  InstArg_Rb,  InstArg_Rc}},
+    [ 5] = {InstEnc_R, "and",  false, {InstArg_Ra,  InstArg_Rb,  InstArg_Rc}},
+    [ 6] = {InstEnc_R, "or",   false, {InstArg_Ra,  InstArg_Rb,  InstArg_Rc}},
+    [ 7] = {InstEnc_R, "shr",  false, {InstArg_Ra,  InstArg_Rb,  InstArg_Rc}},
+    [ 8] = {InstEnc_R, "shra", false, {InstArg_Ra,  InstArg_Rb,  InstArg_Rc}},
+    [ 9] = {InstEnc_R, "shl",  false, {InstArg_Ra,  InstArg_Rb,  InstArg_Rc}},
+    [10] = {InstEnc_R, "ror",  false, {InstArg_Ra,  InstArg_Rb,  InstArg_Rc}},
+    [11] = {InstEnc_R, "rol",  false, {InstArg_Ra,  InstArg_Rb,  InstArg_Rc}},
+    [12] = {InstEnc_I, "addi", false, {InstArg_Ra,  InstArg_Rb,  InstArg_C }},
+    [13] = {InstEnc_I, "andi", false, {InstArg_Ra,  InstArg_Rb,  InstArg_C }},
+    [14] = {InstEnc_I, "ori",  false, {InstArg_Ra,  InstArg_Rb,  InstArg_C }},
+    [15] = {InstEnc_I, "mul",  false, {InstArg_Ra,  InstArg_Rb,  InstArg__ }},
+    [16] = {InstEnc_I, "div",  false, {InstArg_Ra,  InstArg_Rb,  InstArg__ }},
+    [17] = {InstEnc_I, "neg",  false, {InstArg_Ra,  InstArg_Rb,  InstArg__ }},
+    [18] = {InstEnc_I, "not",  false, {InstArg_Ra,  InstArg_Rb,  InstArg__ }},
+    [19] = {InstEnc_B, "br",   true,  {InstArg_Ra,  InstArg_C,   InstArg__ }},
+    [20] = {InstEnc_J, "jr",   false, {InstArg_Ra,  InstArg__,   InstArg__ }},
+    [21] = {InstEnc_J, "jal",  false, {InstArg_Ra,  InstArg__,   InstArg__ }},
+    [22] = {InstEnc_J, "in",   false, {InstArg_Ra,  InstArg__,   InstArg__ }},
+    [23] = {InstEnc_J, "out",  false, {InstArg_Ra,  InstArg__,   InstArg__ }},
+    [24] = {InstEnc_J, "mfhi", false, {InstArg_Ra,  InstArg__,   InstArg__ }},
+    [25] = {InstEnc_J, "mflo", false, {InstArg_Ra,  InstArg__,   InstArg__ }},
+    [26] = {InstEnc_M, "nop",  false, {InstArg__,   InstArg__,   InstArg__ }},
+    [27] = {InstEnc_M, "halt", false, {InstArg__,   InstArg__,   InstArg__ }},
+};
+
+/**
+ * Gets the instruction specification for op. Valid if Format is non-zero.
+ */
+static InstSpec LookupOpcode(Opcode op) {
+    return InstData[op & 0x1F];
+}
+
+/**
+ * DecodeInst decodes inst.
+ */
+static Inst DecodeInst(uint32_t b) {
+    Inst i = INST_ZERO;
+    switch ((i.Opcode = (Opcode)((b >> 27) & 0x1F))) {
+    case 0: case 1: case 2: case 12: case 13: case 14: case 15: case 16: case 17: case 18: // I
+        i.Ra = (Reg)((b >> 23) & 0xF);
+        i.Rb = (Reg)((b >> 19) & 0xF);
+        i.C  = (Imm19s)((b >> 0) & 0x7FFFF);
+        break;
+    case 3: case 4: case 5: case 6: case 7: case 8: case 9: case 10: case 11: // R
+        i.Ra = (Reg)((b >> 23) & 0xF);
+        i.Rb = (Reg)((b >> 19) & 0xF);
+        i.Rc = (Reg)((b >> 15) & 0xF);
+        break;
+    case 19: // B
+        i.Ra = (Reg)((b >> 23) & 0xF);
+        i.C2 = (Cond)((b >> 19) & 0x3);
+        i.C  = (Imm19s)((b >> 0) & 0x7FFFF);
+        break;
+    case 20: case 21: case 22: case 23: case 24: case 25: // J
+        i.Ra = (Reg)((b >> 23) & 0xF);
+        break;
+    case 26: case 27: // M
+        break;
+    }
+    return i;
+}
+
+/**
+ * EncodeInst encodes inst.
+ */
+static uint32_t EncodeInst(Inst i) {
+    uint32_t b = ((uint32_t)(i.Opcode) & 0x1F) << 27;
+    switch (i.Opcode & 0x1F) {
+    case 0: case 1: case 2: case 12: case 13: case 14: case 15: case 16: case 17: case 18: // I
+        b |= ((uint32_t)(i.Ra) & 0xF) << 23;
+        b |= ((uint32_t)(i.Rb) & 0xF) << 19;
+        b |= ((uint32_t)(i.C) & 0x7FFFF) << 0;
+        break;
+    case 3: case 4: case 5: case 6: case 7: case 8: case 9: case 10: case 11: // R
+        b |= ((uint32_t)(i.Ra) & 0xF) << 23;
+        b |= ((uint32_t)(i.Rb) & 0xF) << 19;
+        b |= ((uint32_t)(i.Rc) & 0xF) << 15;
+        break;
+    case 19: // B
+        b |= ((uint32_t)(i.Ra) & 0xF) << 23;
+        b |= ((uint32_t)(i.C2) & 0x3) << 19;
+        b |= ((uint32_t)(i.C) & 0x7FFFF) << 0;
+        break;
+    case 20: case 21: case 22: case 23: case 24: case 25: // J
+        b |= ((uint32_t)(i.Ra) & 0xF) << 23;
+        break;
+    case 26: case 27: // M
+        break;
+    }
+    return b;
+}
+
+/**
+ * CheckInst checks whether inst is valid.
+ */
+static Error CheckInst(Inst i) {
+    switch (i.Opcode & 0x1F) {
+    case 0: case 1: case 2: case 12: case 13: case 14: case 15: case 16: case 17: case 18: // I
+        if (!GetReg(i.Ra)) return Error_Inst_Reg;
+        if (!GetReg(i.Rb)) return Error_Inst_Reg;
+        return NoError;
+    case 3: case 4: case 5: case 6: case 7: case 8: case 9: case 10: case 11: // R
+        if (!GetReg(i.Ra)) return Error_Inst_Reg;
+        if (!GetReg(i.Rb)) return Error_Inst_Reg;
+        if (!GetReg(i.Rc)) return Error_Inst_Reg;
+        return NoError;
+    case 19: // B
+        if (!GetReg(i.Ra)) return Error_Inst_Reg;
+        if (!GetCond(i.C2)) return Error_Inst_Cond;
+        return NoError;
+    case 20: case 21: case 22: case 23: case 24: case 25: // J
+        if (!GetReg(i.Ra)) return Error_Inst_Reg;
+        return NoError;
+    case 26: case 27: // M
+        return NoError;
+    }
+    return Error_Inst_Op;
+}
+
+/**
+ * Writes inst to str, returning a pointer to the end of the updated string.
+ */
+static char *FormatInst(char *str, Inst inst) {
+    if (str) {
+        switch (inst.Opcode & 0x1F) {
+        case 0: // ld Ra, RbC
+            str = str_ecpy(str, "ld ");
+            str = FormatReg(str, inst.Ra);
+            str = FormatRegImm19s(str_ecpy(str, ", "), inst.Rb, inst.C);
+            break;
+        case 1: // ldi Ra, RbC
+            str = str_ecpy(str, "ldi ");
+            str = FormatReg(str, inst.Ra);
+            str = FormatRegImm19s(str_ecpy(str, ", "), inst.Rb, inst.C);
+            break;
+        case 2: // st RbC, Ra
+            str = str_ecpy(str, "st ");
+            str = FormatRegImm19s(str, inst.Rb, inst.C);
+            str = FormatReg(str_ecpy(str, ", "), inst.Ra);
+            break;
+        case 3: // add Ra, Rb, Rc
+            str = str_ecpy(str, "add ");
+            str = FormatReg(str, inst.Ra);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rb);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rc);
+            break;
+        case 4: // sub Ra, Rb, Rc
+            str = str_ecpy(str, "sub ");
+            str = FormatReg(str, inst.Ra);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rb);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rc);
+            break;
+        case 5: // and Ra, Rb, Rc
+            str = str_ecpy(str, "and ");
+            str = FormatReg(str, inst.Ra);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rb);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rc);
+            break;
+        case 6: // or Ra, Rb, Rc
+            str = str_ecpy(str, "or ");
+            str = FormatReg(str, inst.Ra);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rb);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rc);
+            break;
+        case 7: // shr Ra, Rb, Rc
+            str = str_ecpy(str, "shr ");
+            str = FormatReg(str, inst.Ra);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rb);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rc);
+            break;
+        case 8: // shra Ra, Rb, Rc
+            str = str_ecpy(str, "shra ");
+            str = FormatReg(str, inst.Ra);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rb);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rc);
+            break;
+        case 9: // shl Ra, Rb, Rc
+            str = str_ecpy(str, "shl ");
+            str = FormatReg(str, inst.Ra);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rb);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rc);
+            break;
+        case 10: // ror Ra, Rb, Rc
+            str = str_ecpy(str, "ror ");
+            str = FormatReg(str, inst.Ra);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rb);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rc);
+            break;
+        case 11: // rol Ra, Rb, Rc
+            str = str_ecpy(str, "rol ");
+            str = FormatReg(str, inst.Ra);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rb);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rc);
+            break;
+        case 12: // addi Ra, Rb, C
+            str = str_ecpy(str, "addi ");
+            str = FormatReg(str, inst.Ra);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rb);
+            str = FormatImm19s(str_ecpy(str, ", "), inst.C);
+            break;
+        case 13: // andi Ra, Rb, C
+            str = str_ecpy(str, "andi ");
+            str = FormatReg(str, inst.Ra);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rb);
+            str = FormatImm19s(str_ecpy(str, ", "), inst.C);
+            break;
+        case 14: // ori Ra, Rb, C
+            str = str_ecpy(str, "ori ");
+            str = FormatReg(str, inst.Ra);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rb);
+            str = FormatImm19s(str_ecpy(str, ", "), inst.C);
+            break;
+        case 15: // mul Ra, Rb
+            str = str_ecpy(str, "mul ");
+            str = FormatReg(str, inst.Ra);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rb);
+            break;
+        case 16: // div Ra, Rb
+            str = str_ecpy(str, "div ");
+            str = FormatReg(str, inst.Ra);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rb);
+            break;
+        case 17: // neg Ra, Rb
+            str = str_ecpy(str, "neg ");
+            str = FormatReg(str, inst.Ra);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rb);
+            break;
+        case 18: // not Ra, Rb
+            str = str_ecpy(str, "not ");
+            str = FormatReg(str, inst.Ra);
+            str = FormatReg(str_ecpy(str, ", "), inst.Rb);
+            break;
+        case 19: // brCOND Ra, C
+            str = FormatCond(str_ecpy(str, "br"), inst.C2);
+            *str++ = ' ';
+            str = FormatReg(str, inst.Ra);
+            str = FormatImm19s(str_ecpy(str, ", "), inst.C);
+            break;
+        case 20: // jr Ra
+            str = str_ecpy(str, "jr ");
+            str = FormatReg(str, inst.Ra);
+            break;
+        case 21: // jal Ra
+            str = str_ecpy(str, "jal ");
+            str = FormatReg(str, inst.Ra);
+            break;
+        case 22: // in Ra
+            str = str_ecpy(str, "in ");
+            str = FormatReg(str, inst.Ra);
+            break;
+        case 23: // out Ra
+            str = str_ecpy(str, "out ");
+            str = FormatReg(str, inst.Ra);
+            break;
+        case 24: // mfhi Ra
+            str = str_ecpy(str, "mfhi ");
+            str = FormatReg(str, inst.Ra);
+            break;
+        case 25: // mflo Ra
+            str = str_ecpy(str, "mflo ");
+            str = FormatReg(str, inst.Ra);
+            break;
+        case 26: // nop
+            str = str_ecpy(str, "nop");
+            break;
+        case 27: // halt
+            str = str_ecpy(str, "halt");
+            break;
+        default:
+            *str++ = '?';
+            break;
+        }
+        *str = '\0';
+    }
+    return str;
+}
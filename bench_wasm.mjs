@@ -0,0 +1,115 @@
+// Compares the throughput of wasm builds of ASM374 (e.g., the mvp and fast
+// builds) using Node.js.
+//
+//     node bench_wasm.mjs asm374.wasm asm374.simd.wasm
+//
+// Each build assembles a synthetic program, assembles and disassembles single
+// instructions, and the results (median of several runs) are printed as a
+// table, followed by the same results as JSON. Each input is checked once
+// before timing, so a failure is reported rather than timed.
+import {readFileSync} from "node:fs"
+
+const files = process.argv.slice(2)
+if (!files.length) {
+    console.error("usage: node bench_wasm.mjs file.wasm...")
+    process.exit(2)
+}
+
+// prog generates a program with n instructions (plus labels, comments, and
+// data) which fits in n+n/8 words.
+const prog = n => {
+    const ops = [
+        i => `    add r${i%15+1}, r${(i+3)%15+1}, r${(i+7)%15+1}`,
+        i => `    addi r${i%15+1}, r${(i+5)%15+1}, ${i%2000 - 1000} ; adjust`,
+        i => `    ld r${i%15+1}, ${i%64}(r${(i+1)%15+1})`,
+        i => `    brnz r${i%15+1}, l${i>>3}`,
+        i => `    shl r${i%15+1}, r${(i+2)%15+1}, r${(i+9)%15+1}`,
+        i => `    jal r${i%15+1}`,
+        i => `    mfhi r${i%15+1} ; high bits`,
+    ]
+    const lines = []
+    for (let i = 0; i < n; i++) {
+        if (i % 8 == 0) {
+            lines.push(`l${i>>3}:`)
+        }
+        lines.push(ops[i % ops.length](i))
+    }
+    for (let i = 0; i < n >> 3; i++) {
+        lines.push(`    DAT 0x${(i * 2654435761 >>> 0).toString(16)}, ${i}`)
+    }
+    lines.push("    halt")
+    return lines.join("\n")
+}
+
+const median = a => a.sort((x, y) => x - y)[a.length >> 1]
+
+const bench = (fn, bytes) => {
+    const times = []
+    for (let run = 0; run < 7; run++) {
+        let iter = 0
+        const start = performance.now()
+        let t
+        do {
+            fn()
+            iter++
+        } while ((t = performance.now() - start) < 200)
+        times.push(t / iter)
+    }
+    const ms = median(times)
+    return {ms, mb_per_sec: bytes / ms / 1e3}
+}
+
+const run = async file => {
+    const wasm = readFileSync(file)
+    const native = (await WebAssembly.instantiate(wasm, {env: {now: () => performance.now()}})).instance.exports
+    const mem = () => new Uint8Array(native.memory.buffer)
+    const store = b => {
+        native.reset()
+        const p = native.alloc(b.length + 1)
+        mem().set(b, p)
+        return p
+    }
+    const check = (what, res) => {
+        if (res) {
+            throw new Error(`${file}: ${what} failed with error ${res}`)
+        }
+    }
+
+    const result = {size: wasm.length}
+
+    const n = 4096
+    const src = new TextEncoder().encode(prog(n))
+    check("prog", native.prog_assemble(store(src), src.length, n + n/4 + 1))
+    result.prog = bench(() => check("prog", native.prog_assemble(store(src), src.length, n + n/4 + 1)), src.length)
+
+    const insts = new TextEncoder().encode("addi r2, r3, -1")
+    check("assemble", native.assemble(store(insts), insts.length))
+    result.assemble = bench(() => {
+        for (let i = 0; i < 1000; i++) {
+            check("assemble", native.assemble(store(insts), insts.length))
+        }
+    }, insts.length * 1000)
+
+    const words = new TextEncoder().encode("611FFFFF")
+    check("disassemble", native.disassemble(store(words), words.length))
+    result.disassemble = bench(() => {
+        for (let i = 0; i < 1000; i++) {
+            check("disassemble", native.disassemble(store(words), words.length))
+        }
+    }, words.length * 1000)
+
+    return result
+}
+
+const results = {}
+for (const file of files) {
+    results[file] = await run(file)
+}
+
+const base = results[files[0]]
+console.log(["build", "size", "prog (ms)", "assemble (ms/1k)", "disassemble (ms/1k)"].map(x => x.padStart(20)).join(""))
+for (const [file, r] of Object.entries(results)) {
+    const col = k => `${r[k].ms.toFixed(3)} ${r == base ? "" : `${(base[k].ms / r[k].ms).toFixed(2)}x`}`
+    console.log([file, r.size, col("prog"), col("assemble"), col("disassemble")].map(x => String(x).padStart(20)).join(""))
+}
+console.log(JSON.stringify(results))
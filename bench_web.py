@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+"""
+Serves a dist directory (from make dist) locally, runs bench.html in a new
+headless Chrome/Chromium profile, and prints the results as JSON.
+
+usage: bench_web.py [dir] [runs]
+
+The browser can be set with $CHROME.
+"""
+
+import http.server
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+
+root = sys.argv[1] if len(sys.argv) > 1 else "dist"
+runs = sys.argv[2] if len(sys.argv) > 2 else "10"
+result = None
+done = threading.Event()
+
+
+class Handler(http.server.SimpleHTTPRequestHandler):
+    extensions_map = {
+        **http.server.SimpleHTTPRequestHandler.extensions_map,
+        ".wasm": "application/wasm",
+        ".js": "text/javascript",
+    }
+
+    def __init__(self, *args, **kwargs):
+        super().__init__(*args, directory=root, **kwargs)
+
+    def end_headers(self):
+        # hashed files (asm374.HASH.wasm, like loadModule checks) never change
+        if re.search(r"\.[0-9a-f]{16,}\.wasm$", self.path.split("?")[0]):
+            self.send_header("Cache-Control", "public, max-age=31536000, immutable")
+        else:
+            self.send_header("Cache-Control", "no-cache")
+        super().end_headers()
+
+    def do_POST(self):
+        global result
+        result = self.rfile.read(int(self.headers["Content-Length"])).decode()
+        self.send_response(204)
+        self.end_headers()
+        done.set()
+
+    def log_message(self, *args):
+        pass
+
+
+def main():
+    chrome = os.environ.get("CHROME") or next(filter(shutil.which, ["chromium", "chromium-browser", "google-chrome", "google-chrome-stable"]), None)
+    if not chrome:
+        sys.exit("bench_web.py: chrome not found (set $CHROME)")
+
+    server = http.server.ThreadingHTTPServer(("127.0.0.1", 0), Handler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    url = "http://127.0.0.1:%d/bench.html?runs=%s" % (server.server_address[1], runs)
+
+    with tempfile.TemporaryDirectory() as profile:
+        browser = subprocess.Popen([chrome, "--headless=new", "--disable-gpu", "--no-first-run", "--user-data-dir=" + profile, url], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            if not done.wait(120):
+                sys.exit("bench_web.py: timed out")
+        finally:
+            browser.kill()
+            browser.wait()
+    server.shutdown()
+    print(result)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,205 @@
+#!/usr/bin/env python3
+"""
+Generates the instruction table and the specialized instruction decoding,
+encoding, checking, and formatting functions of asm374.c from an instruction
+set description (see isa374.txt).
+
+usage: gen_isa.py [isa374.txt] > asm374_isa.h
+
+Each function is a single switch on the opcode (which compiles to a jump
+table), with the fields and arguments of each opcode written out, rather than
+looking up the opcode in InstData and looping over its arguments at run time.
+"""
+
+import sys
+
+TYPES = {"Ra": "Reg", "Rb": "Reg", "Rc": "Reg", "C2": "Cond", "C": "Imm19s"}
+ARGS = {"Ra": ["Ra"], "Rb": ["Rb"], "Rc": ["Rc"], "C": ["C"], "RbC": ["Rb", "C"]}
+FORMATS = "RIBJM"
+
+
+def fail(line, msg):
+    sys.exit(f"gen_isa.py: line {line}: {msg}")
+
+
+def parse(f):
+    fields, formats, ops = {}, {}, {}
+    for n, line in enumerate(f, 1):
+        w = line.split("#", 1)[0].split()
+        if not w:
+            continue
+        if w[0] == "field" and len(w) == 4:
+            name, msb, lsb = w[1], int(w[2]), int(w[3])
+            if name != "Opcode" and name not in TYPES:
+                fail(n, f"unknown field {name}")
+            if not 0 <= lsb <= msb < 32:
+                fail(n, f"invalid bits {msb}..{lsb}")
+            fields[name] = (lsb, msb - lsb + 1)
+        elif w[0] == "format" and len(w) >= 2:
+            if w[1] not in FORMATS:
+                fail(n, f"unknown format {w[1]} (add it to InstEnc and ExplainInst first)")
+            for x in w[2:]:
+                if x not in fields:
+                    fail(n, f"undefined field {x}")
+            formats[w[1]] = w[2:]
+        elif w[0] == "op" and len(w) >= 4:
+            code, name, fmt = int(w[1]), w[2], w[3]
+            cond = len(w) > 4 and w[4] == "cond"
+            args = w[4 + cond:]
+            if fmt not in formats:
+                fail(n, f"undefined format {fmt}")
+            if code in ops or not 0 <= code < 1 << fields["Opcode"][1]:
+                fail(n, f"invalid or duplicate opcode {code}")
+            if len(name) + 1 > 10:
+                fail(n, f"name {name} too long")
+            if cond and "C2" not in formats[fmt]:
+                fail(n, "cond requires the C2 field")
+            if len(args) > 3:
+                fail(n, "too many arguments")
+            for a in args:
+                if a not in ARGS or any(x not in formats[fmt] for x in ARGS[a]):
+                    fail(n, f"invalid argument {a} for format {fmt}")
+            ops[code] = (name, fmt, cond, args)
+        else:
+            fail(n, f"invalid line: {line.strip()}")
+    if "Opcode" not in fields:
+        sys.exit("gen_isa.py: missing Opcode field")
+    if "C" in fields and fields["C"][1] != 19:
+        sys.exit("gen_isa.py: C must be 19 bits (Imm19s)")
+    return fields, formats, ops
+
+
+def mask(bits):
+    return f"0x{(1 << bits) - 1:X}"
+
+
+def cases(ops, key):
+    """Groups the opcodes by key, in order of the first opcode of each group."""
+    groups = {}
+    for code in sorted(ops):
+        groups.setdefault(key(ops[code]), []).append(code)
+    return groups.items()
+
+
+def generate(fields, formats, ops, src):
+    op_lsb, op_bits = fields["Opcode"]
+    out = []
+    w = out.append
+
+    w(f"/* Generated by gen_isa.py from {src}. Do not edit. */")
+    w("")
+    w("/**")
+    w(" * Instruction table.")
+    w(" *")
+    w(" * This contains the mappings of opcodes to instruction specifications.")
+    w(" */")
+    w(f"static const InstSpec InstData[1<<{op_bits}] = {{")
+    for code in sorted(ops):
+        name, fmt, cond, args = ops[code]
+        a = "".join(f"InstArg_{x},".ljust(13) if k < 2 else f"InstArg_{x}".ljust(10) for k, x in enumerate((args + ["_"] * 3)[:3]))
+        w(f"    [{code:2}] = {{InstEnc_{fmt}, {(chr(34) + name + chr(34) + ',').ljust(7)} {'true, ' if cond else 'false,'} {{{a}}}}},")
+    w("};")
+    w("")
+    w("/**")
+    w(" * Gets the instruction specification for op. Valid if Format is non-zero.")
+    w(" */")
+    w("static InstSpec LookupOpcode(Opcode op) {")
+    w(f"    return InstData[op & {mask(op_bits)}];")
+    w("}")
+    w("")
+
+    w("/**")
+    w(" * DecodeInst decodes inst.")
+    w(" */")
+    w("static Inst DecodeInst(uint32_t b) {")
+    w("    Inst i = INST_ZERO;")
+    w(f"    switch ((i.Opcode = (Opcode)((b >> {op_lsb}) & {mask(op_bits)}))) {{")
+    for fmt, codes in cases(ops, lambda op: op[1]):
+        w(f"    {' '.join(f'case {c}:' for c in codes)} // {fmt}")
+        for f in formats[fmt]:
+            lsb, bits = fields[f]
+            w(f"        i.{f.ljust(2)} = ({TYPES[f]})((b >> {lsb}) & {mask(bits)});")
+        w("        break;")
+    w("    }")
+    w("    return i;")
+    w("}")
+    w("")
+
+    w("/**")
+    w(" * EncodeInst encodes inst.")
+    w(" */")
+    w("static uint32_t EncodeInst(Inst i) {")
+    w(f"    uint32_t b = ((uint32_t)(i.Opcode) & {mask(op_bits)}) << {op_lsb};")
+    w(f"    switch (i.Opcode & {mask(op_bits)}) {{")
+    for fmt, codes in cases(ops, lambda op: op[1]):
+        w(f"    {' '.join(f'case {c}:' for c in codes)} // {fmt}")
+        for f in formats[fmt]:
+            lsb, bits = fields[f]
+            w(f"        b |= ((uint32_t)(i.{f}) & {mask(bits)}) << {lsb};")
+        w("        break;")
+    w("    }")
+    w("    return b;")
+    w("}")
+    w("")
+
+    w("/**")
+    w(" * CheckInst checks whether inst is valid.")
+    w(" */")
+    w("static Error CheckInst(Inst i) {")
+    w(f"    switch (i.Opcode & {mask(op_bits)}) {{")
+    for fmt, codes in cases(ops, lambda op: op[1]):
+        w(f"    {' '.join(f'case {c}:' for c in codes)} // {fmt}")
+        for f in formats[fmt]:
+            if TYPES[f] == "Reg":
+                w(f"        if (!GetReg(i.{f})) return Error_Inst_Reg;")
+            elif TYPES[f] == "Cond":
+                w(f"        if (!GetCond(i.{f})) return Error_Inst_Cond;")
+        w("        return NoError;")
+    w("    }")
+    w("    return Error_Inst_Op;")
+    w("}")
+    w("")
+
+    w("/**")
+    w(" * Writes inst to str, returning a pointer to the end of the updated string.")
+    w(" */")
+    w("static char *FormatInst(char *str, Inst inst) {")
+    w("    if (str) {")
+    w(f"        switch (inst.Opcode & {mask(op_bits)}) {{")
+    for code in sorted(ops):
+        name, fmt, cond, args = ops[code]
+        w(f"        case {code}: // {name}{'COND' if cond else ''} {', '.join(args)}".rstrip())
+        if cond:
+            w(f"            str = FormatCond(str_ecpy(str, \"{name}\"), inst.C2);")
+            if args:
+                w("            *str++ = ' ';")
+        else:
+            w(f"            str = str_ecpy(str, \"{name}{' ' if args else ''}\");")
+        for n, a in enumerate(args):
+            sep = "str_ecpy(str, \", \")" if n else "str"
+            if a == "C":
+                w(f"            str = FormatImm19s({sep}, inst.C);")
+            elif a == "RbC":
+                w(f"            str = FormatRegImm19s({sep}, inst.Rb, inst.C);")
+            else:
+                w(f"            str = FormatReg({sep}, inst.{a});")
+        w("            break;")
+    w("        default:")
+    w("            *str++ = '?';")
+    w("            break;")
+    w("        }")
+    w("        *str = '\\0';")
+    w("    }")
+    w("    return str;")
+    w("}")
+    return "\n".join(out) + "\n"
+
+
+def main():
+    src = sys.argv[1] if len(sys.argv) > 1 else "isa374.txt"
+    with open(src) as f:
+        sys.stdout.write(generate(*parse(f), src))
+
+
+if __name__ == "__main__":
+    main()